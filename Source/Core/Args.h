@@ -19,13 +19,21 @@
 
 namespace QI {
 
-void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::Flag &verbose) {
+inline void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::Flag &verbose) {
+    // Common to all programs. Not static, as several programs can run in one process (qi_pipeline),
+    // so the parser must not be used to print help after this returns.
+    args::ValueFlag<int> gzip_threads(parser, "GZIP THREADS", "Threads for .nii.gz compression (default $QUIT_GZIP_THREADS or 1, 0=hardware limit)", {"gzip-threads"});
+    args::ValueFlag<std::string> precision(parser, "OUT PRECISION", "Storage for float outputs, FLOAT or INT16 (default $QUIT_PRECISION or FLOAT)", {"out-precision"});
     try {
         parser.ParseCLI(argc, argv);
+        if (gzip_threads) QI::SetGzipThreads(gzip_threads.Get());
+        if (precision && !QI::SetOutPrecision(precision.Get())) {
+            QI_FAIL("Invalid precision: " << precision.Get() << std::endl << parser);
+        }
         if (verbose) std::cout << "Starting " << argv[0] << " " << QI::GetVersion() << std::endl;
     } catch (args::Help) {
         std::cout << parser;
-        exit(EXIT_SUCCESS);
+        QI::Exit(EXIT_SUCCESS);
     } catch (args::ParseError e) {
         QI_FAIL(e.what() << std::endl << parser);
     } catch (args::ValidationError e) {
@@ -33,6 +41,16 @@ void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::
     }
 }
 
+/*
+ * As above, for programs with a --threads option. Reading and writing images then uses the same
+ * number of threads.
+ */
+inline void ParseArgs(args::ArgumentParser &parser, int argc, char **argv, const args::Flag &verbose,
+                      args::ValueFlag<int> &threads) {
+    ParseArgs(parser, argc, argv, verbose);
+    QI::SetIOThreads(threads.Get());
+}
+
 template<typename T>
 T CheckPos(args::Positional<T> &a) {
     if (a) {
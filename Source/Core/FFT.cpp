@@ -0,0 +1,408 @@
+/*
+ *  FFT.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <vector>
+#include <algorithm>
+#include <cmath>
+
+#include "FFT.h"
+#include "Macro.h"
+
+#ifdef QI_USE_FFTW
+#include <map>
+#include <mutex>
+#include <tuple>
+#include <fftw3.h>
+#else
+#include "unsupported/Eigen/FFT"
+#endif
+
+namespace QI {
+
+namespace {
+
+#ifdef QI_USE_FFTW
+
+/*
+ * The FFTW functions for each precision. Real plans are out-of-place, complex and DCT plans in-place.
+ */
+template<typename T> struct FFTW;
+template<> struct FFTW<double> {
+    typedef fftw_plan TPlan;
+    typedef fftw_complex TComplex;
+    static TPlan plan(const int n0, const int n1, const int n2, TComplex *data, const int sign) {
+        return fftw_plan_dft_3d(n0, n1, n2, data, data, sign, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static TPlan plan_r2c(const int n0, const int n1, const int n2, double *in, TComplex *out) {
+        return fftw_plan_dft_r2c_3d(n0, n1, n2, in, out, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static TPlan plan_c2r(const int n0, const int n1, const int n2, TComplex *in, double *out) {
+        return fftw_plan_dft_c2r_3d(n0, n1, n2, in, out, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static void execute(const TPlan p, TComplex *data) { fftw_execute_dft(p, data, data); }
+    static void execute(const TPlan p, double *in, TComplex *out) { fftw_execute_dft_r2c(p, in, out); }
+    static TPlan plan_r2r(const int n0, const int n1, const int n2, double *data, const fftw_r2r_kind kind) {
+        return fftw_plan_r2r_3d(n0, n1, n2, data, data, kind, kind, kind, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static void execute(const TPlan p, TComplex *in, double *out) { fftw_execute_dft_c2r(p, in, out); }
+    static void execute(const TPlan p, double *data) { fftw_execute_r2r(p, data, data); }
+    static TComplex *alloc(const size_t n) { return fftw_alloc_complex(n); }
+    static double *alloc_real(const size_t n) { return fftw_alloc_real(n); }
+    static void free(void *data) { fftw_free(data); }
+};
+template<> struct FFTW<float> {
+    typedef fftwf_plan TPlan;
+    typedef fftwf_complex TComplex;
+    static TPlan plan(const int n0, const int n1, const int n2, TComplex *data, const int sign) {
+        return fftwf_plan_dft_3d(n0, n1, n2, data, data, sign, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static TPlan plan_r2c(const int n0, const int n1, const int n2, float *in, TComplex *out) {
+        return fftwf_plan_dft_r2c_3d(n0, n1, n2, in, out, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static TPlan plan_c2r(const int n0, const int n1, const int n2, TComplex *in, float *out) {
+        return fftwf_plan_dft_c2r_3d(n0, n1, n2, in, out, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static void execute(const TPlan p, TComplex *data) { fftwf_execute_dft(p, data, data); }
+    static void execute(const TPlan p, float *in, TComplex *out) { fftwf_execute_dft_r2c(p, in, out); }
+    static TPlan plan_r2r(const int n0, const int n1, const int n2, float *data, const fftw_r2r_kind kind) {
+        return fftwf_plan_r2r_3d(n0, n1, n2, data, data, kind, kind, kind, FFTW_ESTIMATE | FFTW_UNALIGNED);
+    }
+    static void execute(const TPlan p, TComplex *in, float *out) { fftwf_execute_dft_c2r(p, in, out); }
+    static void execute(const TPlan p, float *data) { fftwf_execute_r2r(p, data, data); }
+    static TComplex *alloc(const size_t n) { return fftwf_alloc_complex(n); }
+    static float *alloc_real(const size_t n) { return fftwf_alloc_real(n); }
+    static void free(void *data) { fftwf_free(data); }
+};
+
+std::mutex planner_mutex; // The FFTW planner is not thread-safe, executing a plan is
+
+enum class PlanKind { Forward, Inverse, RealForward, RealInverse, DCT, InverseDCT };
+
+/*
+ * Plans are kept for the life of the program, so every object of the same size shares them
+ */
+template<typename T>
+typename FFTW<T>::TPlan FindPlan(const std::array<size_t, 3> &size, const PlanKind kind) {
+    typedef std::tuple<size_t, size_t, size_t, PlanKind> TKey;
+    static std::map<TKey, typename FFTW<T>::TPlan> plans;
+    std::lock_guard<std::mutex> lock(planner_mutex);
+    const TKey key{size[0], size[1], size[2], kind};
+    auto it = plans.find(key);
+    if (it == plans.end()) {
+        const size_t n = size[0] * size[1] * size[2];
+        typename FFTW<T>::TComplex *temp = FFTW<T>::alloc(n);
+        T *temp_real = FFTW<T>::alloc_real(n);
+        // FFTW is row-major, so the fastest-varying dimension is last
+        typename FFTW<T>::TPlan plan;
+        switch (kind) {
+        case PlanKind::Forward: plan = FFTW<T>::plan(size[2], size[1], size[0], temp, FFTW_FORWARD); break;
+        case PlanKind::Inverse: plan = FFTW<T>::plan(size[2], size[1], size[0], temp, FFTW_BACKWARD); break;
+        case PlanKind::RealForward: plan = FFTW<T>::plan_r2c(size[2], size[1], size[0], temp_real, temp); break;
+        case PlanKind::RealInverse: plan = FFTW<T>::plan_c2r(size[2], size[1], size[0], temp, temp_real); break;
+        case PlanKind::DCT: plan = FFTW<T>::plan_r2r(size[2], size[1], size[0], temp_real, FFTW_REDFT10); break;
+        case PlanKind::InverseDCT: plan = FFTW<T>::plan_r2r(size[2], size[1], size[0], temp_real, FFTW_REDFT01); break;
+        }
+        FFTW<T>::free(temp);
+        FFTW<T>::free(temp_real);
+        if (!plan) {
+            QI_EXCEPTION("Could not create FFTW plan for size " << size[0] << "x" << size[1] << "x" << size[2]);
+        }
+        it = plans.emplace(key, plan).first;
+    }
+    return it->second;
+}
+
+template<typename T>
+class FFTWFFT3D : public FFT3D<T> {
+protected:
+    typedef typename FFTW<T>::TComplex TFFTWComplex;
+    typename FFTW<T>::TPlan m_forward, m_inverse, m_real_forward, m_real_inverse;
+
+public:
+    typedef typename FFT3D<T>::TComplex TComplex;
+    FFTWFFT3D(const typename FFT3D<T>::TSize &size) :
+        FFT3D<T>(size),
+        m_forward(FindPlan<T>(size, PlanKind::Forward)),
+        m_inverse(FindPlan<T>(size, PlanKind::Inverse)),
+        m_real_forward(FindPlan<T>(size, PlanKind::RealForward)),
+        m_real_inverse(FindPlan<T>(size, PlanKind::RealInverse))
+    {}
+
+    void forward(TComplex *data) override {
+        FFTW<T>::execute(m_forward, reinterpret_cast<TFFTWComplex *>(data));
+    }
+
+    void inverse(TComplex *data) override {
+        FFTW<T>::execute(m_inverse, reinterpret_cast<TFFTWComplex *>(data));
+        const T scale = 1. / this->count();
+        std::for_each(data, data + this->count(), [scale](TComplex &v) { v *= scale; });
+    }
+
+    void forward(const T *in, TComplex *out) override {
+        // An out-of-place r2c transform leaves its input alone
+        FFTW<T>::execute(m_real_forward, const_cast<T *>(in), reinterpret_cast<TFFTWComplex *>(out));
+    }
+
+    void inverse(TComplex *in, T *out) override {
+        FFTW<T>::execute(m_real_inverse, reinterpret_cast<TFFTWComplex *>(in), out);
+        const T scale = 1. / this->count();
+        std::for_each(out, out + this->count(), [scale](T &v) { v *= scale; });
+    }
+};
+
+template<typename T>
+class FFTWDCT3D : public DCT3D<T> {
+protected:
+    typename FFTW<T>::TPlan m_forward, m_inverse;
+
+public:
+    FFTWDCT3D(const typename DCT3D<T>::TSize &size) :
+        DCT3D<T>(size),
+        m_forward(FindPlan<T>(size, PlanKind::DCT)),
+        m_inverse(FindPlan<T>(size, PlanKind::InverseDCT))
+    {}
+
+    void forward(T *data) override {
+        FFTW<T>::execute(m_forward, data);
+    }
+
+    void inverse(T *data) override {
+        // REDFT01 undoes REDFT10 up to a factor of 2n along each axis
+        FFTW<T>::execute(m_inverse, data);
+        const T scale = 1. / (8 * this->count());
+        std::for_each(data, data + this->count(), [scale](T &v) { v *= scale; });
+    }
+};
+
+#else
+
+/*
+ * Eigen only has 1D transforms, so transform each line along x, then y, then z. For real data the
+ * x lines use Eigen's real transform, and only the half spectrum is transformed along y and z.
+ * Eigen keeps the twiddle factors for each length it has seen, so they are only calculated once
+ * per object.
+ */
+template<typename T>
+class EigenFFT3D : public FFT3D<T> {
+protected:
+    typedef typename FFT3D<T>::TSize TSize;
+    Eigen::FFT<T> m_fft;
+    std::vector<std::complex<T>> m_line, m_result;
+
+    /*
+     * Transform every line along one axis of an array with the given dimensions. A length 1
+     * transform does nothing, and Eigen cannot plan one, so those axes are skipped.
+     */
+    void transformAxis(std::complex<T> *data, const TSize &dims, const int d, const bool inverse) {
+        const size_t n = dims[d];
+        if (n == 1) {
+            return;
+        }
+        const size_t stride = (d > 0 ? dims[0] : 1) * (d > 1 ? dims[1] : 1);
+        const size_t outer = dims[0] * dims[1] * dims[2] / (n * stride);
+        m_line.resize(n);
+        m_result.resize(n);
+        for (size_t o = 0; o < outer; o++) {
+            for (size_t i = 0; i < stride; i++) {
+                std::complex<T> *start = data + o * n * stride + i;
+                for (size_t k = 0; k < n; k++) {
+                    m_line[k] = start[k * stride];
+                }
+                if (inverse) {
+                    m_fft.inv(m_result.data(), m_line.data(), n);
+                } else {
+                    m_fft.fwd(m_result.data(), m_line.data(), n);
+                }
+                for (size_t k = 0; k < n; k++) {
+                    start[k * stride] = m_result[k];
+                }
+            }
+        }
+    }
+
+public:
+    typedef typename FFT3D<T>::TComplex TComplex;
+    EigenFFT3D(const TSize &size) :
+        FFT3D<T>(size)
+    {
+        m_fft.SetFlag(Eigen::FFT<T>::Unscaled); // Scale once at the end instead of for each axis
+        m_fft.SetFlag(Eigen::FFT<T>::HalfSpectrum); // Only affects the real transforms
+    }
+
+    void forward(TComplex *data) override {
+        for (int d = 0; d < 3; d++) {
+            transformAxis(data, this->m_size, d, false);
+        }
+    }
+
+    void inverse(TComplex *data) override {
+        for (int d = 0; d < 3; d++) {
+            transformAxis(data, this->m_size, d, true);
+        }
+        const T scale = 1. / this->count();
+        std::for_each(data, data + this->count(), [scale](TComplex &v) { v *= scale; });
+    }
+
+    void forward(const T *in, TComplex *out) override {
+        const size_t nx = this->m_size[0];
+        const TSize half = this->halfSize();
+        const size_t lines = this->m_size[1] * this->m_size[2];
+        if (nx == 1) {
+            std::copy(in, in + lines, out);
+        } else {
+            for (size_t l = 0; l < lines; l++) {
+                m_fft.fwd(out + l * half[0], in + l * nx, nx);
+            }
+        }
+        transformAxis(out, half, 1, false);
+        transformAxis(out, half, 2, false);
+    }
+
+    void inverse(TComplex *in, T *out) override {
+        const size_t nx = this->m_size[0];
+        const TSize half = this->halfSize();
+        const size_t lines = this->m_size[1] * this->m_size[2];
+        transformAxis(in, half, 2, true);
+        transformAxis(in, half, 1, true);
+        if (nx == 1) {
+            std::transform(in, in + lines, out, [](const TComplex &v) { return v.real(); });
+        } else {
+            for (size_t l = 0; l < lines; l++) {
+                m_fft.inv(out + l * nx, in + l * half[0], nx);
+            }
+        }
+        const T scale = 1. / this->count();
+        std::for_each(out, out + this->count(), [scale](T &v) { v *= scale; });
+    }
+};
+
+/*
+ * Each line is transformed with a complex FFT of the same length using Makhoul's reordering: the
+ * even samples in order, then the odd samples reversed. The DCT is then the real part of the FFT
+ * after a quarter-sample phase shift, and the inverse reverses each step exactly.
+ */
+template<typename T>
+class EigenDCT3D : public DCT3D<T> {
+protected:
+    typedef typename DCT3D<T>::TSize TSize;
+    Eigen::FFT<T> m_fft;
+    std::vector<std::complex<T>> m_line, m_result, m_shift;
+    std::vector<T> m_real;
+
+    void transformAxis(T *data, const int d, const bool inverse) {
+        const size_t n = this->m_size[d];
+        const size_t stride = (d > 0 ? this->m_size[0] : 1) * (d > 1 ? this->m_size[1] : 1);
+        const size_t outer = this->count() / (n * stride);
+        if (n == 1) {
+            const T scale = inverse ? 0.5 : 2.;
+            std::for_each(data, data + this->count(), [scale](T &v) { v *= scale; });
+            return;
+        }
+        m_line.resize(n);
+        m_result.resize(n);
+        m_real.resize(n);
+        m_shift.resize(n);
+        for (size_t k = 0; k < n; k++) {
+            m_shift[k] = std::polar(T(1), T(-M_PI * k / (2. * n)));
+        }
+        for (size_t o = 0; o < outer; o++) {
+            for (size_t i = 0; i < stride; i++) {
+                T *start = data + o * n * stride + i;
+                if (inverse) {
+                    m_line[0] = start[0] / T(2);
+                    for (size_t k = 1; k < n; k++) {
+                        m_line[k] = std::conj(m_shift[k]) * std::complex<T>(start[k * stride], -start[(n - k) * stride]) / T(2);
+                    }
+                    m_fft.inv(m_result.data(), m_line.data(), n);
+                    for (size_t j = 0; j < (n + 1) / 2; j++) {
+                        start[2 * j * stride] = m_result[j].real() / n;
+                    }
+                    for (size_t j = 0; j < n / 2; j++) {
+                        start[(2 * j + 1) * stride] = m_result[n - 1 - j].real() / n;
+                    }
+                } else {
+                    for (size_t j = 0; j < (n + 1) / 2; j++) {
+                        m_line[j] = start[2 * j * stride];
+                    }
+                    for (size_t j = 0; j < n / 2; j++) {
+                        m_line[n - 1 - j] = start[(2 * j + 1) * stride];
+                    }
+                    m_fft.fwd(m_result.data(), m_line.data(), n);
+                    for (size_t k = 0; k < n; k++) {
+                        start[k * stride] = 2 * (m_shift[k] * m_result[k]).real();
+                    }
+                }
+            }
+        }
+    }
+
+public:
+    EigenDCT3D(const TSize &size) :
+        DCT3D<T>(size)
+    {
+        m_fft.SetFlag(Eigen::FFT<T>::Unscaled);
+    }
+
+    void forward(T *data) override {
+        for (int d = 0; d < 3; d++) {
+            transformAxis(data, d, false);
+        }
+    }
+
+    void inverse(T *data) override {
+        for (int d = 2; d >= 0; d--) {
+            transformAxis(data, d, true);
+        }
+    }
+};
+
+#endif
+
+} // End anonymous namespace
+
+template<typename T>
+std::unique_ptr<FFT3D<T>> FFT3D<T>::Create(const TSize &size) {
+    if (size[0] == 0 || size[1] == 0 || size[2] == 0) {
+        QI_EXCEPTION("Cannot create an FFT with a zero dimension");
+    }
+#ifdef QI_USE_FFTW
+    return std::unique_ptr<FFT3D<T>>(new FFTWFFT3D<T>(size));
+#else
+    return std::unique_ptr<FFT3D<T>>(new EigenFFT3D<T>(size));
+#endif
+}
+
+template<typename T>
+std::unique_ptr<DCT3D<T>> DCT3D<T>::Create(const TSize &size) {
+    if (size[0] == 0 || size[1] == 0 || size[2] == 0) {
+        QI_EXCEPTION("Cannot create a DCT with a zero dimension");
+    }
+#ifdef QI_USE_FFTW
+    return std::unique_ptr<DCT3D<T>>(new FFTWDCT3D<T>(size));
+#else
+    return std::unique_ptr<DCT3D<T>>(new EigenDCT3D<T>(size));
+#endif
+}
+
+std::string FFTBackend() {
+#ifdef QI_USE_FFTW
+    return "FFTW";
+#else
+    return "Eigen";
+#endif
+}
+
+template class FFT3D<float>;
+template class FFT3D<double>;
+template class DCT3D<float>;
+template class DCT3D<double>;
+
+} // End namespace QI
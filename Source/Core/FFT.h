@@ -0,0 +1,88 @@
+/*
+ *  FFT.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_FFT_H
+#define QI_FFT_H
+
+#include <array>
+#include <complex>
+#include <memory>
+#include <string>
+
+namespace QI {
+
+/*
+ * 3D FFTs of one size, on buffers with x varying fastest as in ITK images. Any size can be
+ * transformed, there is no need to pad. The inverse is scaled by 1/N, the same as
+ * itk::ComplexToComplexFFTImageFilter. Plans are made once and reused for every call, and with
+ * FFTW they are also shared between objects of the same size.
+ *
+ * Complex data is transformed in-place. Real data is transformed to the half spectrum, which
+ * holds only the halfSize() = (nx/2 + 1) x ny x nz non-negative x frequencies, as the rest follow
+ * from conjugate symmetry.
+ *
+ * An object must only be used by one thread at a time. To transform several volumes at once,
+ * create an object for each thread.
+ */
+template<typename T>
+class FFT3D {
+public:
+    typedef std::complex<T> TComplex;
+    typedef std::array<size_t, 3> TSize;
+
+    static std::unique_ptr<FFT3D> Create(const TSize &size);
+    virtual ~FFT3D() {}
+
+    virtual void forward(TComplex *data) = 0;
+    virtual void inverse(TComplex *data) = 0;
+    virtual void forward(const T *in, TComplex *out) = 0; //!< Real to half spectrum
+    virtual void inverse(TComplex *in, T *out) = 0;       //!< Half spectrum to real, overwrites in
+    const TSize &size() const { return m_size; }
+    size_t count() const { return m_size[0] * m_size[1] * m_size[2]; }
+    TSize halfSize() const { return {{m_size[0] / 2 + 1, m_size[1], m_size[2]}}; }
+    size_t halfCount() const { return (m_size[0] / 2 + 1) * m_size[1] * m_size[2]; }
+
+protected:
+    TSize m_size;
+    FFT3D(const TSize &size) : m_size(size) {}
+};
+
+/*
+ * 3D discrete cosine transforms of one size, on real buffers in-place. The forward transform is
+ * the DCT-II and the inverse the DCT-III, which correspond to even extension about the half-voxel
+ * at each edge, i.e. Neumann boundaries. The forward transform is unnormalised, matching FFTW's
+ * REDFT10 (2 * sum x_j cos(pi * (j + 1/2) * k / n) along each axis), and the inverse is scaled so
+ * that it exactly undoes the forward transform. Plans are shared as for FFT3D, and an object must
+ * only be used by one thread at a time.
+ */
+template<typename T>
+class DCT3D {
+public:
+    typedef std::array<size_t, 3> TSize;
+
+    static std::unique_ptr<DCT3D> Create(const TSize &size);
+    virtual ~DCT3D() {}
+
+    virtual void forward(T *data) = 0;
+    virtual void inverse(T *data) = 0;
+    const TSize &size() const { return m_size; }
+    size_t count() const { return m_size[0] * m_size[1] * m_size[2]; }
+
+protected:
+    TSize m_size;
+    DCT3D(const TSize &size) : m_size(size) {}
+};
+
+std::string FFTBackend(); //!< The library used by FFT3D, "FFTW" or "Eigen"
+
+} // End namespace QI
+
+#endif // QI_FFT_H
@@ -85,4 +85,44 @@ Eigen::VectorXd RobustLeastSquares(const Eigen::MatrixXd &X, const Eigen::Vector
     return b;
 }
 
+void LinearRegression(const Eigen::ArrayXXd &X, const Eigen::ArrayXXd &Y,
+                      Eigen::ArrayXd &slope, Eigen::ArrayXd &intercept)
+{
+    eigen_assert((X.rows() == Y.rows()) && (X.cols() == Y.cols()));
+    const Eigen::Index n = X.rows();
+    Eigen::ArrayXd sx = Eigen::ArrayXd::Zero(n), sy = Eigen::ArrayXd::Zero(n),
+                   sxx = Eigen::ArrayXd::Zero(n), sxy = Eigen::ArrayXd::Zero(n);
+    for (Eigen::Index k = 0; k < X.cols(); k++) {
+        sx  += X.col(k);
+        sy  += Y.col(k);
+        sxx += X.col(k).square();
+        sxy += X.col(k) * Y.col(k);
+    }
+    const double s = X.cols();
+    const Eigen::ArrayXd det = s*sxx - sx.square();
+    slope = (s*sxy - sx*sy) / det;
+    intercept = (sxx*sy - sx*sxy) / det;
+}
+
+void LinearRegression(const Eigen::ArrayXXd &X, const Eigen::ArrayXXd &Y, const Eigen::ArrayXXd &W,
+                      Eigen::ArrayXd &slope, Eigen::ArrayXd &intercept)
+{
+    eigen_assert((X.rows() == Y.rows()) && (X.cols() == Y.cols()));
+    eigen_assert((X.rows() == W.rows()) && (X.cols() == W.cols()));
+    const Eigen::Index n = X.rows();
+    Eigen::ArrayXd s = Eigen::ArrayXd::Zero(n), sx = Eigen::ArrayXd::Zero(n), sy = Eigen::ArrayXd::Zero(n),
+                   sxx = Eigen::ArrayXd::Zero(n), sxy = Eigen::ArrayXd::Zero(n);
+    for (Eigen::Index k = 0; k < X.cols(); k++) {
+        const auto wx = W.col(k) * X.col(k);
+        s   += W.col(k);
+        sx  += wx;
+        sy  += W.col(k) * Y.col(k);
+        sxx += wx * X.col(k);
+        sxy += wx * Y.col(k);
+    }
+    const Eigen::ArrayXd det = s*sxx - sx.square();
+    slope = (s*sxy - sx*sy) / det;
+    intercept = (sxx*sy - sx*sxy) / det;
+}
+
 } // End namespace QI
\ No newline at end of file
@@ -21,6 +21,16 @@ namespace QI {
 Eigen::VectorXd LeastSquares(const Eigen::MatrixXd &X, const Eigen::VectorXd &y, double *resid = nullptr);
 Eigen::VectorXd RobustLeastSquares(const Eigen::MatrixXd &X, const Eigen::VectorXd &y, double *resid = nullptr);
 
+/*
+ * Closed-form straight-line fits y = slope*x + intercept for a block of voxels at once. Each row of
+ * X, Y and W holds one voxel and each column one measurement, so the running sums are accumulated
+ * down contiguous columns and vectorise. The 2x2 normal equations are inverted analytically.
+ */
+void LinearRegression(const Eigen::ArrayXXd &X, const Eigen::ArrayXXd &Y,
+                      Eigen::ArrayXd &slope, Eigen::ArrayXd &intercept);
+void LinearRegression(const Eigen::ArrayXXd &X, const Eigen::ArrayXXd &Y, const Eigen::ArrayXXd &W,
+                      Eigen::ArrayXd &slope, Eigen::ArrayXd &intercept);
+
 } // End namespace QI
 
 #endif // QI_FIT_H
\ No newline at end of file
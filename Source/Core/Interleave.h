@@ -0,0 +1,90 @@
+/*
+ *  Interleave.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_INTERLEAVE_H
+#define QI_INTERLEAVE_H
+
+#include <algorithm>
+
+#include "ThreadPool.h"
+#include "Util.h"
+
+namespace QI {
+
+/*
+ * Voxels per tile for the blocked transposes below. A tile of volume-major data is read as
+ * contiguous runs of this length, and written as one contiguous run of voxel vectors.
+ */
+const size_t InterleaveTile = 256;
+
+/*
+ * Copy nChunk volumes of nVox voxels each, stored one after another in src, into components
+ * [start, start + nChunk) of the pixel-interleaved buffer dst, which has nComp components per voxel.
+ * Converts from TIn to TOut on the way.
+ */
+template<typename TIn, typename TOut>
+void Interleave(const TIn *src, TOut *dst, const size_t nVox, const size_t nComp,
+                const size_t start, const size_t nChunk)
+{
+    auto tiles = [=](const size_t lo, const size_t hi) {
+        for (size_t t = lo; t < hi; t += InterleaveTile) {
+            const size_t tEnd = std::min(t + InterleaveTile, hi);
+            for (size_t c = 0; c < nChunk; c++) {
+                const TIn *in = src + c*nVox;
+                TOut *out = dst + start + c;
+                for (size_t v = t; v < tEnd; v++) {
+                    out[v*nComp] = static_cast<TOut>(in[v]);
+                }
+            }
+        }
+    };
+    const size_t nThreads = IOThreads();
+    const size_t perThread = ((nVox / nThreads) / InterleaveTile + 1) * InterleaveTile;
+    ThreadPool pool(nThreads);
+    for (size_t lo = 0; lo < nVox; lo += perThread) {
+        const size_t hi = std::min(lo + perThread, nVox);
+        pool.enqueue([=]{ tiles(lo, hi); });
+    }
+}
+
+/*
+ * The reverse of Interleave(). Copies components [start, start + nChunk) of the pixel-interleaved
+ * buffer src into nChunk consecutive volumes in dst. Each value is passed through f(value, voxel),
+ * which can convert or scale it.
+ */
+template<typename TIn, typename TOut, typename TFunc>
+void Deinterleave(const TIn *src, TOut *dst, const size_t nVox, const size_t nComp,
+                  const size_t start, const size_t nChunk, const TFunc &f)
+{
+    auto tiles = [=, &f](const size_t lo, const size_t hi) {
+        for (size_t t = lo; t < hi; t += InterleaveTile) {
+            const size_t tEnd = std::min(t + InterleaveTile, hi);
+            for (size_t c = 0; c < nChunk; c++) {
+                const TIn *in = src + start + c;
+                TOut *out = dst + c*nVox;
+                for (size_t v = t; v < tEnd; v++) {
+                    out[v] = f(in[v*nComp], v);
+                }
+            }
+        }
+    };
+    const size_t nThreads = IOThreads();
+    const size_t perThread = ((nVox / nThreads) / InterleaveTile + 1) * InterleaveTile;
+    ThreadPool pool(nThreads);
+    for (size_t lo = 0; lo < nVox; lo += perThread) {
+        const size_t hi = std::min(lo + perThread, nVox);
+        pool.enqueue([=, &tiles]{ tiles(lo, hi); });
+    }
+}
+
+} // End namespace QI
+
+#endif // QI_INTERLEAVE_H
@@ -12,6 +12,10 @@
 #include "Kernels.h"
 
 namespace QI {
+double FilterKernel::profile(const int, const double, const double, const double) const {
+    QI_EXCEPTION("Kernel " << *this << " is not separable");
+}
+
 TukeyKernel::TukeyKernel() {}
 TukeyKernel::TukeyKernel(std::istream &istr) {
     if (!istr.eof()) {
@@ -77,6 +81,11 @@ double GaussKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, c
     const double v = exp(-r2/2.);
     return v;
 }
+double GaussKernel::profile(const int axis, const double pos, const double sz, const double sp) const {
+    static const double M = 2. * sqrt(2.*log(2.)) / M_PI;
+    const double sigma_k = M * sz * sp / m_fwhm[axis];
+    return exp(-(pos*pos)/(2.*sigma_k*sigma_k));
+}
 
 BlackmanKernel::BlackmanKernel() {
     calc_constants();
@@ -126,6 +135,15 @@ double RectKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &, cons
         return m_val_inside;
     }
 }
+double RectKernel::profile(const int axis, const double pos, const double, const double) const {
+    if (axis != m_dim) {
+        return 1;
+    } else if (fabs(pos) > m_width) {
+        return m_val_outside;
+    } else {
+        return m_val_inside;
+    }
+}
 
 FixFSEKernel::FixFSEKernel() {
 }
@@ -147,11 +165,17 @@ void FixFSEKernel::print(std::ostream &ostr) const {
     ostr << "FixFSE," << m_dim << "," << m_etl << "," << m_kzero
          << "," << m_te1 << "," << m_esp << "," << m_T2;
 }
-double FixFSEKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &) const {
+double FixFSEKernel::value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const {
     const int dim = abs(m_dim);
+    return profile(dim, pos[dim], sz[dim], sp[dim]);
+}
+double FixFSEKernel::profile(const int axis, const double pos, const double sz, const double) const {
+    if (axis != abs(m_dim)) {
+        return 1;
+    }
     const int dir = m_dim > 0 ? 1 : -1;
-    const int n_trains = 2 * sz[dim] / m_etl;
-    const int n_echo = floor((dir*pos[dim] + sz[dim] - (m_etl / 2) + 2) / n_trains);
+    const int n_trains = 2 * sz / m_etl;
+    const int n_echo = floor((dir*pos + sz - (m_etl / 2) + 2) / n_trains);
     // At this point, center of kspace is at m_etl / 2. Shift to make it kzero
     const int n_shifted = n_echo - (m_etl / 2) + m_kzero;
     // Wrap negative echoes to end of train
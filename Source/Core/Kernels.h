@@ -27,6 +27,17 @@ protected:
 public:
     virtual void print(std::ostream &ostr) const = 0;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const = 0;
+
+    /*
+     * A separable kernel is the product of a 1D profile along each axis, so value() equals the
+     * product of profile() for each axis and the 3D kernel never needs to be evaluated voxel by voxel
+     */
+    virtual bool separable() const { return false; }
+    virtual double profile(const int axis, const double pos, const double sz, const double sp) const;
+    /*
+     * A symmetric kernel has value(-pos) == value(pos), so it keeps a real image real
+     */
+    virtual bool symmetric() const { return true; }
 };
 
 class TukeyKernel : public FilterKernel
@@ -65,6 +76,8 @@ class GaussKernel : public FilterKernel
     GaussKernel(std::istream &istr);
     virtual void print(std::ostream &ostr) const override;
     virtual double value(const Eigen::Array3d &pos, const Eigen::Array3d &sz, const Eigen::Array3d &sp) const override;
+    virtual bool separable() const override { return true; }
+    virtual double profile(const int axis, const double pos, const double sz, const double sp) const override;
 };
 
 class BlackmanKernel : public FilterKernel
@@ -92,6 +105,8 @@ public:
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual bool separable() const override { return true; }
+    virtual double profile(const int axis, const double pos, const double sz, const double sp) const override;
 };
 
 class FixFSEKernel : public FilterKernel {
@@ -106,6 +121,9 @@ public:
     virtual double value(const Eigen::Array3d &pos,
                          const Eigen::Array3d &sz,
                          const Eigen::Array3d &sp) const override;
+    virtual bool separable() const override { return true; }
+    virtual double profile(const int axis, const double pos, const double sz, const double sp) const override;
+    virtual bool symmetric() const override { return false; } // Echo order runs one way through k-space
 };
 
 std::shared_ptr<FilterKernel> ReadKernel(const std::string &str);
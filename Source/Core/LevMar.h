@@ -0,0 +1,229 @@
+/*
+ *  LevMar.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_LEVMAR_H
+#define QI_LEVMAR_H
+
+#include <cmath>
+#include <limits>
+#include <iostream>
+#include <type_traits>
+
+#include <Eigen/Dense>
+
+namespace QI {
+
+enum class LMStatus {
+    NotStarted = -1,
+    FunctionTolerance, GradientTolerance, ParameterTolerance, IterationLimit, ErrorEvaluation
+};
+
+inline std::ostream& operator<<(std::ostream &os, const LMStatus &s) {
+    switch (s) {
+        case LMStatus::NotStarted: os << "Not Started"; break;
+        case LMStatus::FunctionTolerance: os << "Function tolerance reached"; break;
+        case LMStatus::GradientTolerance: os << "Gradient tolerance reached"; break;
+        case LMStatus::ParameterTolerance: os << "Parameter tolerance reached"; break;
+        case LMStatus::IterationLimit: os << "Reached iteration limit"; break;
+        case LMStatus::ErrorEvaluation: os << "Could not evaluate cost at starting point"; break;
+    }
+    return os;
+}
+
+/*
+ * Detect whether a cost functor supplies an analytic Jacobian
+ */
+template<typename TCost>
+class HasJacobian {
+    template<typename C> static char test(decltype(&C::jacobian));
+    template<typename C> static long test(...);
+public:
+    static const bool value = (sizeof(test<TCost>(0)) == sizeof(char));
+};
+
+/*
+ * A small, bounded Levenberg-Marquardt solver intended to be used once per voxel.
+ *
+ * The number of parameters is fixed at compile time, the number of residuals can be
+ * either fixed or Eigen::Dynamic. All workspace is allocated on construction, so
+ * a solver can be re-used for multiple starting points without further allocation.
+ * Convergence criteria and Huber loss follow the definitions used by Ceres so that
+ * options can be carried over directly.
+ *
+ * The cost functor must provide:
+ *   int values() const;
+ *   bool operator()(const TParams &p, TResiduals &r) const;
+ * and optionally:
+ *   bool jacobian(const TParams &p, TJacobian &J) const;
+ * If jacobian() is not provided then forward differences are used. Returning false from
+ * either function marks the point as invalid and the step will be rejected.
+ */
+template<int NP_, int NR_ = Eigen::Dynamic>
+class LevMar {
+public:
+    static const int NP = NP_;
+    static const int NR = NR_;
+    typedef Eigen::Matrix<double, NP, 1>  TParams;
+    typedef Eigen::Matrix<double, NR, 1>  TResiduals;
+    typedef Eigen::Matrix<double, NR, NP> TJacobian;
+    typedef Eigen::Matrix<double, NP, NP> THessian;
+
+protected:
+    TParams    m_lo, m_hi;
+    TResiduals m_r, m_rNew;
+    TJacobian  m_J;
+    int    m_maxIterations = 50, m_iterations = 0;
+    double m_ftol = 1e-6, m_gtol = 1e-10, m_ptol = 1e-8, m_huber = 0.0;
+    double m_cost = std::numeric_limits<double>::infinity();
+    LMStatus m_status = LMStatus::NotStarted;
+
+    // Ceres defines cost = 0.5 * rho(|r|^2). Returns the scaling to apply to r and J.
+    double robustify(const double sqnorm, double &cost) const {
+        if ((m_huber > 0) && (sqnorm > m_huber*m_huber)) {
+            const double s = std::sqrt(sqnorm);
+            cost = 0.5 * (2.0 * m_huber * s - m_huber*m_huber);
+            return std::sqrt(m_huber / s);
+        } else {
+            cost = 0.5 * sqnorm;
+            return 1.0;
+        }
+    }
+
+    TParams project(const TParams &p) const {
+        return p.cwiseMax(m_lo).cwiseMin(m_hi);
+    }
+
+    template<typename TCost>
+    bool evalJacobian(const TCost &cost, const TParams &p, std::true_type) {
+        return cost.jacobian(p, m_J);
+    }
+
+    template<typename TCost>
+    bool evalJacobian(const TCost &cost, const TParams &p, std::false_type) {
+        // Forward differences, re-using m_rNew as workspace
+        TParams ph = p;
+        for (int i = 0; i < NP; i++) {
+            double h = 1e-6 * std::abs(p[i]);
+            if (h == 0.) h = 1e-6;
+            if ((p[i] + h) > m_hi[i]) h = -h; // Step backwards at the upper boundary
+            ph[i] = p[i] + h;
+            if (!cost(ph, m_rNew)) {
+                return false;
+            }
+            m_J.col(i) = (m_rNew - m_r) / h;
+            ph[i] = p[i];
+        }
+        return true;
+    }
+
+public:
+    LevMar(const int nR = NR) :
+        m_r(nR), m_rNew(nR), m_J(nR, NP)
+    {
+        m_lo.setConstant(-std::numeric_limits<double>::infinity());
+        m_hi.setConstant(std::numeric_limits<double>::infinity());
+    }
+
+    void setLowerBound(const int i, const double v) { m_lo[i] = v; }
+    void setUpperBound(const int i, const double v) { m_hi[i] = v; }
+    void setBounds(const TParams &lo, const TParams &hi) { m_lo = lo; m_hi = hi; }
+    void setMaxIterations(const int i) { m_maxIterations = i; }
+    void setTolerances(const double f, const double g, const double p) { m_ftol = f; m_gtol = g; m_ptol = p; }
+    void setHuber(const double a) { m_huber = a; }
+
+    int iterations() const { return m_iterations; }
+    double cost() const { return m_cost; }
+    LMStatus status() const { return m_status; }
+    bool usable() const { return (m_status != LMStatus::NotStarted) && (m_status != LMStatus::ErrorEvaluation); }
+    const TResiduals &residuals() const { return m_r; } //!< Residuals at the solution, before robust scaling
+
+    template<typename TCost>
+    LMStatus solve(const TCost &cost, TParams &p) {
+        eigen_assert(cost.values() == m_r.rows());
+        typedef std::integral_constant<bool, HasJacobian<TCost>::value> TAnalytic;
+        m_iterations = 0;
+        p = project(p);
+        if (!cost(p, m_r)) {
+            m_status = LMStatus::ErrorEvaluation;
+            m_cost = std::numeric_limits<double>::infinity();
+            return m_status;
+        }
+        double w = robustify(m_r.squaredNorm(), m_cost);
+        double mu = 1e4, nu = 2.0; // Same initial trust-region radius as Ceres
+        m_status = LMStatus::IterationLimit;
+        bool newJacobian = true;
+        TParams g;
+        THessian A;
+        while (m_iterations < m_maxIterations) {
+            m_iterations++;
+            if (newJacobian) {
+                if (!evalJacobian(cost, p, TAnalytic())) {
+                    m_status = LMStatus::ErrorEvaluation;
+                    break;
+                }
+                g.noalias() = w * w * (m_J.transpose() * m_r);
+                A.noalias() = w * w * (m_J.transpose() * m_J);
+                if ((p - project(p - g)).template lpNorm<Eigen::Infinity>() <= m_gtol) {
+                    m_status = LMStatus::GradientTolerance;
+                    break;
+                }
+                newJacobian = false;
+            }
+            THessian D = A;
+            D.diagonal() += (A.diagonal().cwiseMax(1e-6).cwiseMin(1e32)) / mu;
+            TParams gFree = g;
+            for (int i = 0; i < NP; i++) {
+                // Hold parameters that are on a bound and being pushed against it
+                if (((p[i] <= m_lo[i]) && (g[i] > 0)) || ((p[i] >= m_hi[i]) && (g[i] < 0))) {
+                    D.row(i).setZero();
+                    D.col(i).setZero();
+                    D(i, i) = 1.0;
+                    gFree[i] = 0.0;
+                }
+            }
+            const TParams pNew = project(p - D.ldlt().solve(gFree));
+            const TParams dp = pNew - p;
+            if (dp.norm() <= m_ptol * (p.norm() + m_ptol)) {
+                m_status = LMStatus::ParameterTolerance;
+                break;
+            }
+            double costNew = std::numeric_limits<double>::infinity();
+            double wNew = 1.0;
+            if (cost(pNew, m_rNew)) {
+                wNew = robustify(m_rNew.squaredNorm(), costNew);
+            }
+            const double predicted = -(g.dot(dp) + 0.5 * dp.dot(A * dp));
+            const double rho = (predicted > 0) ? (m_cost - costNew) / predicted : -1.0;
+            if (std::isfinite(costNew) && rho > 1e-3) {
+                const double dcost = m_cost - costNew;
+                p = pNew;
+                m_r.swap(m_rNew);
+                w = wNew;
+                m_cost = costNew;
+                mu = std::min(1e16, mu / std::max(1./3., 1. - std::pow(2.*rho - 1., 3)));
+                nu = 2.0;
+                newJacobian = true;
+                if (dcost <= m_ftol * (m_cost + dcost)) {
+                    m_status = LMStatus::FunctionTolerance;
+                    break;
+                }
+            } else {
+                mu = mu / nu;
+                nu = 2.0 * nu;
+            }
+        }
+        return m_status;
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_LEVMAR_H
@@ -18,6 +18,21 @@
 #define QI_MACRO_H
 
 #include <sstream>
+#include <cstdlib>
+
+namespace QI {
+
+/*
+ * Programs stop early with QI::Exit() rather than exit(). A persistent process that runs programs
+ * as jobs (qi_server) calls SetExitThrows(true) so that a failed job throws ExitException instead
+ * of taking the whole process down. Defined in Util.cpp.
+ */
+struct ExitException { int code; };
+[[noreturn]] void Exit(const int code);
+void SetExitThrows(const bool t);
+bool ExitThrows();
+
+} // End namespace QI
 
 #if defined( _WIN32 ) && !defined( __MINGW32__ )
     #define QI_LOCATION __FUNCSIG__
@@ -39,7 +54,7 @@
 #define QI_FAIL( x )             \
 {                                \
     std::cerr << x << std::endl; \
-    exit(EXIT_FAILURE);          \
+    QI::Exit(EXIT_FAILURE);      \
 }
 
 #define QI_DB( x ) std::cout << "\n" << #x << ": " << x << std::endl;
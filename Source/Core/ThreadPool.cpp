@@ -58,6 +58,21 @@ namespace QI {
         m_threadCondition.notify_one(); // Wake up a thread
     }
     
+    void TaskErrors::run(const std::function<void ()> &f) {
+        try {
+            f();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (!m_error) m_error = std::current_exception();
+        }
+    }
+
+    void TaskErrors::rethrow() {
+        if (m_error) {
+            std::rethrow_exception(m_error);
+        }
+    }
+
     void ThreadPool::invokeThread() {
         TFunc task;
         while (true) {
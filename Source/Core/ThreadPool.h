@@ -20,6 +20,7 @@
 #include <functional>
 #include <vector>
 #include <queue>
+#include <exception>
 
 namespace QI {
     
@@ -45,6 +46,20 @@ public:
     void setDebug(const bool d);
     void setMaxQueueMultiple(const int n);
 };
+
+/*
+ * Exceptions cannot leave a pool task, so wrap each task in run() and call rethrow() once the
+ * pool has been destroyed. Only the first exception is kept.
+ */
+class TaskErrors {
+private:
+    std::mutex m_mutex;
+    std::exception_ptr m_error;
+
+public:
+    void run(const std::function<void ()> &f);
+    void rethrow();
+};
     
     
 } // End namespace QI
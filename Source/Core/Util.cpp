@@ -10,6 +10,8 @@
  *
  */
 #include <fstream>
+#include <thread>
+#include <algorithm>
 
 #include "itkVectorMagnitudeImageFilter.h"
 #include "itkMultiplyImageFilter.h"
@@ -20,41 +22,195 @@
 
 namespace QI {
 
+namespace {
+bool exit_throws = false;
+
+const size_t MaxCached = 8;
+std::mutex cache_mutex;
+std::vector<std::pair<std::string, std::shared_ptr<const void>>> cache; // Most recently used last
+}
+
+void SetExitThrows(const bool t) {
+    exit_throws = t;
+}
+
+bool ExitThrows() {
+    return exit_throws;
+}
+
+void Exit(const int code) {
+    if (exit_throws) {
+        throw ExitException{code};
+    }
+    exit(code);
+}
+
 const std::string &GetVersion() {
     // This file is generated by CMake to create a static version string
     #include "VersionFile"
     return Version;
 }
 
+static std::function<const char *(const char *)> settings_env; // Empty for this process's environment
+
+static const char *SettingEnv(const char *name) {
+    return settings_env ? settings_env(name) : getenv(name);
+}
+
 /*
  * This function checks the environment variable QUIT_EXT. If it does not exist,
  * a default value is returned. If it exists, and is one of the FSL output-types
  * the matching extension is returned. Otherwise, it is assumed that the
  * environment variable is a valid extension, including the ., and it is
- * returned.
+ * returned. The variable is read the first time it is needed.
  */
+static std::string out_ext;
+
+static std::string ParseExt(const char *env_ext) {
+    static const std::map<std::string, std::string> valid_ext{
+        {"NIFTI", ".nii"},
+        {"NIFTI_PAIR", ".img"},
+        {"NIFTI_GZ", ".nii.gz"},
+        {"NIFTI_PAIR_GZ", ".img.gz"},
+    };
+    if (!env_ext) {
+        std::cerr << "Environment variable QUIT_EXT is not valid, defaulting to NIFTI_GZ" << std::endl;
+        return valid_ext.at("NIFTI_GZ");
+    }
+    const auto it = valid_ext.find(env_ext);
+    return (it == valid_ext.end()) ? std::string(env_ext) : it->second;
+}
+
 const std::string &OutExt() {
-    static char *env_ext = getenv("QUIT_EXT");
-    static std::string ext;
-    static bool checked = false;
-    if (!checked) {
-        static std::map<std::string, std::string> valid_ext{
-            {"NIFTI", ".nii"},
-            {"NIFTI_PAIR", ".img"},
-            {"NIFTI_GZ", ".nii.gz"},
-            {"NIFTI_PAIR_GZ", ".img.gz"},
-        };
-        if (!env_ext) {
-            std::cerr << "Environment variable QUIT_EXT is not valid, defaulting to NIFTI_GZ" << std::endl;
-            ext = valid_ext["NIFTI_GZ"];
-        } else if (valid_ext.find(env_ext) == valid_ext.end()){
-            ext = env_ext;
-        } else {
-            ext = valid_ext[env_ext];
-        }
-        checked = true;
+    if (out_ext.empty()) {
+        out_ext = ParseExt(SettingEnv("QUIT_EXT"));
+    }
+    return out_ext;
+}
+
+/*
+ * The --threads options of the programs use 0 (or less) to mean all available cores
+ */
+size_t ThreadCount(const int n) {
+    return (n > 0) ? n : std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*
+ * Number of threads used to compress and decompress .nii.gz files. Read from the environment
+ * variable QUIT_GZIP_THREADS the first time it is needed, unless it has been set explicitly.
+ * The default of 1 leaves the ITK NIfTI IO to handle gzip itself.
+ */
+static int gzip_threads = -1;
+
+static int ParseGzipThreads(const char *env_threads) {
+    return env_threads ? std::max(0, atoi(env_threads)) : 1;
+}
+
+int GzipThreads() {
+    if (gzip_threads < 0) {
+        gzip_threads = ParseGzipThreads(SettingEnv("QUIT_GZIP_THREADS"));
+    }
+    if (gzip_threads == 0) {
+        gzip_threads = ThreadCount(0);
+    }
+    return gzip_threads;
+}
+
+void SetGzipThreads(const int n) {
+    gzip_threads = std::max(0, n);
+}
+
+/*
+ * Threads used to split up reading and writing images, e.g. interleaving the volumes of a 4D file.
+ * Programs set this from their --threads option, otherwise all cores are used.
+ */
+static int io_threads = 0;
+
+size_t IOThreads() {
+    return ThreadCount(io_threads);
+}
+
+void SetIOThreads(const int n) {
+    io_threads = n;
+}
+
+/*
+ * How float images are stored on disk. INT16 writes NIfTI files as 16-bit integers with scl_slope
+ * and scl_inter chosen from the range of the data, which halves their size. Other formats are
+ * always written as float. Read from the environment variable QUIT_PRECISION the first time it is
+ * needed, unless it has been set explicitly.
+ */
+static int out_precision = -1;
+
+static int ParsePrecision(const std::string &p) {
+    if (p == "FLOAT") {
+        return static_cast<int>(Precision::Float);
+    } else if (p == "INT16") {
+        return static_cast<int>(Precision::Int16);
+    } else {
+        return -1;
+    }
+}
+
+static int ParseEnvPrecision(const char *env_precision) {
+    const int p = env_precision ? ParsePrecision(env_precision) : 0;
+    if (p < 0) {
+        std::cerr << "Environment variable QUIT_PRECISION is not valid, defaulting to FLOAT" << std::endl;
+        return 0;
+    }
+    return p;
+}
+
+Precision OutPrecision() {
+    if (out_precision < 0) {
+        out_precision = ParseEnvPrecision(SettingEnv("QUIT_PRECISION"));
+    }
+    return static_cast<Precision>(out_precision);
+}
+
+bool SetOutPrecision(const std::string &p) {
+    const int parsed = ParsePrecision(p);
+    if (parsed < 0) {
+        return false;
+    }
+    out_precision = parsed;
+    return true;
+}
+
+/*
+ * Whether uncompressed .nii inputs are memory-mapped. Setting the environment variable QUIT_MMAP
+ * to 0 turns this off.
+ */
+static int map_inputs = -1;
+
+static int ParseMapInputs(const char *env_mmap) {
+    return !(env_mmap && std::string(env_mmap) == "0");
+}
+
+bool MapInputs() {
+    if (map_inputs < 0) {
+        map_inputs = ParseMapInputs(SettingEnv("QUIT_MMAP"));
     }
-    return ext;
+    return map_inputs;
+}
+
+/*
+ * The settings above can be read from another environment, e.g. that of a qi_server client, instead
+ * of this process's. They are still read when first needed, and a variable that env returns
+ * nullptr for takes its default, as if it was not set.
+ */
+const std::vector<std::string> &SettingVariables() {
+    static const std::vector<std::string> names{"QUIT_EXT", "QUIT_GZIP_THREADS", "QUIT_PRECISION", "QUIT_MMAP"};
+    return names;
+}
+
+void SetSettingsEnvironment(const std::function<const char *(const char *)> &env) {
+    settings_env = env;
+    out_ext.clear();
+    gzip_threads = -1;
+    out_precision = -1;
+    map_inputs = -1;
+    io_threads = 0;
 }
 
 std::string StripExt(const std::string &filename) {
@@ -86,7 +242,7 @@ std::string GetExt(const std::string &filename) {
 std::string Basename(const std::string &path) {
     std::size_t slash = path.find_last_of("/");
     if (slash != std::string::npos) {
-        return StripExt(path.substr(slash));
+        return StripExt(path.substr(slash + 1));
     } else {
         return StripExt(path);
     }
@@ -106,6 +262,33 @@ std::mt19937_64::result_type RandomSeed() {
     return r;
 }
 
+std::shared_ptr<const void> FindCached(const std::string &key) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+        if (it->first == key) {
+            auto entry = *it;
+            cache.erase(it);
+            cache.push_back(entry);
+            return entry.second;
+        }
+    }
+    return nullptr;
+}
+
+void StoreCached(const std::string &key, const std::shared_ptr<const void> &value) {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    for (auto it = cache.begin(); it != cache.end(); ++it) {
+        if (it->first == key) {
+            cache.erase(it);
+            break;
+        }
+    }
+    cache.emplace_back(key, value);
+    if (cache.size() > MaxCached) {
+        cache.erase(cache.begin());
+    }
+}
+
 // From Knuth, surprised this isn't in STL
 unsigned long long Choose(unsigned long long n, unsigned long long k) {
     if (k > n)
@@ -18,13 +18,17 @@
 #include <vector>
 #include <random>
 #include <functional>
+#include <algorithm>
+#include <memory>
 #include <mutex>
+#include <typeinfo>
 #include <vector>
 
 #include <Eigen/Core>
 
 #include "itkVector.h"
 #include "itkCommand.h"
+#include "itkImage.h"
 
 #include "Macro.h"
 
@@ -49,6 +53,17 @@ namespace QI {
 
 const std::string &GetVersion();                    //!< Return the version of the QI library
 const std::string &OutExt();                        //!< Return the extension stored in $QUIT_EXT
+size_t ThreadCount(const int n);                    //!< n threads, or the hardware limit if n is 0 or less
+int GzipThreads();                                  //!< Threads for parallel gzip of .nii.gz files, from $QUIT_GZIP_THREADS
+void SetGzipThreads(const int n);                   //!< Override $QUIT_GZIP_THREADS. 1 uses the ITK NIfTI IO, 0 uses all cores
+size_t IOThreads();                                 //!< Threads for splitting up image reads and writes, the hardware limit unless set
+void SetIOThreads(const int n);                     //!< Set from a program's --threads, 0 uses all cores
+enum class Precision { Float, Int16 };
+Precision OutPrecision();                           //!< Storage for float outputs, from $QUIT_PRECISION (FLOAT or INT16)
+bool SetOutPrecision(const std::string &p);         //!< Override $QUIT_PRECISION. Returns false if p is not valid
+bool MapInputs();                                   //!< Memory-map uncompressed .nii inputs, false if $QUIT_MMAP is 0
+const std::vector<std::string> &SettingVariables(); //!< The environment variables read by the settings above
+void SetSettingsEnvironment(const std::function<const char *(const char *)> &env); //!< Read the settings from env, or the process environment if empty
 std::string StripExt(const std::string &filename);  //!< Remove the extension from a filename
 std::string GetExt(const std::string &filename);    //!< Return the extension from a filename (including .)
 std::string Basename(const std::string &path);      //!< Return only the filename part of a path
@@ -56,6 +71,26 @@ std::mt19937_64::result_type RandomSeed();          //!< Thread-safe random seed
 unsigned long long Choose(unsigned long long n, unsigned long long k); //!< From Knuth, surprised this isn't in STL
 Eigen::ArrayXXd ReadArrayFile(const std::string &path);
 
+/*
+ * Process-wide cache for tables that depend only on a program's inputs, e.g. a dictionary built
+ * from the sequence. A single run builds each table once as before, but inside qi_server tables
+ * stay warm between jobs with the same key. Only the most recently used tables are kept.
+ */
+std::shared_ptr<const void> FindCached(const std::string &key); //!< nullptr if key is not cached
+void StoreCached(const std::string &key, const std::shared_ptr<const void> &value);
+
+template<typename T, typename TBuild>
+std::shared_ptr<const T> Cached(const std::string &key, const TBuild &build) {
+    const std::string typedKey = std::string(typeid(T).name()) + ":" + key;
+    std::shared_ptr<const void> found = FindCached(typedKey);
+    if (found) {
+        return std::static_pointer_cast<const T>(found);
+    }
+    std::shared_ptr<const T> value = build();
+    StoreCached(typedKey, value);
+    return value;
+}
+
 class GenericMonitor : public itk::Command {
 public:
     typedef GenericMonitor          Self;
@@ -84,6 +119,40 @@ double VoxelVolume(const itk::SmartPointer<TImg> &img) {
     return vox_volume;
 }
 
+/*
+ * Copy volume v of a 4D image into a new 3D image with the same geometry. This only reads the
+ * buffer of the input, so unlike itk::ExtractImageFilter several threads can do it at once.
+ */
+template<typename TPixel>
+typename itk::Image<TPixel, 3>::Pointer VolumeOf(const itk::Image<TPixel, 4> *series, const size_t v) {
+    typedef itk::Image<TPixel, 3> TVolume;
+    typename TVolume::RegionType region;
+    typename TVolume::SpacingType spacing;
+    typename TVolume::PointType origin;
+    typename TVolume::DirectionType direction;
+    for (int i = 0; i < 3; i++) {
+        region.GetModifiableSize()[i] = series->GetLargestPossibleRegion().GetSize()[i];
+        spacing[i] = series->GetSpacing()[i];
+        origin[i] = series->GetOrigin()[i];
+        for (int j = 0; j < 3; j++) {
+            direction[i][j] = series->GetDirection()[i][j];
+        }
+    }
+    if (v >= series->GetLargestPossibleRegion().GetSize()[3]) {
+        QI_EXCEPTION("Volume " << v << " is outside the image");
+    }
+    typename TVolume::Pointer volume = TVolume::New();
+    volume->SetRegions(region);
+    volume->SetSpacing(spacing);
+    volume->SetOrigin(origin);
+    volume->SetDirection(direction);
+    volume->Allocate();
+    const size_t nvox = region.GetNumberOfPixels();
+    const TPixel *src = series->GetBufferPointer() + v * nvox;
+    std::copy(src, src + nvox, volume->GetBufferPointer());
+    return volume;
+}
+
 /*
  * Helper function to clamp between two values
  */
@@ -56,6 +56,47 @@ public:
                            TOutput &residual, TInput &resids,
                            TIterations &iterations) const = 0; // Apply the algorithm to the data from one voxel. Return false to indicate algorithm failed.
         virtual TOutput zero() const = 0; // Hack, to supply a zero for masked voxels
+
+        /*
+         * Batched interface. If blockSize() is greater than 1 then the filter gathers up to that many
+         * unmasked voxels and passes them to applyBlock() together. The outer index of each vector is
+         * the voxel within the block, n is the number of valid voxels. The default implementation
+         * calls apply() for each voxel.
+         */
+        virtual size_t blockSize() const { return 1; }
+        virtual bool applyBlock(const size_t n,
+                                const std::vector<std::vector<TInput>> &inputs,
+                                const std::vector<std::vector<TConst>> &consts,
+                                const std::vector<TIndex> &indices,
+                                std::vector<std::vector<TOutput>> &outputs,
+                                std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                                std::vector<TIterations> &iterations) const
+        {
+            bool success = true;
+            for (size_t v = 0; v < n; v++) {
+                success = apply(inputs[v], consts[v], indices[v], outputs[v], residuals[v], resids[v], iterations[v]) && success;
+            }
+            return success;
+        }
+
+        /*
+         * Helper for batched algorithms to implement apply() with a block of one voxel
+         */
+        bool applyAsBlock(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+                          const TIndex &index, std::vector<TOutput> &outputs,
+                          TOutput &residual, TInput &resids, TIterations &iterations) const
+        {
+            std::vector<std::vector<TOutput>> block_outputs{outputs};
+            std::vector<TOutput> block_residual{residual};
+            std::vector<TInput> block_resids{resids};
+            std::vector<TIterations> block_its{iterations};
+            const bool success = applyBlock(1, {inputs}, {consts}, {index}, block_outputs, block_residual, block_resids, block_its);
+            outputs = block_outputs[0];
+            residual = block_residual[0];
+            resids = block_resids[0];
+            iterations = block_its[0];
+            return success;
+        }
     };
 
     void SetAlgorithm(const std::shared_ptr<Algorithm> &a);
@@ -100,7 +141,9 @@ protected:
     virtual void GenerateData() ITK_OVERRIDE;
     /* Doing my own threading so override both of these */
     virtual void GenerateOutputInformation() ITK_OVERRIDE;
+    virtual void GenerateInputRequestedRegion() ITK_OVERRIDE;
     virtual void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE;
+    void ThreadedGenerateBlocks(const TRegion &region);
 
 private:
     ApplyAlgorithmFilter(const Self &); //purposely not implemented
@@ -217,6 +217,23 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateOutputInformation() {
     i->Allocate(true);
 }
 
+/*
+ * Only the subregion of each input is used, so inputs read with QI::ReadImage(path, region) only
+ * need that region buffered
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateInputRequestedRegion() {
+    Superclass::GenerateInputRequestedRegion();
+    if (m_hasSubregion) {
+        for (auto &input : this->GetIndexedInputs()) {
+            auto img = dynamic_cast<ImageBase<TInputImage::ImageDimension> *>(input.GetPointer());
+            if (img) {
+                img->SetRequestedRegion(m_subregion);
+            }
+        }
+    }
+}
+
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateData() {
     auto fullRegion = this->GetInput(0)->GetLargestPossibleRegion();
@@ -252,6 +269,10 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::GenerateData() {
 
 template<typename TI, typename TO, typename TC, typename TM>
 void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateData(const TRegion &region, ThreadIdType /* Unused */) {
+    if (m_algorithm->blockSize() > 1) {
+        this->ThreadedGenerateBlocks(region);
+        return;
+    }
     ImageRegionConstIterator<TMaskImage> maskIter;
     const auto mask = this->GetMask();
     if (mask) {
@@ -350,6 +371,137 @@ void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateData(const TRegion &r
         ++iterationsIter;
     }
 }
+
+/*
+ * Gathers unmasked voxels into blocks and hands them to the algorithm together. Inputs are read with
+ * one set of iterators, and results are written back with a second set that trails behind, so that
+ * masked voxels between the gathered ones are zeroed in the correct order.
+ */
+template<typename TI, typename TO, typename TC, typename TM>
+void ApplyAlgorithmFilter<TI, TO, TC, TM>::ThreadedGenerateBlocks(const TRegion &region) {
+    const auto mask = this->GetMask();
+    ImageRegionConstIterator<TMaskImage> maskIter, writeMaskIter;
+    if (mask) {
+        maskIter = ImageRegionConstIterator<TMaskImage>(mask, region);
+        writeMaskIter = ImageRegionConstIterator<TMaskImage>(mask, region);
+    }
+    std::vector<ImageRegionConstIterator<TInputImage>> dataIters(m_algorithm->numInputs());
+    for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+        dataIters[i] = ImageRegionConstIterator<TInputImage>(this->GetInput(i), region);
+    }
+    std::vector<ImageRegionConstIterator<TConstImage>> constIters(m_algorithm->numConsts());
+    for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+        typename TConstImage::ConstPointer c = this->GetConst(i);
+        if (c) {
+            constIters[i] = ImageRegionConstIterator<TConstImage>(c, region);
+        }
+    }
+    std::vector<ImageRegionIterator<TOutputImage>> outputIters(m_algorithm->numOutputs());
+    for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+        outputIters[i] = ImageRegionIterator<TOutputImage>(this->GetOutput(i), region);
+    }
+    ImageRegionIterator<TInputImage> allResidualsIter;
+    if (m_allResiduals) {
+        allResidualsIter = ImageRegionIterator<TInputImage>(this->GetAllResidualsOutput(), region);
+    }
+    ImageRegionIteratorWithIndex<TOutputImage> indexIter(this->GetResidualOutput(), region);
+    ImageRegionIterator<TOutputImage> residualIter(this->GetResidualOutput(), region);
+    ImageRegionIterator<TIterationsImage> iterationsIter(this->GetIterationsOutput(), region);
+
+    const size_t blockSize = m_algorithm->blockSize();
+    const size_t residSize = m_allResiduals ? this->GetAllResidualsOutput()->GetNumberOfComponentsPerPixel() : 0;
+    std::vector<std::vector<TInputPixel>> inputs(blockSize, std::vector<TInputPixel>(m_algorithm->numInputs()));
+    std::vector<std::vector<TConstPixel>> constants(blockSize, m_algorithm->defaultConsts());
+    std::vector<TIndex> indices(blockSize);
+    std::vector<std::vector<TOutputPixel>> outputs(blockSize, std::vector<TOutputPixel>(m_algorithm->numOutputs()));
+    std::vector<TOutputPixel> residuals(blockSize);
+    std::vector<TInputPixel> resids(blockSize);
+    std::vector<TIterations> iterations(blockSize);
+    VariableLengthVector<float> residZeros(m_algorithm->dataSize()); residZeros.Fill(0.);
+
+    size_t n = 0;
+    auto flush = [&]() {
+        if (n > 0) {
+            for (size_t v = 0; v < n; v++) {
+                for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+                    outputs[v][i] = m_algorithm->zero();
+                }
+                residuals[v] = m_algorithm->zero();
+                resids[v].SetSize(residSize);
+                iterations[v] = 0;
+            }
+            bool success = m_algorithm->applyBlock(n, inputs, constants, indices, outputs, residuals, resids, iterations);
+            if (!success) {
+                std::cerr << "Algorithm failed for block starting at voxel: " << indices[0] << std::endl;
+            }
+        }
+        size_t v = 0;
+        while (!residualIter.IsAtEnd()) {
+            if (!mask || writeMaskIter.Get()) {
+                if (v == n)
+                    break; // This voxel belongs to the next block
+                for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+                    outputIters[i].Set(outputs[v][i]);
+                }
+                residualIter.Set(residuals[v]);
+                if (m_allResiduals) {
+                    allResidualsIter.Set(resids[v]);
+                }
+                iterationsIter.Set(iterations[v]);
+                v++;
+            } else {
+                for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+                    outputIters[i].Set(m_algorithm->zero());
+                }
+                if (m_allResiduals) {
+                    allResidualsIter.Set(residZeros);
+                }
+                residualIter.Set(m_algorithm->zero());
+                iterationsIter.Set(0);
+            }
+            if (mask)
+                ++writeMaskIter;
+            for (size_t i = 0; i < m_algorithm->numOutputs(); i++) {
+                ++outputIters[i];
+            }
+            if (m_allResiduals)
+                ++allResidualsIter;
+            ++residualIter;
+            ++iterationsIter;
+        }
+        n = 0;
+    };
+
+    while(!dataIters[0].IsAtEnd()) {
+        if (!mask || maskIter.Get()) {
+            for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+                inputs[n][i] = dataIters[i].Get();
+            }
+            for (size_t i = 0; i < constIters.size(); i++) {
+                if (this->GetConst(i)) {
+                    constants[n][i] = constIters[i].Get();
+                }
+            }
+            indices[n] = indexIter.GetIndex();
+            n++;
+            if (n == blockSize) {
+                flush();
+            }
+        }
+        if (mask)
+            ++maskIter;
+        for (size_t i = 0; i < m_algorithm->numInputs(); i++) {
+            ++dataIters[i];
+        }
+        for (size_t i = 0; i < m_algorithm->numConsts(); i++) {
+            if (this->GetConst(i))
+                ++constIters[i];
+        }
+        ++indexIter;
+    }
+    flush(); // Remaining voxels and any trailing masked voxels
+}
+
 } // namespace ITK
 
 #endif // APPLYALGORITHMFILTER_HXX
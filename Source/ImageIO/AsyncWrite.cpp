@@ -0,0 +1,101 @@
+/*
+ *  AsyncWrite.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+
+#include "AsyncWrite.h"
+#include "ThreadPool.h"
+#include "Macro.h"
+#include "Util.h"
+
+namespace QI {
+
+namespace {
+AsyncWrites *active_writes = nullptr;
+thread_local bool in_write = false;
+}
+
+AsyncWrites::AsyncWrites(const int threads) :
+    m_pool(new ThreadPool(ThreadCount(threads)))
+{
+    if (active_writes) {
+        QI_EXCEPTION("Only one AsyncWrites can be active at a time");
+    }
+    active_writes = this;
+}
+
+AsyncWrites::~AsyncWrites() {
+    m_pool.reset(); // Destroying the pool finishes the queue
+    active_writes = nullptr;
+    if (m_error) {
+        try {
+            std::rethrow_exception(m_error);
+        } catch (std::exception &e) {
+            // Cannot throw from here, so inside qi_server the failure is only reported
+            std::cerr << "Writing output failed: " << e.what() << std::endl;
+            if (!ExitThrows()) {
+                exit(EXIT_FAILURE);
+            }
+        } catch (const ExitException &) {
+            // QI_FAIL inside a write while exit throws, the message has already been printed
+            std::cerr << "Writing output failed" << std::endl;
+        } catch (...) {
+            std::cerr << "Writing output failed" << std::endl;
+            if (!ExitThrows()) {
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+}
+
+void AsyncWrites::enqueue(const std::function<void()> &task) {
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending++;
+    }
+    m_pool->enqueue([this, task]{
+        in_write = true;
+        std::exception_ptr error;
+        try {
+            task();
+        } catch (...) {
+            error = std::current_exception();
+        }
+        in_write = false;
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (error && !m_error) {
+            m_error = error;
+        }
+        if (--m_pending == 0) {
+            m_finished.notify_all();
+        }
+    });
+}
+
+void AsyncWrites::wait() {
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_finished.wait(lock, [this]{ return m_pending == 0; });
+    if (m_error) {
+        std::exception_ptr e = m_error;
+        m_error = nullptr;
+        std::rethrow_exception(e);
+    }
+}
+
+void DeferWrite(const std::function<void()> &task) {
+    if (active_writes && !in_write) {
+        active_writes->enqueue(task);
+    } else {
+        task();
+    }
+}
+
+} // End namespace QI
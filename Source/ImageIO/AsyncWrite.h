@@ -0,0 +1,55 @@
+/*
+ *  AsyncWrite.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_ASYNCWRITE_H
+#define QI_ASYNCWRITE_H
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+namespace QI {
+
+class ThreadPool; // Forward declare
+
+/*
+ * While an AsyncWrites object is alive, the Write*Image functions queue their work and return
+ * immediately, so that all the output maps of a program are written concurrently. The images
+ * passed in are kept alive until they have been written. The writes share one pool, sized like
+ * the --threads option. wait() blocks until the queue is empty and rethrows the first error from
+ * any write. The destructor waits, and exits the program if a write failed. Only one may be
+ * active at a time.
+ */
+class AsyncWrites {
+protected:
+    std::unique_ptr<ThreadPool> m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_finished;
+    size_t m_pending = 0;
+    std::exception_ptr m_error;
+public:
+    AsyncWrites(const int threads = 4); //!< 0 for the hardware limit
+    ~AsyncWrites();
+    void enqueue(const std::function<void()> &task);
+    void wait();
+};
+
+/*
+ * Queue task on the active AsyncWrites, or run it now if there is none. Tasks queued from inside
+ * another write are also run immediately.
+ */
+void DeferWrite(const std::function<void()> &task);
+
+} // End namespace QI
+
+#endif // QI_ASYNCWRITE_H
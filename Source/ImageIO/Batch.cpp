@@ -0,0 +1,86 @@
+/*
+ *  Batch.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <fstream>
+#include <sstream>
+
+#include "Batch.h"
+#include "Macro.h"
+
+namespace QI {
+
+Subject::Subject(const std::vector<std::string> &columns) :
+    m_columns(columns)
+{}
+
+std::string Subject::path(const std::string &p) const {
+    if (m_columns.empty()) {
+        return p;
+    }
+    std::string result;
+    size_t pos = 0;
+    while (pos < p.size()) {
+        const size_t open = p.find('{', pos);
+        const size_t close = (open == std::string::npos) ? open : p.find('}', open);
+        if (close == std::string::npos) {
+            result += p.substr(pos);
+            break;
+        }
+        result += p.substr(pos, open - pos);
+        const std::string key = p.substr(open + 1, close - open - 1);
+        size_t column = 1;
+        if (!key.empty()) {
+            std::istringstream iss(key);
+            if (!(iss >> column) || !iss.eof() || column == 0) {
+                QI_EXCEPTION("Invalid placeholder {" << key << "} in path: " << p);
+            }
+        }
+        if (column > m_columns.size()) {
+            QI_EXCEPTION("Placeholder {" << key << "} in path " << p << " but subject " << name() << " only has " << m_columns.size() << " columns");
+        }
+        result += m_columns[column - 1];
+        pos = close + 1;
+    }
+    return result;
+}
+
+std::string Subject::name() const {
+    return m_columns.empty() ? std::string() : m_columns.front();
+}
+
+std::vector<Subject> ReadManifest(const std::string &path) {
+    if (path.empty()) {
+        return {Subject()};
+    }
+    std::ifstream file(path);
+    if (!file) {
+        QI_EXCEPTION("Could not open batch manifest: " << path);
+    }
+    std::vector<Subject> subjects;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::vector<std::string> columns;
+        std::string c;
+        while (iss >> c) {
+            columns.push_back(c);
+        }
+        if (!columns.empty() && columns.front()[0] != '#') {
+            subjects.emplace_back(columns);
+        }
+    }
+    if (subjects.empty()) {
+        QI_EXCEPTION("No subjects in batch manifest: " << path);
+    }
+    return subjects;
+}
+
+} // End namespace QI
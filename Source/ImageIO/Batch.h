@@ -0,0 +1,81 @@
+/*
+ *  Batch.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_BATCH_H
+#define QI_BATCH_H
+
+#include <string>
+#include <vector>
+#include <functional>
+#include <future>
+#include <iostream>
+
+#include "AsyncWrite.h"
+
+namespace QI {
+
+/*
+ * One line of a batch manifest. The columns replace the placeholders in the paths given on the
+ * command line: {} or {1} is the first column, {2} the second and so on. Paths without a
+ * placeholder, e.g. a common mask, are used for every subject.
+ */
+class Subject {
+protected:
+    std::vector<std::string> m_columns;
+public:
+    Subject() = default; //!< Not from a manifest, paths are used as they are
+    Subject(const std::vector<std::string> &columns);
+    std::string path(const std::string &p) const;
+    std::string name() const; //!< The first column
+};
+
+/*
+ * Read a manifest with one subject per line and columns separated by whitespace. Blank lines and
+ * lines starting with # are skipped. An empty path gives a single Subject with no substitutions,
+ * i.e. the normal single-subject mode.
+ */
+std::vector<Subject> ReadManifest(const std::string &path);
+
+/*
+ * Run the same processing over several subjects with the algorithm and any precomputed state
+ * built once by the caller. read() loads the inputs for a subject and runs on a separate thread,
+ * so subject N+1 is read while subject N is processed. process() fits a subject and returns a
+ * function that writes its outputs, which is queued so that subject N is written while subject
+ * N+1 is processed. At most one subject's inputs are waiting and one subject's outputs are being
+ * written. process() must not reuse the output buffers of a previous subject (i.e. create new
+ * filters for each subject) as they may not have been written yet. threads sizes the write pool,
+ * as for the --threads option.
+ */
+template<typename TInputs>
+void RunBatch(const std::vector<Subject> &subjects,
+              const std::function<TInputs(const Subject &)> &read,
+              const std::function<std::function<void()>(TInputs &, const Subject &)> &process,
+              const int threads, const bool verbose) {
+    AsyncWrites writes(threads);
+    std::future<TInputs> next = std::async(std::launch::async, read, subjects.front());
+    for (size_t i = 0; i < subjects.size(); i++) {
+        TInputs inputs = next.get();
+        if (i + 1 < subjects.size()) {
+            next = std::async(std::launch::async, read, subjects[i + 1]);
+        }
+        if (verbose && subjects.size() > 1) {
+            std::cout << "Subject " << (i + 1) << " of " << subjects.size() << ": " << subjects[i].name() << std::endl;
+        }
+        const std::function<void()> write = process(inputs, subjects[i]);
+        writes.wait(); // The previous subject
+        write();
+    }
+    writes.wait();
+}
+
+} // End namespace QI
+
+#endif // QI_BATCH_H
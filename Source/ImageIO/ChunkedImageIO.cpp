@@ -0,0 +1,358 @@
+/*
+ *  ChunkedImageIO.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <atomic>
+#include <algorithm>
+#include <fcntl.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "itkObjectFactoryBase.h"
+#include "itkVersion.h"
+
+#include "ChunkedImageIO.h"
+#include "ThreadPool.h"
+#include "Util.h"
+
+namespace QI {
+
+namespace {
+
+const char Magic[4]{'Q', 'I', 'C', '1'};
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+    return (s.size() >= suffix.size()) && (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+template<typename T>
+void Put(std::ostream &os, const T &value) {
+    os.write(reinterpret_cast<const char *>(&value), sizeof(T));
+}
+
+template<typename T>
+T Get(std::istream &is) {
+    T value;
+    is.read(reinterpret_cast<char *>(&value), sizeof(T));
+    return value;
+}
+
+/*
+ * Copy the box [lo, hi) from src, which holds the box starting at srcStart with size srcSize, to
+ * dst, which holds the box starting at dstStart with size dstSize. Rows along the first dimension
+ * are contiguous in both.
+ */
+void CopyBox(const char *src, const std::vector<size_t> &srcStart, const std::vector<size_t> &srcSize,
+             char *dst, const std::vector<size_t> &dstStart, const std::vector<size_t> &dstSize,
+             const std::vector<size_t> &lo, const std::vector<size_t> &hi, const size_t pixelBytes)
+{
+    const size_t nDims = lo.size();
+    const size_t rowBytes = (hi[0] - lo[0]) * pixelBytes;
+    std::vector<size_t> index(lo);
+    while (true) {
+        size_t srcOffset = 0, dstOffset = 0, srcStride = 1, dstStride = 1;
+        for (size_t d = 0; d < nDims; d++) {
+            srcOffset += (index[d] - srcStart[d]) * srcStride;
+            dstOffset += (index[d] - dstStart[d]) * dstStride;
+            srcStride *= srcSize[d];
+            dstStride *= dstSize[d];
+        }
+        std::memcpy(dst + dstOffset * pixelBytes, src + srcOffset * pixelBytes, rowBytes);
+        size_t d = 1;
+        for (; d < nDims; d++) {
+            if (++index[d] < hi[d]) {
+                break;
+            }
+            index[d] = lo[d];
+        }
+        if (d == nDims) {
+            break;
+        }
+    }
+}
+
+size_t Product(const std::vector<size_t> &v) {
+    size_t p = 1;
+    for (const auto &x : v) {
+        p *= x;
+    }
+    return p;
+}
+
+} // End anonymous namespace
+
+ChunkedImageIO::ChunkedImageIO() {
+    this->AddSupportedReadExtension(".qic");
+    this->AddSupportedWriteExtension(".qic");
+}
+
+std::vector<size_t> ChunkedImageIO::Shape() const {
+    std::vector<size_t> shape(this->GetNumberOfDimensions());
+    for (size_t d = 0; d < shape.size(); d++) {
+        shape[d] = this->GetDimensions(d);
+    }
+    return shape;
+}
+
+std::vector<size_t> ChunkedImageIO::ChunkShape() const {
+    std::vector<size_t> shape = this->Shape();
+    for (size_t d = 0; d < shape.size(); d++) {
+        shape[d] = std::min(shape[d], (d < 3) ? ChunkEdge : 1);
+    }
+    return shape;
+}
+
+size_t ChunkedImageIO::NumberOfChunks() const {
+    const auto shape = this->Shape();
+    const auto chunk = this->ChunkShape();
+    size_t n = 1;
+    for (size_t d = 0; d < shape.size(); d++) {
+        n *= (shape[d] + chunk[d] - 1) / chunk[d];
+    }
+    return n;
+}
+
+void ChunkedImageIO::ChunkBox(const size_t c, std::vector<size_t> &lo, std::vector<size_t> &hi) const {
+    const auto shape = this->Shape();
+    const auto chunk = this->ChunkShape();
+    lo.resize(shape.size());
+    hi.resize(shape.size());
+    size_t remainder = c;
+    for (size_t d = 0; d < shape.size(); d++) {
+        const size_t grid = (shape[d] + chunk[d] - 1) / chunk[d];
+        lo[d] = (remainder % grid) * chunk[d];
+        hi[d] = std::min(lo[d] + chunk[d], shape[d]);
+        remainder /= grid;
+    }
+}
+
+itk::ImageIORegion ChunkedImageIO::GenerateStreamableReadRegionFromRequestedRegion(const itk::ImageIORegion &requested) const {
+    return requested;
+}
+
+bool ChunkedImageIO::CanReadFile(const char *path) {
+    if (!EndsWith(path, ".qic")) {
+        return false;
+    }
+    std::ifstream file(path, std::ios::binary);
+    char magic[4];
+    file.read(magic, 4);
+    return file && (std::memcmp(magic, Magic, 4) == 0);
+}
+
+void ChunkedImageIO::ReadImageInformation() {
+    std::ifstream file(m_FileName, std::ios::binary);
+    char magic[4];
+    file.read(magic, 4);
+    if (!file || (std::memcmp(magic, Magic, 4) != 0)) {
+        itkExceptionMacro("Not a QUIT chunked file: " << m_FileName);
+    }
+    const uint32_t nDims = Get<uint32_t>(file);
+    this->SetNumberOfDimensions(nDims);
+    this->SetComponentType(static_cast<IOComponentType>(Get<uint32_t>(file)));
+    this->SetPixelType(static_cast<IOPixelType>(Get<uint32_t>(file)));
+    this->SetNumberOfComponents(Get<uint32_t>(file));
+    for (uint32_t d = 0; d < nDims; d++) {
+        this->SetDimensions(d, Get<uint64_t>(file));
+    }
+    for (uint32_t d = 0; d < nDims; d++) {
+        this->SetSpacing(d, Get<double>(file));
+    }
+    for (uint32_t d = 0; d < nDims; d++) {
+        this->SetOrigin(d, Get<double>(file));
+    }
+    for (uint32_t d = 0; d < nDims; d++) {
+        std::vector<double> axis(nDims);
+        for (uint32_t j = 0; j < nDims; j++) {
+            axis[j] = Get<double>(file);
+        }
+        this->SetDirection(d, axis);
+    }
+    m_table.resize(this->NumberOfChunks());
+    for (auto &chunk : m_table) {
+        chunk.offset = Get<uint64_t>(file);
+        chunk.bytes = Get<uint64_t>(file);
+    }
+    if (!file) {
+        itkExceptionMacro("Failed to read header from file: " << m_FileName);
+    }
+}
+
+void ChunkedImageIO::Read(void *buffer) {
+    const size_t nDims = this->GetNumberOfDimensions();
+    const size_t pixelBytes = this->GetComponentSize() * this->GetNumberOfComponents();
+    // The region may have fewer dimensions than the file, e.g. a 3D image from a 4D file
+    std::vector<size_t> start(nDims, 0), size(nDims, 1);
+    for (size_t d = 0; d < std::min<size_t>(nDims, m_IORegion.GetImageDimension()); d++) {
+        start[d] = m_IORegion.GetIndex(d);
+        size[d] = m_IORegion.GetSize(d);
+    }
+    const int fd = open(m_FileName.c_str(), O_RDONLY);
+    if (fd < 0) {
+        itkExceptionMacro("Could not open file: " << m_FileName);
+    }
+    std::atomic<bool> failed(false);
+    {
+        ThreadPool pool(IOThreads());
+        for (size_t c = 0; c < m_table.size(); c++) {
+            std::vector<size_t> lo, hi;
+            this->ChunkBox(c, lo, hi);
+            std::vector<size_t> clo(nDims), chi(nDims);
+            bool overlap = true;
+            for (size_t d = 0; d < nDims; d++) {
+                clo[d] = std::max(lo[d], start[d]);
+                chi[d] = std::min(hi[d], start[d] + size[d]);
+                overlap = overlap && (clo[d] < chi[d]);
+            }
+            if (!overlap) {
+                continue;
+            }
+            pool.enqueue([=, &failed]{
+                std::vector<size_t> shape(nDims);
+                for (size_t d = 0; d < nDims; d++) {
+                    shape[d] = hi[d] - lo[d];
+                }
+                const size_t rawBytes = Product(shape) * pixelBytes;
+                std::vector<char> stored(m_table[c].bytes), raw;
+                if (pread(fd, stored.data(), stored.size(), m_table[c].offset) != static_cast<ssize_t>(stored.size())) {
+                    failed = true;
+                    return;
+                }
+                if (stored.size() < rawBytes) {
+                    raw.resize(rawBytes);
+                    uLongf rawSize = rawBytes;
+                    if ((uncompress(reinterpret_cast<Bytef *>(raw.data()), &rawSize,
+                                    reinterpret_cast<const Bytef *>(stored.data()), stored.size()) != Z_OK) ||
+                        (rawSize != rawBytes)) {
+                        failed = true;
+                        return;
+                    }
+                } else {
+                    raw.swap(stored);
+                }
+                CopyBox(raw.data(), lo, shape, static_cast<char *>(buffer), start, size, clo, chi, pixelBytes);
+            });
+        }
+    }
+    close(fd);
+    if (failed) {
+        itkExceptionMacro("Failed to read chunks from file: " << m_FileName);
+    }
+}
+
+bool ChunkedImageIO::CanWriteFile(const char *path) {
+    return EndsWith(path, ".qic");
+}
+
+void ChunkedImageIO::Write(const void *buffer) {
+    const size_t nDims = this->GetNumberOfDimensions();
+    const auto shape = this->Shape();
+    for (size_t d = 0; d < nDims; d++) {
+        if ((m_IORegion.GetIndex(d) != 0) || (m_IORegion.GetSize(d) != shape[d])) {
+            itkExceptionMacro("Chunked files can only be written in one piece");
+        }
+    }
+    const size_t pixelBytes = this->GetComponentSize() * this->GetNumberOfComponents();
+    const std::vector<size_t> zero(nDims, 0);
+    std::vector<std::vector<char>> chunks(this->NumberOfChunks());
+    {
+        ThreadPool pool(IOThreads());
+        for (size_t c = 0; c < chunks.size(); c++) {
+            pool.enqueue([=, &chunks]{
+                std::vector<size_t> lo, hi, chunkShape(nDims);
+                this->ChunkBox(c, lo, hi);
+                for (size_t d = 0; d < nDims; d++) {
+                    chunkShape[d] = hi[d] - lo[d];
+                }
+                std::vector<char> raw(Product(chunkShape) * pixelBytes);
+                CopyBox(static_cast<const char *>(buffer), zero, shape, raw.data(), lo, chunkShape, lo, hi, pixelBytes);
+                std::vector<char> packed(compressBound(raw.size()));
+                uLongf packedSize = packed.size();
+                if ((compress2(reinterpret_cast<Bytef *>(packed.data()), &packedSize,
+                               reinterpret_cast<const Bytef *>(raw.data()), raw.size(), Z_BEST_SPEED) == Z_OK) &&
+                    (packedSize < raw.size())) {
+                    packed.resize(packedSize);
+                    chunks[c].swap(packed);
+                } else {
+                    chunks[c].swap(raw);
+                }
+            });
+        }
+    }
+
+    std::ofstream file(m_FileName, std::ios::binary);
+    file.write(Magic, 4);
+    Put<uint32_t>(file, nDims);
+    Put<uint32_t>(file, this->GetComponentType());
+    Put<uint32_t>(file, this->GetPixelType());
+    Put<uint32_t>(file, this->GetNumberOfComponents());
+    for (size_t d = 0; d < nDims; d++) {
+        Put<uint64_t>(file, shape[d]);
+    }
+    for (size_t d = 0; d < nDims; d++) {
+        Put<double>(file, this->GetSpacing(d));
+    }
+    for (size_t d = 0; d < nDims; d++) {
+        Put<double>(file, this->GetOrigin(d));
+    }
+    for (size_t d = 0; d < nDims; d++) {
+        const std::vector<double> axis = this->GetDirection(d);
+        for (size_t j = 0; j < nDims; j++) {
+            Put<double>(file, axis[j]);
+        }
+    }
+    uint64_t offset = 4 + 4*sizeof(uint32_t) + nDims*(sizeof(uint64_t) + 2*sizeof(double)) +
+                      nDims*nDims*sizeof(double) + chunks.size()*2*sizeof(uint64_t);
+    for (const auto &chunk : chunks) {
+        Put<uint64_t>(file, offset);
+        Put<uint64_t>(file, chunk.size());
+        offset += chunk.size();
+    }
+    for (const auto &chunk : chunks) {
+        file.write(chunk.data(), chunk.size());
+    }
+    if (!file) {
+        itkExceptionMacro("Failed to write file: " << m_FileName);
+    }
+}
+
+namespace {
+
+class ChunkedImageIOFactory : public itk::ObjectFactoryBase {
+public:
+    typedef ChunkedImageIOFactory    Self;
+    typedef itk::ObjectFactoryBase   Superclass;
+    typedef itk::SmartPointer<Self>  Pointer;
+    itkFactorylessNewMacro(Self);
+    itkTypeMacro(ChunkedImageIOFactory, ObjectFactoryBase);
+
+    const char *GetITKSourceVersion() const ITK_OVERRIDE { return ITK_SOURCE_VERSION; }
+    const char *GetDescription() const ITK_OVERRIDE { return "QUIT chunked image IO"; }
+
+protected:
+    ChunkedImageIOFactory() {
+        this->RegisterOverride("itkImageIOBase", "QIChunkedImageIO", "QUIT chunked image IO", true,
+                               itk::CreateObjectFunction<ChunkedImageIO>::New());
+    }
+};
+
+} // End anonymous namespace
+
+void RegisterChunkedIO() {
+    static std::once_flag registered;
+    std::call_once(registered, []{
+        itk::ObjectFactoryBase::RegisterFactory(ChunkedImageIOFactory::New());
+    });
+}
+
+} // End namespace QI
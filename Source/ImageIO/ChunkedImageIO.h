@@ -0,0 +1,80 @@
+/*
+ *  ChunkedImageIO.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_CHUNKEDIMAGEIO_H
+#define QI_CHUNKEDIMAGEIO_H
+
+#include <vector>
+#include <cstdint>
+
+#include "itkImageIOBase.h"
+
+namespace QI {
+
+/*
+ * A simple chunked format for intermediate files, with extension .qic. The image is split into
+ * chunks of ChunkEdge voxels along the first three dimensions and 1 along any others. Each chunk
+ * is deflated separately (or stored as-is if that is not smaller) and a table of chunk offsets
+ * follows the header, so a region can be read by inflating only the chunks that intersect it.
+ *
+ * Layout, all values in native byte order:
+ *   "QIC1", uint32 dimensions, component type, pixel type, components
+ *   uint64 size[dims], double spacing[dims], origin[dims], direction[dims*dims] (column-major)
+ *   uint64 offset, bytes for each chunk, with the first dimension varying fastest
+ *   chunk data
+ */
+class ChunkedImageIO : public itk::ImageIOBase {
+public:
+    typedef ChunkedImageIO           Self;
+    typedef itk::ImageIOBase         Superclass;
+    typedef itk::SmartPointer<Self>  Pointer;
+    itkNewMacro(Self);
+    itkTypeMacro(ChunkedImageIO, ImageIOBase);
+
+    static const size_t ChunkEdge = 32;
+
+    bool SupportsDimension(unsigned long) ITK_OVERRIDE { return true; }
+    bool CanStreamRead() ITK_OVERRIDE { return true; }
+    bool CanStreamWrite() ITK_OVERRIDE { return false; }
+    itk::ImageIORegion GenerateStreamableReadRegionFromRequestedRegion(const itk::ImageIORegion &requested) const ITK_OVERRIDE;
+
+    bool CanReadFile(const char *path) ITK_OVERRIDE;
+    void ReadImageInformation() ITK_OVERRIDE;
+    void Read(void *buffer) ITK_OVERRIDE;
+
+    bool CanWriteFile(const char *path) ITK_OVERRIDE;
+    void WriteImageInformation() ITK_OVERRIDE {}
+    void Write(const void *buffer) ITK_OVERRIDE;
+
+protected:
+    ChunkedImageIO();
+    ~ChunkedImageIO() {}
+
+    struct Chunk {
+        uint64_t offset, bytes;
+    };
+    std::vector<Chunk> m_table;
+
+    std::vector<size_t> Shape() const;      //!< Image size in each dimension
+    std::vector<size_t> ChunkShape() const; //!< Chunk size in each dimension
+    size_t NumberOfChunks() const;
+    void ChunkBox(const size_t c, std::vector<size_t> &lo, std::vector<size_t> &hi) const;
+
+private:
+    ChunkedImageIO(const Self &); //purposely not implemented
+    void operator=(const Self &); //purposely not implemented
+};
+
+void RegisterChunkedIO(); //!< Make .qic files available to ITK readers and writers. Safe to call more than once
+
+} // End namespace QI
+
+#endif // QI_CHUNKEDIMAGEIO_H
@@ -12,13 +12,24 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
+#include <functional>
 #include "ImageTypes.h"
+#include "AsyncWrite.h"
 
 namespace QI {
 
 template<typename TImg = QI::VolumeF>
 extern auto ReadImage(const std::string &path) -> typename TImg::Pointer;
 
+/*
+ * Read only the voxels inside region, for use with ApplyAlgorithmFilter::SetSubregion(). The
+ * image has the geometry of the whole file but only region is buffered. Formats that can stream
+ * (.qic and uncompressed .nii) read only that part of the file, others are read in full. An empty
+ * region reads everything.
+ */
+template<typename TImg = QI::VolumeF>
+extern auto ReadImage(const std::string &path, const typename TImg::RegionType &region) -> typename TImg::Pointer;
+
 template<typename TImg = QI::VolumeF>
 extern auto ReadMagnitudeImage(const std::string &path) -> typename TImg::Pointer;
 
@@ -28,6 +39,17 @@ extern void WriteImage(const TImg *ptr, const std::string &path);
 template<typename TImg>
 extern void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path);
 
+/*
+ * Write a series of nVols volumes with the geometry of ref, without holding the whole series in
+ * memory. fill(buffer, start, n) must write volumes [start, start + n) into buffer one after
+ * another. Volumes are requested in slabs of bounded size, and the next slab is filled while the
+ * current one is written. Formats that cannot stream, and images kept in memory for qi_pipeline,
+ * are filled in one go.
+ */
+template<typename TPixel = float>
+extern void WriteSeries(const itk::Image<TPixel, 3> *ref, const size_t nVols, const std::string &path,
+                        const std::function<void(TPixel *, const size_t, const size_t)> &fill);
+
 template<typename TImg>
 extern void WriteMagnitudeImage(const TImg *ptr, const std::string &path);
 
@@ -43,6 +65,9 @@ extern void WriteScaledImage(const itk::SmartPointer<TImg> &ptr, const itk::Smar
 template<typename TPixel = float>
 extern auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer;
 
+template<typename TPixel = float>
+extern auto ReadVectorImage(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<TPixel, 3>::Pointer;
+
 template<typename TVImg>
 extern void WriteVectorImage(const TVImg *img, const std::string &path);
 
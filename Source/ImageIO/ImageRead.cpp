@@ -12,21 +12,156 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
+#include <complex>
+#include <memory>
+#include <type_traits>
 
 #include "itkImageFileReader.h"
 #include "itkComplexToModulusImageFilter.h"
+#include "itkCastImageFilter.h"
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "MappedNifti.h"
+#include "MemoryImages.h"
+#include "ChunkedImageIO.h"
 #include "Macro.h"
 
 namespace QI {
 
+namespace {
+
+template<typename T> struct NiftiType { static const int code = -1; };
+template<> struct NiftiType<unsigned char> { static const int code = 2; };
+template<> struct NiftiType<int> { static const int code = 8; };
+template<> struct NiftiType<float> { static const int code = 16; };
+template<> struct NiftiType<double> { static const int code = 64; };
+template<> struct NiftiType<std::complex<float>> { static const int code = 32; };
+template<> struct NiftiType<std::complex<double>> { static const int code = 1792; };
+
+/*
+ * Pixel container that points into a mapped file and unmaps it on destruction
+ */
+template<typename TPixel>
+class MappedContainer : public itk::ImportImageContainer<itk::SizeValueType, TPixel> {
+public:
+    typedef MappedContainer                                    Self;
+    typedef itk::ImportImageContainer<itk::SizeValueType, TPixel> Superclass;
+    typedef itk::SmartPointer<Self>                            Pointer;
+    itkNewMacro(Self);
+    itkTypeMacro(MappedContainer, ImportImageContainer);
+
+    void SetFile(std::unique_ptr<MappedNifti> file) {
+        this->SetImportPointer(static_cast<TPixel *>(file->data()), file->voxels(), false);
+        m_file = std::move(file);
+    }
+
+protected:
+    MappedContainer() {}
+    ~MappedContainer() {}
+    std::unique_ptr<MappedNifti> m_file;
+};
+
+/*
+ * If the data in the file can be used without conversion, return an image whose buffer is the
+ * mapped file. Only the header is read, so this is almost free and the pages are shared with any
+ * other process reading the same file. Returns nullptr if the file cannot be used in place.
+ */
+template<typename TImg>
+auto ReadMapped(const std::string &path) -> typename TImg::Pointer {
+    typedef typename TImg::PixelType TPixel;
+    auto file = MappedNifti::Open(path);
+    if (!file || (file->datatype() != NiftiType<TPixel>::code)) {
+        return nullptr;
+    }
+    typedef itk::ImageFileReader<TImg> TReader;
+    typename TReader::Pointer reader = TReader::New();
+    reader->SetFileName(path);
+    reader->UpdateOutputInformation();
+    typename TImg::Pointer img = reader->GetOutput();
+    img->DisconnectPipeline();
+    const auto region = img->GetLargestPossibleRegion();
+    if (region.GetNumberOfPixels() != file->voxels()) {
+        return nullptr;
+    }
+    auto container = MappedContainer<TPixel>::New();
+    container->SetFile(std::move(file));
+    img->SetBufferedRegion(region);
+    img->SetRequestedRegion(region);
+    img->SetPixelContainer(container);
+    return img;
+}
+
+template<typename TImg, typename TIn>
+auto CastStored(const itk::DataObject *obj) -> typename TImg::Pointer {
+    const TIn *in = dynamic_cast<const TIn *>(obj);
+    if (!in) {
+        return nullptr;
+    }
+    auto cast = itk::CastImageFilter<TIn, TImg>::New();
+    cast->SetInput(in);
+    cast->Update();
+    typename TImg::Pointer img = cast->GetOutput();
+    img->DisconnectPipeline();
+    return img;
+}
+
+/*
+ * Real volumes in memory are converted between pixel types, as they would be when read from a
+ * file, e.g. masks written as int and read as float
+ */
+template<typename TImg>
+auto ConvertStored(const itk::DataObject *obj, std::true_type) -> typename TImg::Pointer {
+    typename TImg::Pointer img = CastStored<TImg, VolumeF>(obj);
+    if (!img) img = CastStored<TImg, VolumeD>(obj);
+    if (!img) img = CastStored<TImg, VolumeI>(obj);
+    if (!img) img = CastStored<TImg, VolumeUC>(obj);
+    return img;
+}
+
+template<typename TImg>
+auto ConvertStored(const itk::DataObject *, std::false_type) -> typename TImg::Pointer {
+    return nullptr;
+}
+
+/*
+ * Returns nullptr if there is no image in memory for path
+ */
+template<typename TImg>
+auto ReadStored(const std::string &path) -> typename TImg::Pointer {
+    typedef std::integral_constant<bool, std::is_arithmetic<typename TImg::PixelType>::value &&
+                                         (TImg::ImageDimension == 3)> TConvertible;
+    auto obj = StoredImage(path);
+    if (!obj) {
+        return nullptr;
+    }
+    typename TImg::Pointer img = ShareImage<TImg>(obj);
+    if (!img) {
+        img = ConvertStored<TImg>(obj, TConvertible());
+    }
+    if (!img) {
+        QI_EXCEPTION("Image in memory has the wrong type for: " << path);
+    }
+    return img;
+}
+
+} // End anonymous namespace
+
 template<typename TImg>
 auto ReadImage(const std::string &path) -> typename TImg::Pointer {
     typedef itk::ImageFileReader<TImg> TReader;
+    if (auto stored = ReadStored<TImg>(path)) {
+        return stored;
+    }
+    RegisterChunkedIO();
     typename TReader::Pointer file = TReader::New();
-    file->SetFileName(path);
+    GzipReadProxy proxy(path);
+    typename TImg::Pointer img = ReadMapped<TImg>(proxy.path());
+    if (img) {
+        return img;
+    }
+    file->SetFileName(proxy.path());
     file->Update();
-    typename TImg::Pointer img = file->GetOutput();
+    img = file->GetOutput();
     if (!img) {
         QI_EXCEPTION("Failed to read file: " << path);
     }
@@ -34,6 +169,38 @@ auto ReadImage(const std::string &path) -> typename TImg::Pointer {
     return img;
 }
 
+/*
+ * ImageFileReader only reads the requested region if the ImageIO can stream, otherwise the whole
+ * file is read and buffered
+ */
+template<typename TImg>
+auto ReadImage(const std::string &path, const typename TImg::RegionType &region) -> typename TImg::Pointer {
+    if (region.GetNumberOfPixels() == 0) {
+        return ReadImage<TImg>(path);
+    }
+    if (auto stored = ReadStored<TImg>(path)) {
+        return stored;
+    }
+    typedef itk::ImageFileReader<TImg> TReader;
+    RegisterChunkedIO();
+    GzipReadProxy proxy(path);
+    typename TImg::Pointer img = ReadMapped<TImg>(proxy.path());
+    if (img) {
+        return img;
+    }
+    typename TReader::Pointer file = TReader::New();
+    file->SetFileName(proxy.path());
+    file->UpdateOutputInformation();
+    img = file->GetOutput();
+    if (!img->GetLargestPossibleRegion().IsInside(region)) {
+        QI_EXCEPTION("Region " << region << " is not inside file: " << path);
+    }
+    img->SetRequestedRegion(region);
+    img->Update();
+    img->DisconnectPipeline();
+    return img;
+}
+
 template<typename TImg>
 auto ReadMagnitudeImage(const std::string &path) -> typename TImg::Pointer {
     typedef itk::Image<std::complex<typename TImg::PixelType>, TImg::ImageDimension> TComplex;
@@ -56,6 +223,9 @@ template auto ReadImage<SeriesF>(const std::string &path) -> typename SeriesF::P
 template auto ReadImage<SeriesD>(const std::string &path) -> typename SeriesD::Pointer;
 template auto ReadImage<SeriesXF>(const std::string &path) -> typename SeriesXF::Pointer;
 template auto ReadImage<SeriesXD>(const std::string &path) -> typename SeriesXD::Pointer;
+template auto ReadImage<VolumeF>(const std::string &path, const typename VolumeF::RegionType &region) -> typename VolumeF::Pointer;
+template auto ReadImage<VolumeI>(const std::string &path, const typename VolumeI::RegionType &region) -> typename VolumeI::Pointer;
+template auto ReadImage<VolumeUC>(const std::string &path, const typename VolumeUC::RegionType &region) -> typename VolumeUC::Pointer;
 template auto ReadMagnitudeImage<VolumeF>(const std::string &path) -> typename VolumeF::Pointer;
 template auto ReadMagnitudeImage<SeriesF>(const std::string &path) -> typename SeriesF::Pointer;
 
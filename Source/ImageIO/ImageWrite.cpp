@@ -10,23 +10,96 @@
  */
 
 #include <string>
+#include <limits>
+#include <algorithm>
 
 #include "itkImageFileWriter.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkDivideImageFilter.h"
 
 #include "ImageIO.h"
+#include "ParallelGzip.h"
+#include "StreamWrite.h"
+#include "MemoryImages.h"
 #include "Macro.h"
 
 namespace QI {
 
+namespace {
+
+/*
+ * Float images can be stored as scaled int16, see QI::OutPrecision(). Other pixel types are always
+ * written as they are.
+ */
 template<typename TImg>
-void WriteImage(const TImg *ptr, const std::string &path) {
+bool WriteReduced(const TImg *, const std::string &) {
+    return false;
+}
+
+template<unsigned int D>
+bool WriteReduced(const itk::Image<float, D> *img, const std::string &path) {
+    if (!UseInt16(path) || !IsSimpleBuffer(img)) {
+        return false;
+    }
+    const auto size = img->GetLargestPossibleRegion().GetSize();
+    const size_t planeSize = img->GetLargestPossibleRegion().GetNumberOfPixels() / size[D - 1];
+    const float *src = img->GetBufferPointer();
+    WriteInt16(img, 0, path, [=](float *dst, const size_t start, const size_t n) {
+        std::copy(src + start * planeSize, src + (start + n) * planeSize, dst);
+    });
+    return true;
+}
+
+template<typename TImg>
+void WriteNow(const TImg *ptr, const std::string &path) {
+    if (WriteReduced(ptr, path)) {
+        return;
+    }
     typedef itk::ImageFileWriter<TImg> TWriter;
+    RegisterChunkedIO();
     typename TWriter::Pointer file = TWriter::New();
-    file->SetFileName(path);
+    GzipWriteProxy proxy(path);
+    file->SetFileName(proxy.path());
     file->SetInput(ptr);
     file->Update();
+    proxy.commit();
+}
+
+/*
+ * Divides img by simg while the slices are being written, instead of creating a scaled copy of the
+ * image first. Division by zero gives the maximum value, the same as itk::DivideImageFilter.
+ * Returns false if either image is not a simple fully-buffered image.
+ */
+template<typename TImg>
+bool WriteScaledDirect(const TImg *img, const QI::VolumeF *simg, const std::string &path) {
+    typedef typename TImg::PixelType TPixel;
+    if (!IsSimpleBuffer(img) || !IsSimpleBuffer(simg) ||
+        (img->GetLargestPossibleRegion() != simg->GetLargestPossibleRegion())) {
+        return false;
+    }
+    const auto size = img->GetLargestPossibleRegion().GetSize();
+    const size_t planeSize = size[0] * size[1];
+    const TPixel *src = img->GetBufferPointer();
+    const float *scale = simg->GetBufferPointer();
+    WritePlanes<TPixel>(img, 0, path, [=](TPixel *dst, const size_t start, const size_t n) {
+        const size_t offset = start * planeSize;
+        for (size_t i = 0; i < n * planeSize; i++) {
+            const float s = scale[offset + i];
+            dst[i] = (s != 0.f) ? static_cast<TPixel>(src[offset + i] / s) : std::numeric_limits<TPixel>::max();
+        }
+    });
+    return true;
+}
+
+} // End anonymous namespace
+
+template<typename TImg>
+void WriteImage(const TImg *ptr, const std::string &path) {
+    typename TImg::ConstPointer img = Detach(ptr);
+    StoreImage(path, img);
+    if (WriteToDisk(path)) {
+        DeferWrite([img, path]{ WriteNow<TImg>(img, path); });
+    }
 }
 
 template<typename TImg>
@@ -34,14 +107,63 @@ void WriteImage(const itk::SmartPointer<TImg> ptr, const std::string &path) {
     WriteImage<TImg>(ptr.GetPointer(), path);
 }
 
+template<typename TPixel>
+void WriteSeries(const itk::Image<TPixel, 3> *ref, const size_t nVols, const std::string &path,
+                 const std::function<void(TPixel *, const size_t, const size_t)> &fill) {
+    if (KeepingImages()) {
+        // Later programs read the series back from memory, so it has to exist in full anyway
+        typedef itk::Image<TPixel, 4> TSeries;
+        typename TSeries::Pointer series = TSeries::New();
+        typename TSeries::RegionType region;
+        typename TSeries::SpacingType spacing;
+        typename TSeries::PointType origin;
+        typename TSeries::DirectionType direction;
+        spacing.Fill(1.);
+        origin.Fill(1.); // Matches CreateWriteIO()
+        direction.SetIdentity();
+        for (int i = 0; i < 3; i++) {
+            region.GetModifiableSize()[i] = ref->GetLargestPossibleRegion().GetSize()[i];
+            spacing[i] = ref->GetSpacing()[i];
+            origin[i] = ref->GetOrigin()[i];
+            for (int j = 0; j < 3; j++) {
+                direction[i][j] = ref->GetDirection()[i][j];
+            }
+        }
+        region.GetModifiableSize()[3] = nVols;
+        series->SetRegions(region);
+        series->SetSpacing(spacing);
+        series->SetOrigin(origin);
+        series->SetDirection(direction);
+        series->Allocate();
+        fill(series->GetBufferPointer(), 0, nVols);
+        WriteImage<TSeries>(series.GetPointer(), path);
+        return;
+    }
+    // Always go via an uncompressed temporary file, ITK would otherwise hold a .nii.gz in memory
+    GzipWriteProxy proxy(path, true);
+    WritePlanes<TPixel>(ref, nVols, proxy.path(), fill);
+    proxy.commit();
+}
+
 template<typename TImg>
 void WriteMagnitudeImage(const TImg *ptr, const std::string &path) {
     typedef typename TImg::PixelType::value_type TReal;
     typedef itk::Image<TReal, TImg::ImageDimension> TRealImage;
-    auto mag = itk::ComplexToModulusImageFilter<TImg, TRealImage>::New();
-    mag->SetInput(ptr);
-    mag->Update();
-    WriteImage<TRealImage>(mag->GetOutput(), path);
+    if (KeepingImages()) {
+        // Later programs read the magnitude back from memory, so calculate it now
+        auto mag = itk::ComplexToModulusImageFilter<TImg, TRealImage>::New();
+        mag->SetInput(ptr);
+        mag->Update();
+        WriteImage<TRealImage>(mag->GetOutput(), path);
+        return;
+    }
+    typename TImg::ConstPointer img = Detach(ptr);
+    DeferWrite([img, path]{
+        auto mag = itk::ComplexToModulusImageFilter<TImg, TRealImage>::New();
+        mag->SetInput(img);
+        mag->Update();
+        WriteNow<TRealImage>(mag->GetOutput(), path);
+    });
 }
 
 template<typename TImg>
@@ -50,12 +172,28 @@ void WriteMagnitudeImage(const itk::SmartPointer<TImg> ptr, const std::string &p
 }
 
 template<typename TImg>
-void WriteScaledImage(const TImg *img, const QI::VolumeF *simg, const std::string &path) {
-    auto scaleFilter = itk::DivideImageFilter<TImg, QI::VolumeF, TImg>::New();
-    scaleFilter->SetInput1(img);
-    scaleFilter->SetInput2(simg);
-    scaleFilter->Update();
-    WriteImage(scaleFilter->GetOutput(), path);
+void WriteScaledImage(const TImg *ptr, const QI::VolumeF *sptr, const std::string &path) {
+    if (KeepingImages()) {
+        // As above, the stored image has to be the scaled one
+        auto scaleFilter = itk::DivideImageFilter<TImg, QI::VolumeF, TImg>::New();
+        scaleFilter->SetInput1(ptr);
+        scaleFilter->SetInput2(sptr);
+        scaleFilter->Update();
+        WriteImage<TImg>(scaleFilter->GetOutput(), path);
+        return;
+    }
+    typename TImg::ConstPointer img = Detach(ptr);
+    QI::VolumeF::ConstPointer simg = Detach(sptr);
+    DeferWrite([img, simg, path]{
+        if (WriteScaledDirect<TImg>(img, simg, path)) {
+            return;
+        }
+        auto scaleFilter = itk::DivideImageFilter<TImg, QI::VolumeF, TImg>::New();
+        scaleFilter->SetInput1(img);
+        scaleFilter->SetInput2(simg);
+        scaleFilter->Update();
+        WriteNow<TImg>(scaleFilter->GetOutput(), path);
+    });
 }
 
 template<typename TImg>
@@ -79,6 +217,8 @@ template void WriteImage<SeriesF>(const itk::SmartPointer<SeriesF> ptr, const st
 template void WriteImage<SeriesD>(const itk::SmartPointer<SeriesD> ptr, const std::string &path);
 template void WriteImage<SeriesXF>(const itk::SmartPointer<SeriesXF> ptr, const std::string &path);
 template void WriteImage<SeriesXD>(const itk::SmartPointer<SeriesXD> ptr, const std::string &path);
+template void WriteSeries<float>(const VolumeF *ref, const size_t nVols, const std::string &path,
+                                 const std::function<void(float *, const size_t, const size_t)> &fill);
 template void WriteScaledImage<VolumeF>(const VolumeF *img, const VolumeF *simg, const std::string &path);
 template void WriteScaledImage<VolumeF>(const itk::SmartPointer<VolumeF> &ptr, const itk::SmartPointer<VolumeF> &sptr, const std::string &path);
 template void WriteMagnitudeImage<VolumeXF>(const VolumeXF *ptr, const std::string &path);
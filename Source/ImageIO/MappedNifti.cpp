@@ -0,0 +1,134 @@
+/*
+ *  MappedNifti.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cstdint>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "MappedNifti.h"
+#include "Util.h"
+
+namespace QI {
+
+namespace {
+
+/*
+ * Byte offsets of the fields used from the 348 byte NIfTI-1 header
+ */
+const size_t HeaderSize = 348;
+const size_t DimOffset = 40, DatatypeOffset = 70, BitpixOffset = 72, VoxOffset = 108,
+             SlopeOffset = 112, InterOffset = 116, MagicOffset = 344;
+
+template<typename T>
+T Field(const char *header, const size_t offset) {
+    T value;
+    std::memcpy(&value, header + offset, sizeof(T));
+    return value;
+}
+
+/*
+ * Device and inode of every live mapping, so that writers can tell if a path is in use
+ */
+typedef std::pair<unsigned long long, unsigned long long> TFileID;
+std::mutex MappedMutex;
+std::multiset<TFileID> MappedFiles;
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+    return (s.size() >= suffix.size()) && (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+} // End anonymous namespace
+
+MappedNifti::MappedNifti() :
+    m_base(nullptr), m_length(0), m_offset(0), m_voxels(0), m_datatype(0), m_device(0), m_inode(0)
+{}
+
+std::unique_ptr<MappedNifti> MappedNifti::Open(const std::string &path) {
+    if (!EndsWith(path, ".nii") || !MapInputs()) {
+        return nullptr;
+    }
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return nullptr;
+    }
+    std::unique_ptr<MappedNifti> file;
+    char header[HeaderSize];
+    struct stat info;
+    // A byte-swapped header will fail the sizeof_hdr check
+    if ((pread(fd, header, HeaderSize, 0) == static_cast<ssize_t>(HeaderSize)) &&
+        (Field<int32_t>(header, 0) == static_cast<int32_t>(HeaderSize)) &&
+        (std::memcmp(header + MagicOffset, "n+1", 4) == 0) &&
+        (fstat(fd, &info) == 0))
+    {
+        const float slope = Field<float>(header, SlopeOffset);
+        const float inter = Field<float>(header, InterOffset);
+        const float vox_offset = Field<float>(header, VoxOffset);
+        const int bitpix = Field<int16_t>(header, BitpixOffset);
+        const int nDims = Field<int16_t>(header, DimOffset);
+        size_t voxels = 1;
+        for (int i = 1; i <= nDims && i < 8; i++) {
+            voxels *= std::max<int16_t>(1, Field<int16_t>(header, DimOffset + 2*i));
+        }
+        const size_t offset = static_cast<size_t>(vox_offset);
+        const size_t bytes = voxels * bitpix / 8;
+        const bool scaled = (slope != 0.f) && ((slope != 1.f) || (inter != 0.f));
+        if (!scaled && (bitpix % 8 == 0) && (offset % 16 == 0) &&
+            (static_cast<size_t>(info.st_size) >= offset + bytes))
+        {
+            void *base = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+            if (base != MAP_FAILED) {
+                file.reset(new MappedNifti());
+                file->m_base = base;
+                file->m_length = info.st_size;
+                file->m_offset = offset;
+                file->m_voxels = voxels;
+                file->m_datatype = Field<int16_t>(header, DatatypeOffset);
+                file->m_device = info.st_dev;
+                file->m_inode = info.st_ino;
+                std::lock_guard<std::mutex> lock(MappedMutex);
+                MappedFiles.insert(TFileID(file->m_device, file->m_inode));
+            }
+        }
+    }
+    close(fd); // The mapping stays valid
+    return file;
+}
+
+MappedNifti::~MappedNifti() {
+    if (m_base) {
+        munmap(m_base, m_length);
+        std::lock_guard<std::mutex> lock(MappedMutex);
+        MappedFiles.erase(MappedFiles.find(TFileID(m_device, m_inode)));
+    }
+}
+
+bool MappedNifti::IsMapped(const std::string &path) {
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0) {
+        return false;
+    }
+    std::lock_guard<std::mutex> lock(MappedMutex);
+    return MappedFiles.count(TFileID(info.st_dev, info.st_ino)) > 0;
+}
+
+int MappedNifti::datatype() const { return m_datatype; }
+size_t MappedNifti::voxels() const { return m_voxels; }
+void *MappedNifti::data() const { return static_cast<char *>(m_base) + m_offset; }
+
+} // End namespace QI
@@ -0,0 +1,48 @@
+/*
+ *  MappedNifti.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_MAPPEDNIFTI_H
+#define QI_MAPPEDNIFTI_H
+
+#include <string>
+#include <memory>
+
+namespace QI {
+
+/*
+ * A memory-mapped single-file NIfTI-1 image. Open() returns nullptr unless the file is an
+ * uncompressed .nii in native byte order with no intensity scaling, i.e. the data in the file can
+ * be used as-is. The mapping is private, so writing to the data changes only this process's copy.
+ * Writing to the file itself while it is mapped would change or truncate the pages underneath the
+ * image, so writers must check IsMapped() and replace the file instead.
+ */
+class MappedNifti {
+protected:
+    void *m_base;
+    size_t m_length, m_offset, m_voxels;
+    int m_datatype;
+    unsigned long long m_device, m_inode;
+    MappedNifti();
+public:
+    static std::unique_ptr<MappedNifti> Open(const std::string &path);
+    static bool IsMapped(const std::string &path); //!< True if path is the same file as a live mapping
+    ~MappedNifti();
+    MappedNifti(const MappedNifti &) = delete;
+    MappedNifti &operator=(const MappedNifti &) = delete;
+
+    int datatype() const;  //!< NIfTI datatype code
+    size_t voxels() const; //!< Product of all dimensions
+    void *data() const;
+};
+
+} // End namespace QI
+
+#endif // QI_MAPPEDNIFTI_H
@@ -0,0 +1,70 @@
+/*
+ *  MemoryImages.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <map>
+#include <set>
+#include <mutex>
+
+#include "MemoryImages.h"
+#include "Util.h"
+
+namespace QI {
+
+namespace {
+std::mutex store_mutex;
+bool keep_images = false;
+std::set<std::string> disk_outputs;
+std::map<std::string, itk::DataObject::ConstPointer> stored_images;
+}
+
+void KeepImagesInMemory(const std::vector<std::string> &outputs) {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    keep_images = true;
+    disk_outputs.clear();
+    for (const auto &o : outputs) {
+        disk_outputs.insert(StripExt(o));
+    }
+}
+
+void ReleaseMemoryImages() {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    keep_images = false;
+    disk_outputs.clear();
+    stored_images.clear();
+}
+
+bool KeepingImages() {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    return keep_images;
+}
+
+bool WriteToDisk(const std::string &path) {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    return !keep_images || disk_outputs.count(StripExt(path));
+}
+
+void StoreImage(const std::string &path, const itk::DataObject *img) {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    if (keep_images) {
+        stored_images[StripExt(path)] = img;
+    }
+}
+
+itk::DataObject::ConstPointer StoredImage(const std::string &path) {
+    std::lock_guard<std::mutex> lock(store_mutex);
+    const auto it = stored_images.find(StripExt(path));
+    if (it == stored_images.end()) {
+        return nullptr;
+    }
+    return it->second;
+}
+
+} // End namespace QI
@@ -0,0 +1,53 @@
+/*
+ *  MemoryImages.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_MEMORYIMAGES_H
+#define QI_MEMORYIMAGES_H
+
+#include <string>
+#include <vector>
+
+#include "itkDataObject.h"
+
+namespace QI {
+
+/*
+ * When several programs run in one process (see qi_pipeline), the images they write are kept in
+ * memory and later reads of the same path return them without touching the disk. Images are
+ * matched by path with the extension removed, so "D1_T1.nii.gz" and "D1_T1.nii" are the same
+ * image. Only the paths listed in outputs are also written to disk.
+ */
+void KeepImagesInMemory(const std::vector<std::string> &outputs);
+void ReleaseMemoryImages(); //!< Free the stored images and go back to normal file IO
+
+bool KeepingImages(); //!< True between KeepImagesInMemory() and ReleaseMemoryImages()
+bool WriteToDisk(const std::string &path); //!< False if path is an intermediate image held in memory
+void StoreImage(const std::string &path, const itk::DataObject *img); //!< Does nothing unless images are kept in memory
+itk::DataObject::ConstPointer StoredImage(const std::string &path); //!< nullptr if there is no image for path
+
+/*
+ * Return a new image sharing the buffer of obj, or nullptr if obj is not a TImg
+ */
+template<typename TImg>
+typename TImg::Pointer ShareImage(const itk::DataObject *obj) {
+    const TImg *stored = dynamic_cast<const TImg *>(obj);
+    if (!stored) {
+        return nullptr;
+    }
+    typename TImg::Pointer img = TImg::New();
+    img->Graft(stored);
+    img->SetMetaDataDictionary(stored->GetMetaDataDictionary());
+    return img;
+}
+
+} // End namespace QI
+
+#endif // QI_MEMORYIMAGES_H
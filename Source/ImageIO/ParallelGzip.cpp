@@ -0,0 +1,384 @@
+/*
+ *  ParallelGzip.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <fstream>
+#include <vector>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "ParallelGzip.h"
+#include "MappedNifti.h"
+#include "ThreadPool.h"
+#include "Util.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+const size_t BlockSize = 1 << 20;     // Uncompressed bytes per block
+const unsigned char IndexID[2] = {'Q', 'I'}; // Gzip extra subfield holding the block index
+const size_t MaxIndexBlocks = (65535 - 4 - 4) / 4; // Must fit in the 16-bit extra field length
+
+typedef std::vector<unsigned char> TBytes;
+
+TBytes ReadBytes(const std::string &path) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+    if (!file) {
+        QI_EXCEPTION("Failed to open file: " << path);
+    }
+    TBytes bytes(static_cast<size_t>(file.tellg()));
+    file.seekg(0);
+    file.read(reinterpret_cast<char *>(bytes.data()), bytes.size());
+    if (!file) {
+        QI_EXCEPTION("Failed to read file: " << path);
+    }
+    return bytes;
+}
+
+void Put16(TBytes &b, const uint32_t v) {
+    b.push_back(v & 0xff);
+    b.push_back((v >> 8) & 0xff);
+}
+
+void Put32(TBytes &b, const uint32_t v) {
+    Put16(b, v & 0xffff);
+    Put16(b, v >> 16);
+}
+
+uint32_t Get16(const unsigned char *p) { return p[0] | (p[1] << 8); }
+uint32_t Get32(const unsigned char *p) { return Get16(p) | (Get16(p + 2) << 16); }
+
+/*
+ * Raw deflate of one block. All blocks except the last end with a sync-flush, which byte-aligns
+ * the output so that the blocks can simply be concatenated.
+ */
+void DeflateBlock(const unsigned char *in, const size_t n, const bool last, TBytes &out) {
+    z_stream strm{};
+    if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        QI_EXCEPTION("Failed to initialise zlib deflate");
+    }
+    out.resize(deflateBound(&strm, n) + 64);
+    strm.next_in = const_cast<unsigned char *>(in);
+    strm.avail_in = n;
+    strm.next_out = out.data();
+    strm.avail_out = out.size();
+    const int ret = deflate(&strm, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if ((last && ret != Z_STREAM_END) || (!last && (ret != Z_OK || strm.avail_in != 0 || strm.avail_out == 0))) {
+        deflateEnd(&strm);
+        QI_EXCEPTION("zlib deflate failed");
+    }
+    out.resize(out.size() - strm.avail_out);
+    deflateEnd(&strm);
+}
+
+/*
+ * Raw inflate of one block written by DeflateBlock(). Returns the number of bytes produced.
+ */
+size_t InflateBlock(const unsigned char *in, const size_t n, unsigned char *out, const size_t max_out) {
+    z_stream strm{};
+    if (inflateInit2(&strm, -15) != Z_OK) {
+        QI_EXCEPTION("Failed to initialise zlib inflate");
+    }
+    strm.next_in = const_cast<unsigned char *>(in);
+    strm.avail_in = n;
+    strm.next_out = out;
+    strm.avail_out = max_out;
+    int ret = Z_OK;
+    while (ret == Z_OK && strm.avail_in > 0) {
+        ret = inflate(&strm, Z_SYNC_FLUSH);
+    }
+    const size_t produced = max_out - strm.avail_out;
+    inflateEnd(&strm);
+    if ((ret != Z_OK) && (ret != Z_STREAM_END)) {
+        QI_EXCEPTION("zlib inflate failed on block");
+    }
+    return produced;
+}
+
+/*
+ * Serial inflate of any gzip file, including multiple members
+ */
+TBytes InflateSerial(const TBytes &in) {
+    TBytes out;
+    TBytes buffer(BlockSize);
+    z_stream strm{};
+    if (inflateInit2(&strm, 16 + 15) != Z_OK) {
+        QI_EXCEPTION("Failed to initialise zlib inflate");
+    }
+    strm.next_in = const_cast<unsigned char *>(in.data());
+    strm.avail_in = in.size();
+    while (strm.avail_in > 0) {
+        strm.next_out = buffer.data();
+        strm.avail_out = buffer.size();
+        const int ret = inflate(&strm, Z_NO_FLUSH);
+        if ((ret != Z_OK) && (ret != Z_STREAM_END)) {
+            inflateEnd(&strm);
+            QI_EXCEPTION("zlib inflate failed");
+        }
+        out.insert(out.end(), buffer.begin(), buffer.end() - strm.avail_out);
+        if (ret == Z_STREAM_END) {
+            inflateReset(&strm); // Concatenated members
+        }
+    }
+    inflateEnd(&strm);
+    return out;
+}
+
+void WriteBytes(const std::string &path, const unsigned char *data, const size_t n) {
+    std::ofstream file(path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(data), n);
+    if (!file) {
+        QI_EXCEPTION("Failed to write file: " << path);
+    }
+}
+
+std::string TempFile(const std::string &suffix, const std::string &dir = "") {
+    const char *tmpdir = getenv("TMPDIR");
+    const std::string base = dir.empty() ? std::string(tmpdir ? tmpdir : "/tmp") : dir;
+    std::string name = base + "/qi_XXXXXX" + suffix;
+    std::vector<char> buffer(name.begin(), name.end());
+    buffer.push_back('\0');
+    const int fd = mkstemps(buffer.data(), suffix.size());
+    if (fd < 0) {
+        QI_EXCEPTION("Failed to create temporary file: " << name);
+    }
+    close(fd);
+    return std::string(buffer.data());
+}
+
+} // End anonymous namespace
+
+void GzipFile(const std::string &in_path, const std::string &out_path, const int threads) {
+    std::ifstream in(in_path, std::ios::binary | std::ios::ate);
+    if (!in) {
+        QI_EXCEPTION("Failed to open file: " << in_path);
+    }
+    const size_t length = static_cast<size_t>(in.tellg());
+    in.seekg(0);
+    const size_t nBlocks = std::max<size_t>(1, (length + BlockSize - 1) / BlockSize);
+
+    // The block sizes are not known until the end, so the index is filled in afterwards
+    TBytes header{0x1f, 0x8b, 8};
+    const bool index = nBlocks <= MaxIndexBlocks;
+    header.push_back(index ? 4 : 0); // FEXTRA
+    Put32(header, 0); // No modification time
+    header.push_back(0); // Extra flags
+    header.push_back(3); // Unix
+    const size_t indexOffset = header.size() + 2 + 2 + 2 + 4;
+    if (index) {
+        Put16(header, 4 + 4 + 4*nBlocks);
+        header.push_back(IndexID[0]);
+        header.push_back(IndexID[1]);
+        Put16(header, 4 + 4*nBlocks);
+        Put32(header, BlockSize);
+        header.resize(header.size() + 4*nBlocks, 0);
+    }
+    std::ofstream file(out_path, std::ios::binary);
+    file.write(reinterpret_cast<const char *>(header.data()), header.size());
+
+    // Only a few blocks per thread are held in memory at once, so large files can be compressed
+    const size_t batch = std::min<size_t>(nBlocks, 4 * std::max(1, threads));
+    TBytes raw(batch * BlockSize);
+    std::vector<TBytes> blocks(batch);
+    std::vector<uLong> crcs(batch);
+    TBytes sizes;
+    uLong crc = crc32(0L, Z_NULL, 0);
+    for (size_t first = 0; first < nBlocks; first += batch) {
+        const size_t nb = std::min(batch, nBlocks - first);
+        const size_t start = first * BlockSize;
+        const size_t bytes = std::min(nb * BlockSize, length - start);
+        in.read(reinterpret_cast<char *>(raw.data()), bytes);
+        if (!in) {
+            QI_EXCEPTION("Failed to read file: " << in_path);
+        }
+        TaskErrors errors;
+        {
+            ThreadPool pool(std::max(1, threads));
+            for (size_t b = 0; b < nb; b++) {
+                pool.enqueue([&, b]{
+                    errors.run([&]{
+                        const size_t n = std::min(BlockSize, bytes - b * BlockSize);
+                        DeflateBlock(raw.data() + b * BlockSize, n, (first + b) == (nBlocks - 1), blocks[b]);
+                        crcs[b] = crc32(crc32(0L, Z_NULL, 0), raw.data() + b * BlockSize, n);
+                    });
+                });
+            }
+        }
+        errors.rethrow();
+        for (size_t b = 0; b < nb; b++) {
+            crc = crc32_combine(crc, crcs[b], std::min(BlockSize, bytes - b * BlockSize));
+            file.write(reinterpret_cast<const char *>(blocks[b].data()), blocks[b].size());
+            Put32(sizes, blocks[b].size());
+        }
+    }
+    TBytes trailer;
+    Put32(trailer, crc);
+    Put32(trailer, length & 0xffffffff);
+    file.write(reinterpret_cast<const char *>(trailer.data()), trailer.size());
+    if (index) {
+        file.seekp(indexOffset);
+        file.write(reinterpret_cast<const char *>(sizes.data()), sizes.size());
+    }
+    if (!file) {
+        QI_EXCEPTION("Failed to write file: " << out_path);
+    }
+}
+
+void GunzipFile(const std::string &in_path, const std::string &out_path, const int threads) {
+    const TBytes in = ReadBytes(in_path);
+    if ((in.size() < 18) || (in[0] != 0x1f) || (in[1] != 0x8b) || (in[2] != 8)) {
+        QI_EXCEPTION("Not a gzip file: " << in_path);
+    }
+    // Look for our block index
+    const unsigned char flags = in[3];
+    std::vector<size_t> sizes;
+    size_t blockSize = 0, pos = 10;
+    if (flags & 4) {
+        const size_t xlen = Get16(&in[pos]);
+        pos += 2;
+        const size_t end = pos + xlen;
+        while (pos + 4 <= end) {
+            const size_t len = Get16(&in[pos + 2]);
+            if ((in[pos] == IndexID[0]) && (in[pos + 1] == IndexID[1]) && (len >= 4) && (pos + 4 + len <= end)) {
+                blockSize = Get32(&in[pos + 4]);
+                for (size_t i = 8; i + 4 <= 4 + len; i += 4) {
+                    sizes.push_back(Get32(&in[pos + i]));
+                }
+            }
+            pos += 4 + len;
+        }
+        pos = end;
+    }
+    if (flags & 8) { while (pos < in.size() && in[pos++] != 0); } // FNAME
+    if (flags & 16) { while (pos < in.size() && in[pos++] != 0); } // FCOMMENT
+    if (flags & 2) { pos += 2; } // FHCRC
+
+    size_t total = pos + 8;
+    for (const auto &s : sizes) total += s;
+    if (sizes.empty() || (blockSize == 0) || (total != in.size())) {
+        // Not written by GzipFile(), or has extra members
+        const TBytes out = InflateSerial(in);
+        WriteBytes(out_path, out.data(), out.size());
+        return;
+    }
+
+    const size_t nBlocks = sizes.size();
+    TBytes out(nBlocks * blockSize);
+    std::vector<size_t> produced(nBlocks);
+    std::vector<uLong> crcs(nBlocks);
+    TaskErrors errors;
+    {
+        ThreadPool pool(std::max(1, threads));
+        size_t offset = pos;
+        for (size_t b = 0; b < nBlocks; b++) {
+            pool.enqueue([&, b, offset]{
+                errors.run([&]{
+                    produced[b] = InflateBlock(in.data() + offset, sizes[b], out.data() + b*blockSize, blockSize);
+                    crcs[b] = crc32(crc32(0L, Z_NULL, 0), out.data() + b*blockSize, produced[b]);
+                });
+            });
+            offset += sizes[b];
+        }
+    }
+    errors.rethrow();
+    uLong crc = crcs[0];
+    for (size_t b = 1; b < nBlocks; b++) {
+        if (produced[b - 1] != blockSize) {
+            QI_EXCEPTION("Corrupt block index in file: " << in_path);
+        }
+        crc = crc32_combine(crc, crcs[b], produced[b]);
+    }
+    const size_t length = (nBlocks - 1) * blockSize + produced.back();
+    const unsigned char *trailer = &in[in.size() - 8];
+    if ((Get32(trailer) != crc) || (Get32(trailer + 4) != (length & 0xffffffff))) {
+        QI_EXCEPTION("CRC or length mismatch in file: " << in_path);
+    }
+    WriteBytes(out_path, out.data(), length);
+}
+
+bool UseParallelGzip(const std::string &path) {
+    const std::string ext = ".nii.gz";
+    return (GzipThreads() > 1) &&
+           (path.size() > ext.size()) &&
+           (path.compare(path.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+bool IsGzipped(const std::string &path) {
+    const std::string ext = ".gz";
+    return (path.size() > ext.size()) && (path.compare(path.size() - ext.size(), ext.size(), ext) == 0);
+}
+
+GzipReadProxy::GzipReadProxy(const std::string &path) :
+    m_path(path)
+{
+    if (UseParallelGzip(path)) {
+        m_temp = TempFile(".nii");
+        GunzipFile(m_path, m_temp, GzipThreads());
+    }
+}
+
+GzipReadProxy::~GzipReadProxy() {
+    if (!m_temp.empty()) {
+        std::remove(m_temp.c_str());
+    }
+}
+
+const std::string &GzipReadProxy::path() const {
+    return m_temp.empty() ? m_path : m_temp;
+}
+
+GzipWriteProxy::GzipWriteProxy(const std::string &path, const bool always) :
+    m_path(path), m_replace(false)
+{
+    const std::string ext = ".nii.gz";
+    const bool gz = (path.size() > ext.size()) && (path.compare(path.size() - ext.size(), ext.size(), ext) == 0);
+    if (UseParallelGzip(path) || (always && gz)) {
+        m_temp = TempFile(".nii");
+    } else if (MappedNifti::IsMapped(path)) {
+        // Write next to the original and rename over it, the mapping keeps the old file alive
+        const size_t slash = path.find_last_of('/');
+        m_temp = TempFile(".nii", (slash == std::string::npos) ? "." : path.substr(0, std::max<size_t>(slash, 1)));
+        m_replace = true;
+    }
+}
+
+GzipWriteProxy::~GzipWriteProxy() {
+    if (!m_temp.empty()) {
+        std::remove(m_temp.c_str());
+    }
+}
+
+const std::string &GzipWriteProxy::path() const {
+    return m_temp.empty() ? m_path : m_temp;
+}
+
+void GzipWriteProxy::commit() {
+    if (m_replace) {
+        struct stat info;
+        if (stat(m_path.c_str(), &info) == 0) {
+            chmod(m_temp.c_str(), info.st_mode & 07777); // mkstemps() creates files readable only by the owner
+        }
+        if (std::rename(m_temp.c_str(), m_path.c_str()) != 0) {
+            QI_EXCEPTION("Failed to replace file: " << m_path);
+        }
+        m_temp.clear();
+    } else if (!m_temp.empty()) {
+        GzipFile(m_temp, m_path, GzipThreads());
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,73 @@
+/*
+ *  ParallelGzip.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PARALLELGZIP_H
+#define QI_PARALLELGZIP_H
+
+#include <string>
+
+namespace QI {
+
+/*
+ * Multi-threaded gzip in the style of pigz. The input is split into fixed-size blocks which are
+ * deflated independently and joined with sync-flushes, so the result is a single standard gzip
+ * member. The compressed block sizes are stored in a gzip extra field (ignored by other readers)
+ * so that GunzipFile() can also inflate the blocks in parallel. Files without the index are
+ * decompressed serially. GzipFile() reads a few blocks per thread at a time, so memory use does
+ * not depend on the file size.
+ */
+void GzipFile(const std::string &in_path, const std::string &out_path, const int threads);
+void GunzipFile(const std::string &in_path, const std::string &out_path, const int threads);
+
+bool UseParallelGzip(const std::string &path); //!< True for .nii.gz files if QI::GzipThreads() > 1
+
+/*
+ * True for .gz files. Each partial read or write of these restarts the gzip stream from the
+ * beginning, so they must be read and written in one piece, not in chunks.
+ */
+bool IsGzipped(const std::string &path);
+
+/*
+ * For reading. If parallel gzip should be used for path, decompress it to a temporary .nii file
+ * and return that from path(), otherwise path() returns the original path. The temporary file is
+ * removed on destruction.
+ */
+class GzipReadProxy {
+protected:
+    std::string m_path, m_temp;
+public:
+    GzipReadProxy(const std::string &path);
+    ~GzipReadProxy();
+    const std::string &path() const;
+};
+
+/*
+ * For writing. If parallel gzip should be used for path, or always is true and path is a .nii.gz
+ * file, path() returns a temporary .nii file to write to, and commit() compresses it to the
+ * original path. The temporary file is removed on destruction, so if writing fails then nothing is
+ * left behind. If path is memory-mapped by an image that is still in use (see MappedNifti), the
+ * temporary file is created in the same directory and commit() renames it over path, so that the
+ * mapped pages are not truncated while they are being written out.
+ */
+class GzipWriteProxy {
+protected:
+    std::string m_path, m_temp;
+    bool m_replace;
+public:
+    GzipWriteProxy(const std::string &path, const bool always = false);
+    ~GzipWriteProxy();
+    const std::string &path() const;
+    void commit();
+};
+
+} // End namespace QI
+
+#endif // QI_PARALLELGZIP_H
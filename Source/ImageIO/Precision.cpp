@@ -0,0 +1,71 @@
+/*
+ *  Precision.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cmath>
+#include <fstream>
+#include <algorithm>
+
+#include "Precision.h"
+#include "Util.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+bool EndsWith(const std::string &s, const std::string &suffix) {
+    return (s.size() >= suffix.size()) && (s.compare(s.size() - suffix.size(), suffix.size(), suffix) == 0);
+}
+
+const int16_t Int16Max = 32767;
+const int32_t HeaderSize = 348;
+const size_t SlopeOffset = 112;
+
+int16_t Clamp(const float q) {
+    return static_cast<int16_t>(std::max(-static_cast<float>(Int16Max), std::min(static_cast<float>(Int16Max), q)));
+}
+
+} // End anonymous namespace
+
+bool UseInt16(const std::string &path) {
+    return (OutPrecision() == Precision::Int16) && (EndsWith(path, ".nii") || EndsWith(path, ".nii.gz"));
+}
+
+Int16Scale::Int16Scale(const float lo, const float hi) {
+    m_inter = 0.5f * (lo + hi);
+    // A slope of 0 means no scaling in NIfTI, so constant images get a slope of 1
+    m_slope = (hi > lo) ? (hi - lo) / (2.f * Int16Max) : 1.f;
+    m_zero = Clamp(std::round(-m_inter / m_slope));
+}
+
+int16_t Int16Scale::operator()(const float x) const {
+    if (!std::isfinite(x)) {
+        return m_zero; // Integer 0 would read back as the middle of the range
+    }
+    return Clamp(std::round((x - m_inter) / m_slope));
+}
+
+void SetNiftiScaling(const std::string &path, const float slope, const float inter) {
+    std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+    int32_t size = 0;
+    file.read(reinterpret_cast<char *>(&size), sizeof(size));
+    if (!file || (size != HeaderSize)) {
+        QI_EXCEPTION("Could not set scaling, not a NIfTI-1 file: " << path);
+    }
+    const float scaling[2]{slope, inter};
+    file.seekp(SlopeOffset);
+    file.write(reinterpret_cast<const char *>(scaling), sizeof(scaling));
+    if (!file) {
+        QI_EXCEPTION("Failed to write scaling to file: " << path);
+    }
+}
+
+} // End namespace QI
@@ -0,0 +1,45 @@
+/*
+ *  Precision.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PRECISION_H
+#define QI_PRECISION_H
+
+#include <string>
+#include <cstdint>
+
+namespace QI {
+
+bool UseInt16(const std::string &path); //!< True if QI::OutPrecision() is Int16 and path is a NIfTI file
+
+/*
+ * Maps the range [lo, hi] linearly onto [-32767, 32767]. Values outside the range are clamped
+ * and non-finite values are stored as the integer closest to 0. This is only exactly 0 if the
+ * range contains 0, so WriteInt16() widens the range to include 0 if there are such values.
+ */
+class Int16Scale {
+protected:
+    float m_slope, m_inter;
+    int16_t m_zero;
+public:
+    Int16Scale(const float lo, const float hi);
+    float slope() const { return m_slope; }
+    float inter() const { return m_inter; }
+    int16_t operator()(const float x) const;
+};
+
+/*
+ * Set scl_slope and scl_inter in the header of an uncompressed NIfTI-1 file
+ */
+void SetNiftiScaling(const std::string &path, const float slope, const float inter);
+
+} // End namespace QI
+
+#endif // QI_PRECISION_H
@@ -0,0 +1,224 @@
+/*
+ *  StreamWrite.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_STREAMWRITE_H
+#define QI_STREAMWRITE_H
+
+#include <string>
+#include <future>
+#include <vector>
+#include <limits>
+#include <cmath>
+#include <algorithm>
+
+#include "itkImageIOFactory.h"
+#include "ParallelGzip.h"
+#include "ChunkedImageIO.h"
+#include "Precision.h"
+#include "Macro.h"
+
+namespace QI {
+
+/*
+ * Slabs are written to disk in chunks of roughly this many bytes when the ImageIO can stream
+ */
+const size_t WriteChunkBytes = 64 << 20;
+
+/*
+ * True if the whole of img is in memory in one buffer starting at index 0, so that it can be
+ * written directly from the buffer
+ */
+template<typename TImg>
+bool IsSimpleBuffer(const TImg *img) {
+    const auto region = img->GetLargestPossibleRegion();
+    return (img->GetBufferedRegion() == region) && (region.GetIndex() == typename TImg::IndexType());
+}
+
+/*
+ * Bring img up to date, then return a new image sharing its buffer but not its pipeline, so that
+ * deferred writes do not update the same upstream filter from several threads
+ */
+template<typename TImg>
+typename TImg::ConstPointer Detach(const TImg *img) {
+    const_cast<TImg *>(img)->Update(); // As itk::ImageFileWriter does
+    typename TImg::Pointer copy = TImg::New();
+    copy->Graft(img);
+    copy->SetMetaDataDictionary(img->GetMetaDataDictionary());
+    return copy.GetPointer();
+}
+
+/*
+ * Create an ImageIO for path with the geometry of img and pixel type TOut. If nVols is greater than
+ * 0 an extra dimension with that many volumes is added, for writing VectorImages as series.
+ */
+template<typename TOut, typename TImg>
+itk::ImageIOBase::Pointer CreateWriteIO(const TImg *img, const std::string &path, const size_t nVols) {
+    RegisterChunkedIO();
+    itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(path.c_str(), itk::ImageIOFactory::WriteMode);
+    if (!io) {
+        QI_EXCEPTION("Could not create an ImageIO to write file: " << path);
+    }
+    const unsigned int D = TImg::ImageDimension;
+    const unsigned int nDims = (nVols > 0) ? D + 1 : D;
+    const auto region = img->GetLargestPossibleRegion();
+    io->SetFileName(path);
+    io->SetNumberOfDimensions(nDims);
+    io->SetPixelTypeInfo(static_cast<const TOut *>(nullptr));
+    for (unsigned int i = 0; i < nDims; i++) {
+        std::vector<double> axis(nDims, 0.);
+        if (i < D) {
+            io->SetDimensions(i, region.GetSize()[i]);
+            io->SetSpacing(i, img->GetSpacing()[i]);
+            io->SetOrigin(i, img->GetOrigin()[i]);
+            for (unsigned int j = 0; j < D; j++) {
+                axis[j] = img->GetDirection()[j][i];
+            }
+        } else {
+            io->SetDimensions(i, nVols);
+            io->SetSpacing(i, 1.);
+            io->SetOrigin(i, 1.); // Matches VectorToImageFilter
+            axis[i] = 1.;
+        }
+        io->SetDirection(i, axis);
+    }
+    io->SetMetaDataDictionary(img->GetMetaDataDictionary());
+    return io;
+}
+
+/*
+ * Write the data in slabs along the last dimension. fill(buffer, start, n) must write planes
+ * [start, start + n) into buffer, where a plane is everything except the last dimension, i.e. a
+ * slice for 3D files and a volume for 4D. The next slab is filled on a background task while the
+ * current slab is written. If the ImageIO cannot stream, or the file is gzipped, then all planes
+ * are filled and written in one go.
+ */
+template<typename TOut, typename TFill>
+void StreamWrite(itk::ImageIOBase *io, const TFill &fill) {
+    const unsigned int last = io->GetNumberOfDimensions() - 1;
+    const size_t nPlanes = io->GetDimensions(last);
+    size_t planeSize = 1;
+    itk::ImageIORegion ioRegion(io->GetNumberOfDimensions());
+    for (unsigned int i = 0; i < io->GetNumberOfDimensions(); i++) {
+        ioRegion.SetIndex(i, 0);
+        ioRegion.SetSize(i, io->GetDimensions(i));
+        if (i < last) {
+            planeSize *= io->GetDimensions(i);
+        }
+    }
+    const bool stream = io->CanStreamWrite() && !IsGzipped(io->GetFileName());
+    const size_t chunk = stream ? std::max<size_t>(1, WriteChunkBytes / (planeSize * sizeof(TOut))) : nPlanes;
+    std::vector<TOut> slab(std::min(chunk, nPlanes) * planeSize), next;
+    if (chunk < nPlanes) {
+        next.resize(slab.size());
+    }
+    auto fillSlab = [&](std::vector<TOut> &buffer, const size_t start) {
+        fill(buffer.data(), start, std::min(chunk, nPlanes - start));
+    };
+    fillSlab(slab, 0);
+    for (size_t p = 0; p < nPlanes; p += chunk) {
+        std::future<void> pending;
+        if ((p + chunk) < nPlanes) {
+            pending = std::async(std::launch::async, fillSlab, std::ref(next), p + chunk);
+        }
+        ioRegion.SetIndex(last, p);
+        ioRegion.SetSize(last, std::min(chunk, nPlanes - p));
+        io->SetIORegion(ioRegion);
+        io->Write(slab.data());
+        if (pending.valid()) {
+            pending.get();
+        }
+        std::swap(slab, next);
+    }
+}
+
+/*
+ * Write an image with the geometry of img and nVols as for CreateWriteIO(), with the values
+ * produced by fill() as for StreamWrite()
+ */
+template<typename TOut, typename TImg, typename TFill>
+void WriteAs(const TImg *img, const size_t nVols, const std::string &path, const TFill &fill) {
+    GzipWriteProxy proxy(path);
+    auto io = CreateWriteIO<TOut>(img, proxy.path(), nVols);
+    StreamWrite<TOut>(io, fill);
+    proxy.commit();
+}
+
+/*
+ * As WriteAs(), but the float values from fill() are stored as int16 with NIfTI scaling. This
+ * needs an extra pass over the data to find the range, and the header is changed before the file
+ * is compressed.
+ */
+template<typename TImg, typename TFill>
+void WriteInt16(const TImg *img, const size_t nVols, const std::string &path, const TFill &fill) {
+    GzipWriteProxy proxy(path, true);
+    auto io = CreateWriteIO<int16_t>(img, proxy.path(), nVols);
+    const size_t nPlanes = io->GetDimensions(io->GetNumberOfDimensions() - 1);
+    const size_t planeSize = img->GetLargestPossibleRegion().GetNumberOfPixels() / ((nVols > 0) ? 1 : nPlanes);
+    const size_t chunk = std::max<size_t>(1, WriteChunkBytes / (planeSize * sizeof(float)));
+    std::vector<float> values(std::min(chunk, nPlanes) * planeSize);
+    float lo = std::numeric_limits<float>::infinity(), hi = -lo;
+    bool nonFinite = false;
+    for (size_t p = 0; p < nPlanes; p += chunk) {
+        const size_t n = std::min(chunk, nPlanes - p);
+        fill(values.data(), p, n);
+        for (size_t i = 0; i < n * planeSize; i++) {
+            if (std::isfinite(values[i])) {
+                lo = std::min(lo, values[i]);
+                hi = std::max(hi, values[i]);
+            } else {
+                nonFinite = true;
+            }
+        }
+    }
+    if (lo > hi) {
+        lo = hi = 0.f; // No finite values
+    } else if (nonFinite) {
+        // Non-finite values are stored as 0, so it must be in the range
+        lo = std::min(lo, 0.f);
+        hi = std::max(hi, 0.f);
+    }
+    const Int16Scale scale(lo, hi);
+    StreamWrite<int16_t>(io, [&](int16_t *dst, const size_t start, const size_t n) {
+        std::vector<float> slab(n * planeSize);
+        fill(slab.data(), start, n);
+        std::transform(slab.begin(), slab.end(), dst, scale);
+    });
+    io = nullptr;
+    SetNiftiScaling(proxy.path(), scale.slope(), scale.inter());
+    proxy.commit();
+}
+
+template<typename TOut, typename TImg, typename TFill>
+void SelectWrite(const TImg *img, const size_t nVols, const std::string &path, const TFill &fill, const TOut *) {
+    WriteAs<TOut>(img, nVols, path, fill);
+}
+
+template<typename TImg, typename TFill>
+void SelectWrite(const TImg *img, const size_t nVols, const std::string &path, const TFill &fill, const float *) {
+    if (UseInt16(path)) {
+        WriteInt16(img, nVols, path, fill);
+    } else {
+        WriteAs<float>(img, nVols, path, fill);
+    }
+}
+
+/*
+ * Write TOut values as WriteAs(), except that float data goes through WriteInt16() if the output
+ * precision asks for it
+ */
+template<typename TOut, typename TImg, typename TFill>
+void WritePlanes(const TImg *img, const size_t nVols, const std::string &path, const TFill &fill) {
+    SelectWrite(img, nVols, path, fill, static_cast<const TOut *>(nullptr));
+}
+
+} // End namespace QI
+
+#endif // QI_STREAMWRITE_H
@@ -12,19 +12,100 @@
 #ifndef QUIT_IMAGEIO_H
 
 #include <string>
+#include <complex>
+#include <type_traits>
+#include "itkImageIOFactory.h"
 #include "ImageToVectorFilter.h"
 #include "ImageIO.h"
+#include "Interleave.h"
+#include "ParallelGzip.h"
+#include "ChunkedImageIO.h"
+#include "MemoryImages.h"
 #include "Macro.h"
 
 namespace QI {
 
+namespace {
+
+/*
+ * Volumes are read from disk in chunks of roughly this many bytes when the ImageIO can stream and
+ * the file is not gzipped (files decompressed by GzipReadProxy are read in chunks)
+ */
+const size_t ReadChunkBytes = 64 << 20;
+
+/*
+ * Reads the voxels in volume, a region over the first three dimensions, for all nVols volumes
+ */
+template<typename TFile, typename TPixel>
+void ReadInterleaved(itk::ImageIOBase *io, const itk::ImageIORegion &volume, TPixel *buffer, const size_t nVols) {
+    const size_t nVox = volume.GetNumberOfPixels();
+    const bool stream = io->CanStreamRead() && !IsGzipped(io->GetFileName());
+    const size_t chunk = stream ? std::max<size_t>(1, ReadChunkBytes / (nVox * sizeof(TFile))) : nVols;
+    std::vector<TFile> raw(std::min(chunk, nVols) * nVox);
+    itk::ImageIORegion region(io->GetNumberOfDimensions());
+    for (unsigned int d = 0; d < io->GetNumberOfDimensions(); d++) {
+        region.SetIndex(d, (d < 3) ? volume.GetIndex(d) : 0);
+        region.SetSize(d, (d < 3) ? volume.GetSize(d) : io->GetDimensions(d));
+    }
+    for (size_t v = 0; v < nVols; v += chunk) {
+        const size_t n = std::min(chunk, nVols - v);
+        if (io->GetNumberOfDimensions() > 3) {
+            region.SetIndex(3, v);
+            region.SetSize(3, n);
+        }
+        io->SetIORegion(region);
+        io->Read(raw.data());
+        Interleave(raw.data(), buffer, nVox, nVols, v, n);
+    }
+}
+
+/*
+ * Dispatch on the component type in the file. Returns false for combinations that the direct
+ * reader does not handle, e.g. multi-component or integer complex data.
+ */
 template<typename TPixel>
-auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+bool ReadDirect(itk::ImageIOBase *io, const itk::ImageIORegion &vol, TPixel *buffer, const size_t nVols, std::false_type) {
+    if ((io->GetPixelType() != itk::ImageIOBase::SCALAR) || (io->GetNumberOfComponents() != 1)) {
+        return false;
+    }
+    switch (io->GetComponentType()) {
+        case itk::ImageIOBase::UCHAR:  ReadInterleaved<unsigned char>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::CHAR:   ReadInterleaved<char>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::USHORT: ReadInterleaved<unsigned short>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::SHORT:  ReadInterleaved<short>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::UINT:   ReadInterleaved<unsigned int>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::INT:    ReadInterleaved<int>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::ULONG:  ReadInterleaved<unsigned long>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::LONG:   ReadInterleaved<long>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::FLOAT:  ReadInterleaved<float>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::DOUBLE: ReadInterleaved<double>(io, vol, buffer, nVols); break;
+        default: return false;
+    }
+    return true;
+}
+
+template<typename TPixel>
+bool ReadDirect(itk::ImageIOBase *io, const itk::ImageIORegion &vol, TPixel *buffer, const size_t nVols, std::true_type) {
+    if ((io->GetPixelType() != itk::ImageIOBase::COMPLEX) || (io->GetNumberOfComponents() != 2)) {
+        return false;
+    }
+    switch (io->GetComponentType()) {
+        case itk::ImageIOBase::FLOAT:  ReadInterleaved<std::complex<float>>(io, vol, buffer, nVols); break;
+        case itk::ImageIOBase::DOUBLE: ReadInterleaved<std::complex<double>>(io, vol, buffer, nVols); break;
+        default: return false;
+    }
+    return true;
+}
+
+template<typename T> struct IsComplex : std::false_type {};
+template<typename T> struct IsComplex<std::complex<T>> : std::true_type {};
+
+template<typename TPixel>
+auto SeriesToVector(const itk::Image<TPixel, 4> *img) -> typename itk::VectorImage<TPixel, 3>::Pointer {
     typedef itk::Image<TPixel, 4> TSeries;
     typedef itk::VectorImage<TPixel, 3> TVector;
     typedef itk::ImageToVectorFilter<TSeries> TToVector;
-    
-    auto img = ReadImage<TSeries>(path);
+
     auto convert = TToVector::New();
     convert->SetInput(img);
     convert->Update();
@@ -33,8 +114,106 @@ auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixe
     return vols;
 }
 
+/*
+ * Previous implementation, which reads the whole series and then splits and composes it. Used
+ * for any file that the direct reader cannot handle.
+ */
+template<typename TPixel>
+auto ReadVectorImageViaSeries(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    auto img = ReadImage<itk::Image<TPixel, 4>>(path);
+    return SeriesToVector<TPixel>(img);
+}
+
+/*
+ * Allocates the VectorImage once and fills it directly from the file, one chunk of volumes at a
+ * time, with a blocked multi-threaded transpose from volume-major to pixel-interleaved order. If
+ * subregion is not null then only that part of the image is buffered.
+ */
+template<typename TPixel>
+auto ReadVector(const std::string &path, const QI::VolumeF::RegionType *subregion) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    typedef itk::VectorImage<TPixel, 3> TVector;
+    if (auto stored = StoredImage(path)) {
+        typename TVector::Pointer img = ShareImage<TVector>(stored);
+        if (!img) {
+            auto series = ShareImage<itk::Image<TPixel, 4>>(stored);
+            if (series) {
+                return SeriesToVector<TPixel>(series);
+            }
+            QI_EXCEPTION("Image in memory has the wrong type for: " << path);
+        }
+        return img;
+    }
+    RegisterChunkedIO();
+    GzipReadProxy proxy(path);
+    itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO(proxy.path().c_str(), itk::ImageIOFactory::ReadMode);
+    if (!io) {
+        QI_EXCEPTION("Failed to read file: " << path);
+    }
+    io->SetFileName(proxy.path());
+    io->ReadImageInformation();
+    const unsigned int nDims = io->GetNumberOfDimensions();
+    if ((nDims < 3) || (nDims > 4)) {
+        return ReadVectorImageViaSeries<TPixel>(proxy.path());
+    }
+
+    typename TVector::Pointer img = TVector::New();
+    typename TVector::RegionType region;
+    typename TVector::SpacingType spacing;
+    typename TVector::PointType origin;
+    typename TVector::DirectionType direction;
+    for (unsigned int i = 0; i < 3; i++) {
+        region.GetModifiableSize()[i] = io->GetDimensions(i);
+        spacing[i] = io->GetSpacing(i);
+        origin[i] = io->GetOrigin(i);
+        const std::vector<double> axis = io->GetDirection(i);
+        for (unsigned int j = 0; j < 3; j++) {
+            direction[j][i] = axis[j];
+        }
+    }
+    typename TVector::RegionType buffered = region;
+    if (subregion) {
+        if (!region.IsInside(*subregion)) {
+            QI_EXCEPTION("Region " << *subregion << " is not inside file: " << path);
+        }
+        buffered = *subregion;
+    }
+    itk::ImageIORegion volume(3);
+    for (unsigned int i = 0; i < 3; i++) {
+        volume.SetIndex(i, buffered.GetIndex()[i]);
+        volume.SetSize(i, buffered.GetSize()[i]);
+    }
+    const size_t nVols = (nDims == 4) ? io->GetDimensions(3) : 1;
+    img->SetLargestPossibleRegion(region);
+    img->SetBufferedRegion(buffered);
+    img->SetRequestedRegion(buffered);
+    img->SetSpacing(spacing);
+    img->SetOrigin(origin);
+    img->SetDirection(direction);
+    img->SetNumberOfComponentsPerPixel(nVols);
+    img->Allocate();
+    if (!ReadDirect(io.GetPointer(), volume, img->GetBufferPointer(), nVols, IsComplex<TPixel>())) {
+        img = nullptr; // Release the buffer before falling back
+        return ReadVectorImageViaSeries<TPixel>(proxy.path());
+    }
+    return img;
+}
+
+} // End anonymous namespace
+
+template<typename TPixel>
+auto ReadVectorImage(const std::string &path) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    return ReadVector<TPixel>(path, nullptr);
+}
+
+template<typename TPixel>
+auto ReadVectorImage(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<TPixel, 3>::Pointer {
+    return ReadVector<TPixel>(path, (region.GetNumberOfPixels() > 0) ? &region : nullptr);
+}
+
 template auto ReadVectorImage<float>(const std::string &path) -> typename itk::VectorImage<float, 3>::Pointer;
 template auto ReadVectorImage<std::complex<float>>(const std::string &path) -> typename itk::VectorImage<std::complex<float>, 3>::Pointer;
+template auto ReadVectorImage<float>(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<float, 3>::Pointer;
+template auto ReadVectorImage<std::complex<float>>(const std::string &path, const QI::VolumeF::RegionType &region) -> typename itk::VectorImage<std::complex<float>, 3>::Pointer;
 
 } // End namespace QUIT
 
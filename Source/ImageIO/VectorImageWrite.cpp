@@ -10,7 +10,9 @@
  */
 
 #include <string>
+#include <limits>
 
+#include "itkImageIOFactory.h"
 #include "itkImageFileWriter.h"
 #include "itkComplexToModulusImageFilter.h"
 #include "itkDivideImageFilter.h"
@@ -18,39 +20,93 @@
 #include "VectorToImageFilter.h"
 
 #include "ImageIO.h"
+#include "Interleave.h"
+#include "ParallelGzip.h"
+#include "StreamWrite.h"
+#include "MemoryImages.h"
 #include "Macro.h"
 
 namespace QI {
 
+namespace {
+
+/*
+ * Writes a VectorImage as a 4D series without building the series in memory. Each slab of volumes
+ * is transposed out of the interleaved buffer while the previous slab is being written.
+ * Returns false if the image is not a simple fully-buffered image, for which the caller should
+ * fall back to the filter-based path.
+ */
+template<typename TOut, typename TVImg, typename TFunc>
+bool WriteDirect(const TVImg *img, const std::string &path, const TFunc &f) {
+    if (!IsSimpleBuffer(img)) {
+        return false;
+    }
+    const size_t nVox = img->GetLargestPossibleRegion().GetNumberOfPixels();
+    const size_t nVols = img->GetNumberOfComponentsPerPixel();
+    const auto *src = img->GetBufferPointer();
+    WritePlanes<TOut>(img, nVols, path, [&](TOut *dst, const size_t start, const size_t n) {
+        Deinterleave(src, dst, nVox, nVols, start, n, f);
+    });
+    return true;
+}
+
 template<typename TVImg>
-void WriteVectorImage(const TVImg *img, const std::string &path) {
+void WriteVectorNow(const TVImg *img, const std::string &path) {
     using TToSeries = itk::VectorToImageFilter<TVImg>;
-
+    typedef typename TVImg::InternalPixelType TPixel;
+    if (WriteDirect<TPixel>(img, path, [](const TPixel &x, const size_t) { return x; })) {
+        return;
+    }
     typename TToSeries::Pointer convert = TToSeries::New();
     convert->SetInput(img);
     convert->Update();
     WriteImage(convert->GetOutput(), path);
 }
 
+} // End anonymous namespace
+
+template<typename TVImg>
+void WriteVectorImage(const TVImg *ptr, const std::string &path) {
+    typename TVImg::ConstPointer img = Detach(ptr);
+    StoreImage(path, img);
+    if (WriteToDisk(path)) {
+        DeferWrite([img, path]{ WriteVectorNow<TVImg>(img, path); });
+    }
+}
+
 template<typename TVImg>
 void WriteVectorImage(const itk::SmartPointer<TVImg> &ptr, const std::string &path) {
     WriteVectorImage(ptr.GetPointer(), path);
 }
 
 template<typename TVImg>
-void WriteVectorMagnitudeImage(const TVImg *img, const std::string &path) {
-    typedef itk::VectorToImageFilter<TVImg> TToSeries;
-    auto convert = TToSeries::New();
-    convert->SetInput(img);
-
+void WriteVectorMagnitudeImage(const TVImg *ptr, const std::string &path) {
     typedef typename TVImg::InternalPixelType TPixel;
     typedef typename TPixel::value_type TReal;
-    typedef itk::Image<TPixel, 4> TSeries;
-    typedef itk::Image<TReal, 4> TRealSeries;
-    auto mag = itk::ComplexToModulusImageFilter<TSeries, TRealSeries>::New();
-    mag->SetInput(convert->GetOutput());
-    mag->Update();
-    WriteImage<TRealSeries>(mag->GetOutput(), path);
+    typename TVImg::ConstPointer img = Detach(ptr);
+    auto writeSeries = [img, path]{
+        typedef itk::VectorToImageFilter<TVImg> TToSeries;
+        auto convert = TToSeries::New();
+        convert->SetInput(img);
+
+        typedef itk::Image<TPixel, 4> TSeries;
+        typedef itk::Image<TReal, 4> TRealSeries;
+        auto mag = itk::ComplexToModulusImageFilter<TSeries, TRealSeries>::New();
+        mag->SetInput(convert->GetOutput());
+        mag->Update();
+        WriteImage<TRealSeries>(mag->GetOutput(), path);
+    };
+    if (KeepingImages()) {
+        // Later programs read the magnitude back from memory, so calculate it now
+        writeSeries();
+        return;
+    }
+    DeferWrite([img, path, writeSeries]{
+        if (WriteDirect<TReal>(img.GetPointer(), path, [](const TPixel &x, const size_t) { return std::abs(x); })) {
+            return;
+        }
+        writeSeries();
+    });
 }
 
 template<typename TVImg>
@@ -58,13 +114,41 @@ void WriteVectorMagnitudeImage(const itk::SmartPointer<TVImg> &ptr, const std::s
     WriteVectorMagnitudeImage(ptr.GetPointer(), path);
 }
 
+/*
+ * The division is done while the volumes are transposed for writing, with division by zero giving
+ * the maximum value as in itk::DivideImageFilter
+ */
 template<typename TVImg>
-void WriteScaledVectorImage(const TVImg *img, const QI::VolumeF *simg, const std::string &path) {
-    auto scaleFilter = itk::DivideImageFilter<TVImg, QI::VolumeF, TVImg>::New();
-    scaleFilter->SetInput1(img);
-    scaleFilter->SetInput2(simg);
-    scaleFilter->Update();
-    WriteVectorImage(scaleFilter->GetOutput(), path);
+void WriteScaledVectorImage(const TVImg *ptr, const QI::VolumeF *sptr, const std::string &path) {
+    typedef typename TVImg::InternalPixelType TPixel;
+    if (KeepingImages()) {
+        // As above, the stored image has to be the scaled one
+        auto scaleFilter = itk::DivideImageFilter<TVImg, QI::VolumeF, TVImg>::New();
+        scaleFilter->SetInput1(ptr);
+        scaleFilter->SetInput2(sptr);
+        scaleFilter->Update();
+        WriteVectorImage<TVImg>(scaleFilter->GetOutput(), path);
+        return;
+    }
+    typename TVImg::ConstPointer img = Detach(ptr);
+    QI::VolumeF::ConstPointer simg = Detach(sptr);
+    DeferWrite([img, simg, path]{
+        if (IsSimpleBuffer(simg.GetPointer()) &&
+            (img->GetLargestPossibleRegion() == simg->GetLargestPossibleRegion())) {
+            const float *scale = simg->GetBufferPointer();
+            auto divide = [scale](const TPixel &x, const size_t v) {
+                return (scale[v] != 0.f) ? static_cast<TPixel>(x / scale[v]) : std::numeric_limits<TPixel>::max();
+            };
+            if (WriteDirect<TPixel>(img.GetPointer(), path, divide)) {
+                return;
+            }
+        }
+        auto scaleFilter = itk::DivideImageFilter<TVImg, QI::VolumeF, TVImg>::New();
+        scaleFilter->SetInput1(img);
+        scaleFilter->SetInput2(simg);
+        scaleFilter->Update();
+        WriteVectorNow<TVImg>(scaleFilter->GetOutput(), path);
+    });
 }
 
 template<typename TVImg>
@@ -15,6 +15,7 @@
 #include "ApplyTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 
 class DMTR : public QI::ApplyF::Algorithm {
@@ -57,35 +58,49 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> out_prefix(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
-    if (verbose) std::cout << "Opening MT file " << QI::CheckPos(input_file) << std::endl;
-    auto volumes = QI::ReadVectorImage(QI::CheckPos(input_file));
     auto algo = std::make_shared<DMTR>();
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetInput(0, volumes);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-    }
-    std::string outPrefix = out_prefix.Get() + "DMT_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
-        QI::WriteImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
-    }
+    struct DMTInputs {
+        QI::VectorVolumeF::Pointer volumes;
+        QI::VolumeF::Pointer mask;
+    };
+    QI::RunBatch<DMTInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            DMTInputs in;
+            if (verbose) std::cout << "Opening MT file " << subject.path(QI::CheckPos(input_file)) << std::endl;
+            in.volumes = QI::ReadVectorImage(subject.path(QI::CheckPos(input_file)));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](DMTInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetInput(0, in.volumes);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+            }
+            const std::string outPrefix = subject.path(out_prefix.Get()) + "DMT_";
+            return [apply, algo, outPrefix, &verbose]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
+                    QI::WriteImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
-
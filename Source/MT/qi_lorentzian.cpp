@@ -16,43 +16,190 @@
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "IO.h"
 #include "ApplyTypes.h"
 #include "EigenCereal.h"
+#include "LevMar.h"
 
-Eigen::ArrayXd Lorentzian(const double f0, const double fwhm, const double A, const Eigen::ArrayXd &f) {
-    Eigen::ArrayXd x = (f0 - f) / (fwhm/2);
-    Eigen::ArrayXd s = A / (1. + x.square());
-    return s;
-}
+/*
+ * Lorentzian pools. Water is the reference pool, the centre frequency of every other pool is
+ * fitted as an offset from water so that B0 shifts move the whole spectrum together.
+ */
+struct LorentzPool {
+    const char *name;
+    double f0, f0lo, f0hi, w, wlo, whi, A, Alo, Ahi;
+};
+
+const LorentzPool Pools[] = {
+    // Name     f0    lo    hi     w     lo     hi     A      lo    hi
+    {"",        0.0, -2.0,  2.0,   2.0,  0.001, 100.0, 0.9,   0.1,  1.0},
+    {"MT_",    -1.0, -3.0,  0.0,  40.0, 10.0,   100.0, 0.1,   0.0,  1.0},
+    {"amide_",  3.5,  3.0,  4.0,   2.0,  0.5,     5.0, 0.025, 0.0,  0.2},
+    {"NOE_",   -3.5, -4.5, -2.5,   3.0,  1.0,     6.0, 0.02,  0.0,  0.4}
+};
+
+/*
+ * Z(f) = PD * (1 - sum_i L_i(f)) with parameters (f0, w, A) for each pool followed by PD.
+ * The Jacobian is evaluated in closed form alongside the residuals.
+ */
+template<int NPools>
+struct ZFunctor {
+    static const int NP = 3*NPools + 1;
+    typedef QI::LevMar<NP> TSolver;
+    const Eigen::ArrayXd &m_frqs, &m_zspec;
 
-class ZCost {
+    int values() const { return m_frqs.rows(); }
+
+    template<typename TR, typename TJ>
+    void evaluate(const double *p, TR *r, TJ *J) const {
+        const double PD = p[NP - 1];
+        for (Eigen::Index k = 0; k < m_frqs.rows(); k++) {
+            double sum = 0.;
+            if (J) (*J)(k, 0) = 0.;
+            for (int i = 0; i < NPools; i++) {
+                const double c = (i == 0) ? p[0] : p[0] + p[3*i];
+                const double w = p[3*i + 1];
+                const double A = p[3*i + 2];
+                const double x = 2. * (c - m_frqs[k]) / w;
+                const double d = 1. / (1. + x*x);
+                sum += A * d;
+                if (J) {
+                    const double dc = 4. * PD * A * x * d * d / w;
+                    (*J)(k, 0) += dc;
+                    if (i > 0) (*J)(k, 3*i) = dc;
+                    (*J)(k, 3*i + 1) = -0.5 * x * dc;
+                    (*J)(k, 3*i + 2) = -PD * d;
+                }
+            }
+            if (r) (*r)[k] = PD * (1. - sum) - m_zspec[k];
+            if (J) (*J)(k, NP - 1) = 1. - sum;
+        }
+    }
+
+    bool operator()(const typename TSolver::TParams &p, typename TSolver::TResiduals &r) const {
+        evaluate(p.data(), &r, static_cast<typename TSolver::TJacobian *>(nullptr));
+        return true;
+    }
+
+    bool jacobian(const typename TSolver::TParams &p, typename TSolver::TJacobian &j) const {
+        evaluate(p.data(), static_cast<typename TSolver::TResiduals *>(nullptr), &j);
+        return true;
+    }
+};
+
+template<int NPools>
+class ZCost : public ceres::SizedCostFunction<ceres::DYNAMIC, ZFunctor<NPools>::NP> {
 private:
-    Eigen::ArrayXd m_frqs, m_zspec;
+    const ZFunctor<NPools> m_functor;
 public:
+    typedef Eigen::Matrix<double, Eigen::Dynamic, ZFunctor<NPools>::NP, Eigen::RowMajor> TJacobian;
 
     ZCost(const Eigen::ArrayXd &f, const Eigen::ArrayXd &z) :
-          m_frqs(f), m_zspec(z)
-    {}
-
-    bool operator() (double const* const* p, double* resids) const {
-        const Eigen::ArrayXd L = Lorentzian(p[0][0], p[0][1], p[0][2], m_frqs);
-        const Eigen::ArrayXd invL = p[0][3] * (1. - L);
-        Eigen::Map<Eigen::ArrayXd> r(resids, m_frqs.size());
-        r = (invL - m_zspec);
+        m_functor{f, z}
+    {
+        this->set_num_residuals(f.rows());
+    }
+
+    bool Evaluate(double const* const* p, double* resids, double** jacobians) const override {
+        Eigen::Map<Eigen::ArrayXd> r(resids, m_functor.values());
+        if (jacobians && jacobians[0]) {
+            Eigen::Map<TJacobian> j(jacobians[0], m_functor.values(), ZFunctor<NPools>::NP);
+            m_functor.evaluate(p[0], &r, &j);
+        } else {
+            m_functor.evaluate(p[0], &r, static_cast<Eigen::Map<TJacobian> *>(nullptr));
+        }
         return true;
     }
 };
 
+template<int NPools>
 class LorentzFit : public QI::ApplyF::Algorithm {
+public:
+    typedef ZFunctor<NPools> TFunctor;
+    typedef typename TFunctor::TSolver TSolver;
+    typedef typename TSolver::TParams TParams;
+    static const int NP = TFunctor::NP;
+    static const size_t BlockSize = 64;
+
 protected:
-    Eigen::ArrayXd m_zfrqs;
+    Eigen::ArrayXd m_zfrqs, m_fitfrqs;
+    Eigen::Index m_first, m_size;
+    bool m_ceres = false, m_warm = false;
+    TParams m_start_p, m_lo, m_hi;
+    std::vector<std::string> m_names;
+
+    void initialise(const bool window) {
+        if (window) {
+            // Find closest indices to -2/+2 PPM and only fit Lorentzian between them
+            Eigen::Index indP2, indM2;
+            (m_zfrqs + 2.0).abs().minCoeff(&indM2);
+            (m_zfrqs - 2.0).abs().minCoeff(&indP2);
+            if (indM2 > indP2)
+                std::swap(indM2, indP2);
+            m_first = indM2;
+            m_size = indP2 - indM2 + 1;
+        } else {
+            m_first = 0;
+            m_size = m_zfrqs.rows();
+        }
+        m_fitfrqs = m_zfrqs.segment(m_first, m_size);
+        for (int i = 0; i < NPools; i++) {
+            const LorentzPool &pool = Pools[i];
+            m_start_p.template segment<3>(3*i) << pool.f0, pool.w, pool.A;
+            m_lo.template segment<3>(3*i) << pool.f0lo, pool.wlo, pool.Alo;
+            m_hi.template segment<3>(3*i) << pool.f0hi, pool.whi, pool.Ahi;
+            m_names.push_back(std::string(pool.name) + "f0");
+            m_names.push_back(std::string(pool.name) + "w");
+            m_names.push_back(std::string(pool.name) + "sat");
+        }
+        m_start_p[NP - 1] = 2.0; m_lo[NP - 1] = 0.1; m_hi[NP - 1] = 10.0;
+        m_names.push_back("PD");
+    }
+
+    /*
+     * Fit the normalised spectrum z starting from p. Returns false if the solver could not
+     * produce a usable result.
+     */
+    bool fit(TSolver &solver, const Eigen::ArrayXd &z, TParams &p, double &cost, int &its) const {
+        const TFunctor functor{m_fitfrqs, z};
+        if (!m_ceres) {
+            solver.solve(functor, p);
+            cost = solver.cost();
+            its = solver.iterations();
+            return solver.usable() && (solver.status() != QI::LMStatus::IterationLimit);
+        }
+        ZCost<NPools> zcost(m_fitfrqs, z);
+        ceres::Problem::Options problem_options;
+        problem_options.cost_function_ownership = ceres::DO_NOT_TAKE_OWNERSHIP;
+        ceres::Problem problem(problem_options);
+        problem.AddResidualBlock(&zcost, NULL, p.data());
+        for (int i = 0; i < NP; i++) {
+            problem.SetParameterLowerBound(p.data(), i, m_lo[i]);
+            problem.SetParameterUpperBound(p.data(), i, m_hi[i]);
+        }
+        ceres::Solver::Options options;
+        ceres::Solver::Summary summary;
+        options.max_num_iterations = 50;
+        options.function_tolerance = 1e-5;
+        options.gradient_tolerance = 1e-6;
+        options.parameter_tolerance = 1e-4;
+        options.logging_type = ceres::SILENT;
+        ceres::Solve(options, &problem, &summary);
+        cost = summary.final_cost;
+        its = summary.iterations.size();
+        return summary.IsSolutionUsable() && (summary.termination_type == ceres::CONVERGENCE);
+    }
 
 public:
-    LorentzFit(const Eigen::ArrayXd &zf) : m_zfrqs(zf) { }
+    LorentzFit(const Eigen::ArrayXd &zf, const bool window, const bool c = false, const bool warm = false) :
+        m_zfrqs(zf), m_ceres(c), m_warm(warm)
+    {
+        initialise(window);
+    }
     size_t numInputs() const override { return 1; }
     size_t numConsts() const override { return 0; }
-    size_t numOutputs() const override { return 4; }
+    size_t numOutputs() const override { return NP; }
     size_t dataSize() const override { return m_zfrqs.rows(); }
     size_t outputSize() const override { return 1; }
     std::vector<float> defaultConsts() const override {
@@ -60,55 +207,71 @@ public:
         return def;
     }
     TOutput zero() const override { return 0; }
-    const std::vector<std::string> & names() const {
-        static std::vector<std::string> _names = {"f0", "w", "sat", "PD"};
-        return _names;
-    }
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> & /* Unused */,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TOutput &residual,
-               TInput & /* Unused */, TIterations & /* Unused */) const override
+    const std::vector<std::string> & names() const { return m_names; }
+
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> &, // Unused
+                    const std::vector<TIndex> &indices,
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &, // Unused
+                    std::vector<TIterations> &its) const override
     {
-        const Eigen::Map<const Eigen::ArrayXf> z_spec(inputs[0].GetDataPointer(), m_zfrqs.size());
-
-        // Find closest indices to -2/+2 PPM and only fit Lorentzian between them
-        Eigen::ArrayXf::Index indP2, indM2;
-        (m_zfrqs + 2.0).abs().minCoeff(&indM2);
-        (m_zfrqs - 2.0).abs().minCoeff(&indP2);
-        if (indM2 > indP2)
-            std::swap(indM2, indP2);
-        Eigen::ArrayXf::Index sz = indP2 - indM2;
-        const double scale = z_spec.segment(indM2,sz).maxCoeff();
-        auto *cost = new ceres::DynamicNumericDiffCostFunction<ZCost>(new ZCost(m_zfrqs.segment(indM2,sz).cast<double>(), z_spec.segment(indM2,sz).cast<double>() / scale));
-        cost->AddParameterBlock(4);
-        cost->SetNumResiduals(sz);
-        Eigen::Array4d p{0.0, 2.0, 0.9, 2.0};
-        ceres::Problem problem;
-        problem.AddResidualBlock(cost, NULL, p.data());
-        problem.SetParameterLowerBound(p.data(), 0, -2.0);
-        problem.SetParameterUpperBound(p.data(), 0, 2.0);
-        problem.SetParameterLowerBound(p.data(), 1, 0.001);
-        problem.SetParameterUpperBound(p.data(), 1, 100.0);
-        problem.SetParameterLowerBound(p.data(), 2, 0.1);
-        problem.SetParameterUpperBound(p.data(), 2, 1.0);
-        problem.SetParameterLowerBound(p.data(), 3, 0.1);
-        problem.SetParameterUpperBound(p.data(), 3, 10.0);
-        ceres::Solver::Options options;
-        ceres::Solver::Summary summary;
-        options.max_num_iterations = 50;
-        options.function_tolerance = 1e-5;
-        options.gradient_tolerance = 1e-6;
-        options.parameter_tolerance = 1e-4;
-        ceres::Solve(options, &problem, &summary);
-        outputs.at(0) = p[0];
-        outputs.at(1) = p[1];
-        outputs.at(2) = p[2];
-        outputs.at(3) = p[3] * scale;
-        residual = summary.final_cost;
+        TSolver solver(m_size);
+        solver.setBounds(m_lo, m_hi);
+        solver.setMaxIterations(50);
+        solver.setTolerances(1e-5, 1e-6, 1e-4);
+        Eigen::ArrayXd z(m_size);
+        TParams last = m_start_p;
+        bool last_ok = false;
+        for (size_t v = 0; v < n; v++) {
+            const Eigen::Map<const Eigen::ArrayXf> z_spec(inputs[v][0].GetDataPointer() + m_first, m_size);
+            const double scale = z_spec.maxCoeff();
+            z = z_spec.template cast<double>() / scale;
+            // Voxels are supplied in raster order, so the previous voxel is usually the neighbour along the first axis
+            const bool neighbour = (v > 0) && (indices[v][0] == indices[v-1][0] + 1) &&
+                                   (indices[v][1] == indices[v-1][1]) && (indices[v][2] == indices[v-1][2]);
+            TParams p = m_start_p;
+            double cost;
+            int iterations;
+            bool ok;
+            if (m_warm && neighbour && last_ok) {
+                p = last;
+                ok = fit(solver, z, p, cost, iterations);
+                if (!ok) {
+                    // Fall back to the default start and keep whichever is better
+                    TParams p2 = m_start_p;
+                    double cost2;
+                    int its2;
+                    const bool ok2 = fit(solver, z, p2, cost2, its2);
+                    iterations += its2;
+                    if (!(cost <= cost2)) {
+                        p = p2; cost = cost2; ok = ok2;
+                    }
+                }
+            } else {
+                ok = fit(solver, z, p, cost, iterations);
+            }
+            last = p;
+            last_ok = ok;
+            for (int i = 0; i < NP - 1; i++) {
+                outputs[v][i] = p[i];
+            }
+            outputs[v][NP - 1] = p[NP - 1] * scale;
+            residuals[v] = cost;
+            its[v] = iterations;
+        }
         return true;
     }
-};
 
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &index, std::vector<TOutput> &outputs, TOutput &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
+};
 
 int main(int argc, char **argv) {
     Eigen::initParallel();
@@ -121,38 +284,65 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "PREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(input_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    args::Flag use_ceres(parser, "CERES", "Use Ceres (the previous default) instead of the built-in Levenberg-Marquardt solver", {"ceres"});
+    args::Flag multipool(parser, "MULTIPOOL", "Fit water, MT, amide and NOE pools to the whole spectrum", {"multipool"});
+    args::Flag warm(parser, "WARM", "Start each fit from the result in the neighbouring voxel", {"warm"});
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     cereal::JSONInputArchive input(std::cin);
     if (verbose) std::cout << "Enter Z-Spectrum Frequencies: " << std::endl;
     Eigen::ArrayXd z_frqs; QI::ReadCereal(input, "freq", z_frqs);
-    std::shared_ptr<LorentzFit> algo = std::make_shared<LorentzFit>(z_frqs);
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetInput(0, data);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing output." << std::endl;
-    }
-    std::string outPrefix = outarg.Get() + "LTZ_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        QI::WriteImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
+    std::shared_ptr<QI::ApplyF::Algorithm> algo;
+    std::vector<std::string> names;
+    if (multipool) {
+        auto fit = std::make_shared<LorentzFit<4>>(z_frqs, false, use_ceres, warm);
+        names = fit->names();
+        algo = fit;
+    } else {
+        auto fit = std::make_shared<LorentzFit<1>>(z_frqs, true, use_ceres, warm);
+        names = fit->names();
+        algo = fit;
     }
-    QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    struct LTZInputs {
+        QI::VectorVolumeF::Pointer data;
+        QI::VolumeF::Pointer mask;
+    };
+    QI::RunBatch<LTZInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            LTZInputs in;
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.data = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(input_path)));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](LTZInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetInput(0, in.data);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing output." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "LTZ_";
+            return [apply, algo, names, outPrefix]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    QI::WriteImage(apply->GetOutput(i), outPrefix + names.at(i) + QI::OutExt());
+                }
+                QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
@@ -15,6 +15,7 @@
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "IO.h"
 #include "Spline.h"
 #include "ApplyTypes.h"
@@ -81,46 +82,60 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> f0(parser, "OFF RESONANCE", "Specify off-resonance frequency", {'f', "f0"});
     args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(input_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     if (verbose) std::cout << "Enter Z-Spectrum Frequencies: " << std::endl;
     Eigen::ArrayXf z_frqs; QI::ReadArray(std::cin, z_frqs);
     if (verbose) std::cout << "Enter Asymmetry Frequencies: " << std::endl;
     Eigen::ArrayXf a_frqs; QI::ReadArray(std::cin, a_frqs); // Asymmetry output
     std::shared_ptr<MTAsym> algo = std::make_shared<MTAsym>(z_frqs, a_frqs);
-    auto apply = QI::ApplyVectorF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetInput(0, data);
-    if (mask) {
-        if (verbose) std::cout << "Setting mask image: " << mask.Get() << std::endl;
-        apply->SetMask(QI::ReadImage(mask.Get()));
-    }
-    if (f0) {
-        if (verbose) std::cout << "Setting f0 image: " << f0.Get() << std::endl;
-        apply->SetConst(0, QI::ReadImage(f0.Get()));
-    }
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing output." << std::endl;
-    }
-    std::string outPrefix = outarg.Get() + "MT_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
-    }
-    
+    struct MTInputs {
+        QI::VectorVolumeF::Pointer data;
+        QI::VolumeF::Pointer mask, f0;
+    };
+    QI::RunBatch<MTInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            MTInputs in;
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.data = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(input_path)));
+            if (mask) {
+                if (verbose) std::cout << "Setting mask image: " << subject.path(mask.Get()) << std::endl;
+                in.mask = QI::ReadImage(subject.path(mask.Get()));
+            }
+            if (f0) {
+                if (verbose) std::cout << "Setting f0 image: " << subject.path(f0.Get()) << std::endl;
+                in.f0 = QI::ReadImage(subject.path(f0.Get()));
+            }
+            return in;
+        },
+        [&](MTInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyVectorF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetInput(0, in.data);
+            if (in.mask) apply->SetMask(in.mask);
+            if (in.f0) apply->SetConst(0, in.f0);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing output." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "MT_";
+            return [apply, algo, outPrefix]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
@@ -16,6 +16,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "ApplyTypes.h"
 #include "MultiEchoSequence.h"
@@ -178,60 +179,75 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> f0_arg(parser, "FIELD MAP", "A field map for macroscopic field gradient correction", {'f', "fmap"});
     args::ValueFlag<double> slice_arg(parser, "SLICE THICKNESS", "Slice-thickness for MFG calculation (useful if there was a slice gap)", {'s', "slice"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-    if (verbose) std::cout << "Reading ASE data from: " << QI::CheckPos(input_path) << std::endl;
-    const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
-    auto input = QI::ReadVectorImage(QI::CheckPos(input_path));
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     auto sequence = QI::ReadSequence<QI::MultiEchoSequence>(std::cin, verbose);
-    QI::VolumeF::SpacingType vox_size = input->GetSpacing();
-    if (slice_arg) {
-        vox_size[2]  = slice_arg.Get();
-    }
-    std::shared_ptr<ASEAlgo> algo = std::make_shared<ASEAlgo>(sequence, input->GetNumberOfComponentsPerPixel(), B0.Get(), vox_size);
-    auto apply = QI::ApplyF::New();
-    apply->SetVerbose(verbose);
-    apply->SetAlgorithm(algo);
-    apply->SetOutputAllResiduals(false);
-    if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
-    apply->SetInput(0, input);
-    if (f0_arg) {
-        if (verbose) std::cout << "Calculating gradient of field-map" << std::endl;
-        auto f0_map = QI::ReadImage(f0_arg.Get());
-        auto grad = itk::DerivativeImageFilter<QI::VolumeF, QI::VolumeF>::New();
-        grad->SetInput(f0_map);
-        grad->SetDirection(0);
-        apply->SetConst(0, grad->GetOutput());
-        QI::WriteImage(grad->GetOutput(), outPrefix + "_fieldgrad_x" + QI::OutExt());
-        grad->GetOutput()->DisconnectPipeline();
-        grad->SetDirection(1);
-        apply->SetConst(1, grad->GetOutput());
-        QI::WriteImage(grad->GetOutput(), outPrefix + "_fieldgrad_y" + QI::OutExt());
-        grad->GetOutput()->DisconnectPipeline();
-        grad->SetDirection(2);
-        apply->SetConst(2, grad->GetOutput());
-        QI::WriteImage(grad->GetOutput(), outPrefix + "_fieldgrad_z" + QI::OutExt());
-        grad->GetOutput()->DisconnectPipeline();
-    }
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-    }
-    
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        const std::string fname = outPrefix + "_" + algo->names()[i] + QI::OutExt();
-        std::cout << "Writing file: " << fname << std::endl;
-        QI::WriteImage(apply->GetOutput(i), fname);
-    }
+    struct ASEInputs {
+        QI::VectorVolumeF::Pointer input;
+        QI::VolumeF::Pointer f0_map, mask;
+    };
+    QI::RunBatch<ASEInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            ASEInputs in;
+            if (verbose) std::cout << "Reading ASE data from: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.input = QI::ReadVectorImage(subject.path(QI::CheckPos(input_path)));
+            if (f0_arg) in.f0_map = QI::ReadImage(subject.path(f0_arg.Get()));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](ASEInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            const std::string outPrefix = outarg ? subject.path(outarg.Get()) : QI::Basename(subject.path(input_path.Get()));
+            // The algorithm depends on the size and spacing of each subject's data, but is cheap to create
+            QI::VolumeF::SpacingType vox_size = in.input->GetSpacing();
+            if (slice_arg) {
+                vox_size[2]  = slice_arg.Get();
+            }
+            std::shared_ptr<ASEAlgo> algo = std::make_shared<ASEAlgo>(sequence, in.input->GetNumberOfComponentsPerPixel(), B0.Get(), vox_size);
+            auto apply = QI::ApplyF::New();
+            apply->SetVerbose(verbose);
+            apply->SetAlgorithm(algo);
+            apply->SetOutputAllResiduals(false);
+            if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get());
+            apply->SetInput(0, in.input);
+            std::vector<QI::VolumeF::Pointer> grads;
+            if (in.f0_map) {
+                if (verbose) std::cout << "Calculating gradient of field-map" << std::endl;
+                auto grad = itk::DerivativeImageFilter<QI::VolumeF, QI::VolumeF>::New();
+                grad->SetInput(in.f0_map);
+                for (int d = 0; d < 3; d++) {
+                    grad->SetDirection(d);
+                    grad->Update();
+                    grads.push_back(grad->GetOutput());
+                    apply->SetConst(d, grads.back());
+                    grad->GetOutput()->DisconnectPipeline();
+                }
+            }
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(args::get(subregion)));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+            }
+            return [apply, algo, grads, outPrefix]{
+                const std::vector<std::string> axes{"x", "y", "z"};
+                for (size_t d = 0; d < grads.size(); d++) {
+                    QI::WriteImage(grads[d], outPrefix + "_fieldgrad_" + axes[d] + QI::OutExt());
+                }
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    const std::string fname = outPrefix + "_" + algo->names()[i] + QI::OutExt();
+                    std::cout << "Writing file: " << fname << std::endl;
+                    QI::WriteImage(apply->GetOutput(i), fname);
+                }
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
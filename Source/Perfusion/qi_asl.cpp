@@ -14,6 +14,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "ApplyTypes.h"
 #include "CASLSequence.h"
@@ -122,54 +123,66 @@ int main(int argc, char **argv) {
     args::ValueFlag<double> alpha(parser, "ALPHA", "Labelling efficiency, default 0.9", {'a', "alpha"}, 0.9);
     args::ValueFlag<double> lambda(parser, "LAMBDA", "Blood-brain partition co-efficent, default 0.9 mL/g", {'l', "lambda"}, 0.9);
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-    if (verbose) std::cout << "Reading ASL data from: " << QI::CheckPos(input_path) << std::endl;
-    auto input = QI::ReadVectorImage(QI::CheckPos(input_path));
-
-    QI::VolumeF::Pointer PD_image = ITK_NULLPTR;
-    if (PD_path) {
-        if (verbose) std::cout << "Reading proton density map: " << PD_path.Get() << std::endl;
-        PD_image = QI::ReadImage(PD_path.Get());
-    }
-
-    QI::VolumeF::Pointer T1_tissue = ITK_NULLPTR;
-    if (T1_tissue_path) {
-        if (verbose) std::cout << "Reading tissue T1 map: " << T1_tissue_path.Get() << std::endl;
-        T1_tissue = QI::ReadImage(T1_tissue_path.Get());
-    }
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     auto sequence = QI::ReadSequence<QI::CASLSequence>(std::cin, verbose);
-    const auto n_slices = input->GetLargestPossibleRegion().GetSize()[2];
-    if (slice_time && (n_slices != static_cast<size_t>(sequence.post_label_delay.rows()))) {
-        QI_FAIL("Number of post-label delays " << sequence.post_label_delay.rows() << " does not match number of slices " << n_slices);
-    }
-    std::shared_ptr<CASLAlgo> algo = std::make_shared<CASLAlgo>(sequence, T1_blood.Get(), alpha.Get(), lambda.Get(),
-                                                                input->GetNumberOfComponentsPerPixel(), average, slice_time);
-    auto apply = QI::ApplyVectorF::New();
-    apply->SetVerbose(verbose);
-    apply->SetAlgorithm(algo);
-    apply->SetConst(0, T1_tissue);
-    apply->SetConst(1, PD_image);
-    apply->SetOutputAllResiduals(false);
-    if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
-    apply->SetInput(0, input);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    const std::string outPrefix = outarg ? outarg.Get() : QI::Basename(input_path.Get());
-    QI::WriteVectorImage(apply->GetOutput(0), outPrefix + "_CBF" + QI::OutExt());
+    struct ASLInputs {
+        QI::VectorVolumeF::Pointer input;
+        QI::VolumeF::Pointer PD, T1_tissue, mask;
+    };
+    QI::RunBatch<ASLInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            ASLInputs in;
+            if (verbose) std::cout << "Reading ASL data from: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.input = QI::ReadVectorImage(subject.path(QI::CheckPos(input_path)));
+            if (PD_path) {
+                if (verbose) std::cout << "Reading proton density map: " << subject.path(PD_path.Get()) << std::endl;
+                in.PD = QI::ReadImage(subject.path(PD_path.Get()));
+            }
+            if (T1_tissue_path) {
+                if (verbose) std::cout << "Reading tissue T1 map: " << subject.path(T1_tissue_path.Get()) << std::endl;
+                in.T1_tissue = QI::ReadImage(subject.path(T1_tissue_path.Get()));
+            }
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](ASLInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            // The algorithm depends on the size of each subject's data, but is cheap to create
+            const auto n_slices = in.input->GetLargestPossibleRegion().GetSize()[2];
+            if (slice_time && (n_slices != static_cast<size_t>(sequence.post_label_delay.rows()))) {
+                QI_FAIL("Number of post-label delays " << sequence.post_label_delay.rows() << " does not match number of slices " << n_slices);
+            }
+            std::shared_ptr<CASLAlgo> algo = std::make_shared<CASLAlgo>(sequence, T1_blood.Get(), alpha.Get(), lambda.Get(),
+                                                                        in.input->GetNumberOfComponentsPerPixel(), average, slice_time);
+            auto apply = QI::ApplyVectorF::New();
+            apply->SetVerbose(verbose);
+            apply->SetAlgorithm(algo);
+            apply->SetConst(0, in.T1_tissue);
+            apply->SetConst(1, in.PD);
+            apply->SetOutputAllResiduals(false);
+            if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get());
+            apply->SetInput(0, in.input);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(args::get(subregion)));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = outarg ? subject.path(outarg.Get()) : QI::Basename(subject.path(input_path.Get()));
+            return [apply, outPrefix]{
+                QI::WriteVectorImage(apply->GetOutput(0), outPrefix + "_CBF" + QI::OutExt());
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
@@ -0,0 +1,279 @@
+/*
+ *  JSONValue.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "JSONValue.h"
+#include "Macro.h"
+
+namespace QI {
+
+class JSONParser {
+protected:
+    const std::string &m_text;
+    size_t m_pos = 0;
+
+    void skipSpace() {
+        while (m_pos < m_text.size() && std::strchr(" \t\r\n", m_text[m_pos])) {
+            m_pos++;
+        }
+    }
+
+    char peek() {
+        skipSpace();
+        if (m_pos == m_text.size()) {
+            QI_EXCEPTION("Unexpected end of JSON input");
+        }
+        return m_text[m_pos];
+    }
+
+    void expect(const char c) {
+        if (peek() != c) {
+            QI_EXCEPTION("Expected '" << c << "' at position " << m_pos << " of JSON input");
+        }
+        m_pos++;
+    }
+
+    bool literal(const char *word) {
+        const size_t n = std::strlen(word);
+        if (m_text.compare(m_pos, n, word) == 0) {
+            m_pos += n;
+            return true;
+        }
+        return false;
+    }
+
+    void appendUTF8(std::string &s, const unsigned long c) {
+        if (c < 0x80) {
+            s += static_cast<char>(c);
+        } else if (c < 0x800) {
+            s += static_cast<char>(0xC0 | (c >> 6));
+            s += static_cast<char>(0x80 | (c & 0x3F));
+        } else if (c < 0x10000) {
+            s += static_cast<char>(0xE0 | (c >> 12));
+            s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            s += static_cast<char>(0x80 | (c & 0x3F));
+        } else {
+            s += static_cast<char>(0xF0 | (c >> 18));
+            s += static_cast<char>(0x80 | ((c >> 12) & 0x3F));
+            s += static_cast<char>(0x80 | ((c >> 6) & 0x3F));
+            s += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+
+    unsigned long hex4() {
+        if (m_pos + 4 > m_text.size()) {
+            QI_EXCEPTION("Invalid \\u escape in JSON string");
+        }
+        const std::string digits = m_text.substr(m_pos, 4);
+        char *end;
+        const unsigned long c = std::strtoul(digits.c_str(), &end, 16);
+        if (end != digits.c_str() + 4) {
+            QI_EXCEPTION("Invalid \\u escape in JSON string");
+        }
+        m_pos += 4;
+        return c;
+    }
+
+    std::string parseString() {
+        expect('"');
+        std::string s;
+        while (true) {
+            if (m_pos == m_text.size()) {
+                QI_EXCEPTION("Unterminated string in JSON input");
+            }
+            const char c = m_text[m_pos++];
+            if (c == '"') {
+                return s;
+            } else if (c != '\\') {
+                s += c;
+                continue;
+            }
+            if (m_pos == m_text.size()) {
+                QI_EXCEPTION("Unterminated string in JSON input");
+            }
+            const char e = m_text[m_pos++];
+            switch (e) {
+            case '"': case '\\': case '/': s += e; break;
+            case 'b': s += '\b'; break;
+            case 'f': s += '\f'; break;
+            case 'n': s += '\n'; break;
+            case 'r': s += '\r'; break;
+            case 't': s += '\t'; break;
+            case 'u': {
+                unsigned long c = hex4();
+                if (c >= 0xD800 && c < 0xDC00 && literal("\\u")) { // Surrogate pair
+                    c = 0x10000 + ((c - 0xD800) << 10) + (hex4() - 0xDC00);
+                }
+                appendUTF8(s, c);
+            } break;
+            default:
+                QI_EXCEPTION("Invalid escape '\\" << e << "' in JSON string");
+            }
+        }
+    }
+
+public:
+    JSONParser(const std::string &text) : m_text(text) {}
+
+    JSONValue parse() {
+        JSONValue v;
+        const char c = peek();
+        const size_t start = m_pos;
+        if (c == '{') {
+            v.m_type = JSONValue::Type::Object;
+            m_pos++;
+            while (peek() != '}') {
+                std::string key = parseString();
+                expect(':');
+                v.m_object.emplace_back(key, parse());
+                if (peek() != ',') {
+                    break;
+                }
+                m_pos++;
+            }
+            expect('}');
+        } else if (c == '[') {
+            v.m_type = JSONValue::Type::Array;
+            m_pos++;
+            while (peek() != ']') {
+                v.m_array.push_back(parse());
+                if (peek() != ',') {
+                    break;
+                }
+                m_pos++;
+            }
+            expect(']');
+        } else if (c == '"') {
+            v.m_type = JSONValue::Type::String;
+            v.m_string = parseString();
+        } else if (literal("true") || literal("false")) {
+            v.m_type = JSONValue::Type::Bool;
+            v.m_bool = (m_text[start] == 't');
+        } else if (literal("null")) {
+            v.m_type = JSONValue::Type::Null;
+        } else {
+            const char *begin = m_text.c_str() + m_pos;
+            char *end;
+            v.m_number = std::strtod(begin, &end);
+            if (end == begin) {
+                QI_EXCEPTION("Invalid value at position " << m_pos << " of JSON input");
+            }
+            v.m_type = JSONValue::Type::Number;
+            m_pos += (end - begin);
+        }
+        v.m_text = m_text.substr(start, m_pos - start);
+        return v;
+    }
+
+    void finish() {
+        skipSpace();
+        if (m_pos != m_text.size()) {
+            QI_EXCEPTION("Unexpected text after JSON value at position " << m_pos);
+        }
+    }
+};
+
+JSONValue JSONValue::Parse(const std::string &text) {
+    JSONParser parser(text);
+    JSONValue v = parser.parse();
+    parser.finish();
+    return v;
+}
+
+const std::string &JSONValue::string() const {
+    if (m_type != Type::String) {
+        QI_EXCEPTION("Expected a JSON string, found: " << m_text);
+    }
+    return m_string;
+}
+
+double JSONValue::number() const {
+    if (m_type != Type::Number) {
+        QI_EXCEPTION("Expected a JSON number, found: " << m_text);
+    }
+    return m_number;
+}
+
+bool JSONValue::boolean() const {
+    if (m_type != Type::Bool) {
+        QI_EXCEPTION("Expected true or false, found: " << m_text);
+    }
+    return m_bool;
+}
+
+const std::vector<JSONValue> &JSONValue::array() const {
+    if (m_type != Type::Array) {
+        QI_EXCEPTION("Expected a JSON array, found: " << m_text);
+    }
+    return m_array;
+}
+
+std::vector<std::string> JSONValue::strings() const {
+    if (m_type == Type::String) {
+        return {m_string};
+    }
+    std::vector<std::string> s;
+    for (const auto &v : array()) {
+        s.push_back(v.string());
+    }
+    return s;
+}
+
+bool JSONValue::has(const std::string &key) const {
+    for (const auto &kv : m_object) {
+        if (kv.first == key) {
+            return true;
+        }
+    }
+    return false;
+}
+
+const JSONValue &JSONValue::operator[](const std::string &key) const {
+    if (m_type != Type::Object) {
+        QI_EXCEPTION("Expected a JSON object, found: " << m_text);
+    }
+    for (const auto &kv : m_object) {
+        if (kv.first == key) {
+            return kv.second;
+        }
+    }
+    QI_EXCEPTION("Missing \"" << key << "\" in JSON object");
+}
+
+std::string JSONQuote(const std::string &s) {
+    std::string q = "\"";
+    for (const char c : s) {
+        switch (c) {
+        case '"': q += "\\\""; break;
+        case '\\': q += "\\\\"; break;
+        case '\b': q += "\\b"; break;
+        case '\f': q += "\\f"; break;
+        case '\n': q += "\\n"; break;
+        case '\r': q += "\\r"; break;
+        case '\t': q += "\\t"; break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                char code[8];
+                std::snprintf(code, sizeof(code), "\\u%04x", c);
+                q += code;
+            } else {
+                q += c;
+            }
+        }
+    }
+    return q + "\"";
+}
+
+} // End namespace QI
@@ -0,0 +1,61 @@
+/*
+ *  JSONValue.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_JSONVALUE_H
+#define QI_JSONVALUE_H
+
+#include <string>
+#include <vector>
+#include <utility>
+
+namespace QI {
+
+/*
+ * A parsed JSON document. Cereal can only read into known types, but pipeline descriptions contain
+ * program input (e.g. sequence parameters) that must be passed on as text, so each value also
+ * keeps the text it was parsed from.
+ */
+class JSONValue {
+public:
+    enum class Type { Null, Bool, Number, String, Array, Object };
+
+    static JSONValue Parse(const std::string &text);
+
+    Type type() const { return m_type; }
+    bool isString() const { return m_type == Type::String; }
+    bool isArray() const { return m_type == Type::Array; }
+    bool isObject() const { return m_type == Type::Object; }
+
+    const std::string &string() const;
+    double number() const;
+    bool boolean() const;
+    const std::vector<JSONValue> &array() const;
+    std::vector<std::string> strings() const; //!< An array of strings, or a single string
+    bool has(const std::string &key) const;
+    const JSONValue &operator[](const std::string &key) const;
+    const std::string &text() const { return m_text; }
+
+protected:
+    Type m_type = Type::Null;
+    bool m_bool = false;
+    double m_number = 0;
+    std::string m_string, m_text;
+    std::vector<JSONValue> m_array;
+    std::vector<std::pair<std::string, JSONValue>> m_object;
+
+    friend class JSONParser;
+};
+
+std::string JSONQuote(const std::string &s); //!< s as a JSON string, with quotes and escapes
+
+} // End namespace QI
+
+#endif // QI_JSONVALUE_H
@@ -0,0 +1,148 @@
+/*
+ *  Pipeline.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <map>
+#include <set>
+#include <chrono>
+#include <algorithm>
+
+#include "Pipeline.h"
+#include "Programs.h"
+#include "Redirect.h"
+#include "MemoryImages.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+/*
+ * Frees the images held in memory however the pipeline finishes
+ */
+class MemoryScope {
+public:
+    MemoryScope(const bool active, const std::vector<std::string> &outputs) {
+        if (active) {
+            KeepImagesInMemory(outputs);
+        }
+    }
+    ~MemoryScope() {
+        ReleaseMemoryImages();
+    }
+};
+
+Pipeline::Stage ReadStage(const JSONValue &json) {
+    Pipeline::Stage stage;
+    stage.program = json["program"].string();
+    stage.name = json.has("name") ? json["name"].string() : stage.program;
+    if (!FindProgram(stage.program)) {
+        QI_EXCEPTION("Program " << stage.program << " cannot be used in a pipeline");
+    }
+    if (json.has("args")) {
+        stage.args = json["args"].strings();
+    }
+    if (json.has("input")) {
+        // Strings are passed as they are, anything else as JSON text
+        const JSONValue &input = json["input"];
+        stage.input = input.isString() ? input.string() : input.text();
+    }
+    if (json.has("stdin")) {
+        stage.inputFrom = json["stdin"].string();
+        stage.after.push_back(stage.inputFrom);
+    }
+    if (json.has("after")) {
+        const auto after = json["after"].strings();
+        stage.after.insert(stage.after.end(), after.begin(), after.end());
+    }
+    return stage;
+}
+
+} // End anonymous namespace
+
+/*
+ * Stages run in the order given, except that a stage waits until the stages it depends on have run
+ */
+Pipeline::Pipeline(const JSONValue &json) {
+    if (json.has("outputs")) {
+        m_outputs = json["outputs"].strings();
+    }
+    std::vector<Stage> pending;
+    std::set<std::string> names;
+    for (const auto &s : json["stages"].array()) {
+        pending.push_back(ReadStage(s));
+        if (!names.insert(pending.back().name).second) {
+            QI_EXCEPTION("Stage name " << pending.back().name << " is used more than once");
+        }
+    }
+    for (const auto &s : pending) {
+        for (const auto &a : s.after) {
+            if (!names.count(a)) {
+                QI_EXCEPTION("Stage " << s.name << " depends on unknown stage " << a);
+            }
+        }
+    }
+    std::set<std::string> ready;
+    while (!pending.empty()) {
+        auto next = std::find_if(pending.begin(), pending.end(), [&](const Stage &s) {
+            return std::all_of(s.after.begin(), s.after.end(), [&](const std::string &a) { return ready.count(a) > 0; });
+        });
+        if (next == pending.end()) {
+            QI_EXCEPTION("Pipeline stages depend on each other in a cycle, starting at " << pending.front().name);
+        }
+        ready.insert(next->name);
+        m_stages.push_back(*next);
+        pending.erase(next);
+    }
+}
+
+void Pipeline::run(const bool verbose, const bool inMemory) const {
+    std::set<std::string> captured;
+    for (const auto &s : m_stages) {
+        if (!s.inputFrom.empty()) {
+            captured.insert(s.inputFrom);
+        }
+    }
+    MemoryScope memory(inMemory, m_outputs);
+    std::map<std::string, std::string> stdout_text;
+    for (const auto &s : m_stages) {
+        if (verbose) {
+            std::cout << "Running stage " << s.name << ": " << s.program;
+            for (const auto &a : s.args) std::cout << " " << a;
+            std::cout << std::endl;
+        }
+        const auto start = std::chrono::steady_clock::now();
+        std::istringstream in(s.inputFrom.empty() ? s.input : stdout_text[s.inputFrom]);
+        std::ostringstream out;
+        int result;
+        {
+            Redirect cin_redirect(std::cin, in.rdbuf());
+            if (captured.count(s.name)) {
+                Redirect cout_redirect(std::cout, out.rdbuf());
+                result = RunProgram(s.program, s.args);
+            } else {
+                result = RunProgram(s.program, s.args);
+            }
+        }
+        if (result != EXIT_SUCCESS) {
+            QI_EXCEPTION("Stage " << s.name << " (" << s.program << ") failed with code " << result);
+        }
+        stdout_text[s.name] = out.str();
+        if (verbose) {
+            const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+            std::cout << "Stage " << s.name << " took " << elapsed.count() << "s" << std::endl;
+        }
+    }
+}
+
+} // End namespace QI
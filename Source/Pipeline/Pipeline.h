@@ -0,0 +1,54 @@
+/*
+ *  Pipeline.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PIPELINE_H
+#define QI_PIPELINE_H
+
+#include <string>
+#include <vector>
+
+#include "JSONValue.h"
+
+namespace QI {
+
+/*
+ * A set of QUIT programs that run one after another in the same process. Images written by one
+ * stage stay in memory for the stages after it, and only the images listed as outputs are written
+ * to disk. The JSON format is described under qi_pipeline in Docs/Utilities.md.
+ */
+class Pipeline {
+public:
+    struct Stage {
+        std::string name, program;
+        std::vector<std::string> args;
+        std::string input;               //!< Given to the program on stdin
+        std::string inputFrom;           //!< Or the name of a stage whose stdout is used instead
+        std::vector<std::string> after;  //!< Stages that must run first
+    };
+
+    Pipeline(const JSONValue &json);
+    const std::vector<Stage> &stages() const { return m_stages; }
+    const std::vector<std::string> &outputs() const { return m_outputs; }
+
+    /*
+     * Run all stages in order. If inMemory is false every image is written to disk as if the
+     * programs had been run separately.
+     */
+    void run(const bool verbose, const bool inMemory = true) const;
+
+protected:
+    std::vector<Stage> m_stages; // In the order they will run
+    std::vector<std::string> m_outputs;
+};
+
+} // End namespace QI
+
+#endif // QI_PIPELINE_H
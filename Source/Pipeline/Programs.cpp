@@ -0,0 +1,74 @@
+/*
+ *  Programs.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <map>
+
+#include "Programs.h"
+#include "Macro.h"
+
+int qimask_main(int argc, char **argv);
+int qipolyfit_main(int argc, char **argv);
+int qipolyimg_main(int argc, char **argv);
+int qiafi_main(int argc, char **argv);
+int qidespot1_main(int argc, char **argv);
+int qidespot1hifi_main(int argc, char **argv);
+int qidespot2_main(int argc, char **argv);
+int qidespot2fm_main(int argc, char **argv);
+int qimcdespot_main(int argc, char **argv);
+
+namespace QI {
+
+namespace {
+const std::map<std::string, ProgramMain> &Programs() {
+    static const std::map<std::string, ProgramMain> programs{
+        {"qimask", qimask_main},
+        {"qipolyfit", qipolyfit_main},
+        {"qipolyimg", qipolyimg_main},
+        {"qiafi", qiafi_main},
+        {"qidespot1", qidespot1_main},
+        {"qidespot1hifi", qidespot1hifi_main},
+        {"qidespot2", qidespot2_main},
+        {"qidespot2fm", qidespot2fm_main},
+        {"qimcdespot", qimcdespot_main}
+    };
+    return programs;
+}
+}
+
+ProgramMain FindProgram(const std::string &name) {
+    const auto it = Programs().find(name);
+    return (it == Programs().end()) ? nullptr : it->second;
+}
+
+std::vector<std::string> ProgramNames() {
+    std::vector<std::string> names;
+    for (const auto &p : Programs()) {
+        names.push_back(p.first);
+    }
+    return names;
+}
+
+int RunProgram(const std::string &name, const std::vector<std::string> &args) {
+    const ProgramMain program = FindProgram(name);
+    if (!program) {
+        QI_EXCEPTION("Program " << name << " cannot run inside this process");
+    }
+    std::vector<std::string> argStrings{name};
+    argStrings.insert(argStrings.end(), args.begin(), args.end());
+    std::vector<char *> argv;
+    for (auto &a : argStrings) {
+        argv.push_back(&a[0]);
+    }
+    argv.push_back(nullptr);
+    return program(argv.size() - 1, argv.data());
+}
+
+} // End namespace QI
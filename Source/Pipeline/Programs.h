@@ -0,0 +1,32 @@
+/*
+ *  Programs.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_PROGRAMS_H
+#define QI_PROGRAMS_H
+
+#include <string>
+#include <vector>
+
+namespace QI {
+
+/*
+ * The main() functions of the programs that can run inside qi_pipeline. Each program's source is
+ * compiled a second time for this with main renamed to <program>_main, see CMakeLists.txt.
+ */
+typedef int (*ProgramMain)(int argc, char **argv);
+
+ProgramMain FindProgram(const std::string &name); //!< nullptr if name cannot run in-process
+std::vector<std::string> ProgramNames();
+int RunProgram(const std::string &name, const std::vector<std::string> &args); //!< Returns the exit code
+
+} // End namespace QI
+
+#endif // QI_PROGRAMS_H
@@ -0,0 +1,39 @@
+/*
+ *  Redirect.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_REDIRECT_H
+#define QI_REDIRECT_H
+
+#include <ios>
+
+namespace QI {
+
+/*
+ * Points a standard stream at another buffer until destroyed, so that a program running in-process
+ * reads its input from and writes its output to somewhere other than the terminal
+ */
+class Redirect {
+protected:
+    std::ios &m_stream;
+    std::streambuf *m_original;
+public:
+    Redirect(std::ios &stream, std::streambuf *buffer) :
+        m_stream(stream), m_original(stream.rdbuf(buffer))
+    {}
+    ~Redirect() {
+        m_stream.rdbuf(m_original);
+        m_stream.clear();
+    }
+};
+
+} // End namespace QI
+
+#endif // QI_REDIRECT_H
@@ -0,0 +1,407 @@
+/*
+ *  Server.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <mutex>
+#include <chrono>
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/un.h>
+
+#include "itkMultiThreader.h"
+
+#include "Server.h"
+#include "JSONValue.h"
+#include "Programs.h"
+#include "Redirect.h"
+#include "Util.h"
+#include "Macro.h"
+
+namespace QI {
+
+namespace {
+
+volatile std::sig_atomic_t stop_serving = 0;
+
+void StopServing(int) {
+    stop_serving = 1;
+}
+
+bool SendAll(const int fd, const char *data, size_t n) {
+    while (n > 0) {
+        const ssize_t sent = send(fd, data, n, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        } else if (sent < 0) {
+            return false;
+        }
+        data += sent;
+        n -= sent;
+    }
+    return true;
+}
+
+bool RecvAll(const int fd, char *data, size_t n) {
+    while (n > 0) {
+        const ssize_t got = recv(fd, data, n, 0);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got <= 0) {
+            return false;
+        }
+        data += got;
+        n -= got;
+    }
+    return true;
+}
+
+/*
+ * Replies are a series of frames, each a channel byte, a 32-bit length and then the data. The
+ * channels are 'O' for stdout, 'E' for stderr and 'X' for the exit code, which is the last frame.
+ * Both ends are on the same machine so the length is in native byte order.
+ */
+bool SendFrame(const int fd, const char channel, const char *data, const uint32_t n) {
+    char header[5];
+    header[0] = channel;
+    std::memcpy(header + 1, &n, sizeof(n));
+    return SendAll(fd, header, sizeof(header)) && SendAll(fd, data, n);
+}
+
+/*
+ * Sends everything written to it straight to the client. There is no put area, so the worker
+ * threads of a program can write at the same time. stdout and stderr share one mutex because they
+ * share the socket.
+ */
+class FrameBuffer : public std::streambuf {
+protected:
+    const int m_fd;
+    const char m_channel;
+    std::mutex &m_mutex;
+    bool m_connected = true;
+
+    std::streamsize xsputn(const char *s, std::streamsize n) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_connected) {
+            m_connected = SendFrame(m_fd, m_channel, s, n);
+        }
+        return n; // Keep going if the client has gone, the outputs are still written
+    }
+
+    int_type overflow(int_type c) override {
+        if (!traits_type::eq_int_type(c, traits_type::eof())) {
+            const char ch = traits_type::to_char_type(c);
+            xsputn(&ch, 1);
+        }
+        return traits_type::not_eof(c);
+    }
+
+public:
+    FrameBuffer(const int fd, const char channel, std::mutex &mutex) :
+        m_fd(fd), m_channel(channel), m_mutex(mutex)
+    {}
+};
+
+/*
+ * Jobs run in the client's directory so that relative paths work, and read settings such as
+ * $QUIT_EXT from the client's environment. Afterwards the settings go back to being read from the
+ * server's environment, which also drops common options the job set, e.g. --out-precision, so that they
+ * do not change the jobs after it.
+ */
+class JobScope {
+protected:
+    std::string m_cwd;
+    JSONValue m_env;
+    itk::ThreadIdType m_itkMaxThreads, m_itkDefaultThreads;
+public:
+    JobScope(const std::string &dir, const JSONValue &env) :
+        m_env(env),
+        m_itkMaxThreads(itk::MultiThreader::GetGlobalMaximumNumberOfThreads()),
+        m_itkDefaultThreads(itk::MultiThreader::GetGlobalDefaultNumberOfThreads())
+    {
+        char cwd[4096];
+        if (!getcwd(cwd, sizeof(cwd))) {
+            QI_EXCEPTION("Could not read the server working directory");
+        }
+        m_cwd = cwd;
+        if (chdir(dir.c_str()) != 0) {
+            QI_EXCEPTION("Could not change to job directory: " << dir);
+        }
+        SetSettingsEnvironment([this](const char *name) -> const char * {
+            return m_env.has(name) ? m_env[name].string().c_str() : nullptr;
+        });
+    }
+    ~JobScope() {
+        if (chdir(m_cwd.c_str()) != 0) {
+            std::cerr << "Could not change back to server directory: " << m_cwd << std::endl;
+        }
+        SetSettingsEnvironment(nullptr);
+        // Some programs cap the ITK threads, e.g. qipolyimg, which would carry over to later jobs
+        itk::MultiThreader::SetGlobalMaximumNumberOfThreads(m_itkMaxThreads);
+        itk::MultiThreader::SetGlobalDefaultNumberOfThreads(m_itkDefaultThreads);
+    }
+};
+
+int RunJob(const int fd, const JSONValue &job) {
+    std::mutex send_mutex;
+    FrameBuffer out(fd, 'O', send_mutex), err(fd, 'E', send_mutex);
+    Redirect cout_redirect(std::cout, &out), cerr_redirect(std::cerr, &err);
+    int code = EXIT_FAILURE;
+    try {
+        std::istringstream in(job.has("input") ? job["input"].string() : "");
+        Redirect cin_redirect(std::cin, in.rdbuf());
+        JobScope scope(job["cwd"].string(), job.has("env") ? job["env"] : JSONValue());
+        code = RunProgram(job["program"].string(), job.has("args") ? job["args"].strings() : std::vector<std::string>());
+    } catch (const ExitException &e) {
+        code = e.code;
+    } catch (const std::exception &e) {
+        std::cerr << e.what() << std::endl;
+    }
+    return code;
+}
+
+void HandleClient(const int fd, const bool verbose) {
+    std::string text;
+    char buffer[4096];
+    ssize_t got;
+    while ((got = recv(fd, buffer, sizeof(buffer), 0)) != 0) {
+        if (got < 0 && errno == EINTR) {
+            continue;
+        } else if (got < 0) {
+            return;
+        }
+        text.append(buffer, got);
+    }
+    if (text.empty()) {
+        return; // Another qi_server checking if this one is running
+    }
+    const auto start = std::chrono::steady_clock::now();
+    int32_t code = EXIT_FAILURE;
+    try {
+        const JSONValue job = JSONValue::Parse(text);
+        if (verbose) {
+            std::cout << "Running " << job["program"].string();
+            if (job.has("args")) {
+                for (const auto &a : job["args"].strings()) std::cout << " " << a;
+            }
+            std::cout << std::endl;
+        }
+        code = RunJob(fd, job);
+    } catch (const std::exception &e) {
+        const std::string message = std::string("Invalid job: ") + e.what() + "\n";
+        SendFrame(fd, 'E', message.data(), message.size());
+    }
+    SendFrame(fd, 'X', reinterpret_cast<const char *>(&code), sizeof(code));
+    if (verbose) {
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        std::cout << "Finished with code " << code << " in " << elapsed.count() << "s" << std::endl;
+    }
+}
+
+sockaddr_un SocketAddress(const std::string &path) {
+    sockaddr_un addr;
+    std::memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path)) {
+        QI_FAIL("Socket path is too long: " << path);
+    }
+    std::strncpy(addr.sun_path, path.c_str(), sizeof(addr.sun_path) - 1);
+    return addr;
+}
+
+/*
+ * True if the process at the other end of a connected socket belongs to this user. The socket
+ * permissions are not enough on their own, because another user could have created the socket.
+ */
+bool PeerIsUser(const int fd) {
+#if defined(__linux__)
+    struct ucred cred;
+    socklen_t length = sizeof(cred);
+    if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &length) != 0) {
+        return false;
+    }
+    return cred.uid == getuid();
+#else
+    uid_t uid;
+    gid_t gid;
+    if (getpeereid(fd, &uid, &gid) != 0) {
+        return false;
+    }
+    return uid == getuid();
+#endif
+}
+
+/*
+ * Create dir if it does not exist, then check that it is a real directory that only this user
+ * can use
+ */
+void PrivateDirectory(const std::string &dir) {
+    if (mkdir(dir.c_str(), 0700) != 0 && errno != EEXIST) {
+        QI_FAIL("Could not create directory " << dir << ": " << std::strerror(errno));
+    }
+    struct stat info;
+    if (lstat(dir.c_str(), &info) != 0) {
+        QI_FAIL("Could not check directory " << dir << ": " << std::strerror(errno));
+    }
+    if (!S_ISDIR(info.st_mode) || (info.st_uid != getuid()) || ((info.st_mode & 077) != 0)) {
+        QI_FAIL("Directory " << dir << " is not private to this user, refusing to use it for the server socket");
+    }
+}
+
+/*
+ * Returns a connected socket, or -1 if nothing is listening at path
+ */
+int Connect(const std::string &path) {
+    const sockaddr_un addr = SocketAddress(path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+} // End anonymous namespace
+
+std::string ServerSocketPath() {
+    const char *env_path = getenv("QUIT_SERVER");
+    if (env_path) {
+        return env_path;
+    }
+    const char *runtime_dir = getenv("XDG_RUNTIME_DIR");
+    if (runtime_dir && *runtime_dir) {
+        return std::string(runtime_dir) + "/qi_server.sock";
+    }
+    const std::string dir = "/tmp/qi_server-" + std::to_string(getuid());
+    PrivateDirectory(dir);
+    return dir + "/socket";
+}
+
+void Serve(const std::string &socketPath, const bool verbose) {
+    const int existing = Connect(socketPath);
+    if (existing >= 0) {
+        close(existing);
+        QI_FAIL("A server is already listening on " << socketPath);
+    }
+    unlink(socketPath.c_str()); // Left behind by a server that did not shut down cleanly
+    const sockaddr_un addr = SocketAddress(socketPath);
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        QI_FAIL("Could not create socket: " << std::strerror(errno));
+    }
+    const mode_t mask = umask(0177); // Only this user can connect
+    const int bound = bind(fd, reinterpret_cast<const sockaddr *>(&addr), sizeof(addr));
+    umask(mask);
+    if (bound != 0 || listen(fd, 16) != 0) {
+        close(fd);
+        QI_FAIL("Could not listen on " << socketPath << ": " << std::strerror(errno));
+    }
+    struct sigaction action;
+    std::memset(&action, 0, sizeof(action));
+    action.sa_handler = StopServing; // No SA_RESTART, so that accept() is interrupted
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    SetExitThrows(true);
+    if (verbose) std::cout << "Listening on " << socketPath << std::endl;
+    while (!stop_serving) {
+        const int client = accept(fd, nullptr, nullptr);
+        if (client < 0) {
+            continue;
+        }
+        if (!PeerIsUser(client)) {
+            if (verbose) std::cout << "Refused a connection from another user" << std::endl;
+            close(client);
+            continue;
+        }
+        HandleClient(client, verbose);
+        close(client);
+    }
+    SetExitThrows(false);
+    close(fd);
+    unlink(socketPath.c_str());
+    if (verbose) std::cout << "Stopped." << std::endl;
+}
+
+bool SubmitJob(const std::string &socketPath, const std::string &program,
+               const std::vector<std::string> &args, const std::string &input, int &code) {
+    const int fd = Connect(socketPath);
+    if (fd < 0) {
+        return false;
+    }
+    if (!PeerIsUser(fd)) {
+        close(fd);
+        QI_FAIL("The server on " << socketPath << " belongs to another user, refusing to send the job");
+    }
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) {
+        QI_FAIL("Could not read the working directory");
+    }
+    std::string job = "{\"program\": " + JSONQuote(program) + ", \"cwd\": " + JSONQuote(cwd) +
+                      ", \"input\": " + JSONQuote(input) + ", \"env\": {";
+    bool first = true;
+    for (const auto &name : SettingVariables()) {
+        if (const char *value = getenv(name.c_str())) {
+            job += (first ? "" : ", ") + JSONQuote(name) + ": " + JSONQuote(value);
+            first = false;
+        }
+    }
+    job += "}, \"args\": [";
+    for (size_t i = 0; i < args.size(); i++) {
+        job += (i ? ", " : "") + JSONQuote(args[i]);
+    }
+    job += "]}";
+    if (!SendAll(fd, job.data(), job.size())) {
+        close(fd);
+        QI_FAIL("Could not send job to the server on " << socketPath);
+    }
+    shutdown(fd, SHUT_WR);
+    bool finished = false;
+    char header[5];
+    std::vector<char> data;
+    while (!finished && RecvAll(fd, header, sizeof(header))) {
+        uint32_t n;
+        std::memcpy(&n, header + 1, sizeof(n));
+        data.resize(n);
+        if (!RecvAll(fd, data.data(), n)) {
+            break;
+        }
+        if (header[0] == 'O') {
+            std::fwrite(data.data(), 1, n, stdout);
+            std::fflush(stdout);
+        } else if (header[0] == 'E') {
+            std::fwrite(data.data(), 1, n, stderr);
+        } else if (header[0] == 'X' && n == sizeof(int32_t)) {
+            int32_t c;
+            std::memcpy(&c, data.data(), sizeof(c));
+            code = c;
+            finished = true;
+        }
+    }
+    close(fd);
+    if (!finished) {
+        std::cerr << "Lost connection to the server on " << socketPath << std::endl;
+        code = EXIT_FAILURE;
+    }
+    return true;
+}
+
+} // End namespace QI
@@ -0,0 +1,39 @@
+/*
+ *  Server.h
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#ifndef QI_SERVER_H
+#define QI_SERVER_H
+
+#include <string>
+#include <vector>
+
+namespace QI {
+
+std::string ServerSocketPath(); //!< $QUIT_SERVER, or a socket in $XDG_RUNTIME_DIR or a private directory in /tmp
+
+/*
+ * Listen on a Unix domain socket and run each job in this process, one at a time, until SIGINT or
+ * SIGTERM. A job is a JSON object with the program, its arguments, its stdin, the client's
+ * working directory and the client's values of the QUIT environment variables. Output to std::cout and std::cerr is sent back to the client as it is
+ * written, followed by the exit code. Connections from other users are refused.
+ */
+void Serve(const std::string &socketPath, const bool verbose);
+
+/*
+ * Run a program on the server, copying its output to stdout and stderr as it arrives, and set code
+ * to its exit code. Returns false if no server is listening, in which case code is not changed.
+ */
+bool SubmitJob(const std::string &socketPath, const std::string &program,
+               const std::vector<std::string> &args, const std::string &input, int &code);
+
+} // End namespace QI
+
+#endif // QI_SERVER_H
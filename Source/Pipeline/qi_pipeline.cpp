@@ -0,0 +1,57 @@
+/*
+ *  qi_pipeline.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+
+#include "Args.h"
+#include "Util.h"
+#include "Pipeline.h"
+#include "Programs.h"
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    args::ArgumentParser parser("Runs several QUIT programs in one process, described by a JSON file.\n"
+                                "Images passed between stages stay in memory and only the listed outputs are written.\n"
+                                "http://github.com/spinicist/QUIT");
+    args::Positional<std::string> pipeline_path(parser, "PIPELINE", "JSON pipeline file (default is stdin)");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::Flag     write_all(parser, "WRITE ALL", "Write every image to disk, not only the outputs", {'a', "all"});
+    args::Flag     list(parser, "LIST", "List the programs that can be used in a pipeline", {"list"});
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    if (list) {
+        for (const auto &name : QI::ProgramNames()) {
+            std::cout << name << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+    std::stringstream text;
+    if (pipeline_path) {
+        if (verbose) std::cout << "Reading pipeline from: " << pipeline_path.Get() << std::endl;
+        std::ifstream file(pipeline_path.Get());
+        if (!file) {
+            QI_FAIL("Could not open pipeline file: " << pipeline_path.Get());
+        }
+        text << file.rdbuf();
+    } else {
+        text << std::cin.rdbuf();
+    }
+    const QI::Pipeline pipeline(QI::JSONValue::Parse(text.str()));
+    if (verbose) std::cout << "Pipeline has " << pipeline.stages().size() << " stages" << std::endl;
+    pipeline.run(verbose, !write_all);
+    if (verbose) std::cout << "Finished." << std::endl;
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/*
+ *  qi_server.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ */
+
+#include <iostream>
+#include <sstream>
+#include <unistd.h>
+
+#include "Args.h"
+#include "Util.h"
+#include "Programs.h"
+#include "Redirect.h"
+#include "Server.h"
+
+namespace {
+
+/*
+ * Send a job to the server, or run it here if there is no server so that scripts work either way
+ */
+int Submit(const std::string &socketPath, const std::string &program, const std::vector<std::string> &args) {
+    if (!QI::FindProgram(program)) {
+        QI_FAIL("Unknown program: " << program << ", see qi_server --list");
+    }
+    std::stringstream input;
+    if (!isatty(STDIN_FILENO)) {
+        input << std::cin.rdbuf();
+    }
+    int code;
+    if (QI::SubmitJob(socketPath, program, args, input.str(), code)) {
+        return code;
+    }
+    std::istringstream in(input.str());
+    QI::Redirect cin_redirect(std::cin, in.rdbuf());
+    return QI::RunProgram(program, args);
+}
+
+} // End anonymous namespace
+
+//******************************************************************************
+// Main
+//******************************************************************************
+int main(int argc, char **argv) {
+    /*
+     * When called through a symlink named after a program, e.g. qidespot1 -> qi_server, pass the
+     * whole command line to the server
+     */
+    const std::string argv0 = argv[0];
+    const std::string called_as = argv0.substr(argv0.find_last_of('/') + 1);
+    if (called_as != "qi_server" && QI::FindProgram(called_as)) {
+        return Submit(QI::ServerSocketPath(), called_as, std::vector<std::string>(argv + 1, argv + argc));
+    }
+
+    args::ArgumentParser parser("Keeps QUIT programs loaded in one process and runs jobs sent to it.\n"
+                                "Start the server with no command, then run jobs with qi_server -- PROGRAM ARGS...\n"
+                                "http://github.com/spinicist/QUIT");
+    args::PositionalList<std::string> command(parser, "COMMAND", "Program and arguments to run on the server");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<std::string> socket_path(parser, "SOCKET", "Socket to use (default $QUIT_SERVER, $XDG_RUNTIME_DIR/qi_server.sock or /tmp/qi_server-UID/socket)", {"socket"});
+    args::Flag     list(parser, "LIST", "List the programs that can be run on the server", {"list"});
+    QI::ParseArgs(parser, argc, argv, verbose);
+
+    if (list) {
+        for (const auto &name : QI::ProgramNames()) {
+            std::cout << name << std::endl;
+        }
+        return EXIT_SUCCESS;
+    }
+    const std::string path = socket_path ? socket_path.Get() : QI::ServerSocketPath();
+    if (command) {
+        const std::vector<std::string> &c = command.Get();
+        return Submit(path, c.front(), std::vector<std::string>(c.begin() + 1, c.end()));
+    }
+    QI::Serve(path, verbose);
+    return EXIT_SUCCESS;
+}
@@ -10,6 +10,7 @@
  */
 
 #include <iostream>
+#include <algorithm>
 
 #include <Eigen/Dense>
 #include "ceres/ceres.h"
@@ -19,8 +20,11 @@
 #include "SPGRSequence.h"
 #include "SequenceCereal.h"
 #include "Util.h"
+#include "Fit.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
+#include "LevMar.h"
 
 //******************************************************************************
 // Algorithm Subclasses
@@ -53,73 +57,144 @@ public:
         std::vector<float> def(1, 1.0f);
         return def;
     }
+
+protected:
+    static const size_t BlockSize = 64;
+
+    /*
+     * Gather a block of voxels with one row per voxel and form the linearised DESPOT1 problem
+     * Y = slope * X + intercept, where slope = E1 and intercept = PD * (1 - E1)
+     */
+    void linearise(const size_t n, const std::vector<std::vector<TInput>> &inputs,
+                   const std::vector<std::vector<TConst>> &consts,
+                   Eigen::ArrayXXd &data, Eigen::ArrayXd &B1,
+                   Eigen::ArrayXXd &X, Eigen::ArrayXXd &Y) const
+    {
+        const Eigen::Index nD = m_sequence.size();
+        data.resize(n, nD); B1.resize(n); X.resize(n, nD); Y.resize(n, nD);
+        for (size_t v = 0; v < n; v++) {
+            for (Eigen::Index k = 0; k < nD; k++) {
+                data(v, k) = inputs[v][0][k];
+            }
+            B1[v] = consts[v][0];
+        }
+        for (Eigen::Index k = 0; k < nD; k++) {
+            const Eigen::ArrayXd flip = m_sequence.FA[k] * B1;
+            X.col(k) = data.col(k) / flip.tan();
+            Y.col(k) = data.col(k) / flip.sin();
+        }
+    }
+
+    /*
+     * Clamp the parameters, then fill in the outputs and residuals for each voxel in the block
+     */
+    void finish(const size_t n, const Eigen::ArrayXXd &data, const Eigen::ArrayXd &B1,
+                const Eigen::ArrayXd &PD, const Eigen::ArrayXd &T1,
+                std::vector<std::vector<TOutput>> &outputs,
+                std::vector<TOutput> &residuals, std::vector<TInput> &resids) const
+    {
+        const Eigen::ArrayXd cPD = PD.max(m_loPD).min(m_hiPD);
+        const Eigen::ArrayXd cT1 = T1.max(m_loT1).min(m_hiT1);
+        const Eigen::ArrayXd E1 = (-m_sequence.TR / cT1).exp();
+        Eigen::ArrayXXd r(n, data.cols());
+        for (Eigen::Index k = 0; k < data.cols(); k++) {
+            const Eigen::ArrayXd flip = m_sequence.FA[k] * B1;
+            const Eigen::ArrayXd theory = (cPD * (1. - E1) * flip.sin() / (1. - E1*flip.cos())).abs();
+            r.col(k) = data.col(k) - theory;
+        }
+        const Eigen::ArrayXd rms = (r.square().rowwise().sum() / r.cols()).sqrt();
+        for (size_t v = 0; v < n; v++) {
+            outputs[v][0] = cPD[v];
+            outputs[v][1] = cT1[v];
+            residuals[v] = rms[v];
+            for (size_t k = 0; k < resids[v].Size(); k++) {
+                resids[v][k] = r(v, k);
+            }
+        }
+    }
 };
 
 class D1LLS : public D1Algo {
 public:
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> &consts,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
+    {
+        Eigen::ArrayXXd data, X, Y;
+        Eigen::ArrayXd B1, b0, b1;
+        linearise(n, inputs, consts, data, B1, X, Y);
+        QI::LinearRegression(X, Y, b0, b1);
+        const Eigen::ArrayXd PD = b1 / (1. - b0);
+        const Eigen::ArrayXd T1 = -m_sequence.TR / b0.log();
+        finish(n, data, B1, PD, T1, outputs, residuals, resids);
+        std::fill(its.begin(), its.begin() + n, 1);
+        return true;
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
                TInput &resids, TIterations &its) const override
     {
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
-        double B1 = consts[0];
-        Eigen::ArrayXd flip = m_sequence.FA * B1;
-        Eigen::VectorXd Y = data / flip.sin();
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / flip.tan();
-        X.col(1).setOnes();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        outputs[0] = QI::Clamp(b[1] / (1. - b[0]), m_loPD, m_hiPD);
-        outputs[1] = QI::Clamp(-m_sequence.TR / log(b[0]), m_loT1, m_hiT1);
-        Eigen::ArrayXd theory = QI::One_SPGR(m_sequence.FA, m_sequence.TR, outputs[0], outputs[1], B1).array().abs();
-        Eigen::ArrayXf r = (data.array() - theory).cast<float>();
-        residual = sqrt(r.square().sum() / r.rows());
-        resids = itk::VariableLengthVector<float>(r.data(), r.rows());
-        its = 1;
-        return true;
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
     }
 };
 
 class D1WLLS : public D1Algo {
 public:
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
-               TInput &resids, TIterations &its) const override
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> &consts,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
     {
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
-        double B1 = consts[0];
-        Eigen::ArrayXd flip = m_sequence.FA * B1;
-        Eigen::VectorXd Y = data / flip.sin();
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / flip.tan();
-        X.col(1).setOnes();
-        Eigen::Vector2d b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        Eigen::Array2d out;
-        out[1] = -m_sequence.TR / log(b[0]);
-        out[0] = b[1] / (1. - b[0]);
-        for (its = 0; its < m_iterations; its++) {
-            Eigen::VectorXd W = (flip.sin() / (1. - (exp(-m_sequence.TR/outputs[1])*flip.cos()))).square();
-            b = (X.transpose() * W.asDiagonal() * X).partialPivLu().solve(X.transpose() * W.asDiagonal() * Y);
-            Eigen::Array2d newOut;
-            newOut[1] = -m_sequence.TR / log(b[0]);
-            newOut[0] = b[1] / (1. - b[0]);
-            if (newOut.isApprox(out))
-                break;
-            else
-                out = newOut;
+        Eigen::ArrayXXd data, X, Y;
+        Eigen::ArrayXd B1, b0, b1;
+        linearise(n, inputs, consts, data, B1, X, Y);
+        QI::LinearRegression(X, Y, b0, b1);
+        Eigen::ArrayXd PD = b1 / (1. - b0);
+        Eigen::ArrayXd T1 = -m_sequence.TR / b0.log();
+        // All voxels in the block iterate in lock-step, converged voxels are masked out
+        Eigen::Array<bool, Eigen::Dynamic, 1> active = Eigen::Array<bool, Eigen::Dynamic, 1>::Constant(n, true);
+        Eigen::ArrayXi iterations = Eigen::ArrayXi::Zero(n);
+        Eigen::ArrayXXd W(n, data.cols());
+        for (int i = 0; (i < m_iterations) && active.any(); i++) {
+            const Eigen::ArrayXd E1 = (-m_sequence.TR / T1).exp();
+            for (Eigen::Index k = 0; k < data.cols(); k++) {
+                const Eigen::ArrayXd flip = m_sequence.FA[k] * B1;
+                W.col(k) = (flip.sin() / (1. - E1*flip.cos())).square();
+            }
+            QI::LinearRegression(X, Y, W, b0, b1);
+            const Eigen::ArrayXd newPD = b1 / (1. - b0);
+            const Eigen::ArrayXd newT1 = -m_sequence.TR / b0.log();
+            const Eigen::ArrayXd diff = ((newPD - PD).square() + (newT1 - T1).square()).sqrt();
+            const Eigen::ArrayXd norm = (PD.square() + T1.square()).sqrt().min((newPD.square() + newT1.square()).sqrt());
+            const Eigen::Array<bool, Eigen::Dynamic, 1> update = active && !(diff <= Eigen::NumTraits<double>::dummy_precision() * norm);
+            PD = update.select(newPD, PD);
+            T1 = update.select(newT1, T1);
+            iterations += update.cast<int>();
+            active = update;
+        }
+        finish(n, data, B1, PD, T1, outputs, residuals, resids);
+        for (size_t v = 0; v < n; v++) {
+            its[v] = iterations[v];
         }
-        outputs[0] = QI::Clamp(out[0], m_loPD, m_hiPD);
-        outputs[1] = QI::Clamp(out[1], m_loT1, m_hiT1);
-        Eigen::ArrayXd theory = QI::One_SPGR(m_sequence.FA, m_sequence.TR, outputs[0], outputs[1], B1).array().abs();
-        Eigen::ArrayXf r = (data.array() - theory).cast<float>();
-        residual = sqrt(r.square().sum() / r.rows());
-        resids = itk::VariableLengthVector<float>(r.data(), r.rows());
         return true;
     }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
 };
 
 class T1Cost : public ceres::CostFunction {
@@ -154,9 +229,31 @@ public:
 
 };
 
+struct T1Functor {
+    typedef QI::LevMar<2> TSolver;
+    const QI::SPGRSequence &m_seq;
+    const Eigen::ArrayXd &m_data;
+    const double m_B1;
+
+    int values() const { return m_data.rows(); }
+
+    bool operator()(const TSolver::TParams &p, TSolver::TResiduals &r) const {
+        r = QI::One_SPGR(m_seq.FA, m_seq.TR, p[0], p[1], m_B1).array().abs() - m_data;
+        return true;
+    }
+
+    bool jacobian(const TSolver::TParams &p, TSolver::TJacobian &j) const {
+        j = QI::One_SPGR_Magnitude_Derivs(m_seq.FA, m_seq.TR, p[0], p[1], m_B1);
+        return true;
+    }
+};
+
 class D1NLLS : public D1Algo {
+protected:
+    bool m_ceres = false;
+
 public:
-    D1NLLS() {
+    D1NLLS(const bool c = false) : m_ceres(c) {
         m_loT1 = 1e-6;
         m_loPD = 1e-6;
     }
@@ -176,6 +273,38 @@ public:
             return false;
         }
         const Eigen::ArrayXd data = indata.cast<double>() / scale;
+        if (m_ceres) {
+            return apply_ceres(data, B1, scale, outputs, residual, resids, its);
+        }
+        T1Functor cost{m_sequence, data, B1};
+        T1Functor::TSolver solver(data.rows());
+        solver.setLowerBound(0, m_loPD / scale);
+        solver.setUpperBound(0, m_hiPD / scale);
+        solver.setLowerBound(1, m_loT1);
+        solver.setUpperBound(1, m_hiT1);
+        solver.setMaxIterations(50);
+        solver.setTolerances(1e-5, 1e-6, 1e-4);
+        T1Functor::TSolver::TParams p; p << 10., 1.;
+        solver.solve(cost, p);
+        if (!solver.usable()) {
+            std::cout << "NLLS failed: " << solver.status() << std::endl;
+        }
+        outputs[0] = p[0] * scale;
+        outputs[1] = p[1];
+        its = solver.iterations();
+        residual = solver.cost() * scale;
+        if (resids.Size() > 0) {
+            assert(resids.Size() == data.size());
+            for (int i = 0; i < data.size(); i++)
+                resids[i] = solver.residuals()[i];
+        }
+        return true;
+    }
+
+    bool apply_ceres(const Eigen::ArrayXd &data, const double B1, const double scale,
+                     std::vector<TOutput> &outputs, TConst &residual,
+                     TInput &resids, TIterations &its) const
+    {
         Eigen::Array2d p; p << 10., 1.;
         ceres::Problem problem;
         problem.AddResidualBlock(new T1Cost(m_sequence, data, B1), NULL, p.data());
@@ -194,13 +323,13 @@ public:
         // std::cout << "START P: " << p.transpose() << std::endl;
         ceres::Solve(options, &problem, &summary);
         
-        outputs[0] = p[0] * indata.maxCoeff();
+        outputs[0] = p[0] * scale;
         outputs[1] = p[1];
         if (!summary.IsSolutionUsable()) {
             std::cout << summary.FullReport() << std::endl;
         }
         its = summary.iterations.size();
-        residual = summary.final_cost * indata.maxCoeff();
+        residual = summary.final_cost * scale;
         if (resids.Size() > 0) {
             assert(resids.Size() == data.size());
             std::vector<double> r_temp(data.size());
@@ -231,51 +360,70 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampPD(parser, "CLAMP PD", "Clamp PD between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> clampT1(parser, "CLAMP T1", "Clamp T1 between 0 and value", {'t',"clampT1"}, std::numeric_limits<float>::infinity());
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::Flag use_ceres(parser, "CERES", "Use Ceres instead of the built-in Levenberg-Marquardt solver for NLLS", {"ceres"});
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
-    if (verbose) std::cout << "Opening SPGR file: " << QI::CheckPos(spgr_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(spgr_path));
+    const auto region = subregion ? QI::RegionArg(args::get(subregion)) : QI::VolumeF::RegionType();
     std::shared_ptr<D1Algo> algo;
     switch (algorithm.Get()) {
         case 'l': algo = std::make_shared<D1LLS>();  if (verbose) std::cout << "LLS algorithm selected." << std::endl; break;
         case 'w': algo = std::make_shared<D1WLLS>(); if (verbose) std::cout << "WLLS algorithm selected." << std::endl; break;
-        case 'n': algo = std::make_shared<D1NLLS>(); if (verbose) std::cout << "NLLS algorithm selected." << std::endl; break;
+        case 'n': algo = std::make_shared<D1NLLS>(use_ceres); if (verbose) std::cout << "NLLS algorithm selected." << std::endl; break;
     }
     algo->setIterations(its.Get());
     if (clampPD) algo->setClampPD(1e-6, clampPD.Get());
     if (clampT1) algo->setClampT1(1e-6, clampT1.Get());
     auto spgrSequence = QI::ReadSequence<QI::SPGRSequence>(std::cin, verbose);
     algo->setSequence(spgrSequence);
-    auto apply = QI::ApplyF::New();
-    apply->SetVerbose(verbose);
-    apply->SetAlgorithm(algo);
-    apply->SetOutputAllResiduals(resids);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
-    apply->SetInput(0, data);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string outPrefix = outarg.Get() + "D1_";
-    QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(1), outPrefix + "T1" + QI::OutExt());
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
-    if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
-    }
-    if (its) {
-        QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
-    }
+
+    struct D1Inputs {
+        QI::VectorVolumeF::Pointer data;
+        QI::VolumeF::Pointer B1, mask;
+    };
+    QI::RunBatch<D1Inputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            D1Inputs in;
+            if (verbose) std::cout << "Opening SPGR file: " << subject.path(QI::CheckPos(spgr_path)) << std::endl;
+            in.data = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(spgr_path)), region);
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()), region);
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()), region);
+            return in;
+        },
+        [&](D1Inputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetVerbose(verbose);
+            apply->SetAlgorithm(algo);
+            apply->SetOutputAllResiduals(resids);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
+            apply->SetInput(0, in.data);
+            if (in.B1) apply->SetConst(0, in.B1);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) apply->SetSubregion(region);
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "D1_";
+            return [apply, outPrefix, &resids, &its]{
+                QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(1), outPrefix + "T1" + QI::OutExt());
+                QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+                if (resids) {
+                    QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+                }
+                if (its) {
+                    QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
@@ -22,7 +22,9 @@
 #include "SequenceCereal.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "ApplyTypes.h"
+#include "LevMar.h"
 
 class SPGRCost : public ceres::CostFunction {
 protected:
@@ -104,15 +106,69 @@ public:
     }
 };
 
+struct HIFIFunctor {
+    typedef QI::LevMar<3> TSolver;
+    const QI::SPGRSequence &m_seq;
+    const Eigen::ArrayXd &m_data;
+    const IRCostFunction m_ir;
+
+    int values() const { return m_data.rows() + 1; }
+
+    bool operator()(const TSolver::TParams &p, TSolver::TResiduals &r) const {
+        const double &M0 = p[0];
+        const double &T1 = p[1];
+        const double &B1 = p[2];
+
+        const Eigen::ArrayXd sa = sin(B1 * m_seq.FA);
+        const Eigen::ArrayXd ca = cos(B1 * m_seq.FA);
+        const double E1 = exp(-m_seq.TR / T1);
+        const Eigen::ArrayXd denom = (1.-E1*ca);
+        r.head(m_data.rows()) = M0*sa*(1-E1)/denom - m_data;
+        return m_ir(p.data(), r.data() + m_data.rows());
+    }
+
+    bool jacobian(const TSolver::TParams &p, TSolver::TJacobian &j) const {
+        const double &M0 = p[0];
+        const double &T1 = p[1];
+        const double &B1 = p[2];
+
+        const Eigen::ArrayXd sa = sin(B1 * m_seq.FA);
+        const Eigen::ArrayXd ca = cos(B1 * m_seq.FA);
+        const double E1 = exp(-m_seq.TR / T1);
+        const Eigen::ArrayXd denom = (1.-E1*ca);
+        const int n = m_data.rows();
+        j.block(0, 0, n, 1) = (1-E1)*sa/denom;
+        j.block(0, 1, n, 1) = E1*M0*m_seq.TR*(ca-1.)*sa/((denom*T1).square());
+        j.block(0, 2, n, 1) = M0*m_seq.FA*(1.-E1)*(ca-E1)/denom.square();
+        // Only one IR residual, so a forward difference is cheap
+        double r0, r1;
+        if (!m_ir(p.data(), &r0)) {
+            return false;
+        }
+        TSolver::TParams ph = p;
+        for (int i = 0; i < 3; i++) {
+            const double h = 1e-6 * std::max(std::abs(p[i]), 1.);
+            ph[i] = p[i] + h;
+            if (!m_ir(ph.data(), &r1)) {
+                return false;
+            }
+            j(n, i) = (r1 - r0) / h;
+            ph[i] = p[i];
+        }
+        return true;
+    }
+};
+
 class HIFIAlgo : public QI::ApplyF::Algorithm {
 private:
     const QI::SPGRSequence &m_spgr;
     const QI::MPRAGESequence &m_mprage;
     double m_lo = 0;
     double m_hi = std::numeric_limits<double>::infinity();
+    bool m_ceres = false;
 public:
-    HIFIAlgo(const QI::SPGRSequence &s, const QI::MPRAGESequence &m, const float hi) :
-        m_spgr(s), m_mprage(m), m_hi(hi)
+    HIFIAlgo(const QI::SPGRSequence &s, const QI::MPRAGESequence &m, const float hi, const bool c = false) :
+        m_spgr(s), m_mprage(m), m_hi(hi), m_ceres(c)
     {}
     size_t numInputs() const override  { return 2; }
     size_t numConsts() const override  { return 0; }
@@ -136,6 +192,40 @@ public:
         double scale = std::max(spgr_in.maxCoeff(), ir_in.maxCoeff());
         const Eigen::ArrayXd spgr_data = spgr_in.cast<double>() / scale;
         const Eigen::ArrayXd ir_data = ir_in.cast<double>() / scale;
+        if (m_ceres) {
+            return apply_ceres(spgr_data, ir_data, scale, outputs, residual, resids, its);
+        }
+        HIFIFunctor cost{m_spgr, spgr_data, IRCostFunction(m_mprage, ir_data)};
+        HIFIFunctor::TSolver solver(cost.values());
+        solver.setLowerBound(0, 1.);
+        solver.setLowerBound(1, 0.001);
+        solver.setUpperBound(1, 5.0);
+        solver.setLowerBound(2, 0.1);
+        solver.setUpperBound(2, 2.0);
+        solver.setMaxIterations(50);
+        solver.setTolerances(1e-5, 1e-6, 1e-4);
+        HIFIFunctor::TSolver::TParams p; p << 10., 1., 1.; // PD, T1, B1
+        solver.solve(cost, p);
+        if (!solver.usable()) {
+            std::cout << "NLLS failed: " << solver.status() << std::endl;
+        }
+        outputs[0] = p[0] * scale;
+        outputs[1] = QI::Clamp(p[1], m_lo, m_hi);
+        outputs[2] = p[2];
+        its = solver.iterations();
+        residual = solver.cost() * scale;
+        if (resids.Size() > 0) {
+            for (int i = 0; i < solver.residuals().rows(); i++) {
+                resids[i] = solver.residuals()[i];
+            }
+        }
+        return true;
+    }
+
+    bool apply_ceres(const Eigen::ArrayXd &spgr_data, const Eigen::ArrayXd &ir_data, const double scale,
+                     std::vector<TOutput> &outputs, TConst &residual,
+                     TInput &resids, TIterations &its) const
+    {
         double spgr_pars[] = {10., 1., 1.}; // PD, T1, B1
         ceres::Problem problem;
         problem.AddResidualBlock(new SPGRCost(m_spgr, spgr_data), NULL, spgr_pars);
@@ -195,41 +285,58 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::Flag use_ceres(parser, "CERES", "Use Ceres instead of the built-in Levenberg-Marquardt solver", {"ceres"});
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
-    if (verbose) std::cout << "Reading SPGR file: " << QI::CheckPos(spgr_path) << std::endl;
-    auto spgrImg = QI::ReadVectorImage(QI::CheckPos(spgr_path));
+    const auto region = subregion ? QI::RegionArg(args::get(subregion)) : QI::VolumeF::RegionType();
     cereal::JSONInputArchive input(std::cin);
     auto spgr_sequence = QI::ReadSequence<QI::SPGRSequence>(input, verbose);
-    if (verbose) std::cout << "Reading MPRAGE file: " << QI::CheckPos(ir_path) << std::endl;
-    auto irImg = QI::ReadVectorImage(QI::CheckPos(ir_path));
     auto ir_sequence = QI::ReadSequence<QI::MPRAGESequence>(input, verbose);
+    auto hifi = std::make_shared<HIFIAlgo>(spgr_sequence, ir_sequence, clamp.Get(), use_ceres);
 
-    auto apply = QI::ApplyF::New();
-    auto hifi = std::make_shared<HIFIAlgo>(spgr_sequence, ir_sequence, clamp.Get());
-    apply->SetAlgorithm(hifi);
-    apply->SetOutputAllResiduals(all_resids);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
-    apply->SetVerbose(verbose);
-    apply->SetInput(0, spgrImg);
-    apply->SetInput(1, irImg);
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (verbose) std::cout << "Processing..." << std::endl;
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string out_prefix = args::get(outarg) + "HIFI_";
-    QI::WriteImage(apply->GetOutput(0), out_prefix + "PD" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(1), out_prefix + "T1" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(2), out_prefix + "B1" + QI::OutExt());
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), out_prefix + "residual"  + QI::OutExt());
-    if (all_resids) {
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_prefix + "all_residuals" + QI::OutExt());
-    }
+    struct HIFIInputs {
+        QI::VectorVolumeF::Pointer spgr, ir;
+        QI::VolumeF::Pointer mask;
+    };
+    QI::RunBatch<HIFIInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            HIFIInputs in;
+            if (verbose) std::cout << "Reading SPGR file: " << subject.path(QI::CheckPos(spgr_path)) << std::endl;
+            in.spgr = QI::ReadVectorImage(subject.path(QI::CheckPos(spgr_path)), region);
+            if (verbose) std::cout << "Reading MPRAGE file: " << subject.path(QI::CheckPos(ir_path)) << std::endl;
+            in.ir = QI::ReadVectorImage(subject.path(QI::CheckPos(ir_path)), region);
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()), region);
+            return in;
+        },
+        [&](HIFIInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(hifi);
+            apply->SetOutputAllResiduals(all_resids);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get());
+            apply->SetVerbose(verbose);
+            apply->SetInput(0, in.spgr);
+            apply->SetInput(1, in.ir);
+            if (subregion) apply->SetSubregion(region);
+            if (in.mask) apply->SetMask(in.mask);
+            if (verbose) std::cout << "Processing..." << std::endl;
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string out_prefix = subject.path(args::get(outarg)) + "HIFI_";
+            return [apply, out_prefix, &all_resids]{
+                QI::WriteImage(apply->GetOutput(0), out_prefix + "PD" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(1), out_prefix + "T1" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(2), out_prefix + "B1" + QI::OutExt());
+                QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), out_prefix + "residual"  + QI::OutExt());
+                if (all_resids) {
+                    QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_prefix + "all_residuals" + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
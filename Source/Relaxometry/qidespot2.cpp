@@ -11,6 +11,7 @@
  */
 
 #include <iostream>
+#include <algorithm>
 
 #include <Eigen/Dense>
 #include <unsupported/Eigen/LevenbergMarquardt>
@@ -20,8 +21,10 @@
 #include "SSFPSequence.h"
 #include "SequenceCereal.h"
 #include "Util.h"
+#include "Fit.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "ApplyTypes.h"
 
 //******************************************************************************
@@ -54,106 +57,160 @@ public:
         std::vector<float> def(2, 1.0f); // T1, B1
         return def;
     }
-};
 
-class D2LLS : public D2Algo {
-public:
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
-               TInput &resids, TIterations &its) const override
+protected:
+    static const size_t BlockSize = 64;
+
+    /*
+     * Gather a block of voxels with one row per voxel and form the linearised DESPOT2 problem
+     */
+    void linearise(const size_t n, const std::vector<std::vector<TInput>> &inputs,
+                   const std::vector<std::vector<TConst>> &consts,
+                   Eigen::ArrayXXd &data, Eigen::ArrayXd &T1, Eigen::ArrayXd &B1,
+                   Eigen::ArrayXXd &X, Eigen::ArrayXXd &Y) const
+    {
+        const Eigen::Index nD = m_sequence->FA.rows();
+        data.resize(n, nD); T1.resize(n); B1.resize(n); X.resize(n, nD); Y.resize(n, nD);
+        for (size_t v = 0; v < n; v++) {
+            for (Eigen::Index k = 0; k < nD; k++) {
+                data(v, k) = inputs[v][0][k];
+            }
+            T1[v] = consts[v][0];
+            B1[v] = consts[v][1];
+        }
+        for (Eigen::Index k = 0; k < nD; k++) {
+            const Eigen::ArrayXd angle = m_sequence->FA[k] * B1;
+            X.col(k) = data.col(k) / angle.tan();
+            Y.col(k) = data.col(k) / angle.sin();
+        }
+    }
+
+    /*
+     * Convert the slope & intercept of the linear fit to PD & T2
+     */
+    void parameters(const Eigen::ArrayXd &E1, const Eigen::ArrayXd &b0, const Eigen::ArrayXd &b1,
+                    Eigen::ArrayXd &PD, Eigen::ArrayXd &T2) const
     {
-        const double T1 = consts[0];
-        const double B1 = consts[1];
         const double TR = m_sequence->TR;
-        const double E1 = exp(-TR / T1);
-        double PD, T2, E2;
-        const Eigen::ArrayXd angles = (m_sequence->FA * B1);
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
-        Eigen::VectorXd Y = data / angles.sin();
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / angles.tan();
-        X.col(1).setOnes();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
         if (m_elliptical) {
-            T2 = 2. * TR / log((b[0]*E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1*E2*E2) / (sqrt(E2) * (1. - E1));
+            T2 = 2. * TR / ((b0*E1 - 1.) / (b0 - E1)).log();
+            const Eigen::ArrayXd E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1*E2*E2) / (E2.sqrt() * (1. - E1));
         } else {
-            T2 = TR / log((b[0]*E1 - 1.)/(b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1*E2) / (1. - E1);
+            T2 = TR / ((b0*E1 - 1.) / (b0 - E1)).log();
+            const Eigen::ArrayXd E2 = (-TR / T2).exp();
+            PD = b1 * (1. - E1*E2) / (1. - E1);
+        }
+    }
+
+    /*
+     * Fill in the residuals and clamped outputs for each voxel in the block
+     */
+    void finish(const size_t n, const Eigen::ArrayXXd &data, const Eigen::ArrayXd &T1, const Eigen::ArrayXd &B1,
+                const Eigen::ArrayXd &PD, const Eigen::ArrayXd &T2,
+                std::vector<std::vector<TOutput>> &outputs,
+                std::vector<TOutput> &residuals, std::vector<TInput> &resids) const
+    {
+        Eigen::VectorXd p(5);
+        for (size_t v = 0; v < n; v++) {
+            p << PD[v], T1[v], T2[v], 0, B1[v];
+            const Eigen::ArrayXd theory = m_sequence->signal(m_model, p).abs();
+            const Eigen::ArrayXd r = data.row(v).transpose() - theory;
+            residuals[v] = sqrt(r.square().sum() / r.rows());
+            for (size_t k = 0; k < resids[v].Size(); k++) {
+                resids[v][k] = r[k];
+            }
+            outputs[v][0] = QI::Clamp(PD[v], m_loPD, m_hiPD);
+            outputs[v][1] = QI::Clamp(T2[v], m_loT2, m_hiT2);
         }
-        Eigen::VectorXd p(5); p << PD, T1, T2, 0, B1;
-        Eigen::ArrayXd theory = m_sequence->signal(m_model, p).abs();
-        Eigen::ArrayXf r = (data.array() - theory).cast<float>();
-        residual = sqrt(r.square().sum() / r.rows());
-        resids = itk::VariableLengthVector<float>(r.data(), r.rows());
-        outputs[0] = QI::Clamp(PD, m_loPD, m_hiPD);
-        outputs[1] = QI::Clamp(T2, m_loT2, m_hiT2);
-        its = 1;
-        return true;
     }
 };
 
-class D2WLLS : public D2Algo {
+class D2LLS : public D2Algo {
 public:
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> &consts,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
+    {
+        Eigen::ArrayXXd data, X, Y;
+        Eigen::ArrayXd T1, B1, b0, b1, PD, T2;
+        linearise(n, inputs, consts, data, T1, B1, X, Y);
+        const Eigen::ArrayXd E1 = (-m_sequence->TR / T1).exp();
+        QI::LinearRegression(X, Y, b0, b1);
+        parameters(E1, b0, b1, PD, T2);
+        finish(n, data, T1, B1, PD, T2, outputs, residuals, resids);
+        std::fill(its.begin(), its.begin() + n, 1);
+        return true;
+    }
+
     bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
                TInput &resids, TIterations &its) const override
     {
-        const double T1 = consts[0];
-        const double B1 = consts[1];
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
+};
+
+class D2WLLS : public D2Algo {
+public:
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> &consts,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
+    {
+        Eigen::ArrayXXd data, X, Y;
+        Eigen::ArrayXd T1, B1, b0, b1, PD, T2, newPD, newT2;
+        linearise(n, inputs, consts, data, T1, B1, X, Y);
         const double TR = m_sequence->TR;
-        const double E1 = exp(-TR / T1);
-        double PD, T2, E2;
-        const Eigen::ArrayXd angles = (m_sequence->FA * B1);
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
-        Eigen::VectorXd Y = data / angles.sin();
-        Eigen::MatrixXd X(Y.rows(), 2);
-        X.col(0) = data / angles.tan();
-        X.col(1).setOnes();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        if (m_elliptical) {
-            T2 = 2. * TR / log((b[0]*E1 - 1.) / (b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1*E2*E2) / (sqrt(E2) * (1. - E1));
-        } else {
-            T2 = TR / log((b[0]*E1 - 1.)/(b[0] - E1));
-            E2 = exp(-TR / T2);
-            PD = b[1] * (1. - E1*E2) / (1. - E1);
-        }
-        Eigen::VectorXd W(m_sequence->size());
-        for (size_t n = 0; n < m_iterations; n++) {
-            if (m_elliptical) {
-                W = ((1. - E1*E2) * angles.sin() / (1. - E1*E2*E2 - (E1 - E2*E2)*angles.cos())).square();
-            } else {
-                W = ((1. - E1*E2) * angles.sin() / (1. - E1*E2 - (E1 - E2)*angles.cos())).square();
-            }
-            b = (X.transpose() * W.asDiagonal() * X).partialPivLu().solve(X.transpose() * W.asDiagonal() * Y);
-            if (m_elliptical) {
-                T2 = 2. * TR / log((b[0]*E1 - 1.) / (b[0] - E1));
-                E2 = exp(-TR / T2);
-                PD = b[1] * (1. - E1*E2*E2) / (sqrt(E2) * (1. - E1));
-            } else {
-                T2 = TR / log((b[0]*E1 - 1.)/(b[0] - E1));
-                E2 = exp(-TR / T2);
-                PD = b[1] * (1. - E1*E2) / (1. - E1);
+        const Eigen::ArrayXd E1 = (-TR / T1).exp();
+        QI::LinearRegression(X, Y, b0, b1);
+        parameters(E1, b0, b1, PD, T2);
+        // All voxels in the block iterate in lock-step, converged voxels are masked out
+        Eigen::Array<bool, Eigen::Dynamic, 1> active = Eigen::Array<bool, Eigen::Dynamic, 1>::Constant(n, true);
+        Eigen::ArrayXi iterations = Eigen::ArrayXi::Zero(n);
+        Eigen::ArrayXXd W(n, data.cols());
+        for (size_t i = 0; (i < m_iterations) && active.any(); i++) {
+            const Eigen::ArrayXd E2 = (-TR / T2).exp();
+            for (Eigen::Index k = 0; k < data.cols(); k++) {
+                const Eigen::ArrayXd angle = m_sequence->FA[k] * B1;
+                if (m_elliptical) {
+                    W.col(k) = ((1. - E1*E2) * angle.sin() / (1. - E1*E2*E2 - (E1 - E2*E2)*angle.cos())).square();
+                } else {
+                    W.col(k) = ((1. - E1*E2) * angle.sin() / (1. - E1*E2 - (E1 - E2)*angle.cos())).square();
+                }
             }
+            QI::LinearRegression(X, Y, W, b0, b1);
+            parameters(E1, b0, b1, newPD, newT2);
+            const Eigen::ArrayXd diff = ((newPD - PD).square() + (newT2 - T2).square()).sqrt();
+            const Eigen::ArrayXd norm = (PD.square() + T2.square()).sqrt().min((newPD.square() + newT2.square()).sqrt());
+            const Eigen::Array<bool, Eigen::Dynamic, 1> update = active && !(diff <= Eigen::NumTraits<double>::dummy_precision() * norm);
+            PD = update.select(newPD, PD);
+            T2 = update.select(newT2, T2);
+            iterations += update.cast<int>();
+            active = update;
+        }
+        finish(n, data, T1, B1, PD, T2, outputs, residuals, resids);
+        for (size_t v = 0; v < n; v++) {
+            its[v] = iterations[v];
         }
-        Eigen::VectorXd p(5); p << PD, T1, T2, 0, B1;
-        Eigen::ArrayXd theory = m_sequence->signal(m_model, p).abs();
-        Eigen::ArrayXf r = (data.array() - theory).cast<float>();
-        residual = sqrt(r.square().sum() / r.rows());
-        resids = itk::VariableLengthVector<float>(r.data(), r.rows());
-        outputs[0] = QI::Clamp(PD, m_loPD, m_hiPD);
-        outputs[1] = QI::Clamp(T2, m_loT2, m_hiT2);
-        its = m_iterations;
         return true;
     }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
 };
 
 //******************************************************************************
@@ -234,7 +291,8 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampPD(parser, "CLAMP PD", "Clamp PD between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> clampT2(parser, "CLAMP T2", "Clamp T2 between 0 and value", {'t',"clampT2"}, std::numeric_limits<float>::infinity());
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     std::shared_ptr<D2Algo> algo;
     switch (algorithm.Get()) {
@@ -255,38 +313,53 @@ int main(int argc, char **argv) {
     algo->setSequence(ssfp);
     algo->setElliptical(ellipse);
 
-    if (verbose) std::cout << "Reading T1 Map from: " << QI::CheckPos(t1_path) << std::endl;
-    auto T1 = QI::ReadImage(QI::CheckPos(t1_path));
-
-    if (verbose) std::cout << "Opening SSFP file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto data = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path));
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetOutputAllResiduals(resids);
-    apply->SetPoolsize(threads.Get());
-    apply->SetInput(0, data);
-    apply->SetConst(0, T1);
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-
-    if (verbose) {
-        std::cout << "apply setup complete. Processing." << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
+    const auto region = subregion ? QI::RegionArg(args::get(subregion)) : QI::VolumeF::RegionType();
+    struct D2Inputs {
+        QI::VectorVolumeF::Pointer data;
+        QI::VolumeF::Pointer T1, B1, mask;
+    };
+    QI::RunBatch<D2Inputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            D2Inputs in;
+            if (verbose) std::cout << "Reading T1 Map from: " << subject.path(QI::CheckPos(t1_path)) << std::endl;
+            in.T1 = QI::ReadImage(subject.path(QI::CheckPos(t1_path)), region);
+            if (verbose) std::cout << "Opening SSFP file: " << subject.path(QI::CheckPos(ssfp_path)) << std::endl;
+            in.data = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(ssfp_path)), region);
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()), region);
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()), region);
+            return in;
+        },
+        [&](D2Inputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetOutputAllResiduals(resids);
+            apply->SetPoolsize(threads.Get());
+            apply->SetInput(0, in.data);
+            apply->SetConst(0, in.T1);
+            if (in.B1) apply->SetConst(1, in.B1);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) apply->SetSubregion(region);
 
-    }
-    std::string outPrefix = outarg.Get() + "D2_";
-    QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
-    if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
-    }
+            if (verbose) {
+                std::cout << "apply setup complete. Processing." << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "D2_";
+            return [apply, outPrefix, &resids]{
+                QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
+                QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+                if (resids) {
+                    QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "All done." << std::endl;
     return EXIT_SUCCESS;
 }
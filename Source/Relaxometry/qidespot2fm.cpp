@@ -11,16 +11,20 @@
  */
 
 #include <iostream>
+#include <sstream>
+#include <memory>
 #include <Eigen/Dense>
 #include "ceres/ceres.h"
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "Models.h"
 #include "ApplyTypes.h"
 #include "SSFPSequence.h"
 #include "SequenceCereal.h"
+#include "LevMar.h"
 
 class FMCost : public ceres::CostFunction {
 private:
@@ -59,15 +63,115 @@ public:
 
 };
 
+struct FMFunctor {
+    typedef QI::LevMar<3> TSolver;
+    const QI::SSFPSequence &m_sequence;
+    const Eigen::ArrayXd &m_data;
+    const double m_T1, m_B1;
+
+    int values() const { return m_data.rows(); }
+
+    bool operator()(const TSolver::TParams &p, TSolver::TResiduals &r) const {
+        r = QI::One_SSFP_Echo_Magnitude(m_sequence.FA, m_sequence.PhaseInc, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1).array() - m_data;
+        return true;
+    }
+
+    bool jacobian(const TSolver::TParams &p, TSolver::TJacobian &j) const {
+        j = QI::One_SSFP_Echo_Derivs(m_sequence.FA, m_sequence.PhaseInc, m_sequence.TR, p[0], m_T1, p[1], p[2], m_B1);
+        return true;
+    }
+};
+
 class LM_FM : public QI::ApplyF::Algorithm {
 protected:
     QI::SSFPSequence m_sequence;
-    bool m_asymmetric = false, m_debug = false;
+    bool m_asymmetric = false, m_debug = false, m_ceres = false;
+    double m_restart = 0.05;
+    /*
+     * Coarse dictionary of normalised signal shapes over T1, T2 & f0 (PD=1, B1=1). Columns are
+     * ordered with f0 fastest then T2 then T1, so the entries for one T1 bin are contiguous. The
+     * dictionary depends only on the sequence, so it is cached (see QI::Cached).
+     */
+    static const int GridT1 = 32, GridT2 = 16, GridF0 = 16;
+    struct Grid {
+        Eigen::ArrayXd T1, T2, F0;
+        Eigen::MatrixXd shapes;
+        Eigen::ArrayXd norm;
+    };
+    std::shared_ptr<const Grid> m_grid;
+
+    static std::shared_ptr<const Grid> buildGrid(const QI::SSFPSequence &sequence, const bool asymmetric) {
+        const double TR = sequence.TR;
+        const int nf0 = asymmetric ? (2*GridF0 - 1) : GridF0;
+        auto grid = std::make_shared<Grid>();
+        grid->T1 = Eigen::ArrayXd::LinSpaced(GridT1, log(0.1), log(10.)).exp();
+        grid->T2 = Eigen::ArrayXd::LinSpaced(GridT2, log(0.005), 0.).exp(); // Ratio of T2 to T1
+        grid->F0 = Eigen::ArrayXd::LinSpaced(nf0, asymmetric ? -0.5/TR : 0., 0.5/TR);
+        grid->shapes.resize(sequence.size(), GridT1 * GridT2 * nf0);
+        grid->norm.resize(grid->shapes.cols());
+        int c = 0;
+        for (int i1 = 0; i1 < GridT1; i1++) {
+            for (int i2 = 0; i2 < GridT2; i2++) {
+                const double T2 = QI::Clamp(grid->T2[i2] * grid->T1[i1], 1.5*TR, grid->T1[i1]);
+                for (int i3 = 0; i3 < nf0; i3++, c++) {
+                    grid->shapes.col(c) = QI::One_SSFP_Echo_Magnitude(sequence.FA, sequence.PhaseInc, TR, 1., grid->T1[i1], T2, grid->F0[i3], 1.);
+                    grid->norm[c] = grid->shapes.col(c).norm();
+                    grid->shapes.col(c) /= grid->norm[c];
+                }
+            }
+        }
+        return grid;
+    }
+
+    /*
+     * Find the grid entry for the nearest T1 whose shape best matches the data by inner product
+     */
+    Eigen::Array3d gridStart(const Eigen::ArrayXd &data, const double T1) const {
+        const Grid &grid = *m_grid;
+        const int nf0 = grid.F0.rows();
+        const int nT1 = GridT2 * nf0;
+        Eigen::Index i1;
+        (grid.T1.log() - log(T1)).abs().minCoeff(&i1);
+        Eigen::Index best;
+        const Eigen::VectorXd dots = grid.shapes.middleCols(i1 * nT1, nT1).transpose() * data.matrix();
+        dots.maxCoeff(&best);
+        const int i2 = best / nf0, i3 = best % nf0;
+        const double PD = dots[best] / grid.norm[i1 * nT1 + best];
+        const double T2 = QI::Clamp(grid.T2[i2] * T1, 1.5*m_sequence.TR, T1);
+        return Eigen::Array3d(PD, T2, grid.F0[i3]);
+    }
+
+    /*
+     * The grid start is tried first, the others are only tried if the fit from it is poor
+     */
+    std::vector<Eigen::Array3d> starts(const Eigen::ArrayXd &data, const double T1) const {
+        std::vector<Eigen::Array3d> s{gridStart(data, T1)};
+        const double T2 = std::max(0.1 * T1, 1.5*m_sequence.TR); // Yarnykh gives T2 = 0.045 * T1 in brain, but best to overestimate for CSF
+        s.push_back(Eigen::Array3d(5., T2, 0.));
+        s.push_back(Eigen::Array3d(5., T2, 0.4/m_sequence.TR));
+        if (this->m_asymmetric) {
+            s.push_back(Eigen::Array3d(5., T2, 0.2/m_sequence.TR));
+            s.push_back(Eigen::Array3d(5., T2, -0.2/m_sequence.TR));
+            s.push_back(Eigen::Array3d(5., T2, -0.4/m_sequence.TR));
+        }
+        return s;
+    }
+
+    bool good(const double cost, const Eigen::Index n) const {
+        return sqrt(2. * cost / n) < m_restart;
+    }
+
 public:
-    LM_FM(QI::SSFPSequence s, const bool a, const bool d) :
-        m_sequence(s), m_asymmetric(a), m_debug(d)
-    {}
+    LM_FM(QI::SSFPSequence s, const bool a, const bool d, const bool c = false) :
+        m_sequence(s), m_asymmetric(a), m_debug(d), m_ceres(c)
+    {
+        std::ostringstream key;
+        key.precision(17);
+        key << m_sequence.TR << ";" << m_sequence.FA.transpose() << ";" << m_sequence.PhaseInc.transpose() << ";" << m_asymmetric;
+        m_grid = QI::Cached<Grid>(key.str(), [&]{ return buildGrid(m_sequence, m_asymmetric); });
+    }
 
+    void setRestart(const double r) { m_restart = r; }
     size_t numInputs() const override  { return m_sequence.count(); }
     size_t numConsts() const override  { return 2; }
     size_t numOutputs() const override { return 3; }
@@ -90,65 +194,49 @@ public:
             // This gets scaled back up at the end.
             Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
             Eigen::ArrayXd data = indata.cast<double>() / indata.maxCoeff();
+            const std::vector<Eigen::Array3d> p0 = starts(data, T1);
 
-            std::vector<double> f0_starts = {0, 0.4/m_sequence.TR};
-            if (this->m_asymmetric) {
-                f0_starts.push_back(0.2/m_sequence.TR);
-                f0_starts.push_back(-0.2/m_sequence.TR);
-                f0_starts.push_back(-0.4/m_sequence.TR);
+            if (m_ceres) {
+                return apply_ceres(data, p0, T1, B1, indata.maxCoeff(), outputs, residual, resids, its);
             }
 
+            FMFunctor cost{m_sequence, data, T1, B1};
+            FMFunctor::TSolver solver(data.rows());
+            solver.setLowerBound(0, 1.);
+            solver.setLowerBound(1, m_sequence.TR);
+            solver.setUpperBound(1, T1);
+            solver.setLowerBound(2, m_asymmetric ? -0.5/m_sequence.TR : 0.0);
+            solver.setUpperBound(2, 0.5/m_sequence.TR);
+            solver.setMaxIterations(75);
+            solver.setTolerances(1e-6, 1e-7, 1e-5);
             double best = std::numeric_limits<double>::infinity();
-            Eigen::Array3d p, bestP;
-            ceres::Problem problem;
-            problem.AddResidualBlock(new FMCost(data, m_sequence, T1, B1), NULL, p.data());
-            problem.SetParameterLowerBound(p.data(), 0, 1.);
-            problem.SetParameterLowerBound(p.data(), 1, m_sequence.TR);
-            problem.SetParameterUpperBound(p.data(), 1, T1);
-            if (this->m_asymmetric) {
-                problem.SetParameterLowerBound(p.data(), 2, -0.5/m_sequence.TR);
-            } else {
-                problem.SetParameterLowerBound(p.data(), 2, 0.0);
-            }
-            problem.SetParameterUpperBound(p.data(), 2,  0.5/m_sequence.TR);
-            ceres::Solver::Options options;
-            ceres::Solver::Summary summary;
-            options.max_num_iterations = 75;
-            options.function_tolerance = 1e-6;
-            options.gradient_tolerance = 1e-7;
-            options.parameter_tolerance = 1e-5;
-            if (!m_debug) options.logging_type = ceres::SILENT;
-            for (const double &f0 : f0_starts) {
-                p = {5., std::max(0.1 * T1, 1.5*m_sequence.TR), f0}; // Yarnykh gives T2 = 0.045 * T1 in brain, but best to overestimate for CSF
-                ceres::Solve(options, &problem, &summary);
-                if (!summary.IsSolutionUsable()) {
-                    std::cerr << summary.FullReport() << std::endl;
+            FMFunctor::TSolver::TParams p, bestP;
+            for (const Eigen::Array3d &start : p0) {
+                p = start;
+                solver.solve(cost, p);
+                if (!solver.usable()) {
+                    std::cerr << "NLLS failed: " << solver.status() << std::endl;
                     std::cerr << "T1: " << T1 << " B1: " << B1 << std::endl;
                     std::cerr << "Parameters: " << p.transpose() << std::endl;
                     std::cerr << "Data: " << indata.transpose() << std::endl;
                     return false;
                 }
-                double r = summary.final_cost;
-                if (r < best) {
-                    best = r;
+                if (solver.cost() < best) {
+                    best = solver.cost();
                     bestP = p;
-                    its = summary.iterations.size();
+                    its = solver.iterations();
+                    if (resids.Size() > 0) {
+                        for (int i = 0; i < data.size(); i++)
+                            resids[i] = solver.residuals()[i];
+                    }
                 }
+                if (good(best, data.rows()))
+                    break;
             }
-            if (m_debug) std::cout << summary.FullReport() << std::endl;
             outputs[0] = bestP[0] * indata.maxCoeff();
             outputs[1] = bestP[1];
             outputs[2] = bestP[2];
-            
             residual = best * indata.maxCoeff();
-            if (resids.Size() > 0) {
-                assert(resids.Size() == data.size());
-                std::vector<double> r_temp(data.size());
-                p = bestP; // Make sure the correct parameters are in the block
-                problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
-                for (size_t i = 0; i < r_temp.size(); i++)
-                    resids[i] = r_temp[i];
-            }
         } else {
             outputs[0] = 0.;
             outputs[1] = 0.;
@@ -159,6 +247,70 @@ public:
         }
         return true;
     }
+
+    bool apply_ceres(const Eigen::ArrayXd &data, const std::vector<Eigen::Array3d> &p0,
+                     const double T1, const double B1, const double scale,
+                     std::vector<TOutput> &outputs, TConst &residual,
+                     TInput &resids, TIterations &its) const
+    {
+        double best = std::numeric_limits<double>::infinity();
+        Eigen::Array3d p, bestP;
+        ceres::Problem problem;
+        problem.AddResidualBlock(new FMCost(data, m_sequence, T1, B1), NULL, p.data());
+        problem.SetParameterLowerBound(p.data(), 0, 1.);
+        problem.SetParameterLowerBound(p.data(), 1, m_sequence.TR);
+        problem.SetParameterUpperBound(p.data(), 1, T1);
+        if (this->m_asymmetric) {
+            problem.SetParameterLowerBound(p.data(), 2, -0.5/m_sequence.TR);
+        } else {
+            problem.SetParameterLowerBound(p.data(), 2, 0.0);
+        }
+        problem.SetParameterUpperBound(p.data(), 2,  0.5/m_sequence.TR);
+        ceres::Solver::Options options;
+        ceres::Solver::Summary summary;
+        options.max_num_iterations = 75;
+        options.function_tolerance = 1e-6;
+        options.gradient_tolerance = 1e-7;
+        options.parameter_tolerance = 1e-5;
+        if (!m_debug) options.logging_type = ceres::SILENT;
+        for (const Eigen::Array3d &start : p0) {
+            // Ceres requires the start to be feasible
+            p = start;
+            p[0] = std::max(p[0], 1.);
+            p[1] = QI::Clamp(p[1], m_sequence.TR, T1);
+            ceres::Solve(options, &problem, &summary);
+            if (!summary.IsSolutionUsable()) {
+                std::cerr << summary.FullReport() << std::endl;
+                std::cerr << "T1: " << T1 << " B1: " << B1 << std::endl;
+                std::cerr << "Parameters: " << p.transpose() << std::endl;
+                std::cerr << "Data: " << (data * scale).transpose() << std::endl;
+                return false;
+            }
+            double r = summary.final_cost;
+            if (r < best) {
+                best = r;
+                bestP = p;
+                its = summary.iterations.size();
+            }
+            if (good(best, data.rows()))
+                break;
+        }
+        if (m_debug) std::cout << summary.FullReport() << std::endl;
+        outputs[0] = bestP[0] * scale;
+        outputs[1] = bestP[1];
+        outputs[2] = bestP[2];
+        
+        residual = best * scale;
+        if (resids.Size() > 0) {
+            assert(resids.Size() == data.size());
+            std::vector<double> r_temp(data.size());
+            p = bestP; // Make sure the correct parameters are in the block
+            problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
+            for (size_t i = 0; i < r_temp.size(); i++)
+                resids[i] = r_temp[i];
+        }
+        return true;
+    }
 };
 
 //******************************************************************************
@@ -181,45 +333,65 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
     args::Flag debug(parser, "DEBUG", "Output debugging messages", {'d', "debug"});
     args::Flag resids(parser, "RESIDS", "Write out residuals for each data-point", {'r', "resids"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-
-    if (verbose) std::cout << "Reading T1 Map from: " << QI::CheckPos(t1_path) << std::endl;
-    auto T1 = QI::ReadImage(QI::CheckPos(t1_path));
-    if (verbose) std::cout << "Opening SSFP file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto ssfpData = QI::ReadVectorImage<float>(QI::CheckPos(ssfp_path));
+    args::Flag use_ceres(parser, "CERES", "Use Ceres instead of the built-in Levenberg-Marquardt solver", {"ceres"});
+    args::ValueFlag<float> restart(parser, "RESTART", "Try the other f0 starts if the RMS residual (as a fraction of the max signal) exceeds this (default 0.05)", {"restart"}, 0.05);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
+    const auto region = subregion ? QI::RegionArg(args::get(subregion)) : QI::VolumeF::RegionType();
     auto ssfp_sequence = QI::ReadSequence<QI::SSFPSequence>(std::cin, verbose);
-    auto apply = QI::ApplyF::New();
-    std::shared_ptr<LM_FM> algo = std::make_shared<LM_FM>(ssfp_sequence, asym, debug);
-    apply->SetVerbose(verbose);
-    apply->SetAlgorithm(algo);
-    apply->SetOutputAllResiduals(resids);
+    std::shared_ptr<LM_FM> algo = std::make_shared<LM_FM>(ssfp_sequence, asym, debug, use_ceres);
+    algo->setRestart(restart.Get());
     if (verbose) std::cout << "Using " << threads.Get() << " threads" << std::endl;
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Fairly unbalanced algorithm
-    apply->SetInput(0, ssfpData);
-    apply->SetConst(0, T1);
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string outPrefix = args::get(outarg) + "FM_";
-    QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
-    QI::WriteImage(apply->GetOutput(2), outPrefix + "f0" + QI::OutExt());
-    QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "its" + QI::OutExt());
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
-    if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
-    }
+
+    struct FMInputs {
+        QI::VectorVolumeF::Pointer data;
+        QI::VolumeF::Pointer T1, B1, mask;
+    };
+    QI::RunBatch<FMInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            FMInputs in;
+            if (verbose) std::cout << "Reading T1 Map from: " << subject.path(QI::CheckPos(t1_path)) << std::endl;
+            in.T1 = QI::ReadImage(subject.path(QI::CheckPos(t1_path)), region);
+            if (verbose) std::cout << "Opening SSFP file: " << subject.path(QI::CheckPos(ssfp_path)) << std::endl;
+            in.data = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(ssfp_path)), region);
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()), region);
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()), region);
+            return in;
+        },
+        [&](FMInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetVerbose(verbose);
+            apply->SetAlgorithm(algo);
+            apply->SetOutputAllResiduals(resids);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get()); // Fairly unbalanced algorithm
+            apply->SetInput(0, in.data);
+            apply->SetConst(0, in.T1);
+            if (in.B1) apply->SetConst(1, in.B1);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) apply->SetSubregion(region);
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = subject.path(args::get(outarg)) + "FM_";
+            return [apply, outPrefix, &resids]{
+                QI::WriteImage(apply->GetOutput(0), outPrefix + "PD" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(1), outPrefix + "T2" + QI::OutExt());
+                QI::WriteImage(apply->GetOutput(2), outPrefix + "f0" + QI::OutExt());
+                QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "its" + QI::OutExt());
+                QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+                if (resids) {
+                    QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
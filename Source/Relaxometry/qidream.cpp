@@ -50,7 +50,7 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<double> alpha(parser, "ALPHA", "Nominal flip-angle (default 55)", {'a', "alpha"}, 55);
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
 
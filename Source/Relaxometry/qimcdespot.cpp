@@ -21,6 +21,7 @@
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "IO.h"
 #include "Model.h"
 #include "SequenceGroup.h"
@@ -151,19 +152,15 @@ int main(int argc, char **argv) {
     args::ValueFlag<char> algorithm(parser, "ALGO", "Select (S)tochastic or (G)aussian Region Contraction", {'a', "algo"}, 'G');
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations, default 4", {'i',"its"}, 4);
     args::ValueFlag<char> field(parser, "FIELD STRENGTH", "Specify field-strength for fitting regions - 3/7/u for user input", {'t', "tesla"}, '3');
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
-    std::vector<QI::VectorVolumeF::Pointer> images;
-    for (auto &input_path : QI::CheckList(input_paths)) {
-        if (verbose) std::cout << "Reading file: " << input_path << std::endl;
-        auto image = QI::ReadVectorImage<float>(input_path);
-        image->DisconnectPipeline(); // This step is really important.
-        images.push_back(image);
-    }
+    const auto region = subregion ? QI::RegionArg(args::get(subregion)) : QI::VolumeF::RegionType();
+    const std::vector<std::string> paths = QI::CheckList(input_paths);
     cereal::JSONInputArchive input(std::cin);
     auto sequences = QI::ReadSequence<QI::SequenceGroup>(input, verbose);
-    if (sequences.count() != images.size()) {
-        QI_FAIL("Sequence group size " << sequences.count() << " does not match images size " << images.size());
+    if (sequences.count() != paths.size()) {
+        QI_FAIL("Sequence group size " << sequences.count() << " does not match images size " << paths.size());
     }
 
     std::shared_ptr<QI::Model> model = nullptr;
@@ -207,67 +204,87 @@ int main(int argc, char **argv) {
         break;
     }
 
-    auto apply = QI::ApplyF::New();
+    std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
     switch (algorithm.Get()) {
-        case 'S': {
+        case 'S':
             if (verbose) std::cout << "Using SRC algorithm" << std::endl;
-            std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
             algo->setGauss(false);
-            apply->SetAlgorithm(algo);
-        } break;
-        case 'G': {
+            break;
+        case 'G':
             if (verbose) std::cout << "Using GRC algorithm" << std::endl;
-            std::shared_ptr<SRCAlgo> algo = std::make_shared<SRCAlgo>(model, bounds, sequences, its.Get());
             algo->setGauss(true);
-            apply->SetAlgorithm(algo);
-        } break;
+            break;
         default:
             std::cerr << "Unknown algorithm type " << algorithm.Get() << std::endl;
             return EXIT_FAILURE;
     }
-    apply->SetOutputAllResiduals(resids);
-    apply->SetVerbose(verbose);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get() < 8 ? 8 : threads.Get()); // mcdespot with a mask & threads is a very unbalanced algorithm
-    for (size_t i = 0; i < images.size(); i++) {
-        apply->SetInput(i, images[i]);
-    }
-    if (f0) apply->SetConst(0, QI::ReadImage(f0.Get()));
-    if (B1) apply->SetConst(1, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) apply->SetSubregion(QI::RegionArg(args::get(subregion)));
 
-    // Need this here so the bounds.txt file will have the correct prefix
-    std::string outPrefix = outarg.Get() + model->Name() + "_";
-    if (verbose) {
-        std::cout << "Bounds:\n" <<  bounds.transpose() << std::endl;
-        std::ofstream boundsFile(outPrefix + "bounds.txt");
-        boundsFile << "Names: ";
-        for (size_t p = 0; p < model->nParameters(); p++) {
-            boundsFile << model->ParameterNames()[p] << "\t";
-        }
-        boundsFile << std::endl << "Bounds:\n" << bounds.transpose() << std::endl;
-        boundsFile.close();
-    }
+    struct MCDInputs {
+        std::vector<QI::VectorVolumeF::Pointer> images;
+        QI::VolumeF::Pointer f0, B1, mask;
+    };
+    QI::RunBatch<MCDInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            MCDInputs in;
+            for (auto &input_path : paths) {
+                if (verbose) std::cout << "Reading file: " << subject.path(input_path) << std::endl;
+                auto image = QI::ReadVectorImage<float>(subject.path(input_path), region);
+                image->DisconnectPipeline(); // This step is really important.
+                in.images.push_back(image);
+            }
+            if (f0) in.f0 = QI::ReadImage(subject.path(f0.Get()), region);
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()), region);
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()), region);
+            return in;
+        },
+        [&](MCDInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetOutputAllResiduals(resids);
+            apply->SetVerbose(verbose);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get() < 8 ? 8 : threads.Get()); // mcdespot with a mask & threads is a very unbalanced algorithm
+            for (size_t i = 0; i < in.images.size(); i++) {
+                apply->SetInput(i, in.images[i]);
+            }
+            if (in.f0) apply->SetConst(0, in.f0);
+            if (in.B1) apply->SetConst(1, in.B1);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) apply->SetSubregion(region);
 
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    for (size_t i = 0; i < model->nParameters(); i++) {
-        QI::WriteImage(apply->GetOutput(i), outPrefix + model->ParameterNames()[i] + QI::OutExt());
-    }
-    QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
-    if (resids) {
-        QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
-    }
-    QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+            // Need this here so the bounds.txt file will have the correct prefix
+            const std::string outPrefix = subject.path(outarg.Get()) + model->Name() + "_";
+            if (verbose) {
+                std::cout << "Bounds:\n" <<  bounds.transpose() << std::endl;
+                std::ofstream boundsFile(outPrefix + "bounds.txt");
+                boundsFile << "Names: ";
+                for (size_t p = 0; p < model->nParameters(); p++) {
+                    boundsFile << model->ParameterNames()[p] << "\t";
+                }
+                boundsFile << std::endl << "Bounds:\n" << bounds.transpose() << std::endl;
+                boundsFile.close();
+            }
+
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            return [apply, outPrefix, model, &resids]{
+                for (size_t i = 0; i < model->nParameters(); i++) {
+                    QI::WriteImage(apply->GetOutput(i), outPrefix + model->ParameterNames()[i] + QI::OutExt());
+                }
+                QI::WriteScaledImage(apply->GetResidualOutput(), apply->GetOutput(0), outPrefix + "residual" + QI::OutExt());
+                if (resids) {
+                    QI::WriteScaledVectorImage(apply->GetAllResidualsOutput(), apply->GetOutput(0), outPrefix + "all_residuals" + QI::OutExt());
+                }
+                QI::WriteImage(apply->GetIterationsOutput(), outPrefix + "iterations" + QI::OutExt());
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
-
@@ -13,6 +13,7 @@
 #include <iostream>
 #include <string>
 #include <complex>
+#include <memory>
 
 #include "itkBinaryFunctorImageFilter.h"
 #include "itkExtractImageFilter.h"
@@ -23,6 +24,7 @@
 #include "ImageTypes.h"
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "MPRAGESequence.h"
 #include "SequenceCereal.h"
@@ -64,8 +66,15 @@ class MPRAGELookUpFilter : public ImageToImageFilter<QI::VolumeF, QI::VolumeF>
 {
 public:
 
+    /*
+     * The table depends only on the sequence, so in batch mode it is built once and shared
+     */
+    struct Table {
+        std::vector<float> T1, con;
+    };
+
 protected:
-    std::vector<float> m_T1, m_con;
+    std::shared_ptr<const Table> m_table;
 
 public:
     /** Standard class typedefs. */
@@ -82,19 +91,23 @@ public:
         this->SetNthInput(0, const_cast<TImage*>(img));
     }
 
-    void SetSequence(QI::MP2RAGESequence &sequence) {
+    static std::shared_ptr<const Table> MakeTable(QI::MP2RAGESequence &sequence) {
         MP2Functor<double> con;
-        m_T1.clear();
-        m_con.clear();
+        auto table = std::make_shared<Table>();
         for (float T1 = 0.25; T1 < 4.3; T1 += 0.001) {
             Eigen::Array3d tp; tp << T1, 1.0, 1.0; // Fix B1 and eta
             Eigen::Array2cd sig = sequence.signal(1., T1, 1.0, 1.0);
             double c = con(sig[0], sig[1]);
-            m_T1.push_back(T1);
-            m_con.push_back(c);
+            table->T1.push_back(T1);
+            table->con.push_back(c);
             //cout << m_pars.back().transpose() << " : " << m_cons.back().transpose() << std::endl;
         }
-        std::cout << "Lookup table has " << m_T1.size() << " entries" << std::endl;
+        std::cout << "Lookup table has " << table->T1.size() << " entries" << std::endl;
+        return table;
+    }
+
+    void SetTable(const std::shared_ptr<const Table> &table) {
+        m_table = table;
     }
 
 protected:
@@ -125,15 +138,15 @@ protected:
             const double ival = inputIter.Get();
             double best_distance = std::numeric_limits<double>::max();
             int best_index = 0;
-            for (int i = m_T1.size(); i > 0; i--) {
-                double distance = fabs(m_con[i] - ival);
+            for (int i = m_table->T1.size(); i > 0; i--) {
+                double distance = fabs(m_table->con[i] - ival);
                 if (distance < best_distance) {
                     best_distance = distance;
                     best_index = i;
                 }
             }
             //cout << "Best index " << best_index << " distance " << best_distance << " pars " << outputs.transpose() << " data " << data_inputs.transpose() << " cons" << m_cons[best_index].transpose() << std::endl;
-            outputIter.Set(m_T1[best_index]);
+            outputIter.Set(m_table->T1[best_index]);
             ++inputIter;
             ++outputIter;
         }
@@ -155,68 +168,87 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::Flag     automask(parser, "AUTOMASK", "Create a mask from the sum of squares image", {'a', "automask"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
 
-    if (verbose) std::cout << "Opening input file " << QI::CheckPos(input_path) << std::endl;
-    auto inFile = QI::ReadImage<QI::SeriesXF>(QI::CheckPos(input_path));
-
-    auto ti_1 = itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXF>::New();
-    auto ti_2 = itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXF>::New();
-    auto region = inFile->GetLargestPossibleRegion();
-    region.GetModifiableSize()[3] = 0;
-    ti_1->SetExtractionRegion(region);
-    ti_1->SetDirectionCollapseToSubmatrix();
-    ti_1->SetInput(inFile);
-    region.GetModifiableIndex()[3] = 1;
-    ti_2->SetExtractionRegion(region);
-    ti_2->SetDirectionCollapseToSubmatrix();
-    ti_2->SetInput(inFile);
-
-    QI::VolumeI::Pointer mask_img = nullptr;
-    if (automask) {
-        if (verbose) std::cout << "Calculating mask" << std::endl;
-        auto SqrSumFilter = itk::BinaryFunctorImageFilter<QI::VolumeXF, QI::VolumeXF, QI::VolumeF, SqrSumFunctor<float>>::New();
-        SqrSumFilter->SetInput1(ti_1->GetOutput());
-        SqrSumFilter->SetInput2(ti_2->GetOutput());
-        SqrSumFilter->Update();
-        mask_img = QI::ThresholdMask(SqrSumFilter->GetOutput(), 0.025);
-    } else if (mask) {
-        if (verbose) std::cout << "Reading mask file: " << mask.Get() << std::endl;
-        mask_img = QI::ReadImage<QI::VolumeI>(mask.Get());
-    }
-
-    if (verbose) std::cout << "Generating MP2 contrasts" << std::endl;
-    auto MP2Filter = itk::BinaryFunctorImageFilter<QI::VolumeXF, QI::VolumeXF, QI::VolumeF, MP2Functor<float>>::New();
-    MP2Filter->SetInput1(ti_1->GetOutput());
-    MP2Filter->SetInput2(ti_2->GetOutput());
-    MP2Filter->Update();
-    std::string outName = outarg ? outarg.Get() : QI::StripExt(input_path.Get());
-    if (verbose) std::cout << "Calculating T1" << std::endl;
     auto mp2rage_sequence = QI::ReadSequence<QI::MP2RAGESequence>(std::cin, verbose);
-    auto apply = itk::MPRAGELookUpFilter::New();
-    apply->SetSequence(mp2rage_sequence);
-    apply->SetInput(MP2Filter->GetOutput());
-    apply->Update();
-
-    if (mask_img) {
-        if (verbose) std::cout << "Masking outputs" << std::endl;
-        auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeI>::New();
-        auto add = itk::AddImageFilter<QI::VolumeF, QI::VolumeF>::New();
-        add->SetInput(MP2Filter->GetOutput());
-        add->SetConstant(0.5);
-        masker->SetInput(add->GetOutput());
-        masker->SetMaskImage(mask_img);
-        masker->Update();
-        QI::WriteImage(masker->GetOutput(), outName + "_contrast" + QI::OutExt());
-        masker->SetInput(apply->GetOutput());
-        masker->Update();
-        QI::WriteImage(masker->GetOutput(0), outName + "_T1" + QI::OutExt());
-    } else {
-        QI::WriteImage(MP2Filter->GetOutput(), outName + "_contrast" + QI::OutExt());
-        QI::WriteImage(apply->GetOutput(0), outName + "_T1" + QI::OutExt());
-    }
+    auto table = itk::MPRAGELookUpFilter::MakeTable(mp2rage_sequence);
+
+    struct MP2Inputs {
+        QI::SeriesXF::Pointer data;
+        QI::VolumeI::Pointer mask;
+    };
+    QI::RunBatch<MP2Inputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            MP2Inputs in;
+            if (verbose) std::cout << "Opening input file " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.data = QI::ReadImage<QI::SeriesXF>(subject.path(QI::CheckPos(input_path)));
+            if (mask && !automask) {
+                if (verbose) std::cout << "Reading mask file: " << subject.path(mask.Get()) << std::endl;
+                in.mask = QI::ReadImage<QI::VolumeI>(subject.path(mask.Get()));
+            }
+            return in;
+        },
+        [&](MP2Inputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto ti_1 = itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXF>::New();
+            auto ti_2 = itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXF>::New();
+            auto region = in.data->GetLargestPossibleRegion();
+            region.GetModifiableSize()[3] = 0;
+            ti_1->SetExtractionRegion(region);
+            ti_1->SetDirectionCollapseToSubmatrix();
+            ti_1->SetInput(in.data);
+            region.GetModifiableIndex()[3] = 1;
+            ti_2->SetExtractionRegion(region);
+            ti_2->SetDirectionCollapseToSubmatrix();
+            ti_2->SetInput(in.data);
+
+            QI::VolumeI::Pointer mask_img = in.mask;
+            if (automask) {
+                if (verbose) std::cout << "Calculating mask" << std::endl;
+                auto SqrSumFilter = itk::BinaryFunctorImageFilter<QI::VolumeXF, QI::VolumeXF, QI::VolumeF, SqrSumFunctor<float>>::New();
+                SqrSumFilter->SetInput1(ti_1->GetOutput());
+                SqrSumFilter->SetInput2(ti_2->GetOutput());
+                SqrSumFilter->Update();
+                mask_img = QI::ThresholdMask(SqrSumFilter->GetOutput(), 0.025);
+            }
+
+            if (verbose) std::cout << "Generating MP2 contrasts" << std::endl;
+            auto MP2Filter = itk::BinaryFunctorImageFilter<QI::VolumeXF, QI::VolumeXF, QI::VolumeF, MP2Functor<float>>::New();
+            MP2Filter->SetInput1(ti_1->GetOutput());
+            MP2Filter->SetInput2(ti_2->GetOutput());
+            MP2Filter->Update();
+            const std::string outName = outarg ? subject.path(outarg.Get()) : QI::StripExt(subject.path(input_path.Get()));
+            if (verbose) std::cout << "Calculating T1" << std::endl;
+            auto apply = itk::MPRAGELookUpFilter::New();
+            apply->SetTable(table);
+            apply->SetInput(MP2Filter->GetOutput());
+            apply->Update();
+
+            QI::VolumeF::Pointer contrast = MP2Filter->GetOutput();
+            QI::VolumeF::Pointer T1 = apply->GetOutput(0);
+            if (mask_img) {
+                if (verbose) std::cout << "Masking outputs" << std::endl;
+                // Separate maskers as the writes are queued and must not share an output buffer
+                auto add = itk::AddImageFilter<QI::VolumeF, QI::VolumeF>::New();
+                add->SetInput(MP2Filter->GetOutput());
+                add->SetConstant(0.5);
+                auto contrast_masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeI>::New();
+                contrast_masker->SetInput(add->GetOutput());
+                contrast_masker->SetMaskImage(mask_img);
+                contrast_masker->Update();
+                contrast = contrast_masker->GetOutput();
+                auto T1_masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeI>::New();
+                T1_masker->SetInput(apply->GetOutput());
+                T1_masker->SetMaskImage(mask_img);
+                T1_masker->Update();
+                T1 = T1_masker->GetOutput();
+            }
+            return [contrast, T1, outName]{
+                QI::WriteImage(contrast, outName + "_contrast" + QI::OutExt());
+                QI::WriteImage(T1, outName + "_T1" + QI::OutExt());
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
-
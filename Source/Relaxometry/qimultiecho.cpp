@@ -11,7 +11,9 @@
  */
 
 #include <iostream>
+#include <algorithm>
 #include <Eigen/Core>
+#include <Eigen/LU>
 #include <unsupported/Eigen/LevenbergMarquardt>
 #include <unsupported/Eigen/NumericalDiff>
 
@@ -21,6 +23,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "MultiEchoSequence.h"
 #include "SequenceCereal.h"
@@ -58,9 +61,43 @@ protected:
             resids.Fill(0);
         }
     }
+
+    static const size_t BlockSize = 256;
+
+    /*
+     * Gather a block of voxels with one row per voxel and one column per echo
+     */
+    void gather(const size_t n, const std::vector<std::vector<TInput>> &inputs, Eigen::ArrayXXd &data) const {
+        data.resize(n, m_sequence.size());
+        for (size_t v = 0; v < n; v++) {
+            for (Eigen::Index e = 0; e < data.cols(); e++) {
+                data(v, e) = inputs[v][0][e];
+            }
+        }
+    }
+
+    void clamp_and_threshold(const size_t n, const Eigen::ArrayXXd &data, const Eigen::ArrayXd &PD, const Eigen::ArrayXd &T2,
+                             std::vector<std::vector<TOutput>> &outputs, std::vector<TOutput> &residuals,
+                             std::vector<TInput> &resids) const
+    {
+        Eigen::ArrayXXd r(n, data.cols());
+        for (Eigen::Index e = 0; e < data.cols(); e++) {
+            r.col(e) = data.col(e) - (PD * (-m_sequence.TE[e] / T2).exp()).abs();
+        }
+        const Eigen::ArrayXd rms = (r.square().rowwise().sum() / r.cols()).sqrt();
+        for (size_t v = 0; v < n; v++) {
+            const bool keep = PD[v] > m_thresh;
+            outputs[v][0] = keep ? PD[v] : 0.;
+            outputs[v][1] = keep ? QI::Clamp(T2[v], m_clampLo, m_clampHi) : 0.;
+            residuals[v] = keep ? rms[v] : 0.;
+            for (size_t e = 0; e < resids[v].Size(); e++) {
+                resids[v][e] = keep ? r(v, e) : 0.;
+            }
+        }
+    }
 public:
     void setIterations(size_t n) { m_iterations = n; }
-    void setSequence(const QI::MultiEchoSequence &s) { m_sequence = s; }
+    virtual void setSequence(const QI::MultiEchoSequence &s) { m_sequence = s; }
     void setClamp(double lo, double hi) { m_clampLo = lo; m_clampHi = hi; }
     void setThresh(double t) { m_thresh = t; }
     size_t numInputs() const override { return m_sequence.count(); }
@@ -76,51 +113,83 @@ public:
 };
 
 class LogLinAlgo: public RelaxAlgo {
+protected:
+    Eigen::Matrix<double, 2, Eigen::Dynamic> m_projection;
 public:
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> & /* Unused */,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
-               TInput &resids, TIterations &its) const override
-    {
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
-        // Set up echo times array
+    void setSequence(const QI::MultiEchoSequence &s) override {
+        RelaxAlgo::setSequence(s);
+        // The echo times are the same for every voxel, so the regression is a fixed linear map
         Eigen::MatrixXd X(m_sequence.size(), 2);
         X.col(0) = m_sequence.TE;
         X.col(1).setOnes();
-        Eigen::VectorXd Y = data.array().log();
-        Eigen::VectorXd b = (X.transpose() * X).partialPivLu().solve(X.transpose() * Y);
-        double PD = exp(b[1]);
-        double T2 = -1 / b[0];
-        clamp_and_threshold(data, outputs, residual, resids, PD, T2);
-        its = 1;
+        m_projection = (X.transpose() * X).inverse() * X.transpose();
+    }
+
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> & /* Unused */,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
+    {
+        Eigen::ArrayXXd data;
+        gather(n, inputs, data);
+        const Eigen::MatrixXd b = data.log().matrix() * m_projection.transpose();
+        const Eigen::ArrayXd PD = b.col(1).array().exp();
+        const Eigen::ArrayXd T2 = -1. / b.col(0).array();
+        clamp_and_threshold(n, data, PD, T2, outputs, residuals, resids);
+        std::fill(its.begin(), its.begin() + n, 1);
         return true;
     }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
 };
 
 class ARLOAlgo : public RelaxAlgo {
 public:
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> & /* Unused */,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst &residual,
-               TInput &resids, TIterations &its) const override
+    size_t blockSize() const override { return BlockSize; }
+    bool applyBlock(const size_t n,
+                    const std::vector<std::vector<TInput>> &inputs,
+                    const std::vector<std::vector<TConst>> & /* Unused */,
+                    const std::vector<TIndex> &, // Unused
+                    std::vector<std::vector<TOutput>> &outputs,
+                    std::vector<TOutput> &residuals, std::vector<TInput> &resids,
+                    std::vector<TIterations> &its) const override
     {
-        Eigen::Map<const Eigen::ArrayXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::ArrayXd data = indata.cast<double>();
+        Eigen::ArrayXXd data;
+        gather(n, inputs, data);
         const double dTE_3 = (m_sequence.ESP / 3);
-        double si2sum = 0, sidisum = 0;
-        for (size_t i = 0; i < m_sequence.size() - 2; i++) {
-            const double si = dTE_3 * (data(i) + 4*data(i+1) + data(i+2));
-            const double di = data(i) - data(i+2);
+        Eigen::ArrayXd si2sum = Eigen::ArrayXd::Zero(n), sidisum = Eigen::ArrayXd::Zero(n);
+        for (Eigen::Index i = 0; i < data.cols() - 2; i++) {
+            const Eigen::ArrayXd si = dTE_3 * (data.col(i) + 4*data.col(i+1) + data.col(i+2));
+            const Eigen::ArrayXd di = data.col(i) - data.col(i+2);
             si2sum += si*si;
             sidisum += si*di;
         }
-        double T2 = (si2sum + dTE_3*sidisum) / (dTE_3*si2sum + sidisum);
-        double PD = (data.array() / exp(-m_sequence.TE / T2)).mean();
-        clamp_and_threshold(data, outputs, residual, resids, PD, T2);
-        its = 1;
+        const Eigen::ArrayXd T2 = (si2sum + dTE_3*sidisum) / (dTE_3*si2sum + sidisum);
+        Eigen::ArrayXd PD = Eigen::ArrayXd::Zero(n);
+        for (Eigen::Index e = 0; e < data.cols(); e++) {
+            PD += data.col(e) * (m_sequence.TE[e] / T2).exp();
+        }
+        PD /= data.cols();
+        clamp_and_threshold(n, data, PD, T2, outputs, residuals, resids);
+        std::fill(its.begin(), its.begin() + n, 1);
         return true;
     }
+
+    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> &consts,
+               const TIndex &index, std::vector<TOutput> &outputs, TConst &residual,
+               TInput &resids, TIterations &its) const override
+    {
+        return applyAsBlock(inputs, consts, index, outputs, residual, resids, its);
+    }
 };
 
 class RelaxFunctor : public Eigen::DenseFunctor<double> {
@@ -187,10 +256,8 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> its(parser, "ITERS", "Max iterations for WLLS/NLLS (default 15)", {'i',"its"}, 15);
     args::ValueFlag<float> clampT2(parser, "CLAMP T2", "Clamp T2 between 0 and value", {'p',"clampPD"}, std::numeric_limits<float>::infinity());
     args::ValueFlag<float> threshPD(parser, "THRESHOLD PD", "Only output maps when PD exceeds threshold value", {'t', "tresh"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-
-    if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
-    auto inputFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path));
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     std::shared_ptr<RelaxAlgo> algo = ITK_NULLPTR;
     switch (algorithm.Get()) {
@@ -205,49 +272,63 @@ int main(int argc, char **argv) {
     algo->setClamp(0, clampT2.Get());
     algo->setIterations(its.Get());
 
-    // Gather input data
     auto multiecho = QI::ReadSequence<QI::MultiEchoSequence>(std::cin, verbose);
-    size_t nVols = inputFile->GetLargestPossibleRegion().GetSize()[3] / multiecho.size();
     algo->setSequence(multiecho);
-    auto apply = QI::ApplyF::New();
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-
-    auto PDoutput = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
-    auto T2output = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1; layout[3] = nVols;
-    PDoutput->SetLayout(layout);
-    T2output->SetLayout(layout);
-    if (verbose) std::cout << "Processing" << std::endl;
-    auto inputVector = SeriesToVectorF::New();
-    inputVector->SetInput(inputFile);
-    inputVector->SetBlockSize(multiecho.size());
-    std::vector<QI::VolumeF::Pointer> PDimgs(nVols), T2imgs(nVols);
-    for (size_t i = 0; i < nVols; i++) {
-        inputVector->SetBlockStart(i * multiecho.size());
-
-        apply->SetAlgorithm(algo);
-        apply->SetInput(0, inputVector->GetOutput());
-        apply->Update();
-
-        PDimgs.at(i) = apply->GetOutput(0);
-        T2imgs.at(i) = apply->GetOutput(1);
-        PDimgs.at(i)->DisconnectPipeline();
-        T2imgs.at(i)->DisconnectPipeline();
-
-        PDoutput->SetInput(i, PDimgs.at(i));
-        T2output->SetInput(i, T2imgs.at(i));
-    }
-    if (verbose) std::cout << "Writing output" << std::endl;
-    PDoutput->UpdateLargestPossibleRegion();
-    T2output->UpdateLargestPossibleRegion();
-    std::string outPrefix = outarg.Get() + "ME_";
-    QI::WriteImage(PDoutput->GetOutput(), outPrefix + "PD" + QI::OutExt());
-    QI::WriteImage(T2output->GetOutput(), outPrefix + "T2" + QI::OutExt());
-    //QI::writeResiduals(apply->GetResidOutput(), outPrefix, all_residuals);
+    struct MEInputs {
+        QI::SeriesF::Pointer data;
+        QI::VolumeF::Pointer mask;
+    };
+    QI::RunBatch<MEInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            MEInputs in;
+            if (verbose) std::cout << "Opening input file: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.data = QI::ReadImage<QI::SeriesF>(subject.path(QI::CheckPos(input_path)));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](MEInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            size_t nVols = in.data->GetLargestPossibleRegion().GetSize()[3] / multiecho.size();
+            auto apply = QI::ApplyF::New();
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get()); // Unbalanced algorithm
+            if (in.mask) apply->SetMask(in.mask);
+
+            auto PDoutput = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
+            auto T2output = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
+            itk::FixedArray<unsigned int, 4> layout;
+            layout[0] = layout[1] = layout[2] = 1; layout[3] = nVols;
+            PDoutput->SetLayout(layout);
+            T2output->SetLayout(layout);
+            if (verbose) std::cout << "Processing" << std::endl;
+            auto inputVector = SeriesToVectorF::New();
+            inputVector->SetInput(in.data);
+            inputVector->SetBlockSize(multiecho.size());
+            std::vector<QI::VolumeF::Pointer> PDimgs(nVols), T2imgs(nVols);
+            for (size_t i = 0; i < nVols; i++) {
+                inputVector->SetBlockStart(i * multiecho.size());
+
+                apply->SetAlgorithm(algo);
+                apply->SetInput(0, inputVector->GetOutput());
+                apply->Update();
+
+                PDimgs.at(i) = apply->GetOutput(0);
+                T2imgs.at(i) = apply->GetOutput(1);
+                PDimgs.at(i)->DisconnectPipeline();
+                T2imgs.at(i)->DisconnectPipeline();
+
+                PDoutput->SetInput(i, PDimgs.at(i));
+                T2output->SetInput(i, T2imgs.at(i));
+            }
+            PDoutput->UpdateLargestPossibleRegion();
+            T2output->UpdateLargestPossibleRegion();
+            const std::string outPrefix = subject.path(outarg.Get()) + "ME_";
+            return [PDoutput, T2output, outPrefix, &verbose]{
+                if (verbose) std::cout << "Writing output" << std::endl;
+                QI::WriteImage(PDoutput->GetOutput(), outPrefix + "PD" + QI::OutExt());
+                QI::WriteImage(T2output->GetOutput(), outPrefix + "T2" + QI::OutExt());
+                //QI::writeResiduals(apply->GetResidOutput(), outPrefix, all_residuals);
+            };
+        }, threads.Get(), verbose);
 
     return EXIT_SUCCESS;
 }
-
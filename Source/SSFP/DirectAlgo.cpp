@@ -12,6 +12,7 @@
 #include "DirectAlgo.h"
 #include "EllipseHelpers.h"
 #include "Fit.h"
+#include "LevMar.h"
 #include "ceres/ceres.h"
 
 namespace QI {
@@ -83,6 +84,16 @@ public:
         }
     }
 
+struct DirectFunctor {
+    typedef QI::LevMar<5> TSolver;
+    const DirectCost &m_cost;
+
+    int values() const { return m_cost.data.size() * 2; }
+
+    bool operator()(const TSolver::TParams &p, TSolver::TResiduals &r) const {
+        return m_cost(p.data(), r.data());
+    }
+};
 
 Eigen::ArrayXd DirectAlgo::apply_internal(const Eigen::ArrayXcf &indata,
                                           const double flip, const double TR, const Eigen::ArrayXd &phi,
@@ -92,36 +103,23 @@ Eigen::ArrayXd DirectAlgo::apply_internal(const Eigen::ArrayXcf &indata,
     data /= scale;
     std::complex<double> c_mean = data.mean();
 
-    auto *cost = new ceres::AutoDiffCostFunction<DirectCost, ceres::DYNAMIC, 5>(new DirectCost{data, TR, phi, debug}, data.size()*2);
-    ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
-    Eigen::Array<double, 5, 1> p;
-    ceres::Problem problem;
-    problem.AddResidualBlock(cost, loss, p.data());
     const double not_zero = 1.0e-6;
     const double not_one  = 1.0 - not_zero;
     const double max_a = exp(-TR / 5.0); // Set a sensible maximum on T2
     if (debug) std::cout << "max_a : " << max_a << std::endl;
-    problem.SetParameterLowerBound(p.data(), 0, not_zero); problem.SetParameterUpperBound(p.data(), 0, not_one);
-    problem.SetParameterLowerBound(p.data(), 1, not_zero); problem.SetParameterUpperBound(p.data(), 1, max_a);
-    problem.SetParameterLowerBound(p.data(), 2, not_zero); problem.SetParameterUpperBound(p.data(), 2, not_one);
-    problem.SetParameterLowerBound(p.data(), 3, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 3, 2.*M_PI);
-    problem.SetParameterLowerBound(p.data(), 4, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 4, 2.*M_PI);
-    ceres::Solver::Options options;
-    ceres::Solver::Summary summary;
-    options.max_num_iterations = 50;
-    options.function_tolerance = 1e-5;
-    options.gradient_tolerance = 1e-6;
-    options.parameter_tolerance = 1e-3;
-    options.logging_type = ceres::SILENT;
+    const DirectCost direct{data, TR, phi, debug};
+    const DirectFunctor functor{direct};
 
     // Calculate a sensible guess for a/b using T1/T2 of grey matter
     Eigen::Array3d Gab = EllipseGab(1.0, 0.05, TR, flip);
     double th0, psi0, best_cost = std::numeric_limits<double>::infinity();
+    DirectFunctor::TSolver::TParams p;
+    DirectFunctor::TSolver::TResiduals r(functor.values());
     for (const auto &th0_try : {-M_PI, 0., M_PI}) {
         const double psi0_try = arg(c_mean / std::polar(1.0, th0_try/2));
         p << abs(c_mean), Gab[1], Gab[2], th0_try, psi0_try;
-        double cost;
-        problem.Evaluate(ceres::Problem::EvaluateOptions(), &cost, NULL, NULL, NULL);
+        // Huber loss is monotonic, so can compare the plain sum-of-squares here
+        const double cost = functor(p, r) ? 0.5 * r.squaredNorm() : std::numeric_limits<double>::infinity();
         if (debug) std::cout << "th0 = " << th0_try << ", cost was " << cost;
         if (cost < best_cost) {
             best_cost = cost;
@@ -134,15 +132,48 @@ Eigen::ArrayXd DirectAlgo::apply_internal(const Eigen::ArrayXcf &indata,
     }
     p << abs(c_mean), Gab[1], Gab[2], th0, psi0;
     if (debug) std::cout << "Starting p: " << p.transpose() << std::endl;
-    ceres::Solve(options, &problem, &summary);
-    if (debug || !summary.IsSolutionUsable()) {
-        std::cout << summary.FullReport() << std::endl;
+    if (m_ceres) {
+        auto *cost = new ceres::AutoDiffCostFunction<DirectCost, ceres::DYNAMIC, 5>(new DirectCost{data, TR, phi, debug}, data.size()*2);
+        ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
+        ceres::Problem problem;
+        problem.AddResidualBlock(cost, loss, p.data());
+        problem.SetParameterLowerBound(p.data(), 0, not_zero); problem.SetParameterUpperBound(p.data(), 0, not_one);
+        problem.SetParameterLowerBound(p.data(), 1, not_zero); problem.SetParameterUpperBound(p.data(), 1, max_a);
+        problem.SetParameterLowerBound(p.data(), 2, not_zero); problem.SetParameterUpperBound(p.data(), 2, not_one);
+        problem.SetParameterLowerBound(p.data(), 3, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 3, 2.*M_PI);
+        problem.SetParameterLowerBound(p.data(), 4, -2.*M_PI); problem.SetParameterUpperBound(p.data(), 4, 2.*M_PI);
+        ceres::Solver::Options options;
+        ceres::Solver::Summary summary;
+        options.max_num_iterations = 50;
+        options.function_tolerance = 1e-5;
+        options.gradient_tolerance = 1e-6;
+        options.parameter_tolerance = 1e-3;
+        options.logging_type = ceres::SILENT;
+        ceres::Solve(options, &problem, &summary);
+        if (debug || !summary.IsSolutionUsable()) {
+            std::cout << summary.FullReport() << std::endl;
+        }
+        residual = summary.final_cost;
+    } else {
+        DirectFunctor::TSolver solver(functor.values());
+        solver.setLowerBound(0, not_zero); solver.setUpperBound(0, not_one);
+        solver.setLowerBound(1, not_zero); solver.setUpperBound(1, max_a);
+        solver.setLowerBound(2, not_zero); solver.setUpperBound(2, not_one);
+        solver.setLowerBound(3, -2.*M_PI); solver.setUpperBound(3, 2.*M_PI);
+        solver.setLowerBound(4, -2.*M_PI); solver.setUpperBound(4, 2.*M_PI);
+        solver.setMaxIterations(50);
+        solver.setTolerances(1e-5, 1e-6, 1e-3);
+        solver.setHuber(1.0);
+        solver.solve(functor, p);
+        if (debug || !solver.usable()) {
+            std::cout << "Solver finished after " << solver.iterations() << " iterations: " << solver.status() << std::endl;
+        }
+        residual = solver.cost();
     }
-    residual = summary.final_cost;
     p[0] *= scale;
     p[3] = std::fmod(p[3] + 3*M_PI, 2*M_PI) - M_PI;
     p[4] = std::fmod(p[4] + 3*M_PI, 2*M_PI) - M_PI;
-    return p;
+    return p.array();
 };
 
 } // End namespace QI
\ No newline at end of file
@@ -19,9 +19,10 @@ namespace QI {
 
 class DirectAlgo : public EllipseAlgo {
 protected:
+    bool m_ceres = false;
     Eigen::ArrayXd apply_internal(const Eigen::ArrayXcf &input, const double flip, const double TR, const Eigen::ArrayXd &phi, const bool debug, float &residual) const override;
 public:
-    DirectAlgo(const QI::SSFPEllipseSequence &seq, bool debug) : EllipseAlgo(seq, debug) {};
+    DirectAlgo(const QI::SSFPEllipseSequence &seq, bool debug, bool ceres = false) : EllipseAlgo(seq, debug), m_ceres(ceres) {};
 };
 
 } // End namespace QI
@@ -13,6 +13,7 @@
 #include <vector>
 #include <Eigen/Dense>
 #include "ceres/ceres.h"
+#include "LevMar.h"
 #include "MTFromEllipse.h"
 
 namespace QI {
@@ -78,8 +79,19 @@ double EMTCost::debug_print(const double &v) const {
     return v;
 }
 
-MTFromEllipse::MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d) :
-    m_seq(s), T2r(T2), debug(d)
+struct EMTFunctor {
+    typedef QI::LevMar<4> TSolver;
+    const EMTCost &m_cost;
+
+    int values() const { return m_cost.G.size() + m_cost.b.size(); }
+
+    bool operator()(const TSolver::TParams &p, TSolver::TResiduals &r) const {
+        return m_cost(p.data(), r.data());
+    }
+};
+
+MTFromEllipse::MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d, const bool c) :
+    m_seq(s), T2r(T2), debug(d), use_ceres(c)
 {
 }
 
@@ -108,47 +120,82 @@ bool MTFromEllipse::apply(const std::vector<TInput> &inputs, const std::vector<T
     Eigen::ArrayXd T2fs = (-m_seq.TR / a.log());
     const double T2f = T2fs.mean(); // Different TRs so have to average afterwards
 
-    auto *cost = new ceres::AutoDiffCostFunction<EMTCost, ceres::DYNAMIC, 4>(new EMTCost{G, b, m_seq.FA*B1, m_seq.intB1*B1*B1, m_seq.TR, m_seq.Trf, T2r, T2f, f0_Hz, debug}, G.size() + b.size());
-    ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
+    const EMTCost emt{G, b, m_seq.FA*B1, m_seq.intB1*B1*B1, m_seq.TR, m_seq.Trf, T2r, T2f, f0_Hz, debug};
     Eigen::Array<double, 4, 1> p; p << 15.0, 0.1, 2.5, 1.0;
-    ceres::Problem problem;
-    problem.AddResidualBlock(cost, loss, p.data());
-    problem.SetParameterLowerBound(p.data(), 0, 0.1);
-    problem.SetParameterUpperBound(p.data(), 0, 20.0);
-    problem.SetParameterLowerBound(p.data(), 1, 1e-6);
-    problem.SetParameterUpperBound(p.data(), 1, 0.2 - 1e-6);
-    problem.SetParameterLowerBound(p.data(), 2, 0.1);
-    problem.SetParameterUpperBound(p.data(), 2, 5.0);
-    problem.SetParameterLowerBound(p.data(), 3, 0.05);
-    problem.SetParameterUpperBound(p.data(), 3, 5.0);
-    ceres::Solver::Options options;
-    ceres::Solver::Summary summary;
-    options.max_num_iterations = 100;
-    options.function_tolerance = 1e-7;
-    options.gradient_tolerance = 1e-8;
-    options.parameter_tolerance = 1e-3;
-    if (!debug) options.logging_type = ceres::SILENT;
-    ceres::Solve(options, &problem, &summary);
-    if (!summary.IsSolutionUsable()) {
-        std::cerr << summary.FullReport() << std::endl;
-        std::cerr << "Parameters: " << p.transpose() << " T2f: " << T2f << " B1: " << B1 << std::endl;
-        std::cerr << "G: " << G.transpose() << std::endl;
-        std::cerr << "a: " << a.transpose() << std::endl;
-        std::cerr << "b: " << b.transpose() << std::endl;
-        return false;
-    } else if (debug) {
-        std::cout << summary.FullReport() << std::endl;
+    std::vector<double> r_temp(G.size() + b.size());
+    if (use_ceres) {
+        auto *cost = new ceres::AutoDiffCostFunction<EMTCost, ceres::DYNAMIC, 4>(new EMTCost(emt), G.size() + b.size());
+        ceres::LossFunction *loss = new ceres::HuberLoss(1.0);
+        ceres::Problem problem;
+        problem.AddResidualBlock(cost, loss, p.data());
+        problem.SetParameterLowerBound(p.data(), 0, 0.1);
+        problem.SetParameterUpperBound(p.data(), 0, 20.0);
+        problem.SetParameterLowerBound(p.data(), 1, 1e-6);
+        problem.SetParameterUpperBound(p.data(), 1, 0.2 - 1e-6);
+        problem.SetParameterLowerBound(p.data(), 2, 0.1);
+        problem.SetParameterUpperBound(p.data(), 2, 5.0);
+        problem.SetParameterLowerBound(p.data(), 3, 0.05);
+        problem.SetParameterUpperBound(p.data(), 3, 5.0);
+        ceres::Solver::Options options;
+        ceres::Solver::Summary summary;
+        options.max_num_iterations = 100;
+        options.function_tolerance = 1e-7;
+        options.gradient_tolerance = 1e-8;
+        options.parameter_tolerance = 1e-3;
+        if (!debug) options.logging_type = ceres::SILENT;
+        ceres::Solve(options, &problem, &summary);
+        if (!summary.IsSolutionUsable()) {
+            std::cerr << summary.FullReport() << std::endl;
+            std::cerr << "Parameters: " << p.transpose() << " T2f: " << T2f << " B1: " << B1 << std::endl;
+            std::cerr << "G: " << G.transpose() << std::endl;
+            std::cerr << "a: " << a.transpose() << std::endl;
+            std::cerr << "b: " << b.transpose() << std::endl;
+            return false;
+        } else if (debug) {
+            std::cout << summary.FullReport() << std::endl;
+        }
+        residual = summary.final_cost;
+        if (resids.Size() > 0) {
+            problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
+        }
+    } else {
+        const EMTFunctor functor{emt};
+        EMTFunctor::TSolver solver(functor.values());
+        solver.setLowerBound(0, 0.1);
+        solver.setUpperBound(0, 20.0);
+        solver.setLowerBound(1, 1e-6);
+        solver.setUpperBound(1, 0.2 - 1e-6);
+        solver.setLowerBound(2, 0.1);
+        solver.setUpperBound(2, 5.0);
+        solver.setLowerBound(3, 0.05);
+        solver.setUpperBound(3, 5.0);
+        solver.setMaxIterations(100);
+        solver.setTolerances(1e-7, 1e-8, 1e-3);
+        solver.setHuber(1.0);
+        EMTFunctor::TSolver::TParams pv = p.matrix();
+        solver.solve(functor, pv);
+        p = pv.array();
+        if (!solver.usable()) {
+            std::cerr << "NLLS failed: " << solver.status() << std::endl;
+            std::cerr << "Parameters: " << p.transpose() << " T2f: " << T2f << " B1: " << B1 << std::endl;
+            std::cerr << "G: " << G.transpose() << std::endl;
+            std::cerr << "a: " << a.transpose() << std::endl;
+            std::cerr << "b: " << b.transpose() << std::endl;
+            return false;
+        } else if (debug) {
+            std::cout << "Solver finished after " << solver.iterations() << " iterations: " << solver.status() << std::endl;
+        }
+        residual = solver.cost();
+        for (size_t i = 0; i < r_temp.size(); i++)
+            r_temp[i] = solver.residuals()[i];
     }
     outputs[0] = p[0] * scale;
     outputs[1] = p[1];
     outputs[2] = p[2];
     outputs[3] = p[3];
     outputs[4] = T2f;
-    residual = summary.final_cost;
     if (resids.Size() > 0) {
         assert(resids.Size() == (G.size() + a.size() + b.size()));
-        std::vector<double> r_temp(G.size() + a.size() + b.size());
-        problem.Evaluate(ceres::Problem::EvaluateOptions(), NULL, &r_temp, NULL, NULL);
         for (int i = 0; i < G.size(); i++)
             resids[i] = r_temp[i];
         Eigen::ArrayXd as = (-m_seq.TR / T2f).exp();
@@ -23,9 +23,9 @@ public:
 protected:
     const QI::SSFPMTSequence &m_seq;
     const double T2r;
-    const bool debug;
+    const bool debug, use_ceres;
 public:
-    MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d);
+    MTFromEllipse(const QI::SSFPMTSequence &s, const double T2, const bool d, const bool c = false);
     size_t numInputs() const override { return 3; }
     size_t numConsts() const override { return 2; }
     size_t numOutputs() const override { return NumOutputs; }
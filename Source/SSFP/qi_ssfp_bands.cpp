@@ -21,6 +21,7 @@
 #include "Args.h"
 #include "Banding.h"
 #include "ImageIO.h"
+#include "Batch.h"
 
 namespace itk {
 
@@ -172,15 +173,8 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> method(parser, "METHOD", "Choose banding-removal method. G = Geometric Solution, X = Complex Average, R = Root Mean Square, M = Maximum, N = Mean Magnitude. Default = G", {"method"},"G");
     args::ValueFlag<std::string> regularise(parser, "REGULARISE", "Chose regularisation method for GS. M = Magnitude, L = Line, N = None", {"regularise"}, "L");
     args::Flag     two_pass(parser, "SECOND PASS", "Use energy-minimisation 2nd pass scheme", {'2',"2pass"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-    
-    if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
-    auto inFile = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(input_path));
-    size_t nVols = inFile->GetNumberOfComponentsPerPixel() / ph_incs.Get();
-    if (verbose) {
-        std::cout << "Number of phase increments is " << ph_incs.Get() << std::endl;
-        std::cout << "Number of volumes to process is " << nVols << std::endl;
-    }
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, num_threads);
 
     std::shared_ptr<QI::BandAlgo> algo = nullptr;
     std::string suffix = "";
@@ -188,7 +182,6 @@ int main(int argc, char **argv) {
         suffix = "GS";
         if (verbose) std::cout << "Geometric solution selected" << std::endl;
         auto g = std::make_shared<QI::GSAlgo>();
-        g->setInputSize(inFile->GetNumberOfComponentsPerPixel());
         if (regularise.Get() == "L") {
             suffix += "L"; g->setRegularise(QI::RegEnum::Line);
         } else if (regularise.Get() == "M") {
@@ -214,51 +207,74 @@ int main(int argc, char **argv) {
     }
     if (verbose) std::cout << suffix << " method selected." << std::endl;
     algo->setPhases(ph_incs.Get());
-    algo->setInputSize(inFile->GetNumberOfComponentsPerPixel());
     algo->setReorderPhase(ph_order);
     algo->setReorderBlock(alt_order);
-    auto pass1 = QI::ApplyVectorXF::New();
-    pass1->SetAlgorithm(algo);
-    if (mask) pass1->SetMask(QI::ReadImage(mask.Get()));
-    pass1->SetInput(0, inFile);
-    pass1->SetPoolsize(num_threads.Get());
-    pass1->SetSplitsPerThread(num_threads.Get()); // Unbalanced algorithm
-    pass1->SetVerbose(verbose);
-    if (verbose) {
-        std::cout << "1st pass" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        pass1->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    pass1->Update();
-    QI::VectorVolumeXF::Pointer output = ITK_NULLPTR;
     if (two_pass) {
         suffix += "2";
         itk::MultiThreader::SetGlobalDefaultNumberOfThreads(num_threads.Get());
-        auto pass2 = itk::MinEnergyFilter::New();
-        pass2->SetPhases(ph_incs.Get());
-        pass2->setReorderBlock(alt_order);
-        pass2->setReorderPhase(ph_order);
-        pass2->SetInput(inFile);
-        pass2->SetPass1(pass1->GetOutput(0));
-        if (mask) pass2->SetMask(QI::ReadImage(mask.Get()));
-        if (verbose) {
-            std::cout << "2nd pass" << std::endl;
-            auto monitor = QI::GenericMonitor::New();
-            pass2->AddObserver(itk::ProgressEvent(), monitor);
-        }
-        pass2->Update();
-        output = pass2->GetOutput();
-    } else {
-        output = pass1->GetOutput(0);
-    }
-    std::string prefix = (out_arg ? out_arg.Get() : QI::StripExt(input_path.Get()) );
-    std::string outname = prefix + "_" + suffix + QI::OutExt();
-    if (verbose) std::cout << "Output filename: " << outname << std::endl;
-    if (magnitude) {
-        QI::WriteVectorMagnitudeImage<QI::VectorVolumeXF>(output, outname);
-    } else {
-        QI::WriteVectorImage(output, outname);
     }
+    struct BandInputs {
+        QI::VectorVolumeXF::Pointer data;
+        QI::VolumeF::Pointer mask;
+    };
+    QI::RunBatch<BandInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            BandInputs in;
+            if (verbose) std::cout << "Opening input file: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.data = QI::ReadVectorImage<std::complex<float>>(subject.path(QI::CheckPos(input_path)));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](BandInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            size_t nVols = in.data->GetNumberOfComponentsPerPixel() / ph_incs.Get();
+            if (verbose) {
+                std::cout << "Number of phase increments is " << ph_incs.Get() << std::endl;
+                std::cout << "Number of volumes to process is " << nVols << std::endl;
+            }
+            algo->setInputSize(in.data->GetNumberOfComponentsPerPixel());
+            auto pass1 = QI::ApplyVectorXF::New();
+            pass1->SetAlgorithm(algo);
+            if (in.mask) pass1->SetMask(in.mask);
+            pass1->SetInput(0, in.data);
+            pass1->SetPoolsize(num_threads.Get());
+            pass1->SetSplitsPerThread(num_threads.Get()); // Unbalanced algorithm
+            pass1->SetVerbose(verbose);
+            if (verbose) {
+                std::cout << "1st pass" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                pass1->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            pass1->Update();
+            QI::VectorVolumeXF::Pointer output = ITK_NULLPTR;
+            if (two_pass) {
+                auto pass2 = itk::MinEnergyFilter::New();
+                pass2->SetPhases(ph_incs.Get());
+                pass2->setReorderBlock(alt_order);
+                pass2->setReorderPhase(ph_order);
+                pass2->SetInput(in.data);
+                pass2->SetPass1(pass1->GetOutput(0));
+                if (in.mask) pass2->SetMask(in.mask);
+                if (verbose) {
+                    std::cout << "2nd pass" << std::endl;
+                    auto monitor = QI::GenericMonitor::New();
+                    pass2->AddObserver(itk::ProgressEvent(), monitor);
+                }
+                pass2->Update();
+                output = pass2->GetOutput();
+            } else {
+                output = pass1->GetOutput(0);
+            }
+            std::string prefix = (out_arg ? subject.path(out_arg.Get()) : QI::StripExt(subject.path(input_path.Get())));
+            std::string outname = prefix + "_" + suffix + QI::OutExt();
+            return [output, outname, &verbose, &magnitude]{
+                if (verbose) std::cout << "Output filename: " << outname << std::endl;
+                if (magnitude) {
+                    QI::WriteVectorMagnitudeImage<QI::VectorVolumeXF>(output, outname);
+                } else {
+                    QI::WriteVectorImage(output, outname);
+                }
+            };
+        }, num_threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
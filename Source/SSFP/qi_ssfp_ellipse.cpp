@@ -16,6 +16,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 #include "DirectAlgo.h"
 #include "HyperAlgo.h"
@@ -36,48 +37,64 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio)", {'b', "B1"});
     args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
     args::ValueFlag<char> algorithm(parser, "ALGO", "Choose algorithm (h)yper/(d)irect, default d", {'a', "algo"}, 'd');
-    QI::ParseArgs(parser, argc, argv, verbose);
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(ssfp_path) << std::endl;
-    auto data = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(ssfp_path));
+    args::Flag use_ceres(parser, "CERES", "Use Ceres instead of the built-in Levenberg-Marquardt solver for the direct algorithm", {"ceres"});
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     auto seq = QI::ReadSequence<QI::SSFPEllipseSequence>(std::cin, verbose);
     std::shared_ptr<QI::EllipseAlgo> algo;
     switch (algorithm.Get()) {
     case 'h': algo = std::make_shared<QI::HyperAlgo>(seq, debug); break;
-    case 'd': algo = std::make_shared<QI::DirectAlgo>(seq, debug); break;
+    case 'd': algo = std::make_shared<QI::DirectAlgo>(seq, debug, use_ceres); break;
     }
-    QI::ApplyVectorXFVectorF::Pointer apply = QI::ApplyVectorXFVectorF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()*2);
-    apply->SetInput(0, data);
-    if (mask) {
-        if (verbose) std::cout << "Reading mask: " << mask.Get() << std::endl;
-        apply->SetMask(QI::ReadImage(mask.Get()));
-    }
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    apply->SetVerbose(verbose);
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(args::get(subregion)));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string outPrefix;
-    outPrefix = outarg.Get() + "ES_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
-        if (verbose) std::cout << "Writing: " << outName << std::endl;
-        QI::WriteVectorImage(apply->GetOutput(i), outName);
-    }
-    if (verbose) std::cout << "Writing total residuals." << std::endl;
-    QI::WriteVectorImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+    struct ESInputs {
+        QI::VectorVolumeXF::Pointer data;
+        QI::VolumeF::Pointer mask, B1;
+    };
+    QI::RunBatch<ESInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            ESInputs in;
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(ssfp_path)) << std::endl;
+            in.data = QI::ReadVectorImage<std::complex<float>>(subject.path(QI::CheckPos(ssfp_path)));
+            if (mask) {
+                if (verbose) std::cout << "Reading mask: " << subject.path(mask.Get()) << std::endl;
+                in.mask = QI::ReadImage(subject.path(mask.Get()));
+            }
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()));
+            return in;
+        },
+        [&](ESInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            QI::ApplyVectorXFVectorF::Pointer apply = QI::ApplyVectorXFVectorF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get()*2);
+            apply->SetInput(0, in.data);
+            if (in.mask) apply->SetMask(in.mask);
+            if (in.B1) apply->SetConst(0, in.B1);
+            apply->SetVerbose(verbose);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(args::get(subregion)));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "ES_";
+            return [apply, algo, outPrefix, &verbose]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
+                    if (verbose) std::cout << "Writing: " << outName << std::endl;
+                    QI::WriteVectorImage(apply->GetOutput(i), outName);
+                }
+                if (verbose) std::cout << "Writing total residuals." << std::endl;
+                QI::WriteVectorImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
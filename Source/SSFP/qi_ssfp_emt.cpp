@@ -14,6 +14,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "IO.h"
 #include "Args.h"
 #include "MTFromEllipse.h"
@@ -37,59 +38,77 @@ int main(int argc, char **argv) {
     args::ValueFlag<double> T2r_us(parser, "T2r", "T2r (in microseconds, default 12)", {"T2r"}, 12);
     args::ValueFlag<std::string> subregion(parser, "REGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
     args::Flag     all_residuals(parser, "RESIDUALS", "Write out all residuals", {'r',"all_resids"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(G_path) << std::endl;
-    auto G = QI::ReadVectorImage<float>(QI::CheckPos(G_path));
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(a_path) << std::endl;
-    auto a = QI::ReadVectorImage<float>(QI::CheckPos(a_path));
-    if (verbose) std::cout << "Opening file: " << QI::CheckPos(b_path) << std::endl;
-    auto b = QI::ReadVectorImage<float>(QI::CheckPos(b_path));
+    args::Flag     use_ceres(parser, "CERES", "Use Ceres instead of the built-in Levenberg-Marquardt solver", {"ceres"});
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     cereal::JSONInputArchive input(std::cin);
     auto seq = QI::ReadSequence<QI::SSFPMTSequence>(input, verbose);
     if (verbose) {
         std::cout << "T2r " << T2r_us.Get() << "us" << std::endl;
     }
-    auto algo = std::make_shared<QI::MTFromEllipse>(seq, T2r_us.Get() * 1e-6, debug);
+    auto algo = std::make_shared<QI::MTFromEllipse>(seq, T2r_us.Get() * 1e-6, debug, use_ceres);
 
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get()*2);
-    apply->SetOutputAllResiduals(all_residuals);
-    apply->SetInput(0, G);
-    apply->SetInput(1, a);
-    apply->SetInput(2, b);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (f0) apply->SetConst(1, QI::ReadImage(f0.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
+    struct EMTInputs {
+        QI::VectorVolumeF::Pointer G, a, b;
+        QI::VolumeF::Pointer B1, f0, mask;
+    };
+    QI::RunBatch<EMTInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            EMTInputs in;
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(G_path)) << std::endl;
+            in.G = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(G_path)));
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(a_path)) << std::endl;
+            in.a = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(a_path)));
+            if (verbose) std::cout << "Opening file: " << subject.path(QI::CheckPos(b_path)) << std::endl;
+            in.b = QI::ReadVectorImage<float>(subject.path(QI::CheckPos(b_path)));
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()));
+            if (f0) in.f0 = QI::ReadImage(subject.path(f0.Get()));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](EMTInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get()*2);
+            apply->SetOutputAllResiduals(all_residuals);
+            apply->SetInput(0, in.G);
+            apply->SetInput(1, in.a);
+            apply->SetInput(2, in.b);
+            if (in.B1) apply->SetConst(0, in.B1);
+            if (in.f0) apply->SetConst(1, in.f0);
+            if (in.mask) apply->SetMask(in.mask);
 
-    apply->SetVerbose(verbose);
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-        std::cout << "Writing results files." << std::endl;
-    }
-    std::string outPrefix = outarg.Get() + "EMT_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
-        if (verbose) std::cout << "Writing: " << outName << std::endl;
-        QI::WriteImage(apply->GetOutput(i), outName);
-    }
-    if (verbose) std::cout << "Writing total residual." << std::endl;
-    QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
-    if (all_residuals) {
-        if (verbose) std::cout << "Writing individual residuals." << std::endl;
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), outPrefix + "all_residuals" + QI::OutExt());
-    }
+            apply->SetVerbose(verbose);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+                std::cout << "Writing results files." << std::endl;
+            }
+            const std::string outPrefix = subject.path(outarg.Get()) + "EMT_";
+            return [apply, algo, outPrefix, &verbose, &all_residuals]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    std::string outName = outPrefix + algo->names().at(i) + QI::OutExt();
+                    if (verbose) std::cout << "Writing: " << outName << std::endl;
+                    QI::WriteImage(apply->GetOutput(i), outName);
+                }
+                if (verbose) std::cout << "Writing total residual." << std::endl;
+                QI::WriteImage(apply->GetResidualOutput(), outPrefix + "residual" + QI::OutExt());
+                if (all_residuals) {
+                    if (verbose) std::cout << "Writing individual residuals." << std::endl;
+                    QI::WriteVectorImage(apply->GetAllResidualsOutput(), outPrefix + "all_residuals" + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
 
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
@@ -20,6 +20,7 @@
 #include "Util.h"
 #include "Args.h"
 #include "ImageIO.h"
+#include "Batch.h"
 
 struct PLANET : public QI::ApplyVectorF::Algorithm {
     const QI::SSFPGSSequence &m_seq;
@@ -82,41 +83,57 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> B1(parser, "B1", "B1 map (ratio) file", {'b', "B1"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
-    if (verbose) std::cout << "Opening G: " << QI::CheckPos(G_filename) << std::endl;
-    auto G = QI::ReadVectorImage(QI::CheckPos(G_filename));
-    if (verbose) std::cout << "Opening a: " << QI::CheckPos(a_filename) << std::endl;
-    auto a = QI::ReadVectorImage(QI::CheckPos(a_filename));
-    if (verbose) std::cout << "Opening b: " << QI::CheckPos(b_filename) << std::endl;
-    auto b = QI::ReadVectorImage(QI::CheckPos(b_filename));
     auto seq = QI::ReadSequence<QI::SSFPGSSequence>(std::cin, verbose);
     auto algo = std::make_shared<PLANET>(seq);
-    auto apply = QI::ApplyVectorF::New();
-    apply->SetAlgorithm(algo);
-    apply->SetPoolsize(threads.Get());
-    apply->SetInput(0, G);
-    apply->SetInput(1, a);
-    apply->SetInput(2, b);
-    if (B1) apply->SetConst(0, QI::ReadImage(B1.Get()));
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
-    if (subregion) {
-        apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    }
-    if (verbose) {
-        std::cout << "Processing" << std::endl;
-        auto monitor = QI::GenericMonitor::New();
-        apply->AddObserver(itk::ProgressEvent(), monitor);
-    }
-    apply->Update();
-    if (verbose) {
-        std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
-    }
-    std::string outPrefix = out_prefix.Get() + "PLANET_";
-    for (size_t i = 0; i < algo->numOutputs(); i++) {
-        if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
-        QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
-    }
+    struct PLANETInputs {
+        QI::VectorVolumeF::Pointer G, a, b;
+        QI::VolumeF::Pointer B1, mask;
+    };
+    QI::RunBatch<PLANETInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            PLANETInputs in;
+            if (verbose) std::cout << "Opening G: " << subject.path(QI::CheckPos(G_filename)) << std::endl;
+            in.G = QI::ReadVectorImage(subject.path(QI::CheckPos(G_filename)));
+            if (verbose) std::cout << "Opening a: " << subject.path(QI::CheckPos(a_filename)) << std::endl;
+            in.a = QI::ReadVectorImage(subject.path(QI::CheckPos(a_filename)));
+            if (verbose) std::cout << "Opening b: " << subject.path(QI::CheckPos(b_filename)) << std::endl;
+            in.b = QI::ReadVectorImage(subject.path(QI::CheckPos(b_filename)));
+            if (B1) in.B1 = QI::ReadImage(subject.path(B1.Get()));
+            if (mask) in.mask = QI::ReadImage(subject.path(mask.Get()));
+            return in;
+        },
+        [&](PLANETInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            auto apply = QI::ApplyVectorF::New();
+            apply->SetAlgorithm(algo);
+            apply->SetPoolsize(threads.Get());
+            apply->SetInput(0, in.G);
+            apply->SetInput(1, in.a);
+            apply->SetInput(2, in.b);
+            if (in.B1) apply->SetConst(0, in.B1);
+            if (in.mask) apply->SetMask(in.mask);
+            if (subregion) {
+                apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            }
+            if (verbose) {
+                std::cout << "Processing" << std::endl;
+                auto monitor = QI::GenericMonitor::New();
+                apply->AddObserver(itk::ProgressEvent(), monitor);
+            }
+            apply->Update();
+            if (verbose) {
+                std::cout << "Elapsed time was " << apply->GetTotalTime() << "s" << std::endl;
+            }
+            const std::string outPrefix = subject.path(out_prefix.Get()) + "PLANET_";
+            return [apply, algo, outPrefix, &verbose]{
+                for (size_t i = 0; i < algo->numOutputs(); i++) {
+                    if (verbose) std::cout << "Writing output: " << outPrefix + algo->names().at(i) + QI::OutExt() << std::endl;
+                    QI::WriteVectorImage(apply->GetOutput(i), outPrefix + algo->names().at(i) + QI::OutExt());
+                }
+            };
+        }, threads.Get(), verbose);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
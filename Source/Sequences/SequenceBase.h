@@ -44,7 +44,7 @@ struct SequenceBase {
         ar(cereal::make_nvp(#X, X));\
     } catch (cereal::RapidJSONException &e) {\
         std::cerr << "Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what();\
-        exit(EXIT_FAILURE);\
+        QI::Exit(EXIT_FAILURE);\
     };
 
 #define QI_SEQUENCE_LOAD_DEGREES( X ) \
@@ -54,7 +54,7 @@ struct SequenceBase {
         X = X ## _degrees * M_PI / 180.;\
     } catch (cereal::RapidJSONException &e) {\
         std::cerr << "Error parsing parameter " << #X << " for sequence " << name() << ": " << e.what() << std::endl;\
-        exit(EXIT_FAILURE);\
+        QI::Exit(EXIT_FAILURE);\
     }
 
 #define QI_SEQUENCE_SAVE( X )\
@@ -16,17 +16,20 @@
 
 #include <Eigen/Dense>
 
-#include "itkTileImageFilter.h"
-#include "itkSubtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "MeanImageFilter.h"
-
-#include "ApplyTypes.h"
+#include "ImageTypes.h"
 #include "Util.h"
+#include "ThreadPool.h"
 #include "Args.h"
 #include "ImageIO.h"
 
-class ContrastsAlgorithm : public QI::ApplyF::Algorithm {
+/*
+ * Calculates every contrast for every voxel as one matrix product, C * pinv(X) * Y, where Y is
+ * subjects x voxels. A VectorImage stores the subjects for each voxel contiguously, so its buffer
+ * is already Y in column-major order. The voxels are split into slabs that are multiplied on a
+ * thread pool, which lets Eigen use its blocked GEMM kernels instead of a matrix-vector product
+ * per voxel.
+ */
+class ContrastsAlgorithm {
 protected:
     Eigen::MatrixXd m_mat;
     bool m_scale;
@@ -34,32 +37,43 @@ public:
     ContrastsAlgorithm(const Eigen::MatrixXd &d, const Eigen::MatrixXd &c, const bool s = false) :
         m_scale(s)
     {
-        m_mat = c * ((d.transpose() * d).inverse()) * d.transpose();
+        // The pseudo-inverse from a rank-revealing QR avoids forming and inverting X'X, which
+        // squares the condition number and fails outright for rank-deficient designs
+        m_mat = c * d.completeOrthogonalDecomposition().pseudoInverse();
     }
 
-    size_t numInputs() const override { return 1; }
-    size_t numConsts() const override { return 0; }
-    size_t numOutputs() const override { return m_mat.rows(); }
-    size_t dataSize() const override { return m_mat.cols(); }
-    float zero() const override { return 0.f; }
-    std::vector<float> defaultConsts() const override {
-        std::vector<float> def;
-        return def;
-    }
-    bool apply(const std::vector<TInput> &inputs, const std::vector<TConst> & /* Unused */,
-               const TIndex &, // Unused
-               std::vector<TOutput> &outputs, TConst & /* Unused */,
-               TInput & /* Unused */, TIterations & /* Unused */) const override
+    size_t numOutputs() const { return m_mat.rows(); }
+    size_t dataSize() const { return m_mat.cols(); }
+
+    /*
+     * Returns a contrasts x voxels matrix. Voxels outside the mask are zero.
+     */
+    Eigen::MatrixXf apply(const float *data, const size_t nvox, const float *mask,
+                          const size_t nthreads, const size_t slab = 4096) const
     {
-        Eigen::Map<const Eigen::VectorXf> indata(inputs[0].GetDataPointer(), inputs[0].Size());
-        Eigen::VectorXd c = m_mat * indata.cast<double>();
-        if (m_scale) {
-            c /= indata.mean();
+        const Eigen::Map<const Eigen::MatrixXf> Y(data, dataSize(), nvox);
+        Eigen::MatrixXf result(numOutputs(), nvox);
+        auto task = [&](const size_t first, const size_t n) {
+            const Eigen::MatrixXd Ys = Y.middleCols(first, n).cast<double>();
+            Eigen::MatrixXd c = m_mat * Ys;
+            if (m_scale) {
+                c.array().rowwise() /= Ys.colwise().mean().array();
+            }
+            result.middleCols(first, n) = c.cast<float>();
+            if (mask) {
+                for (size_t v = first; v < first + n; v++) {
+                    if (!mask[v]) result.col(v).setZero();
+                }
+            }
+        };
+        {
+            QI::ThreadPool pool(nthreads);
+            for (size_t first = 0; first < nvox; first += slab) {
+                const size_t n = std::min(slab, nvox - first);
+                pool.enqueue([&task, first, n]{ task(first, n); });
+            }
         }
-        for (int i = 0; i < m_mat.rows(); i++) {
-            outputs[i] = c[i];
-        }
-        return true;
+        return result;
     }
 };
 
@@ -76,10 +90,11 @@ int main(int argc, char **argv) {
     args::Positional<std::string> contrasts_path(parser, "CONTRASTS", "Contrasts matrix from qi_glmsetup");
     args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
     args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::Flag fraction(parser, "FRACTION", "Output contrasts as fraction of grand mean", {'F',"frac"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filename", {'o', "out"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     if (verbose) std::cout << "Reading input file " << QI::CheckPos(input_path) << std::endl;
     QI::VectorVolumeF::Pointer merged = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
@@ -98,16 +113,26 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    auto con_algo = std::make_shared<ContrastsAlgorithm>(design_matrix, contrasts, fraction);
-    auto apply = QI::ApplyF::New();
-    apply->SetAlgorithm(con_algo);
-    apply->SetInput(0, merged);
-    if (mask) apply->SetMask(QI::ReadImage(mask.Get()));
+    auto mask_img = mask ? QI::ReadImage(mask.Get()) : ITK_NULLPTR;
+    const auto region = merged->GetLargestPossibleRegion();
+    const size_t nvox = region.GetNumberOfPixels();
+    if (mask_img && mask_img->GetLargestPossibleRegion().GetNumberOfPixels() != nvox) {
+        std::cerr << "Mask size does not match input image size" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+
+    ContrastsAlgorithm con_algo(design_matrix, contrasts, fraction);
     if (verbose) std::cout << "Calculating contrasts" << std::endl;
-    apply->Update();
+    const Eigen::MatrixXf result = con_algo.apply(merged->GetBufferPointer(), nvox,
+                                                  mask_img ? mask_img->GetBufferPointer() : nullptr, nthreads);
     for (int c = 0; c < contrasts.rows(); c++) {
+        auto output = QI::VolumeF::New();
+        output->CopyInformation(merged);
+        output->SetRegions(region);
+        output->Allocate();
+        Eigen::Map<Eigen::VectorXf>(output->GetBufferPointer(), nvox) = result.row(c).transpose();
         if (verbose) std::cout << "Writing contrast " << (c + 1) << std::endl;
-        QI::WriteImage(apply->GetOutput(c), outarg.Get() + "con" + std::to_string(c + 1) + QI::OutExt());
+        QI::WriteImage(output, outarg.Get() + "con" + std::to_string(c + 1) + QI::OutExt());
     }
 }
-
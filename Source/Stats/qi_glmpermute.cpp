@@ -0,0 +1,459 @@
+/*
+ *  qi_glmpermute.cpp
+ *
+ *  Copyright (c) 2018 Tobias Wood.
+ *
+ *  This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ *  file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ *
+ *  Non-parametric inference for the GLM in the style of FSL randomise, see:
+ *  Winkler et al, Permutation inference for the general linear model, NeuroImage 92, 2014
+ *  http://dx.doi.org/10.1016/j.neuroimage.2014.01.060
+ *  Smith & Nichols, Threshold-free cluster enhancement, NeuroImage 44, 2009
+ *  http://dx.doi.org/10.1016/j.neuroimage.2008.03.061
+ */
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <limits>
+#include <functional>
+#include <random>
+#include <atomic>
+#include <mutex>
+#include <cmath>
+
+#include <Eigen/Dense>
+
+#include "ImageTypes.h"
+#include "Util.h"
+#include "ThreadPool.h"
+#include "Args.h"
+#include "ImageIO.h"
+
+/*
+ * One relabelling of the subjects. Subject i is moved to row index[i] and multiplied by sign[i],
+ * which covers both permutations and sign-flips.
+ */
+struct Shuffle {
+    std::vector<int> index;
+    std::vector<double> sign;
+
+    Shuffle(const size_t n) : index(n), sign(n, 1.0) {
+        std::iota(index.begin(), index.end(), 0);
+    }
+};
+
+/*
+ * Calculates t-statistics for all contrasts and a batch of shuffles at once, with the Freedman-Lane
+ * procedure so that nuisance regressors are handled correctly. Under the null hypothesis for
+ * contrast c the model is restricted to the span of Z = {X b : c b = 0}, so the data are shuffled
+ * after removing their fit to Z, i.e. S R y with R = I - Qz Qz'. Adding the fit back would not change
+ * the statistic, so it is left out. The contrast is then A S R y with A = C pinv(X), and the residual
+ * sum of squares is |R y|^2 - |Q' S R y|^2, where Q and Qz are orthonormal bases for the columns of X
+ * and Z. Contrasts with the same null model, e.g. c and -c, share R. Stacking A S R and Q' S R for
+ * every shuffle in the batch gives one matrix, and each slab of voxels needs a single matrix product.
+ */
+class GLMPermuter {
+protected:
+    struct NullModel {
+        std::vector<size_t> contrasts;
+        Eigen::MatrixXd Qz;
+        Eigen::ArrayXd yy; // |R y|^2 for each voxel
+    };
+    Eigen::MatrixXd m_AQ; // A stacked on Q'
+    Eigen::ArrayXd m_scale; // 1 / sqrt(c (X'X)^+ c') for each contrast
+    Eigen::Index m_nc, m_nq;
+    double m_df;
+    const float *m_data;
+    std::vector<size_t> m_voxels;
+    std::vector<NullModel> m_models;
+    size_t m_slab;
+
+    static Eigen::MatrixXd Basis(const Eigen::MatrixXd &M) {
+        Eigen::ColPivHouseholderQR<Eigen::MatrixXd> qr(M);
+        return qr.householderQ() * Eigen::MatrixXd::Identity(M.rows(), qr.rank());
+    }
+
+public:
+    GLMPermuter(const Eigen::MatrixXd &X, const Eigen::MatrixXd &C, const float *data,
+                const std::vector<size_t> &voxels, const size_t slab = 1024) :
+        m_data(data), m_voxels(voxels), m_slab(slab)
+    {
+        const Eigen::MatrixXd A = C * X.completeOrthogonalDecomposition().pseudoInverse();
+        m_scale = A.rowwise().norm().array().inverse();
+        const Eigen::MatrixXd Q = Basis(X);
+        m_nc = A.rows();
+        m_nq = Q.cols();
+        m_df = X.rows() - m_nq;
+        if (m_df < 1) {
+            QI_EXCEPTION("Design matrix has no degrees of freedom left for the residuals");
+        }
+        m_AQ.resize(m_nc + m_nq, X.rows());
+        m_AQ << A, Q.transpose();
+        for (Eigen::Index c = 0; c < m_nc; c++) {
+            const Eigen::MatrixXd N = Eigen::FullPivLU<Eigen::MatrixXd>(C.row(c)).kernel();
+            const Eigen::MatrixXd Qz = Basis(X * N);
+            // Two orthonormal bases span the same space if every column of one lies in the other
+            auto same = std::find_if(m_models.begin(), m_models.end(), [&Qz](const NullModel &m) {
+                return (m.Qz.cols() == Qz.cols()) && (std::abs((m.Qz.transpose() * Qz).squaredNorm() - Qz.cols()) < 1e-6);
+            });
+            if (same != m_models.end()) {
+                same->contrasts.push_back(c);
+            } else {
+                m_models.push_back(NullModel{{size_t(c)}, Qz, Eigen::ArrayXd()});
+            }
+        }
+        for (auto &m : m_models) {
+            m.yy.resize(m_voxels.size());
+            for (size_t v = 0; v < m_voxels.size(); v++) {
+                const Eigen::VectorXd y = Eigen::Map<const Eigen::VectorXf>(m_data + m_voxels[v] * subjects(), subjects()).cast<double>();
+                m.yy[v] = y.squaredNorm() - (m.Qz.transpose() * y).squaredNorm();
+            }
+        }
+    }
+
+    size_t subjects() const { return m_AQ.cols(); }
+    size_t contrasts() const { return m_nc; }
+    size_t voxels() const { return m_voxels.size(); }
+
+    /*
+     * Returns a (contrasts * shuffles) x voxels matrix of t-statistics, for each slab in turn via
+     * func(first_voxel, tstats)
+     */
+    template<typename TFunc>
+    void tstats(const std::vector<Shuffle> &batch, TFunc &&func) const {
+        const size_t nc = contrasts();
+        const size_t nr = nc + m_models.size() * m_nq;
+        Eigen::MatrixXd B(batch.size() * nr, subjects());
+        Eigen::MatrixXd AQS(m_AQ.rows(), subjects());
+        for (size_t b = 0; b < batch.size(); b++) {
+            for (size_t i = 0; i < subjects(); i++) {
+                AQS.col(i) = batch[b].sign[i] * m_AQ.col(batch[b].index[i]);
+            }
+            Eigen::Index row = b * nr;
+            for (const auto &m : m_models) {
+                const Eigen::Index nm = m.contrasts.size();
+                auto Bm = B.middleRows(row, nm + m_nq);
+                for (Eigen::Index j = 0; j < nm; j++) {
+                    Bm.row(j) = AQS.row(m.contrasts[j]);
+                }
+                Bm.bottomRows(m_nq) = AQS.bottomRows(m_nq);
+                Bm -= (Bm * m.Qz) * m.Qz.transpose();
+                row += nm + m_nq;
+            }
+        }
+        Eigen::MatrixXd Ys(subjects(), m_slab);
+        Eigen::MatrixXf T(batch.size() * nc, m_slab);
+        for (size_t first = 0; first < voxels(); first += m_slab) {
+            const size_t n = std::min(m_slab, voxels() - first);
+            for (size_t v = 0; v < n; v++) {
+                Ys.col(v) = Eigen::Map<const Eigen::VectorXf>(m_data + m_voxels[first + v] * subjects(), subjects()).cast<double>();
+            }
+            const Eigen::MatrixXd P = B * Ys.leftCols(n);
+            for (size_t v = 0; v < n; v++) {
+                for (size_t b = 0; b < batch.size(); b++) {
+                    Eigen::Index row = b * nr;
+                    for (const auto &m : m_models) {
+                        const Eigen::Index nm = m.contrasts.size();
+                        const double rss = m.yy[first + v] - P.col(v).segment(row + nm, m_nq).squaredNorm();
+                        const double sigma = std::sqrt(std::max(rss, 0.) / m_df);
+                        for (Eigen::Index j = 0; j < nm; j++) {
+                            const size_t c = m.contrasts[j];
+                            T(b * nc + c, v) = (sigma > 0) ? P(row + j, v) * m_scale[c] / sigma : 0.;
+                        }
+                        row += nm + m_nq;
+                    }
+                }
+            }
+            func(first, T.leftCols(n));
+        }
+    }
+};
+
+/*
+ * Threshold-free cluster enhancement of the positive part of a statistic map, over a list of
+ * voxels with 6-connected neighbours. Thresholds are swept downwards, adding voxels to clusters with
+ * union-find. Each cluster root accumulates e^E h^H dh, and each voxel stores its score relative to
+ * its parent, so merging two clusters and reading back every voxel's total are both cheap.
+ */
+class TFCE {
+protected:
+    const std::vector<int> &m_neighbours;
+    double m_H, m_E;
+    int m_steps;
+
+public:
+    TFCE(const std::vector<int> &neighbours, const double H = 2.0, const double E = 0.5, const int steps = 100) :
+        m_neighbours(neighbours), m_H(H), m_E(E), m_steps(steps)
+    {}
+
+    std::vector<float> operator()(const float *stat, const size_t n) const {
+        std::vector<float> result(n, 0.f);
+        const float max = *std::max_element(stat, stat + n);
+        if (!(max > 0)) {
+            return result;
+        }
+        const double dh = double(max) / m_steps;
+        std::vector<int> order;
+        for (size_t i = 0; i < n; i++) {
+            if (stat[i] >= dh) order.push_back(i);
+        }
+        std::sort(order.begin(), order.end(), [stat](const int a, const int b) { return stat[a] > stat[b]; });
+        std::vector<int> parent(n, -1), size(n, 0), roots;
+        std::vector<double> offset(n, 0.), score(n, 0.);
+        std::function<int(int)> find = [&](const int v) {
+            const int p = parent[v];
+            if (p == v) return v;
+            const int r = find(p);
+            offset[v] += offset[p];
+            parent[v] = r;
+            return r;
+        };
+        size_t next = 0;
+        for (int k = m_steps; k > 0; k--) {
+            const double h = k * dh;
+            for (; next < order.size() && stat[order[next]] >= h; next++) {
+                const int v = order[next];
+                parent[v] = v;
+                size[v] = 1;
+                roots.push_back(v);
+                for (int j = 0; j < 6; j++) {
+                    const int nb = m_neighbours[v * 6 + j];
+                    if (nb < 0 || parent[nb] < 0) continue;
+                    int a = find(v), b = find(nb);
+                    if (a == b) continue;
+                    if (size[a] < size[b]) std::swap(a, b);
+                    offset[b] = score[b] - score[a];
+                    parent[b] = a;
+                    size[a] += size[b];
+                }
+            }
+            roots.erase(std::remove_if(roots.begin(), roots.end(), [&parent](const int r) { return parent[r] != r; }), roots.end());
+            const double hH = std::pow(h, m_H) * dh;
+            for (const int r : roots) {
+                score[r] += std::pow(size[r], m_E) * hH;
+            }
+        }
+        for (const int v : order) {
+            const int r = find(v);
+            result[v] = (v == r) ? score[r] : offset[v] + score[r];
+        }
+        return result;
+    }
+};
+
+/*
+ * Main
+ */
+int main(int argc, char **argv) {
+    Eigen::initParallel();
+    args::ArgumentParser parser("Permutation inference for the GLM, with FWE correction by the maximum statistic.\n"
+                                "Uses the files from qi_glmsetup. Outputs follow FSL randomise, i.e. p-values are 1-p.\n"
+                                "\nhttp://github.com/spinicist/QUIT");
+    args::Positional<std::string> input_path(parser, "IMAGE", "The combined image file from qi_glmsetup");
+    args::Positional<std::string> design_path(parser, "DESIGN", "GLM Design matrix from qi_glmsetup");
+    args::Positional<std::string> contrasts_path(parser, "CONTRASTS", "Contrasts matrix from qi_glmsetup");
+    args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
+    args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+    args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
+    args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
+    args::ValueFlag<int> nperms(parser, "PERMS", "Number of permutations, including the unpermuted data (default 5000)", {'n', "perms"}, 5000);
+    args::ValueFlag<int> seed(parser, "SEED", "Seed for the random permutations (default 0)", {"seed"}, 0);
+    args::Flag signflip(parser, "SIGNFLIP", "Flip the signs of subjects instead of permuting them (one-sample tests)", {"signflip"});
+    args::Flag tfce_flag(parser, "TFCE", "Calculate Threshold-Free Cluster Enhancement statistics (H=2, E=0.5, 6-connected)", {"tfce"});
+    args::ValueFlag<int> batch_size(parser, "BATCH", "Permutations calculated together in one matrix product (default 8)", {"batch"}, 8);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
+
+    if (verbose) std::cout << "Reading input file " << QI::CheckPos(input_path) << std::endl;
+    QI::VectorVolumeF::Pointer merged = QI::ReadVectorImage<float>(QI::CheckPos(input_path));
+    if (verbose) std::cout << "Reading design matrix" << QI::CheckPos(design_path) << std::endl;
+    Eigen::ArrayXXd design_matrix = QI::ReadArrayFile(QI::CheckPos(design_path));
+    if (verbose) std::cout << "Reading contrasts file" << QI::CheckPos(contrasts_path) << std::endl;
+    Eigen::ArrayXXd contrasts     = QI::ReadArrayFile(QI::CheckPos(contrasts_path));
+    if (design_matrix.rows() != merged->GetNumberOfComponentsPerPixel()) {
+        std::cerr << "Number of rows in design matrix (" << design_matrix.rows()
+                  << ") does not match number of volumes in image (" << merged->GetNumberOfComponentsPerPixel() << ")" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (design_matrix.cols() != contrasts.cols()) {
+        std::cerr << "Number of columns in design matrix (" << design_matrix.cols()
+                  << ") does not match contrasts (" << contrasts.cols() << ")" << std::endl;
+        return EXIT_FAILURE;
+    }
+    if (nperms.Get() < 1 || batch_size.Get() < 1) {
+        std::cerr << "Number of permutations and batch size must be positive" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    const auto region = merged->GetLargestPossibleRegion();
+    const size_t nvox = region.GetNumberOfPixels();
+    auto mask_img = mask ? QI::ReadImage(mask.Get()) : ITK_NULLPTR;
+    if (mask_img && mask_img->GetLargestPossibleRegion().GetNumberOfPixels() != nvox) {
+        std::cerr << "Mask size does not match input image size" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::vector<size_t> voxels;
+    std::vector<int> mask_index(nvox, -1);
+    for (size_t i = 0; i < nvox; i++) {
+        if (!mask_img || mask_img->GetBufferPointer()[i]) {
+            mask_index[i] = voxels.size();
+            voxels.push_back(i);
+        }
+    }
+    if (voxels.empty()) {
+        QI_EXCEPTION("No voxels to process, check the mask");
+    }
+    if (voxels.size() > size_t(std::numeric_limits<int>::max())) {
+        QI_EXCEPTION("Too many voxels in mask");
+    }
+    std::vector<int> neighbours;
+    if (tfce_flag) {
+        const auto sz = region.GetSize();
+        const size_t stride[3] = {1, sz[0], sz[0] * sz[1]};
+        neighbours.resize(voxels.size() * 6, -1);
+        for (size_t v = 0; v < voxels.size(); v++) {
+            const size_t i = voxels[v];
+            const size_t xyz[3] = {i % sz[0], (i / sz[0]) % sz[1], i / (sz[0] * sz[1])};
+            for (int d = 0; d < 3; d++) {
+                if (xyz[d] > 0) neighbours[v * 6 + 2 * d] = mask_index[i - stride[d]];
+                if (xyz[d] + 1 < sz[d]) neighbours[v * 6 + 2 * d + 1] = mask_index[i + stride[d]];
+            }
+        }
+    }
+
+    const GLMPermuter permuter(design_matrix, contrasts, merged->GetBufferPointer(), voxels);
+    const TFCE tfce(neighbours);
+    const size_t nc = permuter.contrasts();
+    const size_t nm = permuter.voxels();
+    if (verbose) std::cout << "Subjects: " << permuter.subjects() << " Contrasts: " << nc << " Voxels: " << nm << std::endl;
+
+    /*
+     * The unpermuted statistics, which also count as the first permutation
+     */
+    Eigen::MatrixXf obs_t(nc, nm), obs_tfce = Eigen::MatrixXf::Zero(nc, nm);
+    permuter.tstats({Shuffle(permuter.subjects())}, [&](const size_t first, const Eigen::Ref<const Eigen::MatrixXf> &T) {
+        obs_t.middleCols(first, T.cols()) = T;
+    });
+    if (tfce_flag) {
+        for (size_t c = 0; c < nc; c++) {
+            const Eigen::VectorXf t = obs_t.row(c).transpose();
+            obs_tfce.row(c) = Eigen::Map<const Eigen::VectorXf>(tfce(t.data(), nm).data(), nm).transpose();
+        }
+    }
+
+    /*
+     * Draw every shuffle up front from one generator so that the results only depend on the seed,
+     * not the number of threads. Fisher-Yates and the top bit are used instead of the standard
+     * distributions, which differ between standard libraries.
+     */
+    std::mt19937_64 rng(seed.Get());
+    std::vector<Shuffle> shuffles(nperms.Get() - 1, Shuffle(permuter.subjects()));
+    for (auto &s : shuffles) {
+        if (signflip) {
+            for (auto &x : s.sign) x = (rng() >> 63) ? -1.0 : 1.0;
+        } else {
+            for (size_t i = s.index.size() - 1; i > 0; i--) {
+                std::swap(s.index[i], s.index[rng() % (i + 1)]);
+            }
+        }
+    }
+
+    // Null distributions of the maximum statistics, and per-voxel counts for uncorrected p-values
+    Eigen::MatrixXf max_t(nc, nperms.Get()), max_tfce(nc, nperms.Get());
+    max_t.col(0) = obs_t.rowwise().maxCoeff();
+    max_tfce.col(0) = obs_tfce.rowwise().maxCoeff();
+    Eigen::ArrayXXi count_t = Eigen::ArrayXXi::Ones(nc, nm), count_tfce = Eigen::ArrayXXi::Ones(nc, nm);
+    std::mutex count_mutex;
+    std::atomic<size_t> done{0};
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+    const size_t chunk = (shuffles.size() + nthreads - 1) / std::max<size_t>(nthreads, 1);
+    auto task = [&](const size_t start, const size_t end) {
+        Eigen::ArrayXXi local_t = Eigen::ArrayXXi::Zero(nc, nm), local_tfce;
+        Eigen::MatrixXf maps;
+        if (tfce_flag) local_tfce = Eigen::ArrayXXi::Zero(nc, nm);
+        for (size_t b0 = start; b0 < end; b0 += batch_size.Get()) {
+            const size_t b1 = std::min(end, b0 + batch_size.Get());
+            const std::vector<Shuffle> batch(shuffles.begin() + b0, shuffles.begin() + b1);
+            const size_t nb = batch.size();
+            Eigen::ArrayXf batch_max = Eigen::ArrayXf::Constant(nb * nc, -std::numeric_limits<float>::infinity());
+            if (tfce_flag) maps.resize(nb * nc, nm);
+            permuter.tstats(batch, [&](const size_t first, const Eigen::Ref<const Eigen::MatrixXf> &T) {
+                batch_max = batch_max.max(T.rowwise().maxCoeff().array());
+                for (size_t b = 0; b < nb; b++) {
+                    local_t.middleCols(first, T.cols()) += (T.middleRows(b * nc, nc).array() >= obs_t.middleCols(first, T.cols()).array()).cast<int>();
+                }
+                if (tfce_flag) maps.middleCols(first, T.cols()) = T;
+            });
+            for (size_t b = 0; b < nb; b++) {
+                max_t.col(1 + b0 + b) = batch_max.segment(b * nc, nc).matrix();
+                if (tfce_flag) {
+                    for (size_t c = 0; c < nc; c++) {
+                        const Eigen::VectorXf t = maps.row(b * nc + c).transpose();
+                        const std::vector<float> enhanced = tfce(t.data(), nm);
+                        const Eigen::Map<const Eigen::ArrayXf> e(enhanced.data(), nm);
+                        max_tfce(c, 1 + b0 + b) = e.maxCoeff();
+                        local_tfce.row(c) += (e.transpose() >= obs_tfce.row(c).array()).cast<int>();
+                    }
+                }
+            }
+            const size_t before = done.fetch_add(nb);
+            if (verbose && ((before + nb) * 10 / shuffles.size()) > (before * 10 / shuffles.size())) {
+                std::lock_guard<std::mutex> lock(count_mutex);
+                std::cout << "Finished " << (before + nb) << " of " << shuffles.size() << " permutations" << std::endl;
+            }
+        }
+        std::lock_guard<std::mutex> lock(count_mutex);
+        count_t += local_t;
+        if (tfce_flag) count_tfce += local_tfce;
+    };
+    {
+        QI::ThreadPool pool(nthreads);
+        for (size_t start = 0; start < shuffles.size(); start += chunk) {
+            const size_t end = std::min(shuffles.size(), start + chunk);
+            pool.enqueue([&task, start, end]{ task(start, end); });
+        }
+    }
+
+    /*
+     * Write out 1-p, as randomise does, so that significant voxels are close to 1
+     */
+    auto write = [&](const Eigen::Ref<const Eigen::ArrayXf> &values, const std::string &name) {
+        auto img = QI::VolumeF::New();
+        img->CopyInformation(merged);
+        img->SetRegions(region);
+        img->Allocate();
+        img->FillBuffer(0);
+        for (size_t v = 0; v < nm; v++) {
+            img->GetBufferPointer()[voxels[v]] = values[v];
+        }
+        if (verbose) std::cout << "Writing " << name << std::endl;
+        QI::WriteImage(img, outarg.Get() + name + QI::OutExt());
+    };
+    auto corrected = [&](const Eigen::Ref<const Eigen::ArrayXf> &obs, const Eigen::Ref<const Eigen::ArrayXf> &null) {
+        Eigen::ArrayXf sorted = null;
+        std::sort(sorted.data(), sorted.data() + sorted.size());
+        Eigen::ArrayXf p(obs.size());
+        for (Eigen::Index v = 0; v < obs.size(); v++) {
+            const auto below = std::lower_bound(sorted.data(), sorted.data() + sorted.size(), obs[v]) - sorted.data();
+            p[v] = float(below) / sorted.size();
+        }
+        return p;
+    };
+    for (size_t c = 0; c < nc; c++) {
+        const std::string con = std::to_string(c + 1);
+        write(obs_t.row(c).transpose().array(), "tstat" + con);
+        write(1.f - count_t.row(c).transpose().cast<float>() / float(nperms.Get()), "vox_p_tstat" + con);
+        write(corrected(obs_t.row(c).transpose().array(), max_t.row(c).transpose().array()), "vox_corrp_tstat" + con);
+        if (tfce_flag) {
+            write(obs_tfce.row(c).transpose().array(), "tfce_tstat" + con);
+            write(1.f - count_tfce.row(c).transpose().cast<float>() / float(nperms.Get()), "tfce_p_tstat" + con);
+            write(corrected(obs_tfce.row(c).transpose().array(), max_tfce.row(c).transpose().array()), "tfce_corrp_tstat" + con);
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -14,13 +14,9 @@
 #include <string>
 #include <algorithm>
 
-#include "itkTileImageFilter.h"
-#include "itkSubtractImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "MeanImageFilter.h"
-
 #include "ImageTypes.h"
 #include "Util.h"
+#include "ThreadPool.h"
 #include "Args.h"
 #include "ImageIO.h"
 
@@ -44,6 +40,7 @@ int main(int argc, char **argv) {
     args::PositionalList<std::string> file_paths(parser, "INPUTS", "Input files to be merged.");
     args::HelpFlag help(parser, "HELP", "Show this help message", {'h', "help"});
     args::Flag     verbose(parser, "VERBOSE", "Print more information", {'v', "verbose"});
+    args::ValueFlag<int> threads(parser, "THREADS", "Read N input files at once (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::Flag sort(parser, "SORT", "Sort merged file and GLM in ascending group order", {'s',"sort"});
     args::ValueFlag<std::string> group_path(parser, "GROUPS", "File to read group numbers from (REQUIRED)", {'g',"groups"});
     args::ValueFlag<std::string> output_path(parser, "OUT", "Path for output merged file", {'o',"out"});
@@ -51,7 +48,7 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> design_path(parser, "DESIGN", "Path to save design matrix", {'d',"design"});
     args::ValueFlag<std::string> contrasts_path(parser, "CONTRASTS", "Generate and save contrasts", {'c',"contrasts"});
     args::ValueFlag<std::string> ftests_path(parser, "FTESTS", "Generate and save F-tests", {'f',"ftests"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     std::ifstream group_file(QI::CheckValue(group_path));
     if (verbose) std::cout << "Reading group file" << std::endl;
@@ -68,14 +65,11 @@ int main(int argc, char **argv) {
         return EXIT_FAILURE;
     }
 
-    std::vector<std::vector<QI::VolumeF::Pointer>> groups(n_groups);
+    // Only the paths are kept here, the images are read while the merged file is written
+    std::vector<std::vector<std::string>> groups(n_groups);
+    std::vector<std::string> merge_order;
     if (verbose) std::cout << "Number of groups: " << n_groups << std::endl;
     if (verbose) std::cout << "Number of images: " << n_images << std::endl;
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = n_images;
-    auto tiler = itk::TileImageFilter<QI::VolumeF, QI::SeriesF>::New();
-    tiler->SetLayout(layout);
 
     std::ofstream design_file;
     if (design_path) {
@@ -99,13 +93,11 @@ int main(int argc, char **argv) {
             covars_files.push_back(std::move(covars_file));
         }
     }
-    int out_index = 0;
     for (size_t i = 0; i < group_list.size(); i++) {
         const int group = group_list.at(i);
         if (group > 0) { // Ignore entries with a 0
             if (verbose) std::cout << "File: " << file_paths.Get().at(i) << " Group: " << group << std::flush;
-            QI::VolumeF::Pointer ptr = QI::ReadImage(file_paths.Get().at(i));
-            groups.at(group - 1).push_back(ptr);
+            groups.at(group - 1).push_back(file_paths.Get().at(i));
             std::vector<std::string> covar;
             if (covars_path) {
                 if (verbose) std::cout << " Covariates: ";
@@ -119,8 +111,7 @@ int main(int argc, char **argv) {
             }
             if (verbose) std::cout << std::endl;
             if (!sort) {
-                tiler->SetInput(out_index, ptr);
-                out_index++;
+                merge_order.push_back(file_paths.Get().at(i));
                 if (design_path) {
                     for (int g = 1; g <= n_groups; g++) {
                         if (g == group) {
@@ -150,8 +141,7 @@ int main(int argc, char **argv) {
         if (verbose) std::cout << "Sorting." << std::endl;
         for (int g = 0; g < n_groups; g++) {
             for (size_t i = 0; i < groups.at(g).size(); i++) {
-                tiler->SetInput(out_index, groups.at(g).at(i));
-                out_index++;
+                merge_order.push_back(groups.at(g).at(i));
                 if (design_path) {
                     for (int g2 = 0; g2 < n_groups; g2++) {
                         if (g2 == g) {
@@ -226,28 +216,39 @@ int main(int argc, char **argv) {
             fts_file << std::endl;
         }
     }
-    tiler->UpdateLargestPossibleRegion();
-    // Reset space information because tiler messes it up
-    QI::SeriesF::Pointer output = tiler->GetOutput();
-    output->DisconnectPipeline();
-    auto spacing    = output->GetSpacing();
-    auto origin     = output->GetOrigin();
-    auto direction  = output->GetDirection();
-    spacing.Fill(1);
-    origin.Fill(0);
-    direction.SetIdentity();
-    for (int i = 0; i < 3; i++) {
-        spacing[i] = groups.at(0).at(0)->GetSpacing()[i];
-        origin[i] =  groups.at(0).at(0)->GetOrigin()[i];
-        for (int j = 0; j < 3; j++) {
-            direction[i][j] = groups.at(0).at(0)->GetDirection()[i][j];
-        }
+    /*
+     * Stream the subjects into the merged file. The writer asks for slabs of volumes in order and
+     * prefetches the next slab while writing, so only two slabs are held in memory however many
+     * subjects there are. The subjects within a slab are read in parallel.
+     */
+    if (merge_order.empty()) {
+        std::cerr << "No images to merge" << std::endl;
+        return EXIT_FAILURE;
     }
-    output->SetSpacing(spacing);
-    output->SetOrigin(origin);
-    output->SetDirection(direction);
     if (verbose) std::cout << "Writing merged file: " << QI::CheckValue(output_path) << std::endl;
-    QI::WriteImage<QI::SeriesF>(output, QI::CheckValue(output_path));
+    const QI::VolumeF::Pointer reference = QI::ReadImage(merge_order.front());
+    const auto ref_size = reference->GetLargestPossibleRegion().GetSize();
+    const size_t nvox = reference->GetLargestPossibleRegion().GetNumberOfPixels();
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+    QI::WriteSeries<float>(reference, merge_order.size(), QI::CheckValue(output_path),
+                           [&](float *buffer, const size_t start, const size_t n) {
+        QI::TaskErrors errors;
+        {
+            QI::ThreadPool pool(std::min(nthreads, n));
+            for (size_t i = 0; i < n; i++) {
+                pool.enqueue([&, i]{
+                    errors.run([&]{
+                        const std::string &path = merge_order.at(start + i);
+                        const QI::VolumeF::Pointer img = (start + i == 0) ? reference : QI::ReadImage(path);
+                        if (img->GetLargestPossibleRegion().GetSize() != ref_size) {
+                            QI_EXCEPTION("Image " << path << " does not match size of " << merge_order.front());
+                        }
+                        std::copy(img->GetBufferPointer(), img->GetBufferPointer() + nvox, buffer + i * nvox);
+                    });
+                });
+            }
+        }
+        errors.rethrow();
+    });
     return EXIT_SUCCESS;
 }
-
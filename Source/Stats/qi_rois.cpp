@@ -13,15 +13,20 @@
 #include <iomanip>
 #include <fstream>
 #include <string>
+#include <vector>
+#include <set>
+#include <algorithm>
+#include <cmath>
+#include <mutex>
+#include <limits>
 
 #include "ImageTypes.h"
 #include "ImageIO.h"
 #include "Args.h"
 #include "Util.h"
+#include "ThreadPool.h"
 
-#include "itkLabelStatisticsImageFilter.h"
-typedef itk::LabelStatisticsImageFilter<QI::VolumeF, QI::VolumeI> TStatsFilter;
-typedef TStatsFilter::ValidLabelValuesContainerType TLabels;
+typedef std::vector<int> TLabels;
 // Declare arguments here so they are available in helper functions
 args::ArgumentParser parser("Calculates average values or volumes of ROI labels.\n"
                             "If the --volumes flag is specified, only give the label images.\n"
@@ -42,6 +47,101 @@ args::ValueFlag<std::string> delim(parser, "DELIMITER", "Specify delimiter to us
 args::ValueFlagList<std::string> header_paths(parser, "HEADER", "Add a header (can be specified multiple times)", {'H', "header"});
 args::ValueFlagList<std::string> header_names(parser, "HEADER NAME", "Header name (must be specified in same order as paths)", {"header_name"});
 args::ValueFlagList<double> scales(parser, "SCALE", "Divide ROI values by scale (must be same order as paths)", {"scale"});
+args::Flag     median(parser, "MEDIAN", "Output the median instead of the mean", {"median"});
+args::ValueFlag<double> percentile(parser, "PERCENTILE", "Output this percentile (0-100) instead of the mean", {"percentile"});
+args::ValueFlag<int> threads(parser, "THREADS", "Process N files at once (default=4, 0=hardware limit)", {'T', "threads"}, 4);
+
+/*
+ * Maps label values to their column in the output. Label values are usually small integers, so a
+ * table covering the range is used if it is not too large, otherwise a binary search.
+ */
+class LabelIndex {
+protected:
+    TLabels m_sorted;
+    std::vector<int> m_sorted_index, m_table;
+    int m_lo = 0, m_hi = -1;
+    static const int MaxTable = 1 << 24;
+
+public:
+    LabelIndex(const TLabels &labels) {
+        if (labels.empty()) {
+            return;
+        }
+        std::vector<std::pair<int, int>> pairs;
+        for (size_t i = 0; i < labels.size(); i++) {
+            pairs.emplace_back(labels[i], i);
+        }
+        std::sort(pairs.begin(), pairs.end());
+        for (const auto &p : pairs) {
+            m_sorted.push_back(p.first);
+            m_sorted_index.push_back(p.second);
+        }
+        m_lo = m_sorted.front();
+        m_hi = m_sorted.back();
+        if (static_cast<long>(m_hi) - m_lo < MaxTable) {
+            m_table.assign(static_cast<long>(m_hi) - m_lo + 1, -1);
+            for (const auto &p : pairs) {
+                m_table[p.first - m_lo] = p.second;
+            }
+        }
+    }
+
+    int operator()(const int label) const {
+        if (label < m_lo || label > m_hi) {
+            return -1;
+        }
+        if (!m_table.empty()) {
+            return m_table[label - m_lo];
+        }
+        const auto it = std::lower_bound(m_sorted.begin(), m_sorted.end(), label);
+        return (it != m_sorted.end() && *it == label) ? m_sorted_index[it - m_sorted.begin()] : -1;
+    }
+};
+
+/*
+ * Every distinct value in a label image, in ascending order
+ */
+TLabels FindLabels(const QI::VolumeI *img) {
+    const int *data = img->GetBufferPointer();
+    const size_t n = img->GetLargestPossibleRegion().GetNumberOfPixels();
+    TLabels labels;
+    if (n == 0) {
+        return labels;
+    }
+    const auto range = std::minmax_element(data, data + n);
+    const long lo = *range.first, hi = *range.second;
+    if (hi - lo < (1 << 24)) {
+        std::vector<char> present(hi - lo + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            present[data[i] - lo] = 1;
+        }
+        for (long l = lo; l <= hi; l++) {
+            if (present[l - lo]) labels.push_back(l);
+        }
+    } else {
+        const std::set<int> unique(data, data + n);
+        labels.assign(unique.begin(), unique.end());
+    }
+    return labels;
+}
+
+/*
+ * The p-th percentile of values, interpolating linearly between the closest ranks. Reorders values.
+ */
+double Percentile(std::vector<float> &values, const double p) {
+    if (values.empty()) {
+        return std::numeric_limits<double>::quiet_NaN();
+    }
+    const double pos = p / 100. * (values.size() - 1);
+    const size_t below = std::floor(pos);
+    std::nth_element(values.begin(), values.begin() + below, values.end());
+    const double lo = values[below];
+    if (below + 1 >= values.size()) {
+        return lo;
+    }
+    const double hi = *std::min_element(values.begin() + below + 1, values.end());
+    return lo + (pos - below) * (hi - lo);
+}
 
 /*
  * Helper function to work out the label list
@@ -62,13 +162,8 @@ void GetLabelList(TLabels &label_numbers, std::vector<std::string> &label_names)
             if (verbose) std::cout << "Read label: " << label_numbers.back() << ", name: " << label_names.back() << std::endl;
         }
     } else {
-        TStatsFilter::Pointer label_filter = TStatsFilter::New();
         if (verbose) std::cout << "Reading first label file to determine labels: " << QI::CheckList(in_paths).at(0) << std::endl;
-        label_filter->SetLabelInput(QI::ReadImage<QI::VolumeI>(QI::CheckList(in_paths).at(0)));
-        label_filter->SetInput(QI::ReadImage<QI::VolumeF>(QI::CheckList(in_paths).at(0))); // Dummy value because ITK complains input primary is not set
-        label_filter->Update();
-        label_numbers = label_filter->GetValidLabelValues();
-        std::sort(label_numbers.begin(), label_numbers.end());
+        label_numbers = FindLabels(QI::ReadImage<QI::VolumeI>(QI::CheckList(in_paths).at(0)));
         if (verbose) {
             std::cout << "Found the following labels:" << std::endl;
             for (auto &l : label_numbers) std::cout << l << " ";
@@ -110,44 +205,86 @@ std::vector<std::vector<std::string>> GetHeaders(size_t n_files) {
 }
 
 /*
- * Helper function to actually work out all the values
+ * Helper function to actually work out all the values. Files are processed concurrently, each with
+ * its own accumulators, in a single pass over the voxels. The percentile, if requested, needs the
+ * values for each label to be kept until the end of the pass.
  */
 void GetValues(const int n_files, const TLabels &labels, const std::vector<double> &scale_list,
                std::vector<std::vector<double>> &mean_table, std::vector<std::vector<double>> &sigma_table, std::vector<std::vector<double>> &volume_table) {
     mean_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
     sigma_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
     volume_table = std::vector<std::vector<double>>(n_files, std::vector<double>(labels.size()));
-    TStatsFilter::Pointer label_filter = TStatsFilter::New();
-    QI::VolumeI::Pointer label_img = ITK_NULLPTR;
-    QI::VolumeF::Pointer value_img = ITK_NULLPTR;
-    for (int f = 0; f < n_files; f++) {
+    const LabelIndex index(labels);
+    const bool use_percentile = median || percentile;
+    const double pct = median ? 50. : (percentile ? percentile.Get() : 0.);
+    if (pct < 0. || pct > 100.) {
+        QI_EXCEPTION("Percentile must be between 0 and 100");
+    }
+    std::mutex mutex;
+    auto task = [&](const int f) {
+        if (verbose) {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::cout << "Reading label file: " << in_paths.Get().at(f) << std::endl;
+            if (!volumes) std::cout << "Reading value file: " << in_paths.Get().at(f + n_files) << std::endl;
+        }
+        const QI::VolumeI::Pointer label_img = QI::ReadImage<QI::VolumeI>(in_paths.Get().at(f));
+        const size_t n = label_img->GetLargestPossibleRegion().GetNumberOfPixels();
+        const int *label_data = label_img->GetBufferPointer();
+        std::vector<size_t> count(labels.size(), 0);
         if (volumes) {
-            if (verbose) std::cout << "Reading label file: " << in_paths.Get().at(f) << std::endl;
-            label_img = QI::ReadImage<QI::VolumeI>(in_paths.Get().at(f));
-            value_img = QI::ReadImage(in_paths.Get().at(f)); // Dummy image
+            for (size_t i = 0; i < n; i++) {
+                const int l = index(label_data[i]);
+                if (l >= 0) count[l]++;
+            }
         } else {
-            if (verbose) std::cout << "Reading label file: " << in_paths.Get().at(f) << std::endl;
-            label_img = QI::ReadImage<QI::VolumeI>(in_paths.Get().at(f));
-            if (verbose) std::cout << "Reading value file: " << in_paths.Get().at(f + n_files) << std::endl;
-            value_img = QI::ReadImage(in_paths.Get().at(f + n_files));
+            const QI::VolumeF::Pointer value_img = QI::ReadImage(in_paths.Get().at(f + n_files));
+            if (value_img->GetLargestPossibleRegion().GetNumberOfPixels() != n) {
+                QI_EXCEPTION("Label file " << in_paths.Get().at(f) << " and value file "
+                             << in_paths.Get().at(f + n_files) << " are different sizes");
+            }
+            const float *value_data = value_img->GetBufferPointer();
+            std::vector<double> sum(labels.size(), 0.), sum_sq(labels.size(), 0.);
+            std::vector<std::vector<float>> values(use_percentile ? labels.size() : 0);
+            for (size_t i = 0; i < n; i++) {
+                const int l = index(label_data[i]);
+                if (l >= 0) {
+                    const double v = value_data[i];
+                    count[l]++;
+                    sum[l] += v;
+                    sum_sq[l] += v * v;
+                    if (use_percentile) values[l].push_back(value_data[i]);
+                }
+            }
+            for (size_t l = 0; l < labels.size(); l++) {
+                // Sample variance, as itk::LabelStatisticsImageFilter
+                const double mean = count[l] ? sum[l] / count[l] : 0.;
+                const double var = (count[l] > 1) ? (sum_sq[l] - sum[l] * mean) / (count[l] - 1) : 0.;
+                const double centre = use_percentile ? Percentile(values[l], pct) : mean;
+                mean_table.at(f).at(l) = centre / scale_list.at(f);
+                sigma_table.at(f).at(l) = std::sqrt(std::max(var, 0.)) / scale_list.at(f);
+            }
         }
-        double vox_volume = QI::VoxelVolume(label_img);
-        label_filter->SetLabelInput(label_img);
-        label_filter->SetInput(value_img);
-        label_filter->Update();
-        for (size_t i = 0; i < labels.size(); i++) {
-            mean_table.at(f).at(i) = label_filter->GetMean(labels.at(i)) / scale_list.at(f);
-            sigma_table.at(f).at(i) = label_filter->GetSigma(labels.at(i)) / scale_list.at(f);
-            volume_table.at(f).at(i) = label_filter->GetCount(labels.at(i)) * vox_volume;
+        const double vox_volume = QI::VoxelVolume(label_img);
+        for (size_t l = 0; l < labels.size(); l++) {
+            volume_table.at(f).at(l) = count[l] * vox_volume;
+        }
+    };
+    QI::TaskErrors errors;
+    {
+        const size_t nthreads = QI::ThreadCount(threads.Get());
+        QI::ThreadPool pool(std::max<size_t>(1, std::min<size_t>(nthreads, n_files)));
+        for (int f = 0; f < n_files; f++) {
+            pool.enqueue([&, f]{ errors.run([&]{ task(f); }); });
         }
     }
+    errors.rethrow();
 }
 
 /*
  * MAIN
  */
 int main(int argc, char **argv) {
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
 
     size_t n_files = QI::CheckList(in_paths).size();
     if (volumes) {
@@ -260,7 +397,7 @@ int main(int argc, char **argv) {
                     std::cout << volume_table.at(file).at(l);
                 } else {
                     std::cout << mean_table.at(file).at(l);
-                    if (sigma) std::cout << "±" << sigma_table.at(0).at(l);
+                    if (sigma) std::cout << "±" << sigma_table.at(file).at(l);
                 }
             }
             std::cout << std::endl;
@@ -14,12 +14,136 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <array>
+#include <cstring>
+#include <limits>
 #include "PathUnwrapFilter.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIterator.h"
+#include "ThreadPool.h"
+#include "Macro.h"
 
 namespace itk {
 
+namespace {
+
+/*
+ * The voxels joined so far, as a forest over voxel indices. Each voxel stores the number of wraps
+ * relative to its parent, and each root the number of wraps for the whole group. Finding a root
+ * compresses the path to it, so every voxel on the path then points straight at the root.
+ */
+class WrapGroups {
+protected:
+    std::vector<uint32_t> m_parent, m_size;
+    std::vector<int> m_wraps;
+
+public:
+    WrapGroups(const size_t n) : m_parent(n), m_size(n, 1), m_wraps(n, 0) {
+        for (size_t i = 0; i < n; i++) {
+            m_parent[i] = i;
+        }
+    }
+
+    /*
+     * Returns the root of the group containing i, and sets rel to the wraps of i relative to it
+     */
+    uint32_t find(const uint32_t i, int &rel) {
+        uint32_t root = i;
+        int total = 0;
+        while (m_parent[root] != root) {
+            total += m_wraps[root];
+            root = m_parent[root];
+        }
+        uint32_t n = i;
+        int remaining = total;
+        while (n != root && m_parent[n] != root) {
+            const uint32_t next = m_parent[n];
+            const int w = m_wraps[n];
+            m_parent[n] = root;
+            m_wraps[n] = remaining;
+            remaining -= w;
+            n = next;
+        }
+        rel = total;
+        return root;
+    }
+
+    uint32_t size(const uint32_t root) const { return m_size[root]; }
+    int wraps(const uint32_t root) const { return m_wraps[root]; }
+
+    /*
+     * Add the group with root from to the group with root to, adding delta wraps to its voxels
+     */
+    void merge(const uint32_t to, const uint32_t from, const int delta) {
+        m_parent[from] = to;
+        m_wraps[from] += delta - m_wraps[to];
+        m_size[to] += m_size[from];
+    }
+};
+
+/*
+ * Maps a float to an unsigned integer with the same order, treating -0 as 0
+ */
+inline uint32_t SortKey(const float f) {
+    const float nz = f + 0.0f;
+    uint32_t bits;
+    std::memcpy(&bits, &nz, sizeof(bits));
+    return (bits & 0x80000000u) ? ~bits : (bits | 0x80000000u);
+}
+
+/*
+ * Stable LSD radix sort on the top 32 bits, one byte per pass. Each thread counts and then scatters
+ * its own chunk, and the chunks are written in order, so equal keys keep their input order.
+ */
+void RadixSortKeys(std::vector<uint64_t> &values, const size_t nthreads) {
+    std::vector<uint64_t> temp(values.size());
+    const size_t chunk = (values.size() + nthreads - 1) / nthreads;
+    std::vector<std::array<size_t, 256>> counts(nthreads);
+    for (int shift = 32; shift < 64; shift += 8) {
+        {
+            QI::ThreadPool pool(nthreads);
+            for (size_t t = 0; t < nthreads; t++) {
+                pool.enqueue([&, t, shift]{
+                    counts[t].fill(0);
+                    const size_t end = std::min(values.size(), (t + 1) * chunk);
+                    for (size_t i = t * chunk; i < end; i++) {
+                        counts[t][(values[i] >> shift) & 0xFF]++;
+                    }
+                });
+            }
+        }
+        size_t total = 0;
+        bool single_bucket = false;
+        for (size_t b = 0; b < 256; b++) {
+            size_t bucket = 0;
+            for (size_t t = 0; t < nthreads; t++) {
+                const size_t c = counts[t][b];
+                counts[t][b] = total;
+                total += c;
+                bucket += c;
+            }
+            if (bucket == values.size()) {
+                single_bucket = true;
+            }
+        }
+        if (single_bucket) { // This byte is the same for every key, nothing would move
+            continue;
+        }
+        {
+            QI::ThreadPool pool(nthreads);
+            for (size_t t = 0; t < nthreads; t++) {
+                pool.enqueue([&, t, shift]{
+                    const size_t end = std::min(values.size(), (t + 1) * chunk);
+                    for (size_t i = t * chunk; i < end; i++) {
+                        temp[counts[t][(values[i] >> shift) & 0xFF]++] = values[i];
+                    }
+                });
+            }
+        }
+        std::swap(values, temp);
+    }
+}
+
+} // End anonymous namespace
+
 void UnwrapPathPhaseFilter::SetReliability(const TImage *img) { this->SetNthInput(1, const_cast<TImage*>(img)); }
 void UnwrapPathPhaseFilter::GenerateOutputInformation() {
     Superclass::GenerateOutputInformation();
@@ -45,94 +169,78 @@ int UnwrapPathPhaseFilter::find_wrap(float phase1, float phase2) {
     }
 }
 
-// Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-void UnwrapPathPhaseFilter::merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                    std::shared_ptr<std::list<Voxel *>> group2,
-                    int wrap_delta) {
-    for (auto v : *group2) {
-        v->group = group1;
-        v->wraps += wrap_delta;
-    }
-    group1->splice(group1->end(), *group2);
-}
-
+/*
+ * Edges join each voxel to its neighbour along x, y and z, and are processed from most to least
+ * reliable (lowest to highest second difference). Each edge is packed into 64 bits, the sort key
+ * of its reliability above its direction * nvox + the first voxel. That is the order the edges are
+ * built in, so sorting the key alone with a stable sort gives the same order as sorting the full
+ * value, and ties are processed in the same order as they always have been.
+ */
 void UnwrapPathPhaseFilter::GenerateData() {
-    //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
     const auto region = this->GetInput()->GetLargestPossibleRegion();
-    const auto volume_size = region.GetSize()[0] * region.GetSize()[1] * region.GetSize()[2];
-    int volume_width = region.GetSize()[0];
-    int volume_height = region.GetSize()[1];
-    int volume_depth = region.GetSize()[2];
-
-    std::vector<Voxel> voxels;
-    voxels.reserve(volume_size);
-    ImageRegionConstIterator<TImage> phaseIter(this->GetInput(0), region);
-    ImageRegionConstIterator<TImage> relIter(this->GetInput(1), region);
-    while (!phaseIter.IsAtEnd()) {
-        voxels.emplace_back(Voxel{phaseIter.Get(), relIter.Get()});
-        voxels.back().group->push_front(&voxels.back());
-        ++phaseIter; ++relIter;
-    }
-    std::vector<Edge> edges;
-    edges.reserve(3 * volume_size);
-    std::vector<Voxel>::iterator v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width - 1; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + 1)->reliability,
-                                    &*v_it, &*(v_it + 1),
-                                    find_wrap(v_it->phase, (v_it + 1)->phase)});
-                v_it++;
-            }
-        v_it++;
-        }
+    const size_t nx = region.GetSize()[0];
+    const size_t ny = region.GetSize()[1];
+    const size_t nz = region.GetSize()[2];
+    const size_t nvox = nx * ny * nz;
+    if (3 * nvox > std::numeric_limits<uint32_t>::max()) {
+        QI_EXCEPTION("Volume is too large for path unwrapping, " << nvox << " voxels");
     }
-
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth; n++) {
-        for (int i = 0; i < volume_height - 1; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width)->reliability,
-                                    &*v_it, &*(v_it + volume_width),
-                                    find_wrap(v_it->phase, (v_it + volume_width)->phase)});
-                v_it++;
-            }
-        }
-        v_it+=volume_width;
-    }
-
-    v_it = voxels.begin();
-    for (int n=0; n < volume_depth - 1; n++) {
-        for (int i = 0; i < volume_height; i++) {
-            for (int j = 0; j < volume_width; j++) {
-                edges.emplace_back(Edge{v_it->reliability + (v_it + volume_width*volume_height)->reliability,
-                                    &*v_it, &*(v_it + (volume_width*volume_height)),
-                                    find_wrap(v_it->phase, (v_it + volume_width*volume_height)->phase)});
-                v_it++;
-            }
+    const float *phase = this->GetInput(0)->GetBufferPointer();
+    const float *reliability = this->GetInput(1)->GetBufferPointer();
+    const size_t nthreads = std::max<size_t>(1, std::min<size_t>(this->GetNumberOfThreads(), nz));
+    const std::array<size_t, 3> stride{{1, nx, nx * ny}};
+    const size_t n_x_edges = (nx - 1) * ny * nz;
+    const size_t n_y_edges = nx * (ny - 1) * nz;
+    const size_t n_z_edges = nx * ny * (nz - 1);
+    std::vector<uint64_t> edges(n_x_edges + n_y_edges + n_z_edges);
+    {
+        QI::ThreadPool pool(nthreads);
+        for (size_t z = 0; z < nz; z++) {
+            pool.enqueue([&, z]{
+                auto add = [&](const size_t pos, const size_t dir, const size_t v) {
+                    const float rel = reliability[v] + reliability[v + stride[dir]];
+                    edges[pos] = (static_cast<uint64_t>(SortKey(rel)) << 32) | (dir * nvox + v);
+                };
+                for (size_t y = 0; y < ny; y++) {
+                    for (size_t x = 0; x < nx; x++) {
+                        const size_t v = x + nx * (y + ny * z);
+                        if (x < nx - 1) add((z * ny + y) * (nx - 1) + x, 0, v);
+                        if (y < ny - 1) add(n_x_edges + (z * (ny - 1) + y) * nx + x, 1, v);
+                        if (z < nz - 1) add(n_x_edges + n_y_edges + (z * ny + y) * nx + x, 2, v);
+                    }
+                }
+            });
         }
     }
+    RadixSortKeys(edges, nthreads);
 
-    std::stable_sort(edges.begin(), edges.end(), [](Edge a, Edge b){ return a.reliability < b.reliability; });
-    for (auto &edge : edges) {
-        Voxel *voxel1 = edge.voxel1;
-        Voxel *voxel2 = edge.voxel2;
-        if (voxel2->group != voxel1->group) {
-            if (voxel1->group->size() > voxel2->group->size()) {
-                merge_groups(voxel1->group, voxel2->group, voxel1->wraps - edge.wrap - voxel2->wraps);
+    WrapGroups groups(nvox);
+    for (const uint64_t edge : edges) {
+        const uint32_t id = edge & 0xFFFFFFFFu;
+        const uint32_t v1 = id % nvox;
+        const uint32_t v2 = v1 + stride[id / nvox];
+        int rel1, rel2;
+        const uint32_t root1 = groups.find(v1, rel1);
+        const uint32_t root2 = groups.find(v2, rel2);
+        if (root1 != root2) {
+            const int wraps1 = rel1 + groups.wraps(root1);
+            const int wraps2 = rel2 + groups.wraps(root2);
+            const int wrap = find_wrap(phase[v1], phase[v2]);
+            if (groups.size(root1) > groups.size(root2)) {
+                groups.merge(root1, root2, wraps1 - wrap - wraps2);
             } else {
-                merge_groups(voxel2->group, voxel1->group, voxel2->wraps + edge.wrap - voxel1->wraps);
+                groups.merge(root2, root1, wraps2 + wrap - wraps1);
             }
         }
     }
 
-    // Unwrap voxels and reassemble into image
-    ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
-    v_it = voxels.begin();
-    while (!outputIter.IsAtEnd()) {
-        outputIter.Set(v_it->phase + 2*M_PI*v_it->wraps);
-        ++v_it; ++outputIter;
+    // Unwrap voxels
+    float *output = this->GetOutput()->GetBufferPointer();
+    for (size_t v = 0; v < nvox; v++) {
+        int rel;
+        const uint32_t root = groups.find(v, rel);
+        output[v] = phase[v] + 2*M_PI*(rel + groups.wraps(root));
     }
 }
 
-} // End namespace itk
\ No newline at end of file
+} // End namespace itk
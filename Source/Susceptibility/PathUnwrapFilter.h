@@ -40,36 +40,8 @@ protected:
     UnwrapPathPhaseFilter();
     ~UnwrapPathPhaseFilter() {}
 
-    struct Voxel {
-        float phase;
-        float reliability;
-        int wraps;
-        std::shared_ptr<std::list<Voxel *>> group;
-
-        Voxel() {}
-        Voxel(float ph, float rel) {
-            phase = ph; reliability = rel;
-            wraps = 0;
-            group = std::make_shared<std::list<Voxel *>>();
-            // group->push_front(this);
-            // std::cout << "New Voxel " << this << " / " << group->front() << std::endl;
-        }
-    };
-
-    struct Edge {
-        float reliability;			//reliabilty of the edge and its equal to the sum of the reliability of the two voxels that it conntects
-        Voxel *voxel1;		//pointer to the first voxel
-        Voxel *voxel2;		//pointer to the second voxel
-        int wrap;			//No. of 2*pi to add to the voxel to unwrap it 
-    }; 
-
     int find_wrap(float phase1, float phase2);
 
-    // Do not point shared_ptrs as references, otherwise group2 gets deallocated during loop
-    void merge_groups(std::shared_ptr<std::list<Voxel *>> group1,
-                      std::shared_ptr<std::list<Voxel *>> group2,
-                      int wrap_delta);
-
     void GenerateData() ITK_OVERRIDE;
 
 private:
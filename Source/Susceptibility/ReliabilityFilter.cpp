@@ -14,60 +14,97 @@
  *  avoids singularity loops, http://ao.osa.org/abstract.cfm?URI=ao-48-23-4582
  */
 
+#include <algorithm>
 #include "ReliabilityFilter.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIterator.h"
 
 namespace itk {
 
+namespace {
+
+/*
+ * Branch-free so the row loops below vectorise. Compares and adds in double as the scalar version
+ * did, so the result is the same.
+ */
+inline float Wrap(const float voxel_value) {
+    const double v = voxel_value;
+    const double k = static_cast<double>(v > M_PI) - static_cast<double>(v < -M_PI);
+    return v - 2*M_PI*k;
+}
+
+inline long Clamp(const long i, const long lo, const long hi) {
+    return std::min(std::max(i, lo), hi);
+}
+
+/*
+ * The backward half of each pair of neighbours, the forward half is the negation
+ */
+const int back[13][3] = { {-1, 0, 0}, { 0,-1, 0}, { 0, 0,-1},
+                          {-1,-1, 0}, { 1,-1, 0}, {-1,-1,-1},
+                          { 0,-1,-1}, { 1,-1,-1}, {-1, 0,-1},
+                          {-1, 1,-1}, { 1, 0,-1}, { 0, 1,-1},
+                          { 1, 1,-1} };
+
+} // End anonymous namespace
+
 PhaseReliabilityFilter::PhaseReliabilityFilter() {
     this->SetNumberOfRequiredInputs(1);
     this->SetNumberOfRequiredOutputs(1);
     this->SetNthOutput(0, this->MakeOutput(0));
 }
 
-float PhaseReliabilityFilter::wrap(float voxel_value) {
-    if (voxel_value > M_PI) {
-        return voxel_value - (2*M_PI);
-    } else if (voxel_value < -M_PI) {
-        return voxel_value + (2*M_PI);
-    } else {
-        return voxel_value;
-    }
-}
-
+/*
+ * Works along rows of the raw buffers. Neighbours outside the image take the value of the nearest
+ * voxel inside, as with ZeroFluxNeumannBoundaryCondition. Along y and z that only changes the
+ * offset of a neighbour row, so only the first and last voxel of each row need their own path.
+ */
 void PhaseReliabilityFilter::ThreadedGenerateData(const TRegion &region, ThreadIdType /* Unused */) {
-    using TIter = ImageRegionIterator<TImage>;
-    using TCNIter = ConstNeighborhoodIterator<TImage>;
-    using TOffset = TCNIter::OffsetType;
-    TCNIter::RadiusType radius; radius.Fill(1);
-    TCNIter inputIter(radius, this->GetInput(0), region);
-    TIter   outputIter(this->GetOutput(), region);
-    std::vector<TOffset> back = { {{-1, 0, 0}}, {{ 0,-1, 0}}, {{ 0, 0,-1}},
-                                    {{-1,-1, 0}}, {{ 1,-1, 0}}, {{-1,-1,-1}},
-                                    {{ 0,-1,-1}}, {{ 1,-1,-1}}, {{-1, 0,-1}},
-                                    {{-1, 1,-1}}, {{ 1, 0,-1}}, {{ 0, 1,-1}},
-                                    {{ 1, 1,-1}} };
-    std::vector<TOffset> fwrd = { {{ 1, 0, 0}}, {{ 0, 1, 0}}, {{ 0, 0, 1}},
-                                    {{ 1, 1, 0}}, {{-1, 1, 0}}, {{ 1, 1, 1}},
-                                    {{ 0, 1, 1}}, {{-1, 1, 1}}, {{ 1, 0, 1}},
-                                    {{ 1,-1, 1}}, {{-1, 0, 1}}, {{ 0,-1, 1}},
-                                    {{-1,-1, 1}} };
-
-    inputIter.GoToBegin();
-    outputIter.GoToBegin();
-
-    while (!inputIter.IsAtEnd()) {
-        const float phase = inputIter.GetCenterPixel();
-        float reliability = 0;
-        for (size_t j = 0; j < back.size(); j++) {
-            const float d = wrap(inputIter.GetPixel(back[j]) - phase) -
-                            wrap(phase - inputIter.GetPixel(fwrd[j]));
-            reliability += d*d;
+    const TImage *input = this->GetInput(0);
+    TImage *output = this->GetOutput();
+    const TRegion buffered = input->GetBufferedRegion();
+    const long nx = buffered.GetSize()[0];
+    const long ny = buffered.GetSize()[1];
+    const long nz = buffered.GetSize()[2];
+    const long xs = region.GetIndex()[0] - buffered.GetIndex()[0];
+    const long xe = xs + region.GetSize()[0];
+    const long xa = Clamp(1, xs, xe);      // Start of the interior of each row
+    const long xb = Clamp(nx - 1, xa, xe); // End of the interior
+    const float *in = input->GetBufferPointer();
+    float *out = output->GetBufferPointer();
+    TImage::IndexType row_index = region.GetIndex();
+    row_index[0] = buffered.GetIndex()[0];
+    for (size_t rz = 0; rz < region.GetSize()[2]; rz++) {
+        row_index[2] = region.GetIndex()[2] + rz;
+        const long z = row_index[2] - buffered.GetIndex()[2];
+        for (size_t ry = 0; ry < region.GetSize()[1]; ry++) {
+            row_index[1] = region.GetIndex()[1] + ry;
+            const long y = row_index[1] - buffered.GetIndex()[1];
+            const float *row = in + input->ComputeOffset(row_index);
+            float *out_row = out + output->ComputeOffset(row_index);
+            std::fill(out_row + xs, out_row + xe, 0.f);
+            for (int j = 0; j < 13; j++) {
+                const int dx = back[j][0];
+                const float *brow = row + nx * ((Clamp(y + back[j][1], 0, ny - 1) - y) +
+                                                ny * (Clamp(z + back[j][2], 0, nz - 1) - z));
+                const float *frow = row + nx * ((Clamp(y - back[j][1], 0, ny - 1) - y) +
+                                                ny * (Clamp(z - back[j][2], 0, nz - 1) - z));
+                auto edge = [&](const long x) {
+                    const float d = Wrap(brow[Clamp(x + dx, 0, nx - 1)] - row[x]) -
+                                    Wrap(row[x] - frow[Clamp(x - dx, 0, nx - 1)]);
+                    out_row[x] += d*d;
+                };
+                for (long x = xs; x < xa; x++) {
+                    edge(x);
+                }
+                for (long x = xa; x < xb; x++) {
+                    const float d = Wrap(brow[x + dx] - row[x]) - Wrap(row[x] - frow[x - dx]);
+                    out_row[x] += d*d;
+                }
+                for (long x = xb; x < xe; x++) {
+                    edge(x);
+                }
+            }
         }
-        outputIter.Set(reliability);
-        ++inputIter; ++outputIter;
     }
 }
 
-} // End namespace itk
\ No newline at end of file
+} // End namespace itk
@@ -37,7 +37,6 @@ protected:
     PhaseReliabilityFilter();
     ~PhaseReliabilityFilter() {}
 
-    float wrap(float voxel_value);
     void ThreadedGenerateData(const TRegion &region, ThreadIdType threadId) ITK_OVERRIDE;
 
 private:
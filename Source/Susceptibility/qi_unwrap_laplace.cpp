@@ -10,27 +10,21 @@
  */
 
 #include <iostream>
-
-#include "itkImageSource.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkMultiplyImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkForwardFFTImageFilter.h"
-#include "itkInverseFFTImageFilter.h"
-#include "itkFFTShiftImageFilter.h"
-#include "itkComplexToModulusImageFilter.h"
-#include "itkFFTPadImageFilter.h"
-#include "itkMaskImageFilter.h"
-#include "itkThresholdImageFilter.h"
-#include "itkBinaryThresholdImageFilter.h"
-#include "itkBinaryCrossStructuringElement.h"
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <complex>
+#include <string>
+#include <vector>
+
+#include "itkImageToImageFilter.h"
 #include "itkBinaryBallStructuringElement.h"
 #include "itkBinaryErodeImageFilter.h"
-#include "itkExtractImageFilter.h"
 
 #include "ImageTypes.h"
 #include "Util.h"
+#include "FFT.h"
+#include "ThreadPool.h"
 #include "ImageIO.h"
 #include "Args.h"
 
@@ -80,37 +74,62 @@ protected:
         }
     }
 
+    /*
+     * arg(f*b/c^2) is the sum of the neighbouring phases minus twice the centre phase, wrapped back
+     * into (-pi, pi], so it needs no complex exponentials. Works along rows of the raw buffers,
+     * neighbours outside the image take the value of the nearest voxel inside as with
+     * ZeroFluxNeumannBoundaryCondition.
+     */
+    static double WrapPhase(const double phase) {
+        const double turns = phase / (2*M_PI);
+        return phase - 2*M_PI*std::ceil(turns - 0.5); // Rounds halves down so +/-pi both give pi, as arg() does
+    }
+
     void ThreadedGenerateData(const RegionType &region, ThreadIdType /* Unused */) ITK_OVERRIDE {
-        //std::cout <<  __PRETTY_FUNCTION__ << std::endl;
-        ConstNeighborhoodIterator<TImage>::RadiusType radius;
-        radius.Fill(1);
-        ConstNeighborhoodIterator<TImage> inputIter(radius, this->GetInput(), region);
-        ImageRegionIterator<TImage> outputIter(this->GetOutput(), region);
-
-        std::vector<ConstNeighborhoodIterator<TImage>::OffsetType> back, fwrd;
-        back.push_back({{-1, 0, 0}});
-        fwrd.push_back({{ 1, 0, 0}});
-        back.push_back({{ 0,-1, 0}});
-        fwrd.push_back({{ 0, 1, 0}});
-        back.push_back({{ 0, 0,-1}});
-        fwrd.push_back({{ 0, 0, 1}});
-
-        TImage::SpacingType spacing = this->GetInput()->GetSpacing();
-        TImage::SpacingType s_sqr = spacing * spacing;
-        while(!inputIter.IsAtEnd()) {
-            double sum = 0;
-            double cphase = inputIter.GetCenterPixel();
-            std::complex<double> c = std::polar(1., cphase);
-            for (size_t i = 0; i < fwrd.size(); ++i) {
-                double bphase = inputIter.GetPixel(back[i]);
-                double fphase = inputIter.GetPixel(fwrd[i]);
-                std::complex<double> b = std::polar(1., bphase);
-                std::complex<double> f = std::polar(1., fphase);
-                sum += std::arg((f*b)/(c*c)) / s_sqr[i];
+        const TImage *input = this->GetInput();
+        TImage *output = this->GetOutput();
+        const RegionType buffered = input->GetBufferedRegion();
+        const long nx = buffered.GetSize()[0];
+        const long ny = buffered.GetSize()[1];
+        const long nz = buffered.GetSize()[2];
+        const long xs = region.GetIndex()[0] - buffered.GetIndex()[0];
+        const long xe = xs + region.GetSize()[0];
+        const long xa = std::min(std::max(1L, xs), xe);      // Start of the interior of each row
+        const long xb = std::min(std::max(nx - 1, xa), xe);  // End of the interior
+        const TImage::SpacingType spacing = input->GetSpacing();
+        const double sx = 1. / (spacing[0] * spacing[0]);
+        const double sy = 1. / (spacing[1] * spacing[1]);
+        const double sz = 1. / (spacing[2] * spacing[2]);
+        TImage::IndexType row_index = region.GetIndex();
+        row_index[0] = buffered.GetIndex()[0];
+        for (size_t rz = 0; rz < region.GetSize()[2]; rz++) {
+            row_index[2] = region.GetIndex()[2] + rz;
+            const long z = row_index[2] - buffered.GetIndex()[2];
+            const long zb = (z > 0) ? -nx*ny : 0;
+            const long zf = (z < nz - 1) ? nx*ny : 0;
+            for (size_t ry = 0; ry < region.GetSize()[1]; ry++) {
+                row_index[1] = region.GetIndex()[1] + ry;
+                const long y = row_index[1] - buffered.GetIndex()[1];
+                const long yb = (y > 0) ? -nx : 0;
+                const long yf = (y < ny - 1) ? nx : 0;
+                const float *row = input->GetBufferPointer() + input->ComputeOffset(row_index);
+                float *out_row = output->GetBufferPointer() + output->ComputeOffset(row_index);
+                auto laplace = [&](const long x, const long xback, const long xfwrd) {
+                    const double c2 = 2. * row[x];
+                    out_row[x] = WrapPhase(row[xback] + static_cast<double>(row[xfwrd]) - c2) * sx +
+                                 WrapPhase(row[x + yb] + static_cast<double>(row[x + yf]) - c2) * sy +
+                                 WrapPhase(row[x + zb] + static_cast<double>(row[x + zf]) - c2) * sz;
+                };
+                for (long x = xs; x < xa; x++) {
+                    laplace(x, std::max(x - 1, 0L), std::min(x + 1, nx - 1));
+                }
+                for (long x = xa; x < xb; x++) {
+                    laplace(x, x - 1, x + 1);
+                }
+                for (long x = xb; x < xe; x++) {
+                    laplace(x, std::max(x - 1, 0L), std::min(x + 1, nx - 1));
+                }
             }
-            outputIter.Set(sum / 7.);
-            ++inputIter;
-            ++outputIter;
         }
     }
 
@@ -119,139 +138,179 @@ private:
     void operator=(const Self &);  //purposely not implemented
 };
 
-class DiscreteInverseLaplace : public ImageSource<QI::VolumeF> {
+} // End namespace itk
+
+/*
+ * Inverts the discrete Laplacian by dividing by it in k-space. The kernel depends only on the image
+ * and voxel sizes, so it is calculated once and shared by every volume, as are the transform plans.
+ *
+ * The FFT solver has periodic boundaries, so volumes are padded to a size with no prime factors
+ * above 5 by repeating the edge voxels, as itk::FFTPadImageFilter does. Real FFTs are used, so the
+ * kernel is only kept for the half spectrum. The DCT solver has Neumann boundaries, which match the
+ * clamped edges of DiscreteLaplacePhaseFilter, so needs no padding and transforms real data in-place.
+ */
+class InverseLaplacian {
 public:
-    typedef QI::VolumeF            TImage;
-    typedef DiscreteInverseLaplace Self;
-    typedef ImageSource<TImage>    Superclass;
-    typedef SmartPointer<Self>     Pointer;
+    typedef QI::FFT3D<float>::TSize TSize;
+    enum class Solver { FFT, DCT };
 
-    itkNewMacro(Self);
-    itkTypeMacro(DiscreteInverseLaplace, ImageSource);
+protected:
+    Solver m_solver;
+    TSize m_size{{0, 0, 0}}, m_padded{{0, 0, 0}}, m_lower{{0, 0, 0}};
+    std::array<double, 3> m_spacing{{1., 1., 1.}};
+    std::vector<float> m_kernel;
+
+    static size_t PaddedSize(size_t n) {
+        for (;; n++) {
+            size_t r = n;
+            for (const size_t p : {2, 3, 5}) {
+                while (r % p == 0) r /= p;
+            }
+            if (r == 1) return n;
+        }
+    }
 
-    void SetImageProperties(const TImage *img) {
-        m_region = img->GetLargestPossibleRegion();
-        m_spacing = img->GetSpacing();
-        m_direction = img->GetDirection();
-        m_origin = img->GetOrigin();
+    /*
+     * 1/L for frequency index k, where L is the Laplacian in k-space. The terms are those of -L, as
+     * the Laplacian is negative definite. There is a pole at k=0, so the mean phase is lost.
+     */
+    float value(const size_t x, const size_t y, const size_t z, const std::array<std::vector<double>, 3> &terms) const {
+        if (x == 0 && y == 0 && z == 0) {
+            return 0.;
+        }
+        return -1. / (terms[0][x] + terms[1][y] + terms[2][z]);
     }
 
-protected:
-    typename TImage::RegionType    m_region;
-    typename TImage::SpacingType   m_spacing;
-    typename TImage::DirectionType m_direction;
-    typename TImage::PointType     m_origin;
-
-    DiscreteInverseLaplace(){}
-    ~DiscreteInverseLaplace(){}
-    void GenerateData() ITK_OVERRIDE {
-        typename TImage::Pointer output = this->GetOutput();
-        output->SetRegions(m_region);
+    /*
+     * The eigenvalues of minus the 1D Laplacian along each axis, divided by the squared voxel size
+     * as in DiscreteLaplacePhaseFilter. The DCT basis functions are half the frequency of the FFT
+     * ones for the same index.
+     */
+    std::array<std::vector<double>, 3> terms() const {
+        const double period = (m_solver == Solver::DCT) ? M_PI : 2. * M_PI;
+        std::array<std::vector<double>, 3> t;
+        for (int d = 0; d < 3; d++) {
+            t[d].resize(m_padded[d]);
+            for (size_t k = 0; k < m_padded[d]; k++) {
+                t[d][k] = (2. - 2. * cos(k * period / m_padded[d])) / (m_spacing[d] * m_spacing[d]);
+            }
+        }
+        return t;
+    }
+
+    QI::VolumeF::Pointer newOutput(const QI::VolumeF *lap) const {
+        auto output = QI::VolumeF::New();
+        output->CopyInformation(lap);
+        output->SetRegions(lap->GetLargestPossibleRegion());
         output->Allocate();
-        output->SetSpacing(m_spacing);
-        output->SetDirection(m_direction);
-        output->SetOrigin(m_origin);
-        itk::ImageRegionIteratorWithIndex<TImage> imageIt(output,output->GetLargestPossibleRegion());
-        imageIt.GoToBegin();
-        imageIt.Set(0.); // There is a pole here
-        ++imageIt;
-        while(!imageIt.IsAtEnd()) {
-            auto index = imageIt.GetIndex() - m_region.GetIndex(); // Might be padded to a negative start
-            double val = 0;
-            for (int i = 0; i < 3; i++) {
-                val += 2. - 2. * cos(index[i] * 2. * M_PI / m_region.GetSize()[i]);
+        return output;
+    }
+
+    QI::VolumeF::Pointer applyFFT(const QI::VolumeF *lap) const {
+        auto fft = QI::FFT3D<float>::Create(m_padded);
+        std::vector<float> padded(fft->count());
+        std::vector<std::complex<float>> spectrum(fft->halfCount());
+        const float *in = lap->GetBufferPointer();
+        auto clamp = [](const size_t i, const size_t lower, const size_t n) {
+            return static_cast<size_t>(std::min(std::max(static_cast<long>(i) - static_cast<long>(lower), 0L), static_cast<long>(n) - 1));
+        };
+        size_t index = 0;
+        for (size_t z = 0; z < m_padded[2]; z++) {
+            const size_t iz = clamp(z, m_lower[2], m_size[2]);
+            for (size_t y = 0; y < m_padded[1]; y++) {
+                const float *row = in + m_size[0] * (clamp(y, m_lower[1], m_size[1]) + m_size[1] * iz);
+                for (size_t x = 0; x < m_padded[0]; x++) {
+                    padded[index++] = row[clamp(x, m_lower[0], m_size[0])];
+                }
+            }
+        }
+        fft->forward(padded.data(), spectrum.data());
+        for (size_t i = 0; i < spectrum.size(); i++) {
+            spectrum[i] *= m_kernel[i];
+        }
+        fft->inverse(spectrum.data(), padded.data());
+        auto output = newOutput(lap);
+        float *out = output->GetBufferPointer();
+        for (size_t z = 0; z < m_size[2]; z++) {
+            for (size_t y = 0; y < m_size[1]; y++) {
+                const float *row = padded.data() + m_lower[0] + m_padded[0] * ((y + m_lower[1]) + m_padded[1] * (z + m_lower[2]));
+                std::copy(row, row + m_size[0], out + m_size[0] * (y + m_size[1] * z));
             }
-            val /= 7.;
-            imageIt.Set(1./val);
-            ++imageIt;
         }
+        return output;
     }
 
-private:
-    DiscreteInverseLaplace(const Self &);
-    void operator=(const Self &);
-};
+    QI::VolumeF::Pointer applyDCT(const QI::VolumeF *lap) const {
+        auto dct = QI::DCT3D<float>::Create(m_size);
+        auto output = newOutput(lap);
+        float *out = output->GetBufferPointer();
+        std::copy(lap->GetBufferPointer(), lap->GetBufferPointer() + dct->count(), out);
+        dct->forward(out);
+        for (size_t i = 0; i < m_kernel.size(); i++) {
+            out[i] *= m_kernel[i];
+        }
+        dct->inverse(out);
+        return output;
+    }
 
-/*
- * Do it the hard way!
- */
-class DiscreteInverseLaplace2 : public ImageSource<QI::VolumeF> {
 public:
-    typedef QI::VolumeF             TImage;
-    typedef DiscreteInverseLaplace2 Self;
-    typedef ImageSource<TImage>     Superclass;
-    typedef SmartPointer<Self>      Pointer;
+    InverseLaplacian(const Solver s) : m_solver(s) {}
 
-    itkNewMacro(Self);
-    itkTypeMacro(DiscreteInverseLaplace2, ImageSource);
-
-    void SetImageProperties(const TImage *img) {
-        m_region = img->GetLargestPossibleRegion();
-        m_spacing = img->GetSpacing();
-        m_direction = img->GetDirection();
-        m_origin = img->GetOrigin();
+    void setGeometry(const QI::VolumeF::SizeType &size, const QI::VolumeF::SpacingType &spacing) {
+        const TSize new_size{{size[0], size[1], size[2]}};
+        const std::array<double, 3> new_spacing{{spacing[0], spacing[1], spacing[2]}};
+        if (new_size == m_size && new_spacing == m_spacing) {
+            return;
+        }
+        m_size = new_size;
+        m_spacing = new_spacing;
+        for (int d = 0; d < 3; d++) {
+            m_padded[d] = (m_solver == Solver::DCT) ? m_size[d] : PaddedSize(m_size[d]);
+            m_lower[d] = (m_padded[d] - m_size[d]) / 2;
+        }
+        const auto t = terms();
+        const size_t nx = (m_solver == Solver::DCT) ? m_padded[0] : m_padded[0] / 2 + 1;
+        m_kernel.resize(nx * m_padded[1] * m_padded[2]);
+        size_t index = 0;
+        for (size_t z = 0; z < m_padded[2]; z++) {
+            for (size_t y = 0; y < m_padded[1]; y++) {
+                for (size_t x = 0; x < nx; x++) {
+                    m_kernel[index++] = value(x, y, z, t);
+                }
+            }
+        }
     }
 
-protected:
-    typename TImage::RegionType    m_region;
-    typename TImage::SpacingType   m_spacing;
-    typename TImage::DirectionType m_direction;
-    typename TImage::PointType     m_origin;
-
-    DiscreteInverseLaplace2(){}
-    ~DiscreteInverseLaplace2(){}
-    void GenerateData() ITK_OVERRIDE {
-        typename TImage::Pointer output = this->GetOutput();
-        output->SetRegions(m_region);
-        output->Allocate();
-        output->SetSpacing(m_spacing);
-        output->SetDirection(m_direction);
-        output->SetOrigin(m_origin);
-
-        typename TImage::Pointer filt = TImage::New();
-        filt->SetRegions(m_region);
-        filt->SetSpacing(m_spacing);
-        filt->SetDirection(m_direction);
-        filt->SetOrigin(m_origin);
-        filt->Allocate();
-        typename TImage::IndexType index = m_region.GetIndex();
-        index[0] += m_region.GetSize()[0] / 2;
-        index[1] += m_region.GetSize()[1] / 2;
-        index[2] += m_region.GetSize()[2] / 2;
-        filt->SetPixel(index, -6);
-        index[0] -= 1; filt->SetPixel(index, 1);
-        index[0] += 2; filt->SetPixel(index, 1); index[0] -= 1;
-        index[1] -= 1; filt->SetPixel(index, 1);
-        index[1] += 2; filt->SetPixel(index, 1); index[1] -= 1;
-        index[2] -= 1; filt->SetPixel(index, 1);
-        index[2] += 2; filt->SetPixel(index, 1); index[2] -= 1;
-        auto shift = itk::FFTShiftImageFilter<TImage, TImage>::New();
-        shift->SetInput(filt);
-        typedef itk::ForwardFFTImageFilter<TImage> FFFTType;
-        auto forwardFFT = FFFTType::New();
-        forwardFFT->SetInput(shift->GetOutput());
-        auto magFilt = itk::ComplexToModulusImageFilter<QI::VolumeXF, QI::VolumeF>::New();
-        magFilt->SetInput(forwardFFT->GetOutput());
-        magFilt->Update();
-        auto divFilt = itk::DivideImageFilter<QI::VolumeF, QI::VolumeF, QI::VolumeF>::New();
-        divFilt->SetConstant1(1.);
-        divFilt->SetInput2(magFilt->GetOutput());
-        divFilt->Update();
-        QI::VolumeF::Pointer filt2 = divFilt->GetOutput();
-        filt2->DisconnectPipeline();
-        index = m_region.GetIndex();
-        filt2->SetPixel(index,0);
-        this->GraftOutput(filt2);
+    const TSize &paddedSize() const { return m_padded; }
+
+    QI::VolumeF::Pointer apply(const QI::VolumeF *lap) const {
+        return (m_solver == Solver::DCT) ? applyDCT(lap) : applyFFT(lap);
     }
 
-private:
-    DiscreteInverseLaplace2(const Self &);
-    void operator=(const Self &);
+    /*
+     * The whole kernel on the padded grid, with k=0 at the first voxel
+     */
+    QI::VolumeF::Pointer kernelImage() const {
+        auto img = QI::VolumeF::New();
+        QI::VolumeF::RegionType region;
+        for (int d = 0; d < 3; d++) {
+            region.GetModifiableSize()[d] = m_padded[d];
+        }
+        img->SetRegions(region);
+        img->Allocate();
+        const auto t = terms();
+        float *k = img->GetBufferPointer();
+        for (size_t z = 0; z < m_padded[2]; z++) {
+            for (size_t y = 0; y < m_padded[1]; y++) {
+                for (size_t x = 0; x < m_padded[0]; x++) {
+                    *k++ = value(x, y, z, t);
+                }
+            }
+        }
+        return img;
+    }
 };
 
-
-} // End namespace itk
-
 //******************************************************************************
 // Main
 //******************************************************************************
@@ -265,104 +324,120 @@ int main(int argc, char **argv) {
     args::ValueFlag<std::string> outarg(parser, "OUTPREFIX", "Add a prefix to output filenames", {'o', "out"});
     args::ValueFlag<std::string> mask(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
     args::ValueFlag<int> erode(parser, "ERODE", "Erode mask by N mm (default 1)", {'e', "erode"}, 1);
+    args::ValueFlag<std::string> solver(parser, "SOLVER", "Choose Poisson solver. F = FFT with periodic boundaries (padded), D = DCT with Neumann boundaries (no padding). Default = F", {"solver"}, "F");
+    args::ValueFlag<int> mem(parser, "MEM", "Memory for volumes processed at once, in MB (default 4096)", {"mem"}, 4096);
     args::Flag debug(parser, "DEBUG", "Output debugging images", {'d', "debug"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     
     itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
 
     if (verbose) std::cout << "Opening input file: " << QI::CheckPos(input_path) << std::endl;
-    auto inFile = QI::ReadImage(QI::CheckPos(input_path));
+    auto inFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path));
     std::string prefix = (outarg ? outarg.Get() : QI::StripExt(input_path.Get()));
 
-    auto calcLaplace = itk::DiscreteLaplacePhaseFilter::New();
-    calcLaplace->SetInput(inFile);
-    calcLaplace->Update();
-    if (debug) QI::WriteImage(calcLaplace->GetOutput(), prefix + "_step1_laplace" + QI::OutExt());
-
-    QI::VolumeF::Pointer lap = calcLaplace->GetOutput();
     auto mask_img = mask ? QI::ReadImage<QI::VolumeUC>(mask.Get()) : ITK_NULLPTR;
-    if (mask) {
-        auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeUC>::New();
-        masker->SetInput(calcLaplace->GetOutput());
-        
-        if (erode) {
-            typedef itk::BinaryBallStructuringElement<QI::VolumeUC::PixelType, 3> ElementType;
-            ElementType structuringElement;
-            ElementType::SizeType radii;
-            auto spacing = mask_img->GetSpacing();
-            radii[0] = ceil(erode.Get() / spacing[0]);
-            radii[1] = ceil(erode.Get() / spacing[1]);
-            radii[2] = ceil(erode.Get() / spacing[2]);
-            structuringElement.SetRadius(radii);
-            structuringElement.CreateStructuringElement();
-            if (verbose) std::cout << "Eroding mask by " << erode.Get() << " mm (" << radii << " voxels)" << std::endl;
-            typedef itk::BinaryErodeImageFilter <QI::VolumeUC, QI::VolumeUC, ElementType> BinaryErodeImageFilterType;
-            BinaryErodeImageFilterType::Pointer erodeFilter = BinaryErodeImageFilterType::New();
-            erodeFilter->SetInput(mask_img);
-            erodeFilter->SetErodeValue(1);
-            erodeFilter->SetKernel(structuringElement);
-            erodeFilter->Update();
-            masker->SetMaskImage(erodeFilter->GetOutput());
-            if (debug) QI::WriteImage(erodeFilter->GetOutput(), prefix + "_eroded_mask" + QI::OutExt());
-        } else {
-            masker->SetMaskImage(mask_img);
-        }
-        if (verbose) std::cout << "Applying mask" << std::endl;
-        masker->Update();
-        lap = masker->GetOutput();
-        lap->DisconnectPipeline();
-        if (debug) QI::WriteImage(lap, prefix + "_step1_laplace_masked" + QI::OutExt());
+    QI::VolumeUC::Pointer eroded_mask = mask_img;
+    if (mask && erode) {
+        typedef itk::BinaryBallStructuringElement<QI::VolumeUC::PixelType, 3> ElementType;
+        ElementType structuringElement;
+        ElementType::SizeType radii;
+        auto spacing = mask_img->GetSpacing();
+        radii[0] = ceil(erode.Get() / spacing[0]);
+        radii[1] = ceil(erode.Get() / spacing[1]);
+        radii[2] = ceil(erode.Get() / spacing[2]);
+        structuringElement.SetRadius(radii);
+        structuringElement.CreateStructuringElement();
+        if (verbose) std::cout << "Eroding mask by " << erode.Get() << " mm (" << radii << " voxels)" << std::endl;
+        typedef itk::BinaryErodeImageFilter <QI::VolumeUC, QI::VolumeUC, ElementType> BinaryErodeImageFilterType;
+        BinaryErodeImageFilterType::Pointer erodeFilter = BinaryErodeImageFilterType::New();
+        erodeFilter->SetInput(mask_img);
+        erodeFilter->SetErodeValue(1);
+        erodeFilter->SetKernel(structuringElement);
+        erodeFilter->Update();
+        eroded_mask = erodeFilter->GetOutput();
+        eroded_mask->DisconnectPipeline();
+        if (debug) QI::WriteImage(eroded_mask, prefix + "_eroded_mask" + QI::OutExt());
     }
 
-    if (verbose) std::cout << "Padding image to valid FFT size." << std::endl;
-    typedef itk::FFTPadImageFilter<QI::VolumeF> PadFFTType;
-    auto padFFT = PadFFTType::New();
-    padFFT->SetInput(lap);
-    padFFT->Update();
-    if (debug) QI::WriteImage(padFFT->GetOutput(), prefix + "_step2_padFFT" + QI::OutExt());
-    if (verbose) {
-        std::cout << "Padded image size: " << padFFT->GetOutput()->GetLargestPossibleRegion().GetSize() << std::endl;
-        std::cout << "Calculating Forward FFT." << std::endl;
+    auto region = inFile->GetLargestPossibleRegion();
+    const size_t nvols = region.GetSize()[3];
+    QI::VolumeF::SizeType vol_size;
+    for (int i = 0; i < 3; i++) {
+        vol_size[i] = region.GetSize()[i];
     }
-    typedef itk::ForwardFFTImageFilter<QI::VolumeF> FFFTType;
-    auto forwardFFT = FFFTType::New();
-    forwardFFT->SetInput(padFFT->GetOutput());
-    forwardFFT->Update();
-    if (debug) QI::WriteImage(forwardFFT->GetOutput(), prefix + "_step3_forwardFFT" + QI::OutExt());
-    if (verbose) std::cout << "Generating Inverse Laplace Kernel." << std::endl;
-    auto inverseLaplace = itk::DiscreteInverseLaplace::New();
-    inverseLaplace->SetImageProperties(padFFT->GetOutput());
-    inverseLaplace->Update();
-    if (debug) QI::WriteImage(inverseLaplace->GetOutput(), prefix + "_inverse_laplace_filter" + QI::OutExt());
-    if (verbose) std::cout << "Multiplying." << std::endl;
-    auto mult = itk::MultiplyImageFilter<QI::VolumeXF, QI::VolumeF, QI::VolumeXF>::New();
-    mult->SetInput1(forwardFFT->GetOutput());
-    mult->SetInput2(inverseLaplace->GetOutput());
-    if (debug) QI::WriteImage(mult->GetOutput(), prefix + "_step3_multFFT" + QI::OutExt());
-    if (verbose) std::cout << "Inverse FFT." << std::endl;
-    auto inverseFFT = itk::InverseFFTImageFilter<QI::VolumeXF, QI::VolumeF>::New();
-    inverseFFT->SetInput(mult->GetOutput());
-    inverseFFT->Update();
-    if (debug) QI::WriteImage(inverseFFT->GetOutput(), prefix + "_step4_inverseFFT" + QI::OutExt());
-    if (verbose) std::cout << "Extracting original size image" << std::endl;
-    auto extract = itk::ExtractImageFilter<QI::VolumeF, QI::VolumeF>::New();
-    extract->SetInput(inverseFFT->GetOutput());
-    extract->SetDirectionCollapseToSubmatrix();
-    extract->SetExtractionRegion(calcLaplace->GetOutput()->GetLargestPossibleRegion());
-    extract->Update();
-    if (debug) QI::WriteImage(extract->GetOutput(), prefix + "_step5_extract" + QI::OutExt());
-    std::string outname = prefix + "_unwrap" + QI::OutExt();
-    if (verbose) std::cout << "Output filename: " << outname << std::endl;
-    if (mask) {
-        if (verbose) std::cout << "Re-applying mask" << std::endl;
-        auto masker = itk::MaskImageFilter<QI::VolumeF, QI::VolumeUC>::New();
-        masker->SetMaskImage(mask_img);
-        masker->SetInput(extract->GetOutput());
-        masker->Update();
-        QI::WriteImage(masker->GetOutput(), outname);
+    if (mask && (mask_img->GetLargestPossibleRegion().GetSize() != vol_size)) {
+        QI_FAIL("Mask size does not match input image size");
+    }
+    InverseLaplacian::Solver solver_type;
+    if (solver.Get() == "F") {
+        solver_type = InverseLaplacian::Solver::FFT;
+    } else if (solver.Get() == "D") {
+        solver_type = InverseLaplacian::Solver::DCT;
     } else {
-        QI::WriteImage(extract->GetOutput(), outname);
+        std::cerr << "Invalid solver " << solver.Get() << " selected." << std::endl;
+        return EXIT_FAILURE;
+    }
+    InverseLaplacian inverse(solver_type);
+    QI::VolumeF::SpacingType vol_spacing;
+    for (int i = 0; i < 3; i++) {
+        vol_spacing[i] = inFile->GetSpacing()[i];
     }
+    inverse.setGeometry(vol_size, vol_spacing);
+    if (verbose) std::cout << "Padded image size: " << inverse.paddedSize()[0] << "x" << inverse.paddedSize()[1] << "x" << inverse.paddedSize()[2] << std::endl;
+    if (debug) QI::WriteImage(inverse.kernelImage(), prefix + "_inverse_laplace_filter" + QI::OutExt());
+
+    // Volumes are processed at once, as many as fit in the memory budget, splitting the threads between them
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+    const size_t nvox = vol_size[0] * vol_size[1] * vol_size[2];
+    const size_t npadded = inverse.paddedSize()[0] * inverse.paddedSize()[1] * inverse.paddedSize()[2];
+    const size_t vol_bytes = 20 * nvox + (solver_type == InverseLaplacian::Solver::FFT ? 8 * npadded : 0);
+    const size_t nconcurrent = debug ? 1 : std::max<size_t>(1, std::min({nthreads, nvols, (mem.Get() * size_t(1 << 20)) / vol_bytes}));
+    const size_t vol_threads = std::max<size_t>(1, nthreads / nconcurrent);
+    if (verbose) std::cout << "Unwrapping " << nvols << " volumes, " << nconcurrent << " at once" << std::endl;
+
+    auto output = QI::SeriesF::New();
+    output->CopyInformation(inFile);
+    output->SetRegions(region);
+    output->Allocate();
+    // The input and masks are shared between volumes, so they are only read through their buffers.
+    // Filters that take them as inputs would update them, which races between threads.
+    auto apply_mask = [nvox](float *data, const QI::VolumeUC *m) {
+        const unsigned char *mdata = m->GetBufferPointer();
+        for (size_t i = 0; i < nvox; i++) {
+            if (!mdata[i]) data[i] = 0.f;
+        }
+    };
+    auto task = [&](const size_t v) {
+        const std::string suffix = nvols > 1 ? "_" + std::to_string(v) : "";
+        auto calcLaplace = itk::DiscreteLaplacePhaseFilter::New();
+        calcLaplace->SetInput(QI::VolumeOf(inFile.GetPointer(), v));
+        calcLaplace->SetNumberOfThreads(vol_threads);
+        calcLaplace->Update();
+        QI::VolumeF::Pointer lap = calcLaplace->GetOutput();
+        lap->DisconnectPipeline();
+        if (debug) QI::WriteImage(lap, prefix + "_step1_laplace" + suffix + QI::OutExt());
+        if (mask) {
+            apply_mask(lap->GetBufferPointer(), eroded_mask);
+            if (debug) QI::WriteImage(lap, prefix + "_step1_laplace_masked" + suffix + QI::OutExt());
+        }
+        QI::VolumeF::Pointer unwrapped = inverse.apply(lap);
+        if (debug) QI::WriteImage(unwrapped, prefix + "_step5_extract" + suffix + QI::OutExt());
+        if (mask) {
+            apply_mask(unwrapped->GetBufferPointer(), mask_img);
+        }
+        std::copy(unwrapped->GetBufferPointer(), unwrapped->GetBufferPointer() + nvox, output->GetBufferPointer() + v * nvox);
+    };
+    QI::TaskErrors errors;
+    {
+        QI::ThreadPool pool(nconcurrent);
+        for (size_t v = 0; v < nvols; v++) {
+            pool.enqueue([&, v]{ errors.run([&]{ task(v); }); });
+        }
+    } // Destroying the pool waits for the volumes
+    errors.rethrow();
+    std::string outname = prefix + "_unwrap" + QI::OutExt();
+    if (verbose) std::cout << "Output filename: " << outname << std::endl;
+    QI::WriteImage(output, outname);
     if (verbose) std::cout << "Finished." << std::endl;
     return EXIT_SUCCESS;
 }
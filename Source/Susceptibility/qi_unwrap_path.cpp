@@ -16,14 +16,12 @@
 
 #include <iostream>
 #include <memory>
-#include <list>
-#include <list>
+#include <algorithm>
 
 #include "itkImageToImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkTileImageFilter.h"
 #include "ImageTypes.h"
 #include "Util.h"
+#include "ThreadPool.h"
 #include "ImageIO.h"
 #include "Args.h"
 #include "ReliabilityFilter.h"
@@ -44,57 +42,55 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> threads(parser, "THREADS", "Use N threads (default=4, 0=hardware limit)", {'T', "threads"}, 4);
     args::ValueFlag<std::string> outarg(parser, "OUTPUT PREFIX", "Change output prefix (default input filename)", {'o', "out"});
     args::ValueFlag<std::string> maskarg(parser, "MASK", "Only process voxels within the mask", {'m', "mask"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<int> mem(parser, "MEM", "Memory for volumes processed at once, in MB (default 4096)", {"mem"}, 4096);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
 
     if (verbose) std::cout << "Reading phase file: " << QI::CheckPos(input_path) << std::endl;
     auto inFile = QI::ReadImage<QI::SeriesF>(QI::CheckPos(input_path));
 
-    typedef itk::ExtractImageFilter<QI::SeriesF, QI::VolumeF> TExtract;
-    typedef itk::TileImageFilter<QI::VolumeF, QI::SeriesF>    TTile;
-    
     auto region = inFile->GetLargestPossibleRegion();
-    const size_t nvols = region.GetSize()[3]; // Save for the loop
-    region.GetModifiableSize()[3] = 0;
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = nvols;
+    const size_t nvols = region.GetSize()[3];
+    const size_t nvox = region.GetSize()[0] * region.GetSize()[1] * region.GetSize()[2];
 
-    auto extract = TExtract::New();
-    auto tile   = TTile::New();
-    extract->SetInput(inFile);
-    extract->SetDirectionCollapseToSubmatrix();
-    tile->SetLayout(layout);
+    // Each volume needs roughly 80 bytes per voxel, mostly for the sorted edges
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+    const size_t vol_bytes = 80 * nvox;
+    const size_t nconcurrent = std::max<size_t>(1, std::min({nthreads, nvols, (mem.Get() * size_t(1 << 20)) / vol_bytes}));
+    const size_t vol_threads = std::max<size_t>(1, nthreads / nconcurrent);
+    if (verbose) std::cout << "Unwrapping " << nvols << " volumes, " << nconcurrent << " at once" << std::endl;
 
-    auto reliabilityFilter = itk::PhaseReliabilityFilter::New();
-    auto unwrapFilter = itk::UnwrapPathPhaseFilter::New();
-    for (size_t i = 0; i < nvols; i++) {
-        region.GetModifiableIndex()[3] = i;
-        if (verbose) std::cout << "Processing volume " << i << std::endl;
-        extract->SetExtractionRegion(region);
-        extract->Update();
-        if (verbose) std::cout << "Calculating reliabilty" << std::endl;
-        reliabilityFilter->SetInput(extract->GetOutput());
-        reliabilityFilter->Update();
-        if (verbose) std::cout << "Unwrapping phase" << std::endl;
-        unwrapFilter->SetInput(extract->GetOutput());
+    auto output = QI::SeriesF::New();
+    output->CopyInformation(inFile);
+    output->SetRegions(inFile->GetLargestPossibleRegion());
+    output->Allocate();
+    auto task = [&](const size_t i) {
+        // Each volume is copied out directly, as filters sharing inFile as input would race
+        const QI::VolumeF::Pointer volume = QI::VolumeOf(inFile.GetPointer(), i);
+        auto reliabilityFilter = itk::PhaseReliabilityFilter::New();
+        reliabilityFilter->SetInput(volume);
+        reliabilityFilter->SetNumberOfThreads(vol_threads);
+        auto unwrapFilter = itk::UnwrapPathPhaseFilter::New();
+        unwrapFilter->SetInput(volume);
         unwrapFilter->SetReliability(reliabilityFilter->GetOutput());
+        unwrapFilter->SetNumberOfThreads(vol_threads);
         unwrapFilter->Update();
-        tile->SetInput(i, unwrapFilter->GetOutput());
-        unwrapFilter->GetOutput()->DisconnectPipeline();
-    }
-    tile->Update();
-    // Make sure output orientation info is correct
-    auto dir = inFile->GetDirection();
-    auto spc = inFile->GetSpacing();
-    inFile = tile->GetOutput();
-    inFile->SetDirection(dir);
-    inFile->SetSpacing(spc);
-    inFile->DisconnectPipeline();
+        const float *unwrapped = unwrapFilter->GetOutput()->GetBufferPointer();
+        std::copy(unwrapped, unwrapped + nvox, output->GetBufferPointer() + i * nvox);
+        if (verbose) std::cout << "Finished volume " << i << std::endl;
+    };
+    QI::TaskErrors errors;
+    {
+        QI::ThreadPool pool(nconcurrent);
+        for (size_t i = 0; i < nvols; i++) {
+            pool.enqueue([&, i]{ errors.run([&]{ task(i); }); });
+        }
+    } // Destroying the pool waits for the volumes
+    errors.rethrow();
 
     std::string outname = (outarg ? outarg.Get() : (QI::StripExt(input_path.Get())) + "_unwrapped" + QI::OutExt());
     if (verbose) std::cout << "Writing output: " << outname << std::endl;
-    QI::WriteImage(inFile, outname);
+    QI::WriteImage(output, outname);
 
     return EXIT_SUCCESS;
 }
@@ -11,6 +11,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "ApplyTypes.h"
 #include "Args.h"
 
@@ -155,69 +156,86 @@ int main(int argc, char **argv) {
     args::ValueFlag<int> coils_arg(parser, "COILS", "Number of coils (default is number of volumes)", {'C', "coils"});
     args::Flag     save_corrected(parser, "SAVE COILS", "Save the individual coil images after phase correction", {'s', "save"});
     args::ValueFlag<std::string> subregion(parser, "SUBREGION", "Process subregion starting at voxel I,J,K with size SI,SJ,SK", {'s', "subregion"});
-    QI::ParseArgs(parser, argc, argv, verbose);
-
-    if (verbose) std::cout << "Reading input image: " << QI::CheckPos(input_path) << std::endl;
-    auto input_image = QI::ReadVectorImage<std::complex<float>>(QI::CheckPos(input_path));
-    const auto sz = input_image->GetNumberOfComponentsPerPixel();
-    const auto ncoils = coils_arg ? coils_arg.Get() : sz;
-    auto combine = std::make_shared<ComplexCombine>(sz, ncoils);
-    auto apply = TApplyCombine::New();
-    apply->SetAlgorithm(combine);
-    apply->SetInput(0, input_image);
-    apply->SetOutputAllResiduals(save_corrected);
-    apply->SetVerbose(verbose);
-    apply->SetPoolsize(threads.Get());
-    apply->SetSplitsPerThread(threads.Get());
-    if (subregion) apply->SetSubregion(QI::RegionArg(subregion.Get()));
-    if (ser_path) {
-        if (verbose) std::cout << "Reading COMPOSER reference image: " << ser_path.Get() << std::endl;
-        auto ser_image = QI::ReadVectorImage(ser_path.Get());
-        if (ser_image->GetNumberOfComponentsPerPixel() != ncoils) {
-            QI_FAIL("Number of coil reference images does not match number of coils in data");
-        }
-        apply->SetConst(0, ser_image);
-    } else {
-        // Fall back to Hammond Method
-        if (verbose) std::cout << "Using Hammond method" << std::endl;
-        QI::VectorVolumeXF::RegionType region;
-        if (region_arg) {
-            region = QI::RegionArg<QI::VolumeF::RegionType>(region_arg.Get());
-        } else {
-            auto size = input_image->GetLargestPossibleRegion().GetSize();
-            itk::Index<3> index;
-            for (auto i = 0; i < 3; i++) {
-                index[i] = size[i] / 2 - 4;
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
+
+    struct CoilInputs {
+        QI::VectorVolumeXF::Pointer input;
+        QI::VectorVolumeF::Pointer ser;
+    };
+    QI::RunBatch<CoilInputs>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            CoilInputs in;
+            if (verbose) std::cout << "Reading input image: " << subject.path(QI::CheckPos(input_path)) << std::endl;
+            in.input = QI::ReadVectorImage<std::complex<float>>(subject.path(QI::CheckPos(input_path)));
+            if (ser_path) {
+                if (verbose) std::cout << "Reading COMPOSER reference image: " << subject.path(ser_path.Get()) << std::endl;
+                in.ser = QI::ReadVectorImage(subject.path(ser_path.Get()));
             }
-            region.GetModifiableIndex() = index;
-            region.GetModifiableSize() = {{8, 8, 8}};
-        }
-        if (verbose) std::cout << "Reference region is:\n" << region << std::endl;
-        auto roi = itk::RegionOfInterestImageFilter<QI::VectorVolumeXF, QI::VectorVolumeXF>::New();
-        roi->SetRegionOfInterest(region);
-        roi->SetInput(input_image);
-        auto mean_filter = ComplexVectorMeanFilter::New();
-        mean_filter->SetInput(roi->GetOutput());
-        mean_filter->Update();
-        auto roi_mean = mean_filter->GetResult();
-        if (verbose) std::cout << "Mean values: " << roi_mean << std::endl;
-        itk::VariableLengthVector<float> phase(sz);
-        for (size_t i = 0; i < sz; i++) {
-            phase[i] = std::arg(roi_mean[i]);
-        }
-        if (verbose) std::cout << "Mean phase: " << phase << std::endl;
-        combine->setChannelPhases(phase);
-    }
-    if (verbose) std::cout << "Correcting phase & combining" << std::endl;
-    apply->Update();
-    const std::string out_name = (outarg ? outarg.Get() : QI::StripExt(input_path.Get())) + "_combined" + QI::OutExt();
-    if (verbose) std::cout << "Writing output file " << out_name << std::endl;
-    QI::WriteVectorImage(apply->GetOutput(0), out_name);
-    if (save_corrected) {
-        const std::string out_name = (outarg ? outarg.Get() : QI::StripExt(input_path.Get())) + "_corrected" + QI::OutExt();
-        if (verbose) std::cout << "Writing corrected coil file " << out_name << std::endl;
-        QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_name);
-    }
+            return in;
+        },
+        [&](CoilInputs &in, const QI::Subject &subject) -> std::function<void()> {
+            // The channel phases are measured for each subject, so each needs its own algorithm
+            const auto sz = in.input->GetNumberOfComponentsPerPixel();
+            const auto ncoils = coils_arg ? coils_arg.Get() : sz;
+            auto combine = std::make_shared<ComplexCombine>(sz, ncoils);
+            auto apply = TApplyCombine::New();
+            apply->SetAlgorithm(combine);
+            apply->SetInput(0, in.input);
+            apply->SetOutputAllResiduals(save_corrected);
+            apply->SetVerbose(verbose);
+            apply->SetPoolsize(threads.Get());
+            apply->SetSplitsPerThread(threads.Get());
+            if (subregion) apply->SetSubregion(QI::RegionArg(subregion.Get()));
+            if (in.ser) {
+                if (in.ser->GetNumberOfComponentsPerPixel() != ncoils) {
+                    QI_FAIL("Number of coil reference images does not match number of coils in data");
+                }
+                apply->SetConst(0, in.ser);
+            } else {
+                // Fall back to Hammond Method
+                if (verbose) std::cout << "Using Hammond method" << std::endl;
+                QI::VectorVolumeXF::RegionType region;
+                if (region_arg) {
+                    region = QI::RegionArg<QI::VolumeF::RegionType>(region_arg.Get());
+                } else {
+                    auto size = in.input->GetLargestPossibleRegion().GetSize();
+                    itk::Index<3> index;
+                    for (auto i = 0; i < 3; i++) {
+                        index[i] = size[i] / 2 - 4;
+                    }
+                    region.GetModifiableIndex() = index;
+                    region.GetModifiableSize() = {{8, 8, 8}};
+                }
+                if (verbose) std::cout << "Reference region is:\n" << region << std::endl;
+                auto roi = itk::RegionOfInterestImageFilter<QI::VectorVolumeXF, QI::VectorVolumeXF>::New();
+                roi->SetRegionOfInterest(region);
+                roi->SetInput(in.input);
+                auto mean_filter = ComplexVectorMeanFilter::New();
+                mean_filter->SetInput(roi->GetOutput());
+                mean_filter->Update();
+                auto roi_mean = mean_filter->GetResult();
+                if (verbose) std::cout << "Mean values: " << roi_mean << std::endl;
+                itk::VariableLengthVector<float> phase(sz);
+                for (size_t i = 0; i < sz; i++) {
+                    phase[i] = std::arg(roi_mean[i]);
+                }
+                if (verbose) std::cout << "Mean phase: " << phase << std::endl;
+                combine->setChannelPhases(phase);
+            }
+            if (verbose) std::cout << "Correcting phase & combining" << std::endl;
+            apply->Update();
+            const std::string prefix = outarg ? subject.path(outarg.Get()) : QI::StripExt(subject.path(input_path.Get()));
+            return [apply, prefix, &verbose, &save_corrected]{
+                const std::string out_name = prefix + "_combined" + QI::OutExt();
+                if (verbose) std::cout << "Writing output file " << out_name << std::endl;
+                QI::WriteVectorImage(apply->GetOutput(0), out_name);
+                if (save_corrected) {
+                    const std::string out_name = prefix + "_corrected" + QI::OutExt();
+                    if (verbose) std::cout << "Writing corrected coil file " << out_name << std::endl;
+                    QI::WriteVectorImage(apply->GetAllResidualsOutput(), out_name);
+                }
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
-
@@ -23,6 +23,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "ChunkedImageIO.h"
 #include "Args.h"
 
 /*
@@ -200,6 +201,7 @@ int Pipeline() {
 
 int main(int argc, char **argv) {
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::RegisterChunkedIO(); // Uses ITK readers and writers directly
     if (verbose) std::cout << "Reading header for: " << QI::CheckPos(source_path) << std::endl;
     auto header = itk::ImageIOFactory::CreateImageIO(QI::CheckPos(source_path).c_str(), itk::ImageIOFactory::ReadMode);
     if (!header)  {
@@ -27,6 +27,7 @@
 
 #include "Util.h"
 #include "ImageIO.h"
+#include "ChunkedImageIO.h"
 #include "Args.h"
 
 namespace itk {
@@ -234,7 +235,8 @@ void Run() {
 }
 
 int main(int argc, char **argv) {
-    QI::ParseArgs(parser, argc, argv, verbose);
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
+    QI::RegisterChunkedIO(); // Uses ITK readers and writers directly
     itk::MultiThreader::SetGlobalMaximumNumberOfThreads(threads.Get());
     if (use_double) {
         if (verbose) std::cout << "Using double precision" << std::endl;
@@ -14,6 +14,7 @@
 #include "itkImageFileReader.h"
 #include "itkMetaDataObject.h"
 #include "ImageIO.h"
+#include "ChunkedImageIO.h"
 #include "Args.h"
 #include "Util.h"
 
@@ -43,6 +44,7 @@ args::ValueFlagList<std::string> header_fields(parser, "METADATA", "Print a head
 int main(int argc, char **argv) {
 
     QI::ParseArgs(parser, argc, argv, verbose);
+    QI::RegisterChunkedIO(); // Uses ITK readers and writers directly
     bool print_all = !(print_direction || print_origin || print_spacing || print_size ||
                        print_voxvol || print_type || print_dims || header_fields);
     for (const std::string& fname : QI::CheckList(filenames)) {
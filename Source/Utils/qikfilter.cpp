@@ -12,113 +12,389 @@
 #include <memory>
 #include <iostream>
 #include <sstream>
+#include <complex>
+#include <algorithm>
+#include <cmath>
 #include "Eigen/Dense"
 
-#include "itkImageSource.h"
-#include "itkConstNeighborhoodIterator.h"
-#include "itkImageRegionIteratorWithIndex.h"
-#include "itkMultiplyImageFilter.h"
-#include "itkDivideImageFilter.h"
-#include "itkComplexToComplexFFTImageFilter.h"
-#include "itkInverseFFTImageFilter.h"
-#include "itkFFTShiftImageFilter.h"
-#include "itkComplexToModulusImageFilter.h"
-#include "itkFFTPadImageFilter.h"
-#include "itkConstantPadImageFilter.h"
-#include "itkExtractImageFilter.h"
-#include "itkPasteImageFilter.h"
 #include "itkCastImageFilter.h"
-#include "itkTileImageFilter.h"
 
 #include "ImageTypes.h"
 #include "Util.h"
 #include "Kernels.h"
+#include "FFT.h"
+#include "ThreadPool.h"
 #include "ImageIO.h"
+#include "Batch.h"
 #include "Args.h"
 
-using namespace Eigen;
-
-namespace itk {
+/*
+ * The precision-independent interface to KSpaceFilter
+ */
+class KSpaceFilterBase {
+public:
+    virtual ~KSpaceFilterBase() {}
+    virtual bool symmetric() const = 0;
+    virtual QI::SeriesXF::Pointer apply(const QI::SeriesXF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) = 0;
+    virtual QI::SeriesXF::Pointer apply(const QI::SeriesF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) = 0;
+    virtual QI::SeriesF::Pointer applyReal(const QI::SeriesF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) = 0;
+    virtual QI::VolumeF::Pointer kernelImage(const itk::ImageBase<4> *vols) const = 0;
+};
 
-template<typename TImage>
-class KernelSource : public ImageSource<TImage> {
+/*
+ * Filters each volume of a series in k-space. Volumes are zero-padded, transformed, multiplied by
+ * the kernel and transformed back, with several volumes in flight at once. The kernel for each
+ * volume is calculated once and kept until the padded size or spacing changes, so it is shared by
+ * all the volumes of a series and by later subjects in batch mode.
+ *
+ * Separable kernels are kept as a 1D profile along each axis and applied as their product, only
+ * the other kernels are evaluated at every voxel. Real data filtered by symmetric kernels stays
+ * real, so applyReal() only transforms and filters half of k-space.
+ */
+template<typename T>
+class KSpaceFilter : public KSpaceFilterBase {
 public:
-    typedef TImage                 ImageType;
-    typedef KernelSource           Self;
-    typedef ImageSource<ImageType> Superclass;
-    typedef SmartPointer<Self>     Pointer;
-    typedef typename ImageType::RegionType     RegionType;
-    typedef typename ImageType::IndexType      IndexType;
-    typedef typename ImageType::SizeType       SizeType;
-    typedef typename ImageType::SpacingType    SpacingType;
-    typedef typename ImageType::DirectionType  DirectionType;
-    typedef typename ImageType::PointType      PointType;
+    typedef std::complex<T> TComplex;
+    typedef typename QI::FFT3D<T>::TSize TSize;
+    typedef std::vector<std::shared_ptr<QI::FilterKernel>> TKernels;
 
 protected:
-    KernelSource(){}
-    ~KernelSource(){}
-    RegionType    m_Region;
-    SpacingType   m_Spacing;
-    DirectionType m_Direction;
-    PointType     m_Origin;
-    std::vector<std::shared_ptr<QI::FilterKernel>> m_kernels;
+    struct Kernel {
+        std::array<std::vector<T>, 3> profiles; // Product of the separable kernels along each axis
+        std::vector<T> full;                    // Product of the others, empty if there are none
+    };
 
-public:
-    itkNewMacro(Self);
-    itkTypeMacro(Self, ImageSource);
-    void SetKernel(const std::shared_ptr<QI::FilterKernel> &k) {
-        m_kernels.clear();
-        m_kernels.push_back(k);
-        this->Modified();
+    std::vector<TKernels> m_kernels; // One set for each volume, or one set for all
+    std::vector<Kernel> m_cache;
+    TSize m_size{{0, 0, 0}};
+    Eigen::Array3d m_spacing = Eigen::Array3d::Zero();
+    size_t m_pad, m_threads;
+
+    /*
+     * Kernel values on the padded grid, with k=0 at the first voxel as the FFT expects
+     */
+    Kernel makeKernel(const TKernels &kernels) const {
+        const Eigen::Array3d sz{static_cast<double>(m_size[0]), static_cast<double>(m_size[1]), static_cast<double>(m_size[2])};
+        const Eigen::Array3d hsz = sz / 2;
+        std::array<std::vector<double>, 3> pos;
+        Kernel k;
+        for (int d = 0; d < 3; d++) {
+            pos[d].resize(m_size[d]);
+            for (size_t i = 0; i < m_size[d]; i++) {
+                pos[d][i] = fmod(i + hsz[d], sz[d]) - hsz[d];
+            }
+            k.profiles[d].assign(m_size[d], 1);
+        }
+        TKernels others;
+        for (const auto &kernel : kernels) {
+            if (kernel->separable()) {
+                for (int d = 0; d < 3; d++) {
+                    for (size_t i = 0; i < m_size[d]; i++) {
+                        k.profiles[d][i] *= kernel->profile(d, pos[d][i], hsz[d], m_spacing[d]);
+                    }
+                }
+            } else {
+                others.push_back(kernel);
+            }
+        }
+        if (!others.empty()) {
+            k.full.resize(m_size[0] * m_size[1] * m_size[2]);
+            size_t index = 0;
+            for (size_t z = 0; z < m_size[2]; z++) {
+                for (size_t y = 0; y < m_size[1]; y++) {
+                    for (size_t x = 0; x < m_size[0]; x++) {
+                        const Eigen::Array3d p{pos[0][x], pos[1][y], pos[2][z]};
+                        double val = 1;
+                        for (const auto &kernel : others) {
+                            val *= kernel->value(p, hsz, m_spacing);
+                        }
+                        k.full[index++] = val;
+                    }
+                }
+            }
+        }
+        return k;
     }
-    void SetKernels(const std::vector<std::shared_ptr<QI::FilterKernel>> &k) {
-        m_kernels = k;
-        this->Modified();
+
+    /*
+     * Multiply k-space by the kernel. For the half spectrum nx is the number of x frequencies kept,
+     * and the kernel is symmetric so its first nx values along x are the ones needed.
+     */
+    void multiply(const Kernel &k, TComplex *data, const size_t nx) const {
+        for (size_t z = 0; z < m_size[2]; z++) {
+            for (size_t y = 0; y < m_size[1]; y++) {
+                const T pyz = k.profiles[1][y] * k.profiles[2][z];
+                const T *px = k.profiles[0].data();
+                TComplex *line = data + nx * (y + m_size[1] * z);
+                if (k.full.empty()) {
+                    for (size_t x = 0; x < nx; x++) {
+                        line[x] *= px[x] * pyz;
+                    }
+                } else {
+                    const T *full = k.full.data() + m_size[0] * (y + m_size[1] * z);
+                    for (size_t x = 0; x < nx; x++) {
+                        line[x] *= px[x] * pyz * full[x];
+                    }
+                }
+            }
+        }
     }
-    itkSetMacro(Region, RegionType);
-    itkSetMacro(Spacing, SpacingType);
-    itkSetMacro(Direction, DirectionType);
-    itkSetMacro(Origin, PointType);
 
-protected:
-    void GenerateOutputInformation() ITK_OVERRIDE {
-        auto output = this->GetOutput(0);
-        output->SetLargestPossibleRegion(m_Region);
-        output->SetSpacing(m_Spacing);
-        output->SetDirection(m_Direction);
-        output->SetOrigin(m_Origin);
+    /*
+     * Fill a padded real volume with k=0 in the centre, as itk::FFTShiftImageFilter, from a
+     * function of the unshifted index
+     */
+    template<typename TFunc>
+    void shiftInto(float *out, const TFunc &func) const {
+        for (size_t z = 0; z < m_size[2]; z++) {
+            const size_t sz = (z + m_size[2] / 2) % m_size[2];
+            for (size_t y = 0; y < m_size[1]; y++) {
+                const size_t sy = (y + m_size[1] / 2) % m_size[1];
+                for (size_t x = 0; x < m_size[0]; x++) {
+                    const size_t sx = (x + m_size[0] / 2) % m_size[0];
+                    out[sx + m_size[0] * (sy + m_size[1] * sz)] = func(x, y, z);
+                }
+            }
+        }
     }
 
-    void ThreadedGenerateData(const RegionType & /* Unused */, ThreadIdType /* Unused */) ITK_OVERRIDE {
-        const auto startIndex = m_Region.GetIndex();
-        const Eigen::Array3d sz{static_cast<double>(m_Region.GetSize()[0]),
-                                static_cast<double>(m_Region.GetSize()[1]),
-                                static_cast<double>(m_Region.GetSize()[2])};
-        const Eigen::Array3d hsz = sz / 2;
-        const Eigen::Array3d sp{m_Spacing[0], m_Spacing[1], m_Spacing[2]};
-        itk::ImageRegionIterator<ImageType> outIt(this->GetOutput(), m_Region);
-        outIt.GoToBegin();
-        while(!outIt.IsAtEnd()) {
-            const auto I = outIt.GetIndex() - startIndex; // Might be padded to a negative start
-            const double x = fmod(static_cast<double>(I[0]) + hsz[0], sz[0]) - hsz[0];
-            const double y = fmod(static_cast<double>(I[1]) + hsz[1], sz[1]) - hsz[1];
-            const double z = fmod(static_cast<double>(I[2]) + hsz[2], sz[2]) - hsz[2];
-            const Eigen::Array3d p{x, y, z};
-            typename ImageType::PixelType val = 1;
-            for (const auto &kernel : m_kernels) {
-                val *= kernel->value(p, hsz, sp);
+    void magnitudeInto(float *out, const TComplex *data) const {
+        shiftInto(out, [=](const size_t x, const size_t y, const size_t z) {
+            return std::abs(data[x + m_size[0] * (y + m_size[1] * z)]);
+        });
+    }
+
+    /*
+     * The half spectrum only holds the non-negative x frequencies, the others are the conjugates
+     * of the opposite frequencies
+     */
+    void halfMagnitudeInto(float *out, const TComplex *data) const {
+        const size_t nh = m_size[0] / 2 + 1;
+        shiftInto(out, [=](const size_t x, const size_t y, const size_t z) {
+            if (x < nh) {
+                return std::abs(data[x + nh * (y + m_size[1] * z)]);
+            } else {
+                const size_t ry = (m_size[1] - y) % m_size[1];
+                const size_t rz = (m_size[2] - z) % m_size[2];
+                return std::abs(data[(m_size[0] - x) + nh * (ry + m_size[1] * rz)]);
+            }
+        });
+    }
+
+    /*
+     * Copy a volume into the centre of a zeroed padded buffer, and back out again
+     */
+    template<typename TIn, typename TBuf>
+    void pad(const TIn *vin, const TSize &in_size, TBuf *data) const {
+        for (size_t z = 0; z < in_size[2]; z++) {
+            for (size_t y = 0; y < in_size[1]; y++) {
+                const TIn *line = vin + in_size[0] * (y + in_size[1] * z);
+                TBuf *padded = data + m_pad + m_size[0] * ((y + m_pad) + m_size[1] * (z + m_pad));
+                std::copy(line, line + in_size[0], padded);
             }
-            outIt.Set(val);
-            ++outIt;
         }
     }
 
-private:
-    KernelSource(const Self &);
-    void operator=(const Self &);
-};
+    template<typename TBuf, typename TOut>
+    void unpad(const TBuf *data, const TSize &in_size, TOut *vout) const {
+        for (size_t z = 0; z < in_size[2]; z++) {
+            for (size_t y = 0; y < in_size[1]; y++) {
+                const TBuf *padded = data + m_pad + m_size[0] * ((y + m_pad) + m_size[1] * (z + m_pad));
+                TOut *line = vout + in_size[0] * (y + in_size[1] * z);
+                std::copy(padded, padded + in_size[0], line);
+            }
+        }
+    }
+
+    /*
+     * An image with the geometry of the padded volumes of vols and nvols volumes
+     */
+    template<typename TImg>
+    typename TImg::Pointer paddedImage(const itk::ImageBase<4> *vols, const size_t nvols) const {
+        typename TImg::RegionType region;
+        for (size_t i = 0; i < 3; i++) {
+            region.GetModifiableSize()[i] = m_size[i];
+        }
+        typename TImg::SpacingType spacing;
+        typename TImg::PointType origin;
+        typename TImg::DirectionType direction;
+        direction.SetIdentity();
+        auto start = vols->GetLargestPossibleRegion().GetIndex();
+        for (size_t i = 0; i < 3; i++) {
+            start[i] -= m_pad;
+        }
+        itk::ImageBase<4>::PointType padded_origin;
+        vols->TransformIndexToPhysicalPoint(start, padded_origin);
+        for (size_t i = 0; i < 3; i++) {
+            spacing[i] = vols->GetSpacing()[i];
+            origin[i] = padded_origin[i];
+            for (size_t j = 0; j < 3; j++) {
+                direction[i][j] = vols->GetDirection()[i][j];
+            }
+        }
+        for (size_t i = 3; i < TImg::ImageDimension; i++) { // The volumes of a series
+            region.GetModifiableSize()[i] = nvols;
+            spacing[i] = vols->GetSpacing()[i];
+            origin[i] = vols->GetOrigin()[i];
+        }
+        auto img = TImg::New();
+        img->SetRegions(region);
+        img->SetSpacing(spacing);
+        img->SetOrigin(origin);
+        img->SetDirection(direction);
+        img->Allocate();
+        return img;
+    }
 
-} // End namespace itk
+    /*
+     * Set the geometry for the next series, recalculating the kernels if it has changed
+     */
+    void setGeometry(const itk::ImageBase<4> *vols) {
+        TSize size;
+        Eigen::Array3d spacing;
+        for (size_t i = 0; i < 3; i++) {
+            size[i] = vols->GetLargestPossibleRegion().GetSize()[i] + 2 * m_pad;
+            spacing[i] = vols->GetSpacing()[i];
+        }
+        if (size != m_size || (spacing != m_spacing).any()) {
+            m_size = size;
+            m_spacing = spacing;
+            m_cache.clear();
+            for (const auto &k : m_kernels) {
+                m_cache.push_back(makeKernel(k));
+            }
+        }
+    }
+
+    /*
+     * Everything common to filtering a series. Sets up the geometry and k-space images and returns
+     * the output series, then runs task for each volume.
+     */
+    template<typename TOutImg, typename TTask>
+    typename TOutImg::Pointer run(const itk::ImageBase<4> *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after,
+                                  const TTask &task) {
+        setGeometry(vols);
+        const size_t nvols = vols->GetLargestPossibleRegion().GetSize()[3];
+        if (m_kernels.size() > 1 && nvols != m_kernels.size()) {
+            QI_FAIL("Number of volumes (" << nvols << ") and kernels (" << m_kernels.size() << ") do not match for filter_per_volume option");
+        }
+        auto output = TOutImg::New();
+        output->CopyInformation(vols);
+        output->SetRegions(vols->GetLargestPossibleRegion());
+        output->Allocate();
+        if (before) *before = paddedImage<QI::SeriesF>(vols, nvols);
+        if (after) *after = paddedImage<QI::SeriesF>(vols, nvols);
+        float *before_data = before ? (*before)->GetBufferPointer() : nullptr;
+        float *after_data = after ? (*after)->GetBufferPointer() : nullptr;
+        const size_t count = m_size[0] * m_size[1] * m_size[2];
+        auto *out = output->GetBufferPointer();
+        {
+            QI::ThreadPool pool(std::min(m_threads, nvols));
+            for (size_t v = 0; v < nvols; v++) {
+                pool.enqueue([=, &task]{
+                    task(v, m_cache.at(m_kernels.size() > 1 ? v : 0), out,
+                         before_data ? before_data + v * count : nullptr,
+                         after_data ? after_data + v * count : nullptr);
+                });
+            }
+        } // Destroying the pool waits for the volumes
+        return output;
+    }
+
+    template<typename TIn>
+    QI::SeriesXF::Pointer applyComplex(const itk::Image<TIn, 4> *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) {
+        const auto in_size = vols->GetLargestPossibleRegion().GetSize();
+        const TSize vol_size{{in_size[0], in_size[1], in_size[2]}};
+        const size_t in_count = in_size[0] * in_size[1] * in_size[2];
+        const TIn *in = vols->GetBufferPointer();
+        auto task = [=](const size_t v, const Kernel &kernel, std::complex<float> *out, float *before_data, float *after_data) {
+            auto fft = QI::FFT3D<T>::Create(m_size);
+            std::vector<TComplex> data(fft->count(), TComplex(0));
+            pad(in + v * in_count, vol_size, data.data());
+            fft->forward(data.data());
+            if (before_data) magnitudeInto(before_data, data.data());
+            multiply(kernel, data.data(), m_size[0]);
+            if (after_data) magnitudeInto(after_data, data.data());
+            fft->inverse(data.data());
+            unpad(data.data(), vol_size, out + v * in_count);
+        };
+        return run<QI::SeriesXF>(vols, before, after, task);
+    }
+
+public:
+    KSpaceFilter(const TKernels &kernels, const bool perVolume, const size_t pad, const size_t threads) :
+        m_pad(pad), m_threads(threads)
+    {
+        if (perVolume) {
+            for (const auto &k : kernels) {
+                m_kernels.push_back({k});
+            }
+        } else {
+            m_kernels.push_back(kernels);
+        }
+    }
+
+    bool symmetric() const override {
+        for (const auto &set : m_kernels) {
+            for (const auto &k : set) {
+                if (!k->symmetric()) return false;
+            }
+        }
+        return true;
+    }
+
+    /*
+     * Returns the filtered series. If before and after are not null they are set to the magnitude
+     * of k-space before and after filtering.
+     */
+    QI::SeriesXF::Pointer apply(const QI::SeriesXF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) override {
+        return applyComplex(vols, before, after);
+    }
+
+    QI::SeriesXF::Pointer apply(const QI::SeriesF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) override {
+        return applyComplex(vols, before, after);
+    }
+
+    /*
+     * As apply(), but for real data and symmetric kernels, which give a real result. Only half of
+     * k-space is calculated.
+     */
+    QI::SeriesF::Pointer applyReal(const QI::SeriesF *vols, QI::SeriesF::Pointer *before, QI::SeriesF::Pointer *after) override {
+        if (!symmetric()) {
+            QI_EXCEPTION("Cannot filter real data with an asymmetric kernel and keep a real result");
+        }
+        const auto in_size = vols->GetLargestPossibleRegion().GetSize();
+        const TSize vol_size{{in_size[0], in_size[1], in_size[2]}};
+        const size_t in_count = in_size[0] * in_size[1] * in_size[2];
+        const float *in = vols->GetBufferPointer();
+        auto task = [=](const size_t v, const Kernel &kernel, float *out, float *before_data, float *after_data) {
+            auto fft = QI::FFT3D<T>::Create(m_size);
+            std::vector<T> data(fft->count(), T(0));
+            std::vector<TComplex> spectrum(fft->halfCount());
+            pad(in + v * in_count, vol_size, data.data());
+            fft->forward(data.data(), spectrum.data());
+            if (before_data) halfMagnitudeInto(before_data, spectrum.data());
+            multiply(kernel, spectrum.data(), fft->halfSize()[0]);
+            if (after_data) halfMagnitudeInto(after_data, spectrum.data());
+            fft->inverse(spectrum.data(), data.data());
+            unpad(data.data(), vol_size, out + v * in_count);
+        };
+        return run<QI::SeriesF>(vols, before, after, task);
+    }
+
+    /*
+     * The kernel for the last volume, with k=0 in the centre
+     */
+    QI::VolumeF::Pointer kernelImage(const itk::ImageBase<4> *vols) const override {
+        auto img = paddedImage<QI::VolumeF>(vols, 1);
+        const Kernel &k = m_cache.back();
+        shiftInto(img->GetBufferPointer(), [&](const size_t x, const size_t y, const size_t z) {
+            const T full = k.full.empty() ? 1 : k.full[x + m_size[0] * (y + m_size[1] * z)];
+            return static_cast<float>(k.profiles[0][x] * k.profiles[1][y] * k.profiles[2][z] * full);
+        });
+        return img;
+    }
+};
 
 //******************************************************************************
 // Main
@@ -139,8 +415,10 @@ int main(int argc, char **argv) {
     args::Flag save_kernel(parser, "KERNEL", "Save kernels as images", {"save_kernel"});
     args::Flag save_kspace(parser, "KSPACE", "Save k-space before & after filtering", {"save_kspace"});
     args::Flag filter_per_volume(parser, "FILTER_PER_VOL", "Instead of concatenating multiple filters, use one per volume", {"filter_per_volume"});
+    args::Flag single(parser, "SINGLE", "Use single-precision FFTs (faster, uses half the memory)", {"single"});
     args::ValueFlagList<std::string> filters(parser, "FILTER", "Specify a filter to use (can be multiple)", {'f', "filter"});
-    QI::ParseArgs(parser, argc, argv, verbose);
+    args::ValueFlag<std::string> batch(parser, "BATCH", "Process each subject in this manifest, replacing {} in paths", {"batch"});
+    QI::ParseArgs(parser, argc, argv, verbose, threads);
     itk::MultiThreader::SetGlobalDefaultNumberOfThreads(threads.Get());
 
     std::vector<std::shared_ptr<QI::FilterKernel>> kernels;
@@ -152,150 +430,84 @@ int main(int argc, char **argv) {
     } else {
         kernels.push_back(std::make_shared<QI::TukeyKernel>());
     }
-
-    QI::SeriesXF::Pointer vols;
-    if (complex_in) {
-        if (verbose) std::cout << "Reading complex file: " << QI::CheckPos(in_path) << std::endl;
-        vols = QI::ReadImage<QI::SeriesXF>(QI::CheckPos(in_path));
-    } else {
-        if (verbose) std::cout << "Reading real file: " << QI::CheckPos(in_path) << std::endl;
-        QI::SeriesF::Pointer rvols = QI::ReadImage<QI::SeriesF>(QI::CheckPos(in_path));
-        auto cast = itk::CastImageFilter<QI::SeriesF, QI::SeriesXF>::New();
-        cast->SetInput(rvols);
-        cast->Update();
-        vols = cast->GetOutput();
-        vols->DisconnectPipeline();
-    }
-    const std::string out_base = out_prefix ? out_prefix.Get() : QI::Basename(in_path.Get());
-    /*
-     * Main calculation starts hear.
-     * First a lot of typedefs.
-     */
-    typedef itk::ExtractImageFilter<QI::SeriesXF, QI::VolumeXD> TExtract;
-    typedef itk::TileImageFilter<QI::VolumeXF, QI::SeriesXF>    TTile;
-    typedef itk::ConstantPadImageFilter<QI::VolumeXD, QI::VolumeXD> TZeroPad;
-    typedef itk::FFTPadImageFilter<QI::VolumeXD>                TFFTPad;
-    typedef itk::FFTShiftImageFilter<QI::VolumeXD, QI::VolumeXD> TFFTShift;
-    typedef itk::ComplexToComplexFFTImageFilter<QI::VolumeXD>   TFFT;
-    typedef itk::MultiplyImageFilter<QI::VolumeXD, QI::VolumeD, QI::VolumeXD> TMult;
-    typedef itk::KernelSource<QI::VolumeD>                      TKernel;
-    typedef itk::ExtractImageFilter<QI::VolumeXD, QI::VolumeXF> TUnpad;
-    
-    auto region = vols->GetLargestPossibleRegion();
-    const size_t nvols = region.GetSize()[3]; // Save for the loop
-    if (filter_per_volume && nvols != kernels.size()) {
-        std::cerr << "Number of volumes (" << nvols << ") and kernels (" << kernels.size() << ") do not match for filter_per_volume option" << std::endl;
-        return EXIT_FAILURE;
-    }
-    region.GetModifiableSize()[3] = 0;
-    QI::VolumeXD::RegionType unpad_region;
-    for (int i = 0; i < 3; i++) {
-        unpad_region.GetModifiableSize()[i] = region.GetSize()[i];
+    if (zero_padding.Get() < 0) {
+        QI_FAIL("Zero padding must not be negative");
     }
-
-    auto tkernel = TKernel::New();
-    if (!filter_per_volume) {
-        tkernel->SetKernels(kernels);
-    }
-
-    auto tile   = TTile::New();
-    itk::FixedArray<unsigned int, 4> layout;
-    layout[0] = layout[1] = layout[2] = 1;
-    layout[3] = nvols;
-    tile->SetLayout(layout);
-
-    for (size_t i = 0; i < nvols; i++) {
-        region.GetModifiableIndex()[3] = i;
-        if (verbose) std::cout << "Processing volume " << i << std::endl;
-
-        auto extract = TExtract::New();
-        extract->SetInput(vols);
-        extract->SetDirectionCollapseToSubmatrix();
-        extract->SetExtractionRegion(region);
-        auto zero_pad = TZeroPad::New();
-        auto fft_pad = TFFTPad::New();
-        fft_pad->SetSizeGreatestPrimeFactor(5); // This is the largest the VNL FFT supports
-        if (zero_padding > 0) {
-            QI::VolumeXD::SizeType padding;
-            padding.Fill(zero_padding);
-            zero_pad->SetInput(extract->GetOutput());
-            zero_pad->SetPadLowerBound(padding);
-            zero_pad->SetPadUpperBound(padding);
-            zero_pad->SetConstant(0);
-            fft_pad->SetInput(zero_pad->GetOutput());
-        } else {
-            fft_pad->SetInput(extract->GetOutput());
-        }
-        fft_pad->Update(); // Need to know the size of this to set up the kernel properly
-        if (i == 0) {
-            tkernel->SetRegion(fft_pad->GetOutput()->GetLargestPossibleRegion());
-            tkernel->SetSpacing(fft_pad->GetOutput()->GetSpacing());
-            tkernel->SetOrigin(fft_pad->GetOutput()->GetOrigin());
-            tkernel->SetDirection(fft_pad->GetOutput()->GetDirection());
-        }
-        if (filter_per_volume) {
-            tkernel->SetKernel(kernels.at(i));
-            if (verbose) std::cout << "Setting kernel to: " << *kernels.at(i) << std::endl;
-        }
-        auto forward = TFFT::New();
-        forward->SetInput(fft_pad->GetOutput());
-
-        auto mult    = TMult::New();
-        mult->SetInput1(forward->GetOutput());
-        mult->SetInput2(tkernel->GetOutput());
-
-        auto inverse = TFFT::New();
-        inverse->SetTransformDirection(TFFT::INVERSE);
-        inverse->SetInput(mult->GetOutput());
-
-        auto unpadder = TUnpad::New();
-        unpadder->SetDirectionCollapseToSubmatrix();
-        unpadder->SetExtractionRegion(unpad_region);
-        unpadder->SetInput(inverse->GetOutput());
-        unpadder->Update();
-
-        QI::VolumeXF::Pointer v = unpadder->GetOutput();
-        tile->SetInput(i, v);
-        v->DisconnectPipeline();
-
-        if (save_kspace) {
-            auto shift_filter = TFFTShift::New();
-            auto cast_filter = itk::CastImageFilter<QI::VolumeXD, QI::VolumeXF>::New();
-            shift_filter->SetInput(forward->GetOutput());
-            cast_filter->SetInput(shift_filter->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(cast_filter->GetOutput(), out_base + "_kspace_before" + QI::OutExt());
-            shift_filter->SetInput(mult->GetOutput());
-            cast_filter->Update();
-            QI::WriteMagnitudeImage(cast_filter->GetOutput(), out_base + "_kspace_after" + QI::OutExt());
-        }
-    }
-    if (verbose) std::cout << "Finished." << std::endl;
-    tile->Update();
-    auto dir = vols->GetDirection();
-    auto spc = vols->GetSpacing();
-    vols = tile->GetOutput();
-    vols->SetDirection(dir);
-    vols->SetSpacing(spc);
-    vols->DisconnectPipeline();
-
-    const std::string out_path = out_base + "_filtered" + QI::OutExt();
-    if (complex_out) {
-        if (verbose) std::cout << "Saving complex output file: " << out_path << std::endl;
-        QI::WriteImage(vols, out_path);
+    const size_t nthreads = QI::ThreadCount(threads.Get());
+    if (verbose) std::cout << "Using " << QI::FFTBackend() << " FFTs in " << (single ? "single" : "double") << " precision" << std::endl;
+    std::unique_ptr<KSpaceFilterBase> filter;
+    if (single) {
+        filter.reset(new KSpaceFilter<float>(kernels, filter_per_volume, zero_padding.Get(), nthreads));
     } else {
-        if (verbose) std::cout << "Saving real output file: " << out_path << std::endl;
-        QI::WriteMagnitudeImage(vols, out_path);
-    }
-    if (save_kernel) {
-        const std::string kernel_path = out_base + "_kernel" + QI::OutExt();
-        if (verbose) std::cout << "Saving filter kernel to: " << kernel_path << std::endl;
-        auto shift_filter = itk::FFTShiftImageFilter<QI::VolumeD, QI::VolumeD>::New();
-        shift_filter->SetInput(tkernel->GetOutput());
-        auto cast_filter = itk::CastImageFilter<QI::VolumeD, QI::VolumeF>::New();
-        cast_filter->SetInput(shift_filter->GetOutput());
-        cast_filter->Update();
-        QI::WriteImage(cast_filter->GetOutput(), kernel_path);
+        filter.reset(new KSpaceFilter<double>(kernels, filter_per_volume, zero_padding.Get(), nthreads));
     }
+    if (verbose && !complex_in && !filter->symmetric()) std::cout << "Kernels are asymmetric, output will be complex" << std::endl;
+
+    struct Input {
+        QI::SeriesF::Pointer real;
+        QI::SeriesXF::Pointer complex;
+    };
+    QI::RunBatch<Input>(QI::ReadManifest(batch.Get()),
+        [&](const QI::Subject &subject) {
+            Input input;
+            if (complex_in) {
+                if (verbose) std::cout << "Reading complex file: " << subject.path(QI::CheckPos(in_path)) << std::endl;
+                input.complex = QI::ReadImage<QI::SeriesXF>(subject.path(QI::CheckPos(in_path)));
+            } else {
+                if (verbose) std::cout << "Reading real file: " << subject.path(QI::CheckPos(in_path)) << std::endl;
+                input.real = QI::ReadImage<QI::SeriesF>(subject.path(QI::CheckPos(in_path)));
+            }
+            return input;
+        },
+        [&](Input &input, const QI::Subject &subject) -> std::function<void()> {
+            const std::string out_base = out_prefix ? subject.path(out_prefix.Get()) : QI::Basename(subject.path(in_path.Get()));
+            const itk::ImageBase<4> *vols = input.real ? static_cast<itk::ImageBase<4> *>(input.real.GetPointer()) : input.complex.GetPointer();
+            if (verbose) std::cout << "Filtering " << vols->GetLargestPossibleRegion().GetSize()[3] << " volumes" << std::endl;
+            QI::SeriesF::Pointer before, after, filtered_real;
+            QI::SeriesXF::Pointer filtered;
+            QI::VolumeF::Pointer kernel_image;
+            if (input.complex) {
+                filtered = filter->apply(input.complex, save_kspace ? &before : nullptr, save_kspace ? &after : nullptr);
+            } else if (filter->symmetric()) {
+                QI::SeriesF::Pointer real = filter->applyReal(input.real, save_kspace ? &before : nullptr, save_kspace ? &after : nullptr);
+                if (complex_out) {
+                    auto cast = itk::CastImageFilter<QI::SeriesF, QI::SeriesXF>::New();
+                    cast->SetInput(real);
+                    cast->Update();
+                    filtered = cast->GetOutput();
+                    filtered->DisconnectPipeline();
+                } else { // Match the magnitude of the complex result
+                    float *data = real->GetBufferPointer();
+                    std::transform(data, data + real->GetPixelContainer()->Size(), data, [](const float v) { return std::fabs(v); });
+                    filtered_real = real;
+                }
+            } else {
+                filtered = filter->apply(input.real, save_kspace ? &before : nullptr, save_kspace ? &after : nullptr);
+            }
+            if (save_kernel) kernel_image = filter->kernelImage(vols);
+            if (verbose) std::cout << "Finished." << std::endl;
+            return [filtered, filtered_real, kernel_image, before, after, out_base, &complex_out, &verbose]{
+                const std::string out_path = out_base + "_filtered" + QI::OutExt();
+                if (filtered_real) {
+                    if (verbose) std::cout << "Saving real output file: " << out_path << std::endl;
+                    QI::WriteImage(filtered_real, out_path);
+                } else if (complex_out) {
+                    if (verbose) std::cout << "Saving complex output file: " << out_path << std::endl;
+                    QI::WriteImage(filtered, out_path);
+                } else {
+                    if (verbose) std::cout << "Saving real output file: " << out_path << std::endl;
+                    QI::WriteMagnitudeImage(filtered, out_path);
+                }
+                if (before) {
+                    QI::WriteImage(before, out_base + "_kspace_before" + QI::OutExt());
+                    QI::WriteImage(after, out_base + "_kspace_after" + QI::OutExt());
+                }
+                if (kernel_image) {
+                    const std::string kernel_path = out_base + "_kernel" + QI::OutExt();
+                    if (verbose) std::cout << "Saving filter kernel to: " << kernel_path << std::endl;
+                    QI::WriteImage(kernel_image, kernel_path);
+                }
+            };
+        }, threads.Get(), verbose);
     return EXIT_SUCCESS;
 }
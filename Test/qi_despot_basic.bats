@@ -93,4 +93,101 @@ qidespot2 T1.nii $SSFP_FILE --verbose <<OUT
 OUT
 qidiff --baseline=T2.nii --input=D2_T2.nii --noise=$NOISE --tolerance=30 --verbose
 
-}
\ No newline at end of file
+}
+
+@test "DESPOT1-NLLS" {
+
+# Setup parameters
+SPGR_FILE="spgr$EXT"
+SPGR_FLIP="3,3,20,20"
+SPGR_TR="0.01"
+SIZE="16,16,16"
+NOISE="0.01"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qisignal --model=1 -v --noise=$NOISE $SPGR_FILE << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [
+            {
+                "SPGR": {
+                    "TR": $SPGR_TR,
+                    "FA": [$SPGR_FLIP]
+                }
+            }
+        ]
+    }
+}
+OUT
+qidespot1 $SPGR_FILE --algo=n --verbose <<OUT
+{
+    "SPGR": {
+        "TR": $SPGR_TR,
+        "FA": [$SPGR_FLIP]
+    }
+}
+OUT
+qidiff --baseline=T1$EXT --input=D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+qidespot1 $SPGR_FILE --algo=n --ceres --out=ceres_ --verbose <<OUT
+{
+    "SPGR": {
+        "TR": $SPGR_TR,
+        "FA": [$SPGR_FLIP]
+    }
+}
+OUT
+qidiff --baseline=T1$EXT --input=ceres_D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+
+}
+
+@test "DESPOT1-Batch" {
+
+# Setup parameters
+SPGR_FLIP="3,3,20,20"
+SPGR_TR="0.01"
+SIZE="16,16,16"
+NOISE="0.01"
+rm -rf sub1 sub2
+mkdir sub1 sub2
+printf "sub1\nsub2\n" > subjects.txt
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" sub1/T1$EXT
+qinewimage --size "$SIZE" -g "1 0.8 1.2" sub2/T1$EXT
+for SUB in sub1 sub2; do
+qisignal --model=1 -v --noise=$NOISE $SUB/spgr$EXT << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "$SUB/T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [
+            {
+                "SPGR": {
+                    "TR": $SPGR_TR,
+                    "FA": [$SPGR_FLIP]
+                }
+            }
+        ]
+    }
+}
+OUT
+done
+qidespot1 --batch=subjects.txt --out={}/ {}/spgr$EXT --verbose <<OUT
+{
+    "SPGR": {
+        "TR": $SPGR_TR,
+        "FA": [$SPGR_FLIP]
+    }
+}
+OUT
+qidiff --baseline=sub1/T1$EXT --input=sub1/D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+qidiff --baseline=sub2/T1$EXT --input=sub2/D1_T1$EXT --noise=$NOISE --tolerance=30 --verbose
+
+}
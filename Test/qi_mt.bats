@@ -0,0 +1,35 @@
+# Copyright Tobias Wood 2018
+# Tests for MT and CEST
+
+setup() {
+    load $BATS_TEST_DIRNAME/common.bash
+    init_tests
+}
+
+@test "Lorentzian Fitting" {
+
+SIZE="4,4,4"
+# One water pool centred at 0.3 ppm, 1.5 ppm wide and 0.8 deep, with a PD of 1000
+FRQS="-2 -1.5 -1 -0.5 0 0.5 1 1.5 2"
+INPUTS=""
+: > zspec_groups.txt
+for F in $FRQS; do
+    Z=$( awk -v f=$F 'BEGIN { x = 2 * (0.3 - f) / 1.5; print 1000 * (1 - 0.8 / (1 + x * x)) }' )
+    qinewimage --size="$SIZE" --fill=$Z zspec_$F$EXT
+    INPUTS="$INPUTS zspec_$F$EXT"
+    echo "1" >> zspec_groups.txt
+done
+qi_glmsetup $INPUTS --groups=zspec_groups.txt --out=zspec$EXT
+qinewimage --size="$SIZE" --fill=0.3 f0$EXT
+qinewimage --size="$SIZE" --fill=1.5 w$EXT
+qinewimage --size="$SIZE" --fill=1000 PD$EXT
+echo '{ "freq": [-2, -1.5, -1, -0.5, 0, 0.5, 1, 1.5, 2] }' > zspec.json
+qi_lorentzian zspec$EXT --out=levmar_ --verbose < zspec.json
+qi_lorentzian zspec$EXT --out=ceres_ --ceres --verbose < zspec.json
+for SOLVER in levmar ceres; do
+    qidiff --baseline=f0$EXT --input=${SOLVER}_LTZ_f0$EXT --tolerance=0.01 --verbose
+    qidiff --baseline=w$EXT --input=${SOLVER}_LTZ_w$EXT --tolerance=0.01 --verbose
+    qidiff --baseline=PD$EXT --input=${SOLVER}_LTZ_PD$EXT --tolerance=0.01 --verbose
+done
+
+}
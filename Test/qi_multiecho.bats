@@ -55,4 +55,14 @@ qidiff --baseline=T2.nii --input=LL_ME_T2.nii --noise=$NOISE --tolerance=50 --ve
 qidiff --baseline=T2.nii --input=LM_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
 qidiff --baseline=T2.nii --input=AR_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
 
+# The same fit over two subjects with --batch
+rm -rf sub1 sub2
+mkdir sub1 sub2
+cp $SPIN_FILE sub1/
+cp $SPIN_FILE sub2/
+printf "sub1\nsub2\n" > subjects.txt
+qimultiecho --batch=subjects.txt {}/$SPIN_FILE -v -al --out={}/LL_ < multiecho.in
+qidiff --baseline=T2.nii --input=sub1/LL_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
+qidiff --baseline=T2.nii --input=sub2/LL_ME_T2.nii --noise=$NOISE --tolerance=50 --verbose
+
 }
@@ -0,0 +1,139 @@
+# Copyright Tobias Wood 2018
+# Tests for running several programs in one process
+
+setup() {
+    load $BATS_TEST_DIRNAME/common.bash
+    init_tests
+}
+
+teardown() {
+    if [ -n "$SERVER_PID" ]; then
+        kill $SERVER_PID 2> /dev/null || true
+    fi
+}
+
+@test "Pipeline-DESPOT" {
+
+# Setup parameters
+SPGR_FILE="spgr$EXT"
+SPGR_FLIP="3,3,20,20"
+SPGR_TR="0.01"
+SSFP_FILE="ssfp$EXT"
+SSFP_FLIP="15,60"
+SSFP_PINC="180,180"
+SSFP_TR="0.01"
+SIZE="16,16,16"
+NOISE="0.01"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qinewimage --size "$SIZE" -g "2 0.02 0.1" T2$EXT
+qisignal --model=1 -v --noise=$NOISE $SPGR_FILE $SSFP_FILE << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "T2$EXT",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [
+            { "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } },
+            { "SSFP": { "TR": $SSFP_TR, "FA": [$SSFP_FLIP], "PhaseInc": [$SSFP_PINC] } }
+        ]
+    }
+}
+OUT
+qi_pipeline --verbose << OUT
+{
+    "outputs": ["D2_T2"],
+    "stages": [
+        {
+            "name": "d2", "program": "qidespot2", "after": ["d1"],
+            "args": ["D1_T1$EXT", "$SSFP_FILE"],
+            "input": { "SSFP": { "TR": $SSFP_TR, "PhaseInc": [$SSFP_PINC], "FA": [$SSFP_FLIP] } }
+        },
+        {
+            "name": "d1", "program": "qidespot1",
+            "args": ["$SPGR_FILE"],
+            "input": { "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+        }
+    ]
+}
+OUT
+[ ! -e D1_T1$EXT ]
+qidiff --baseline=T2$EXT --input=D2_T2$EXT --noise=$NOISE --tolerance=30 --verbose
+
+}
+
+@test "Server-DESPOT1" {
+
+SPGR_FILE="spgr$EXT"
+SPGR_FLIP="3,3,20,20"
+SPGR_TR="0.01"
+SIZE="16,16,16"
+NOISE="0.01"
+qinewimage --size "$SIZE" -g "1 0.8 1.0" PD$EXT
+qinewimage --size "$SIZE" -g "0 0.5 1.5" T1$EXT
+qisignal --model=1 -v --noise=$NOISE $SPGR_FILE << OUT
+{
+    "PD": "PD$EXT",
+    "T1": "T1$EXT",
+    "T2": "",
+    "f0": "",
+    "B1": "",
+    "SequenceGroup": {
+        "sequences": [
+            { "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+        ]
+    }
+}
+OUT
+export QUIT_SERVER="$QI_TEST_DIR/qi_server_test.sock"
+rm -f "$QUIT_SERVER"
+
+# With no server running the client runs the program itself
+qi_server -- qidespot1 $SPGR_FILE --out=local_ << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+[ -e local_D1_T1$EXT ]
+
+qi_server --verbose &
+SERVER_PID=$!
+for i in $(seq 100); do
+    [ -S "$QUIT_SERVER" ] && break
+    sleep 0.1
+done
+[ -S "$QUIT_SERVER" ]
+qi_server -- qidespot1 $SPGR_FILE --out=server_ << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+qidiff --baseline=local_D1_T1$EXT --input=server_D1_T1$EXT --tolerance=0.01 --abs --verbose
+
+# A failed job reports its exit code and the server keeps running
+run qi_server -- qidespot1 missing$EXT << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+[ "$status" -ne 0 ]
+kill -0 $SERVER_PID
+qi_server -- qidespot1 $SPGR_FILE --out=again_ << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+[ -e again_D1_T1$EXT ]
+
+# The client's QUIT_EXT is used, not the server's, and only for that job
+rm -f ext_D1_T1.nii ext_D1_T1$EXT
+QUIT_EXT=NIFTI qi_server -- qidespot1 $SPGR_FILE --out=ext_ << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+[ -e ext_D1_T1.nii ]
+[ ! -e ext_D1_T1$EXT ]
+qi_server -- qidespot1 $SPGR_FILE --out=after_ << OUT
+{ "SPGR": { "TR": $SPGR_TR, "FA": [$SPGR_FLIP] } }
+OUT
+[ -e after_D1_T1$EXT ]
+
+kill $SERVER_PID
+wait $SERVER_PID || true
+SERVER_PID=""
+[ ! -e "$QUIT_SERVER" ]
+
+}
@@ -0,0 +1,39 @@
+# Copyright Tobias Wood 2018
+# Tests for the GLM tools
+
+setup() {
+    load $BATS_TEST_DIRNAME/common.bash
+    init_tests
+}
+
+@test "Permutation Testing" {
+
+SIZE="16,16,16"
+# Two groups of four subjects, where the second group is 10 lower in the lower half of x and 10 higher
+# in the upper half. The subjects within each group differ by a constant, so the t-statistics are finite.
+INPUTS=""
+: > perm_groups.txt
+for G in 1 2; do
+    for S in 1 2 3 4; do
+        if [ $G -eq 1 ]; then
+            qinewimage --size="$SIZE" --fill=$S perm_${G}_${S}$EXT
+        else
+            qinewimage --size="$SIZE" --step="0 $(( S - 10 )) $(( S + 10 )) 2" perm_${G}_${S}$EXT
+        fi
+        INPUTS="$INPUTS perm_${G}_${S}$EXT"
+        echo "$G" >> perm_groups.txt
+    done
+done
+qi_glmsetup $INPUTS --groups=perm_groups.txt --design=perm_design.txt --out=perm_merged$EXT
+echo -e "-1\t1" > perm_contrasts.txt
+qi_glmpermute perm_merged$EXT perm_design.txt perm_contrasts.txt --perms=500 --out=perm_ --verbose
+# Only permutations that leave the groups intact or swap them reach the observed maximum, 2 in 70, and
+# no permutation has a maximum below the negative effect
+qinewimage --size="$SIZE" --step="0 0 1 2" perm_expected$EXT
+qidiff --baseline=perm_expected$EXT --input=perm_vox_corrp_tstat1$EXT --abs --tolerance=0.05 --verbose
+# An empty mask must be rejected rather than producing empty null distributions
+qinewimage --size="$SIZE" --fill=0 perm_empty$EXT
+run qi_glmpermute perm_merged$EXT perm_design.txt perm_contrasts.txt --mask=perm_empty$EXT --out=perm_empty_
+[ "$status" -ne 0 ]
+
+}
@@ -18,12 +18,57 @@ qidiff --baseline=ramp$EXT --input=wrapped_unwrapped$EXT --tolerance=1 --abs --v
 
 }
 
-# @test "Laplacian Phase Unwrapping" {
+@test "Laplacian Phase Unwrapping" {
 
-# SIZE="32,32,32"
-# qinewimage --size=$SIZE --grad="0 0 12.566" ramp$EXT
-# qinewimage --size=$SIZE --grad="0 0 12.566" --wrap=6.283 wrapped$EXT
-# qi_unwrap_laplace wrapped$EXT --verbose
-# qidiff --baseline=ramp$EXT --input=wrapped_unwrapped$EXT --tolerance=1 --abs --verbose
+SIZE="32,32,32"
+# The FFT solver has periodic boundaries, so the phase must be the same on opposite faces. A parabola
+# along x and y is, and is wrapped by converting to complex. The mean phase is lost, hence the offset.
+qinewimage --size=$SIZE --fill=1 ones$EXT
+qipolyimg ones$EXT parabola$EXT --order=2 << END_INPUT
+{
+    "center": [0, 0, 0],
+    "scale": 1,
+    "coeffs": [0, 1.55, 1.55, 0, -0.05, 0, 0, -0.05, 0, 0]
+}
+END_INPUT
+qipolyimg ones$EXT baseline$EXT --order=2 << END_INPUT
+{
+    "center": [0, 0, 0],
+    "scale": 1,
+    "coeffs": [-15.5, 1.55, 1.55, 0, -0.05, 0, 0, -0.05, 0, 0]
+}
+END_INPUT
+qicomplex -m ones$EXT -p parabola$EXT -P wrapped$EXT
+qi_unwrap_laplace wrapped$EXT --verbose
+qidiff --baseline=baseline$EXT --input=wrapped_unwrap$EXT --tolerance=0.01 --abs --verbose
+
+}
+
+@test "Laplacian Phase Unwrapping with DCT" {
 
-# }
\ No newline at end of file
+SIZE="32,32,32"
+# Neumann boundaries match the edges of the Laplacian, so a ramp is recovered. It has zero mean already.
+qinewimage --size=$SIZE --grad="0 -12.566 12.566" ramp$EXT
+qinewimage --size=$SIZE --grad="0 -12.566 12.566" --wrap=6.283 wrapped$EXT
+qi_unwrap_laplace wrapped$EXT --solver=D --verbose
+qidiff --baseline=ramp$EXT --input=wrapped_unwrap$EXT --tolerance=0.01 --abs --verbose
+
+}
+
+@test "Multi-Volume Phase Unwrapping" {
+
+SIZE="32,32,32"
+# Every volume is the same, so the mean across them (from qi_glmcontrasts) must match the 3D results
+qinewimage --size=$SIZE --grad="0 -12.566 12.566" ramp$EXT
+qinewimage --size=$SIZE --grad="0 -6.2832 18.8496" path_ramp$EXT
+qinewimage --dims=4 --size="$SIZE,3" --grad="0 -12.566 12.566" --wrap=6.283 wrapped$EXT
+echo -e "1\n1\n1" > mean_design.txt
+echo "1" > mean_contrast.txt
+qi_unwrap_laplace wrapped$EXT --solver=D --threads=3 --verbose
+qi_glmcontrasts wrapped_unwrap$EXT mean_design.txt mean_contrast.txt --out=laplace_ --verbose
+qidiff --baseline=ramp$EXT --input=laplace_con1$EXT --tolerance=0.01 --abs --verbose
+qi_unwrap_path wrapped$EXT --threads=3 --verbose
+qi_glmcontrasts wrapped_unwrapped$EXT mean_design.txt mean_contrast.txt --out=path_ --verbose
+qidiff --baseline=path_ramp$EXT --input=path_con1$EXT --tolerance=1 --abs --verbose
+
+}
@@ -24,4 +24,41 @@ INPUT
 SIZE="64,64,16,4"
 qinewimage --dims=4 --size="$SIZE" --step="0 0 8 4" steps$EXT
 qikfilter steps$EXT --threads=1 --filter_per_volume --filter=Gauss,2.0 --filter=Blackman --filter=Hamming --filter=Tukey --verbose
-}
\ No newline at end of file
+qikfilter steps$EXT --threads=4 --single --zero_pad=3 --filter=Gauss,2.0 --save_kspace --save_kernel --out=single --verbose
+[ -e single_filtered$EXT ]
+# Every kernel is 1 at k=0 and the inverse FFT is normalised, so a constant image must pass through
+# unchanged in both precisions. Zero-padding would blur the edges, so it is not used here.
+qinewimage --size="32,32,16" --fill=100 const$EXT
+qikfilter const$EXT --filter=Gauss,2.0 --filter=Tukey --out=const --verbose
+qidiff --baseline=const$EXT --input=const_filtered$EXT --tolerance=0.001 --verbose
+qikfilter const$EXT --single --filter=Blackman --filter=Hamming --out=const_single --verbose
+qidiff --baseline=const$EXT --input=const_single_filtered$EXT --tolerance=0.001 --verbose
+}
+
+@test "Affine In-Place on Uncompressed NIfTI" {
+
+SIZE="32,32,32"
+qinewimage --size="$SIZE" --grad="0 0 1" grad.nii
+cp grad.nii rewritten.nii
+qiaffine rewritten.nii --verbose
+qidiff --baseline=grad.nii --input=rewritten.nii --abs --verbose
+cp grad.nii flipped.nii
+qiaffine flipped.nii --flip=1,0,0 --verbose
+qiaffine flipped.nii --flip=1,0,0 --verbose
+qidiff --baseline=grad.nii --input=flipped.nii --abs --verbose
+}
+
+@test "Int16 Storage with NaN" {
+
+SIZE="16,16,16"
+qinewimage --size="$SIZE" --fill=nan nan$EXT
+qinewimage --size="$SIZE" --fill=0 zero$EXT
+qinewimage --size="$SIZE" --grad="0 10 20" grad$EXT
+echo -e "1\n2" > int16_groups.txt
+echo -e "1\t0\n0\t1" > int16_contrasts.txt
+qi_glmsetup nan$EXT grad$EXT --groups=int16_groups.txt --design=int16_design.txt --out=int16_merged$EXT --out-precision=INT16 --verbose
+qi_glmcontrasts int16_merged$EXT int16_design.txt int16_contrasts.txt --out=int16_ --verbose
+# NaN must read back as 0, not the middle of the range, and the other values within the quantisation
+qidiff --baseline=zero$EXT --input=int16_con1$EXT --abs --tolerance=0.01 --verbose
+qidiff --baseline=grad$EXT --input=int16_con2$EXT --tolerance=0.001 --verbose
+}